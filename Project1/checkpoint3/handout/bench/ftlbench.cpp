@@ -0,0 +1,381 @@
+/**
+ * @file ftlbench.cpp
+ * @brief Microbenchmarks of the FTL's translate paths
+ *
+ * Drives CreateMyFTL() directly, without the controller, DataStore, IPC or
+ * memcheck (built with CONFIG_TWOPROC=0), and reports the time per call of
+ * ReadTranslate(), WriteTranslate() and Trim() for a few geometries.
+ *
+ * Usage: ftlbench [-n ops] [-s seed] [-g geometry] [-f filter] [-v]
+ *   -n ops       calls timed per benchmark (default: 200000)
+ *   -s seed      seed of the LBA generator (default: 15746)
+ *   -g geometry  only run this geometry (small, test3, large)
+ *   -f filter    only run benchmarks whose name contains filter
+ *   -v           keep the FTL's own output
+ *
+ * Benchmarks, each on a freshly created FTL:
+ *   write_fill     first write of every LBA in order, no cleaning yet
+ *   read_random    reads of random LBAs, after a fill
+ *   write_random   random overwrites after a fill. Split by whether the call
+ *                  issued an erase: write_random/nogc and write_random/gc
+ *   trim_random    trims of random LBAs, after a fill
+ *
+ * Calls are timed in batches, except write_random which times each call to
+ * split it. The overhead of reading the clock is subtracted there.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "common.h"
+#include "myFTL.h"
+
+#if (CONFIG_TWOPROC == 1)
+#error "ftlbench calls the FTL directly, build it with CONFIG_TWOPROC=0"
+#endif
+
+/* Calls timed between two clock reads in batched benchmarks */
+#define BENCH_BATCH	1024
+
+/*
+ * class BenchConf - Geometry of a benchmark, in place of a config file
+ */
+class BenchConf : public ConfBase {
+
+	public:
+
+	const char *name;
+	size_t ssd_size;
+	size_t package_size;
+	size_t die_size;
+	size_t plane_size;
+	size_t block_size;
+	size_t block_erases;
+	size_t op;
+
+	BenchConf(const char *name, size_t ssd_size, size_t package_size,
+		size_t die_size, size_t plane_size, size_t block_size,
+		size_t block_erases, size_t op) :
+		name{name},
+		ssd_size{ssd_size},
+		package_size{package_size},
+		die_size{die_size},
+		plane_size{plane_size},
+		block_size{block_size},
+		block_erases{block_erases},
+		op{op} {}
+
+	size_t GetSSDSize(void) const { return ssd_size; }
+	size_t GetPackageSize(void) const { return package_size; }
+	size_t GetDieSize(void) const { return die_size; }
+	size_t GetPlaneSize(void) const { return plane_size; }
+	size_t GetBlockSize(void) const { return block_size; }
+	size_t GetBlockEraseCount(void) const { return block_erases; }
+	size_t GetOverprovisioning(void) const { return op; }
+	size_t GetGCPolicy(void) const { return 0; }
+
+};
+
+/*
+ * Geometries. Block erases are high enough that no run wears flash out,
+ * so only the translate paths are measured. test3 is the geometry of the
+ * checkpoint 3 tests. small keeps a few overprovisioned blocks, myFTL needs
+ * some for both log and cleaning blocks.
+ */
+static BenchConf geometries[] = {
+	BenchConf("small", 1, 1, 1, 64, 64, 1000000, 10),
+	BenchConf("test3", 4, 8, 2, 10, 64, 1000000, 5),
+	BenchConf("large", 4, 8, 2, 40, 128, 1000000, 10),
+};
+
+/*
+ * class NullCallBack - Drops the operations the FTL issues
+ */
+class NullCallBack : public ExecCallBack<TEST_PAGE_TYPE> {
+
+	public:
+
+	void operator()(OpCode operation, Address addr) const {
+		(void)operation;
+		(void)addr;
+	}
+};
+
+/*
+ * class RecordingCallBack - Counts the operations the FTL issues
+ */
+class RecordingCallBack : public ExecCallBack<TEST_PAGE_TYPE> {
+
+	public:
+
+	mutable uint64_t reads;
+	mutable uint64_t writes;
+	mutable uint64_t erases;
+
+	RecordingCallBack() : reads{0}, writes{0}, erases{0} {}
+
+	void operator()(OpCode operation, Address addr) const {
+		(void)addr;
+
+		if (operation == OpCode::READ)
+			reads++;
+		else if (operation == OpCode::WRITE)
+			writes++;
+		else
+			erases++;
+	}
+};
+
+static uint64_t num_ops = 200000;
+static const char *filter;
+static bool verbose;
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * create_ftl() - New FTL of the geometry, its banner hidden unless -v
+ */
+static FTLBase<TEST_PAGE_TYPE> *create_ftl(const BenchConf &conf) {
+	FTLBase<TEST_PAGE_TYPE> *ftl;
+	int saved_fd = -1;
+
+	fflush(stdout);
+	if (!verbose) {
+		int null_fd = open("/dev/null", O_WRONLY);
+
+		saved_fd = dup(STDOUT_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+		close(null_fd);
+	}
+
+	ftl = CreateMyFTL(&conf);
+
+	fflush(stdout);
+	if (saved_fd >= 0) {
+		dup2(saved_fd, STDOUT_FILENO);
+		close(saved_fd);
+	}
+
+	return ftl;
+}
+
+/*
+ * fill() - Write every LBA once, returns the LBAs that failed
+ */
+static uint64_t fill(FTLBase<TEST_PAGE_TYPE> *ftl, size_t num_lbas) {
+	NullCallBack null_cb;
+	uint64_t failed = 0;
+
+	for (size_t lba = 0; lba < num_lbas; lba++)
+		if (ftl->WriteTranslate(lba, null_cb).first !=
+			ExecState::SUCCESS)
+			failed++;
+
+	return failed;
+}
+
+static bool selected(const char *name) {
+	return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void report(const char *name, const BenchConf &conf, uint64_t ops,
+		double ns, uint64_t failed) {
+
+	printf("%-22s %-6s %10lu %10.1f", name, conf.name, ops,
+		ops ? ns / ops : 0.0);
+	if (failed)
+		printf("   (%lu failed)", failed);
+	printf("\n");
+}
+
+/*
+ * clock_overhead() - ns one now_ns() pair adds to a timed call
+ */
+static double clock_overhead(void) {
+	uint64_t total = 0;
+
+	for (int i = 0; i < 100000; i++) {
+		uint64_t start = now_ns();
+		total += now_ns() - start;
+	}
+
+	return (double)total / 100000;
+}
+
+static void bench_write_fill(const BenchConf &conf) {
+	FTLBase<TEST_PAGE_TYPE> *ftl = create_ftl(conf);
+	size_t num_lbas = conf.GetNumLBAs();
+	uint64_t start, failed;
+
+	start = now_ns();
+	failed = fill(ftl, num_lbas);
+	report("write_fill", conf, num_lbas, now_ns() - start, failed);
+
+	delete ftl;
+}
+
+static void bench_read_random(const BenchConf &conf,
+			const std::vector<size_t> &lbas) {
+
+	FTLBase<TEST_PAGE_TYPE> *ftl = create_ftl(conf);
+	NullCallBack null_cb;
+	uint64_t failed = 0, ns = 0;
+
+	fill(ftl, conf.GetNumLBAs());
+
+	for (size_t i = 0; i < lbas.size(); i += BENCH_BATCH) {
+		size_t end = std::min(i + BENCH_BATCH, lbas.size());
+		uint64_t start = now_ns();
+
+		for (size_t j = i; j < end; j++)
+			if (ftl->ReadTranslate(lbas[j], null_cb).first !=
+				ExecState::SUCCESS)
+				failed++;
+
+		ns += now_ns() - start;
+	}
+
+	report("read_random", conf, lbas.size(), ns, failed);
+
+	delete ftl;
+}
+
+static void bench_write_random(const BenchConf &conf,
+			const std::vector<size_t> &lbas) {
+
+	FTLBase<TEST_PAGE_TYPE> *ftl = create_ftl(conf);
+	RecordingCallBack rec_cb;
+	double overhead = clock_overhead();
+	uint64_t gc_ops = 0, gc_ns = 0, nogc_ops = 0, nogc_ns = 0;
+	uint64_t failed = 0;
+
+	fill(ftl, conf.GetNumLBAs());
+
+	for (size_t lba : lbas) {
+		uint64_t erases = rec_cb.erases;
+		uint64_t start = now_ns();
+
+		if (ftl->WriteTranslate(lba, rec_cb).first !=
+			ExecState::SUCCESS)
+			failed++;
+
+		uint64_t ns = now_ns() - start;
+
+		if (rec_cb.erases != erases) {
+			gc_ops++;
+			gc_ns += ns;
+		} else {
+			nogc_ops++;
+			nogc_ns += ns;
+		}
+	}
+
+	report("write_random/nogc", conf, nogc_ops,
+		MAX(nogc_ns - overhead * nogc_ops, 0.0), 0);
+	report("write_random/gc", conf, gc_ops,
+		MAX(gc_ns - overhead * gc_ops, 0.0), failed);
+	printf("%-22s %-6s %10s   %lu reads, %lu writes, %lu erases issued\n",
+		"", conf.name, "", rec_cb.reads, rec_cb.writes, rec_cb.erases);
+
+	delete ftl;
+}
+
+static void bench_trim_random(const BenchConf &conf,
+			const std::vector<size_t> &lbas) {
+
+	FTLBase<TEST_PAGE_TYPE> *ftl = create_ftl(conf);
+	NullCallBack null_cb;
+	uint64_t failed = 0, ns = 0;
+
+	fill(ftl, conf.GetNumLBAs());
+
+	for (size_t i = 0; i < lbas.size(); i += BENCH_BATCH) {
+		size_t end = std::min(i + BENCH_BATCH, lbas.size());
+		uint64_t start = now_ns();
+
+		for (size_t j = i; j < end; j++)
+			if (ftl->Trim(lbas[j], null_cb) != ExecState::SUCCESS)
+				failed++;
+
+		ns += now_ns() - start;
+	}
+
+	report("trim_random", conf, lbas.size(), ns, failed);
+
+	delete ftl;
+}
+
+static void usage(const char *prog) {
+	printf("usage: %s [-n ops] [-s seed] [-g small|test3|large] "
+		"[-f filter] [-v]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+
+	const char *geometry = NULL;
+	unsigned long seed = 15746;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:g:f:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			num_ops = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			geometry = optarg;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	printf("%-22s %-6s %10s %10s\n", "Benchmark", "Geom", "Ops", "ns/op");
+
+	for (const BenchConf &conf : geometries) {
+
+		if (geometry != NULL && strcmp(geometry, conf.name) != 0)
+			continue;
+
+		/* Same LBA sequence for every benchmark of a geometry */
+		std::mt19937_64 gen(seed);
+		std::uniform_int_distribution<size_t> dist(0,
+						conf.GetNumLBAs() - 1);
+		std::vector<size_t> lbas(num_ops);
+
+		for (size_t &lba : lbas)
+			lba = dist(gen);
+
+		if (selected("write_fill"))
+			bench_write_fill(conf);
+		if (selected("read_random"))
+			bench_read_random(conf, lbas);
+		if (selected("write_random"))
+			bench_write_random(conf, lbas);
+		if (selected("trim_random"))
+			bench_trim_random(conf, lbas);
+	}
+
+	return 0;
+}
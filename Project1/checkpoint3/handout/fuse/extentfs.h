@@ -0,0 +1,482 @@
+/**
+ * @file extentfs.h
+ * @brief Extent allocator placing many files on the simulated flash
+ *
+ * The LBA space of the simulator is split into a metadata region (the first
+ * EXTENTFS_META_PAGES LBAs) and data pages. Each file owns a list of extents
+ * (runs of contiguous LBAs) that map its pages 0..alloc_pages-1 in order.
+ * Growing a file first extends its last extent in place and otherwise takes
+ * a new extent of at least as many pages as the file already has, so a file
+ * written sequentially ends up with few extents even when several files grow
+ * interleaved.
+ *
+ * The metadata region holds a superblock followed by the inode table, the
+ * same structs as kept in memory. Sync() writes it back when it changed. The
+ * free extent map is not stored, Mount() rebuilds it from the inodes.
+ *
+ * Bytes of allocated pages at or beyond a file's size are undefined, the
+ * caller zeroes them when the size grows over them (see myFuse.cpp).
+ *
+ * Not thread safe, the caller serializes (myFuse.cpp holds sim_lock).
+ */
+
+#ifndef __EXTENTFS_H__
+#define __EXTENTFS_H__
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define EXTENTFS_MAGIC		0x45585446	/* "EXTF" */
+
+/* LBAs reserved for the superblock and inode table */
+#define EXTENTFS_META_PAGES	4
+
+/* Longest path (from the mount point) of a file, with its '\0' */
+#define EXTENTFS_NAME_LEN	64
+
+/* Extents a file can have, growing it further fails with ENOSPC */
+#define EXTENTFS_MAX_EXTENTS	8
+
+/* Smallest extent taken when a file grows */
+#define EXTENTFS_MIN_ALLOC	4
+
+/* Map() result of a page with no LBA */
+#define EXTENTFS_NO_LBA		((size_t)-1)
+
+struct extentfs_extent {
+	uint32_t lba;
+	uint32_t len;
+};
+
+struct extentfs_inode {
+	char name[EXTENTFS_NAME_LEN];	/* Empty if the inode is free */
+	uint64_t size;
+	uint32_t alloc_pages;
+	uint32_t num_extents;
+	struct extentfs_extent extents[EXTENTFS_MAX_EXTENTS];
+};
+
+struct extentfs_super {
+	uint32_t magic;
+	uint32_t num_pages;
+	uint32_t num_inodes;
+	uint32_t pad;
+};
+
+/*
+ * class ExtentFS - Files and free space on the LBAs of the simulator
+ */
+class ExtentFS {
+
+	public:
+
+	/* Read metadata page lba into data, returns 1 on success */
+	using ReadFn = std::function<int(size_t lba, char *data)>;
+	/* Write data to metadata page lba, returns 1 on success */
+	using WriteFn = std::function<int(size_t lba, const char *data)>;
+	/* Pages lba to lba + len - 1 no longer hold file data */
+	using FreeFn = std::function<void(size_t lba, size_t len)>;
+
+	private:
+
+	size_t num_pages;
+	size_t page_size;
+	ReadFn read_meta;
+	WriteFn write_meta;
+	FreeFn on_free;
+
+	struct extentfs_super super;
+	std::vector<struct extentfs_inode> inodes;
+	bool is_dirty;
+
+	/* Name to inode of the files */
+	std::unordered_map<std::string, int> names;
+
+	/* Free extents, start LBA to length */
+	std::map<size_t, size_t> free_extents;
+	size_t free_pages;
+
+	void AddFree(size_t lba, size_t len) {
+		auto next = free_extents.lower_bound(lba);
+
+		free_pages += len;
+
+		/* Merge with the following extent */
+		if (next != free_extents.end() && next->first == lba + len) {
+			len += next->second;
+			next = free_extents.erase(next);
+		}
+
+		/* And with the preceding one */
+		if (next != free_extents.begin()) {
+			auto prev = std::prev(next);
+			if (prev->first + prev->second == lba) {
+				prev->second += len;
+				return;
+			}
+		}
+
+		free_extents[lba] = len;
+	}
+
+	/* Take len pages at the start of free extent it */
+	size_t TakeFree(std::map<size_t, size_t>::iterator it, size_t len) {
+		size_t lba = it->first;
+		size_t left = it->second - len;
+
+		free_extents.erase(it);
+		if (left > 0)
+			free_extents[lba + len] = left;
+		free_pages -= len;
+
+		return lba;
+	}
+
+	/*
+	 * FindFree() - Smallest free extent of at least want pages, else
+	 * the largest one
+	 */
+	std::map<size_t, size_t>::iterator FindFree(size_t want) {
+		auto fit = free_extents.end();
+		auto largest = free_extents.end();
+
+		for (auto it = free_extents.begin(); it != free_extents.end();
+			++it) {
+
+			if (it->second >= want && (fit == free_extents.end() ||
+						it->second < fit->second))
+				fit = it;
+			if (largest == free_extents.end() ||
+				it->second > largest->second)
+				largest = it;
+		}
+
+		return fit != free_extents.end() ? fit : largest;
+	}
+
+	/*
+	 * Shrink() - Free the pages of the file from page keep on
+	 */
+	void Shrink(struct extentfs_inode &inode, size_t keep) {
+		size_t first = 0;
+
+		for (size_t e = 0; e < inode.num_extents; e++) {
+			struct extentfs_extent &ext = inode.extents[e];
+
+			if (first + ext.len <= keep) {
+				first += ext.len;
+				continue;
+			}
+
+			/* Extent crosses or lies beyond the new end */
+			size_t kept = keep > first ? keep - first : 0;
+
+			AddFree(ext.lba + kept, ext.len - kept);
+			on_free(ext.lba + kept, ext.len - kept);
+			first += ext.len;
+			ext.len = kept;
+		}
+
+		/* Drop the extents that became empty */
+		while (inode.num_extents > 0 &&
+			inode.extents[inode.num_extents - 1].len == 0)
+			inode.num_extents--;
+
+		inode.alloc_pages = std::min((size_t)inode.alloc_pages, keep);
+	}
+
+	void Format() {
+		super.magic = EXTENTFS_MAGIC;
+		super.num_pages = num_pages;
+		super.num_inodes = inodes.size();
+		super.pad = 0;
+
+		memset(inodes.data(), 0, inodes.size() * sizeof(inodes[0]));
+		names.clear();
+		free_extents.clear();
+		free_pages = 0;
+		AddFree(EXTENTFS_META_PAGES, num_pages - EXTENTFS_META_PAGES);
+		is_dirty = true;
+	}
+
+	public:
+
+	ExtentFS(size_t num_pages, size_t page_size, ReadFn read_meta,
+			WriteFn write_meta, FreeFn on_free) :
+		num_pages{num_pages},
+		page_size{page_size},
+		read_meta{read_meta},
+		write_meta{write_meta},
+		on_free{on_free},
+		inodes((EXTENTFS_META_PAGES * page_size - sizeof(super)) /
+			sizeof(struct extentfs_inode)),
+		is_dirty{false},
+		free_pages{0} {
+
+		memset(&super, 0, sizeof(super));
+	}
+
+	/*
+	 * Mount() - Load the metadata region, formatting it if it holds
+	 * none (or holds metadata of a different geometry)
+	 *
+	 * Returns 1 if the metadata was loaded, 0 if formatted
+	 */
+	int Mount() {
+		std::vector<char> image(EXTENTFS_META_PAGES * page_size);
+		struct extentfs_super *disk_super =
+			(struct extentfs_super *)image.data();
+
+		for (size_t i = 0; i < EXTENTFS_META_PAGES; i++) {
+			if (read_meta(i, &image[i * page_size]) != 1) {
+				Format();
+				return 0;
+			}
+		}
+
+		if (disk_super->magic != EXTENTFS_MAGIC ||
+			disk_super->num_pages != num_pages ||
+			disk_super->num_inodes != inodes.size()) {
+			Format();
+			return 0;
+		}
+
+		super = *disk_super;
+		memcpy(inodes.data(), &image[sizeof(super)],
+			inodes.size() * sizeof(inodes[0]));
+
+		/* Free space is whatever no inode maps */
+		std::vector<bool> used(num_pages, false);
+
+		names.clear();
+		for (size_t ino = 0; ino < inodes.size(); ino++) {
+			struct extentfs_inode &inode = inodes[ino];
+
+			if (inode.name[0] == '\0')
+				continue;
+
+			names[inode.name] = ino;
+			for (size_t e = 0; e < inode.num_extents; e++)
+				for (size_t i = 0; i < inode.extents[e].len; i++)
+					used[inode.extents[e].lba + i] = true;
+		}
+
+		free_extents.clear();
+		free_pages = 0;
+		for (size_t lba = EXTENTFS_META_PAGES; lba < num_pages; ) {
+			size_t end = lba;
+
+			while (end < num_pages && !used[end])
+				end++;
+			if (end > lba)
+				AddFree(lba, end - lba);
+			lba = end + 1;
+		}
+
+		is_dirty = false;
+		return 1;
+	}
+
+	/*
+	 * Sync() - Write the metadata region if it changed
+	 *
+	 * Returns 1 on success, like FlashSimTest
+	 */
+	int Sync() {
+		if (!is_dirty)
+			return 1;
+
+		std::vector<char> image(EXTENTFS_META_PAGES * page_size, 0);
+
+		memcpy(image.data(), &super, sizeof(super));
+		memcpy(&image[sizeof(super)], inodes.data(),
+			inodes.size() * sizeof(inodes[0]));
+
+		for (size_t i = 0; i < EXTENTFS_META_PAGES; i++)
+			if (write_meta(i, &image[i * page_size]) != 1)
+				return 0;
+
+		is_dirty = false;
+		return 1;
+	}
+
+	/* Inode of the file, -1 if it is not on flash */
+	int Lookup(const char *name) const {
+		auto found = names.find(name);
+
+		return found == names.end() ? -1 : found->second;
+	}
+
+	/*
+	 * Create() - Add an empty file
+	 *
+	 * Returns its inode, -errno on error
+	 */
+	int Create(const char *name) {
+		if (strlen(name) >= EXTENTFS_NAME_LEN)
+			return -ENAMETOOLONG;
+		if (Lookup(name) >= 0)
+			return -EEXIST;
+
+		for (size_t ino = 0; ino < inodes.size(); ino++) {
+			struct extentfs_inode &inode = inodes[ino];
+
+			if (inode.name[0] != '\0')
+				continue;
+
+			memset(&inode, 0, sizeof(inode));
+			strcpy(inode.name, name);
+			names[inode.name] = ino;
+			is_dirty = true;
+
+			return ino;
+		}
+
+		return -ENOSPC;
+	}
+
+	/*
+	 * Remove() - Delete the file and free its pages
+	 */
+	void Remove(int ino) {
+		Truncate(ino, 0);
+		names.erase(inodes[ino].name);
+		memset(&inodes[ino], 0, sizeof(inodes[ino]));
+		is_dirty = true;
+	}
+
+	size_t Size(int ino) const {
+		return inodes[ino].size;
+	}
+
+	void SetSize(int ino, size_t size) {
+		inodes[ino].size = size;
+		is_dirty = true;
+	}
+
+	/* Pages mapped by the file, including preallocated ones */
+	size_t AllocPages(int ino) const {
+		return inodes[ino].alloc_pages;
+	}
+
+	/*
+	 * Map() - LBA of page of the file, EXTENTFS_NO_LBA if not allocated
+	 *
+	 * run is set to the pages from page on that are contiguous on flash
+	 */
+	size_t Map(int ino, size_t page, size_t *run) const {
+		const struct extentfs_inode &inode = inodes[ino];
+		size_t first = 0;
+
+		for (size_t e = 0; e < inode.num_extents; e++) {
+			const struct extentfs_extent &ext = inode.extents[e];
+
+			if (page < first + ext.len) {
+				*run = first + ext.len - page;
+				return ext.lba + (page - first);
+			}
+			first += ext.len;
+		}
+
+		*run = 0;
+		return EXTENTFS_NO_LBA;
+	}
+
+	/*
+	 * Allocate() - Map all pages of the file up to last_page
+	 *
+	 * Returns 0 on success, -ENOSPC if flash or the file's extents ran
+	 * out. Nothing is allocated then.
+	 */
+	int Allocate(int ino, size_t last_page) {
+		struct extentfs_inode &inode = inodes[ino];
+		size_t old_pages = inode.alloc_pages;
+
+		if (last_page < inode.alloc_pages)
+			return 0;
+
+		size_t need = last_page + 1 - inode.alloc_pages;
+		size_t want = std::max(need, std::max((size_t)inode.alloc_pages,
+					(size_t)EXTENTFS_MIN_ALLOC));
+
+		is_dirty = true;
+
+		while (need > 0) {
+
+			struct extentfs_extent *last = inode.num_extents ?
+				&inode.extents[inode.num_extents - 1] : NULL;
+			size_t len;
+
+			/* Extend the last extent in place if possible */
+			auto it = last ? free_extents.find(last->lba + last->len) :
+				free_extents.end();
+
+			if (it != free_extents.end()) {
+				len = std::min(want, it->second);
+				TakeFree(it, len);
+				last->len += len;
+			} else {
+				if (inode.num_extents == EXTENTFS_MAX_EXTENTS ||
+					(it = FindFree(want)) == free_extents.end()) {
+					Shrink(inode, old_pages);
+					return -ENOSPC;
+				}
+
+				struct extentfs_extent &ext =
+					inode.extents[inode.num_extents++];
+
+				len = std::min(want, it->second);
+				ext.lba = TakeFree(it, len);
+				ext.len = len;
+			}
+
+			inode.alloc_pages += len;
+			need -= std::min(need, len);
+			want = std::max(need, (size_t)EXTENTFS_MIN_ALLOC);
+		}
+
+		return 0;
+	}
+
+	/*
+	 * Truncate() - Set the size and free the pages beyond it, including
+	 * preallocated ones
+	 */
+	void Truncate(int ino, size_t size) {
+		Shrink(inodes[ino], (size + page_size - 1) / page_size);
+		inodes[ino].size = size;
+		is_dirty = true;
+	}
+
+	/*
+	 * FormatStats() - Usage as one line of text, snprintf() semantics
+	 */
+	int FormatStats(char *buf, size_t size) const {
+		size_t num_files = 0, num_extents = 0, largest_free = 0;
+
+		for (const struct extentfs_inode &inode : inodes) {
+			if (inode.name[0] == '\0')
+				continue;
+			num_files++;
+			num_extents += inode.num_extents;
+		}
+
+		for (auto &kv : free_extents)
+			largest_free = std::max(largest_free, kv.second);
+
+		return snprintf(buf, size, "files %zu extents %zu free_pages %zu "
+			"of %zu free_extents %zu largest_free %zu\n", num_files,
+			num_extents, free_pages, num_pages - EXTENTFS_META_PAGES,
+			free_extents.size(), largest_free);
+	}
+};
+
+#endif /* __EXTENTFS_H__ */
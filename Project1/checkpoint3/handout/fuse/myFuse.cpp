@@ -2,8 +2,40 @@
  * Fuse is used to first read in a file into the flash simulator and then
  * read/write from that flashsimulator to fullfil user's requirements
  *
- * Note: This file currently assumes workload of only 1 file. Flashsimulator
- * has no concept of filesystem.
+ * Note: By default only the input file (-f) is on flash, all other files are
+ * passed through to the reference directory. Flashsimulator has no concept
+ * of filesystem, see -M for more files.
+ *
+ * Concurrency (multithreaded mode, -t 1):
+ * The simulator, the FTL and the page cache are not thread safe, so every
+ * call into them is serialized by sim_lock. A request on the simulated file
+ * holds the range locks of the pages it covers for its whole duration,
+ * shared for reads and exclusive for writes, but takes sim_lock only for one
+ * range lock's worth of pages at a time. Requests on other ranges interleave
+ * with it between those pieces, while the range locks keep the request, and
+ * the read-modify-write of partially written pages, atomic. Passthrough
+ * operations don't take either lock.
+ *
+ * Page cache (-C, see pagecache.h):
+ * Reads and writes of the simulated file go through an ARC page cache with
+ * readahead. Dirty pages are written to the simulator on flush/release,
+ * eviction and unmount. The cache stats are printed on unmount and can be
+ * read as the PAGECACHE_XATTR extended attribute of the simulated file.
+ *
+ * Lazy load (-L):
+ * Instead of writing the whole input file into the simulator before
+ * mounting, pages are faulted in from the input file the first time they
+ * are accessed. Optionally a background loader thread populates the rest
+ * in large chunks. page_loaded tracks which pages the simulator has.
+ *
+ * Multiple files (-M 1, see extentfs.h):
+ * The input file and every regular file created under the mount point live
+ * on flash. An extent allocator maps their pages to LBAs and keeps its
+ * metadata in the first LBAs. The reference directory keeps an empty file of
+ * each name for the directory tree, permissions and times. Files that were
+ * in the reference directory before mounting, other than the input file,
+ * are still passed through. Requests on files on flash hold sim_lock
+ * throughout, the range locks are not used.
  */
 
 #define FUSE_USE_VERSION 26
@@ -26,14 +58,41 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <vector>
 
 #include "746FlashSim.h"
 #include "common.h"
+#include "extentfs.h"
+#include "pagecache.h"
 
 #define MAX_PATH_LEN 4096
 
 #define UNUSED __attribute__((unused))
 
+/* Pages of the simulated file covered by one range lock */
+#define RANGE_LOCK_PAGES	16
+
+/* Range locks, ranges are hashed onto them. At most 64 (one bit each) */
+#define NUM_RANGE_LOCKS		64
+
+/* Default page cache size in pages (1MB), -C 0 disables the cache */
+#define PAGECACHE_DEFAULT_PAGES	256
+
+/* Extended attribute of the simulated file giving the page cache stats */
+#define PAGECACHE_XATTR		"user.pagecache.stats"
+
+/* How the input file is loaded into the simulator (-L) */
+#define LOAD_EAGER		0	/* All of it before mounting */
+#define LOAD_LAZY		1	/* Each page on first access */
+#define LOAD_LAZY_BG		2	/* Lazy, plus a background loader */
+
+/* Pages the background loader reads and writes at once */
+#define LOADER_CHUNK_PAGES	64
+
+/* Extended attribute of any file giving the extent allocator's usage (-M) */
+#define EXTENTFS_XATTR		"user.extentfs.stats"
+
 /* Is debugging enabled? Default - Disabled*/
 int is_debug_enabled;
 
@@ -60,6 +119,36 @@ FlashSimTest *sim;
 /* File size */
 size_t fsize;
 
+/* Is fuse running multithreaded? Default - Single threaded */
+int is_multithreaded;
+
+/* Serializes all calls into sim. Also protects fsize */
+pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Locks on ranges of pages of the simulated file */
+pthread_rwlock_t range_locks[NUM_RANGE_LOCKS];
+
+/* Cache in front of sim, NULL if disabled. Protected by sim_lock */
+PageCache *page_cache;
+size_t page_cache_pages = PAGECACHE_DEFAULT_PAGES;
+
+/* Lazy load state. page_loaded is protected by sim_lock */
+int load_mode = LOAD_EAGER;
+int src_fd = -1;
+size_t src_pages;
+std::vector<bool> page_loaded;
+
+/* Background loader */
+pthread_t loader_thread;
+int is_loader_running;
+int loader_stop;
+
+/* Are all files on flash? Default - Only the input file */
+int is_multi_file;
+
+/* Files on flash with -M 1, NULL otherwise. Protected by sim_lock */
+ExtentFS *extent_fs;
+
 
 int dprintf(const char *fmt, ...)  __attribute__ ((format (printf, 1, 2)));
 
@@ -87,6 +176,538 @@ void get_rel_path(const char *path, char *rel_path)
 	strcpy(&rel_path[1], path);
 }
 
+/*
+ * Is path the input file, served from the simulator in single file mode?
+ */
+static int is_sim_file(const char *path)
+{
+	return !is_multi_file && strcmp(path, rel_fname) == 0;
+}
+
+/*
+ * Returns the set of range locks covering pages start_page to end_page
+ */
+static uint64_t get_range_lock_set(size_t start_page, size_t end_page)
+{
+	uint64_t set = 0;
+	size_t range;
+
+	for (range = start_page / RANGE_LOCK_PAGES;
+		range <= end_page / RANGE_LOCK_PAGES; range++) {
+
+		set |= 1ULL << (range % NUM_RANGE_LOCKS);
+
+		/* Request spans every lock already */
+		if (set == ~0ULL)
+			break;
+	}
+
+	return set;
+}
+
+/*
+ * Takes the range locks in the set, always in the same order to not
+ * deadlock with another request
+ */
+static void lock_ranges(uint64_t set, int is_write)
+{
+	int i;
+
+	for (i = 0; i < NUM_RANGE_LOCKS; i++) {
+		if (!(set & (1ULL << i)))
+			continue;
+
+		if (is_write)
+			pthread_rwlock_wrlock(&range_locks[i]);
+		else
+			pthread_rwlock_rdlock(&range_locks[i]);
+	}
+}
+
+static void unlock_ranges(uint64_t set)
+{
+	int i;
+
+	for (i = 0; i < NUM_RANGE_LOCKS; i++) {
+		if (set & (1ULL << i))
+			pthread_rwlock_unlock(&range_locks[i]);
+	}
+}
+
+/*
+ * Sets size of the simulated file. Cached pages beyond it are stale now.
+ */
+static void set_fsize(size_t new_size)
+{
+	size_t page_size = sizeof(datastore_page_t);
+
+	pthread_mutex_lock(&sim_lock);
+	fsize = new_size;
+	if (page_cache != NULL)
+		page_cache->Invalidate((new_size + page_size - 1) / page_size);
+	pthread_mutex_unlock(&sim_lock);
+}
+
+static size_t get_fsize(void)
+{
+	size_t size;
+
+	pthread_mutex_lock(&sim_lock);
+	size = fsize;
+	pthread_mutex_unlock(&sim_lock);
+
+	return size;
+}
+
+/*
+ * Makes sure page lba of the input file is in the simulator before it is
+ * accessed. Pass overwrite if the page is about to be written as a whole,
+ * then it is not read from the input file.
+ * Call with sim_lock held.
+ */
+static void lazy_prepare(size_t lba, int overwrite)
+{
+	class datastore_page_t page;
+	ssize_t rbytes;
+	int ret;
+
+	if (load_mode == LOAD_EAGER || lba >= src_pages || page_loaded[lba])
+		return;
+
+	if (!overwrite) {
+		rbytes = pread(src_fd, page.buf, sizeof(page.buf),
+				lba * sizeof(page.buf));
+		if (rbytes < 0) {
+			fprintf(stderr, "Couldn't read in the input file\n");
+			exit(-1);
+		}
+
+		/* Input file might have been truncated meanwhile */
+		memset(&page.buf[rbytes], 0, sizeof(page.buf) - rbytes);
+
+		ret = sim->Write(log_fp, lba, page);
+		if (ret != 1) {
+			fprintf(stderr, "Couldn't read in the input file\n");
+			exit(-1);
+		}
+	}
+
+	page_loaded[lba] = true;
+}
+
+/*
+ * lazy_prepare() for all pages of a request
+ */
+static void lazy_prepare_range(size_t size, off_t offset, int is_write)
+{
+	size_t page_size = sizeof(datastore_page_t);
+	size_t page_num;
+
+	if (load_mode == LOAD_EAGER)
+		return;
+
+	for (page_num = offset / page_size;
+		page_num <= (offset + size - 1) / page_size; page_num++) {
+
+		size_t start_offset = page_num * page_size;
+		int overwrite = is_write && (size_t)offset <= start_offset &&
+			offset + size >= start_offset + page_size;
+
+		lazy_prepare(page_num, overwrite);
+	}
+}
+
+/*
+ * Background loader - Loads the input file in chunks of LOADER_CHUNK_PAGES,
+ * skipping pages that were faulted in or written already
+ */
+static void *loader_main(void *arg UNUSED)
+{
+	size_t page_size = sizeof(datastore_page_t);
+	std::vector<char> chunk(LOADER_CHUNK_PAGES * page_size);
+	size_t first, i, j;
+
+	for (first = 0; first < src_pages &&
+		!__atomic_load_n(&loader_stop, __ATOMIC_RELAXED);
+		first += LOADER_CHUNK_PAGES) {
+
+		size_t n = MIN(LOADER_CHUNK_PAGES, src_pages - first);
+		ssize_t rbytes;
+		uint64_t lock_set;
+
+		/* Input file is not written by us, read it without locks */
+		rbytes = pread(src_fd, chunk.data(), n * page_size,
+				first * page_size);
+		if (rbytes < 0)
+			rbytes = 0;
+		memset(&chunk[rbytes], 0, n * page_size - rbytes);
+
+		lock_set = get_range_lock_set(first, first + n - 1);
+		lock_ranges(lock_set, 1);
+		pthread_mutex_lock(&sim_lock);
+
+		/* One range write per run of pages still not loaded */
+		for (i = 0; i < n; i = j) {
+
+			for (j = i; j < n && !page_loaded[first + j]; j++)
+				;
+
+			if (j == i) {
+				j++;
+				continue;
+			}
+
+			if (sim->WriteRange(log_fp, (first + i) * page_size,
+				(j - i) * page_size, &chunk[i * page_size]) != 1) {
+				fprintf(stderr, "Couldn't read in the input "
+						"file\n");
+				exit(-1);
+			}
+
+			while (i < j)
+				page_loaded[first + i++] = true;
+		}
+
+		pthread_mutex_unlock(&sim_lock);
+		unlock_ranges(lock_set);
+	}
+
+	dprintf("Background load done\n");
+
+	return NULL;
+}
+
+/*
+ * Reads or writes LBAs of the simulator through the page cache. Readahead
+ * stays below limit_lba.
+ * Call with sim_lock held. Returns 1 on success, 0 if a page couldn't be read
+ */
+static int cached_rw(char *buf, size_t size, off_t offset, int is_write,
+			size_t limit_lba)
+{
+	size_t page_size = sizeof(datastore_page_t);
+	size_t start_page_num = offset / page_size;
+	size_t end_page_num = (offset + size - 1) / page_size;
+	size_t page_num;
+	size_t buf_idx = 0;
+
+	for (page_num = start_page_num; page_num <= end_page_num;
+		page_num++) {
+
+		size_t start_offset = page_num * page_size;
+		size_t start_idx = 0;
+		size_t end_idx = page_size - 1;
+		bool ok;
+
+		if ((size_t)offset > start_offset)
+			start_idx = offset - start_offset;
+
+		if (offset + size - 1 < start_offset + page_size - 1)
+			end_idx = offset + size - 1 - start_offset;
+
+		size_t len = end_idx - start_idx + 1;
+
+		if (is_write) {
+			/* A page not in the simulator yet reads as zeros */
+			char *data = page_cache->Get(page_num,
+						len != page_size, &ok);
+
+			memcpy(&data[start_idx], &buf[buf_idx], len);
+			page_cache->MarkDirty(page_num);
+		} else {
+			char *data = page_cache->Get(page_num, true, &ok);
+			if (!ok)
+				return 0;
+
+			memcpy(&buf[buf_idx], &data[start_idx], len);
+		}
+
+		buf_idx += len;
+	}
+
+	if (!is_write)
+		page_cache->Readahead(start_page_num, end_page_num, limit_lba);
+
+	return 1;
+}
+
+/*
+ * Reads or writes the simulated file RANGE_LOCK_PAGES pages at a time,
+ * holding sim_lock only around each piece. Writes extend fsize.
+ * Call with the range locks of the request held. Returns 1 on success
+ */
+static int sim_rw(char *buf, size_t size, off_t offset, int is_write)
+{
+	size_t page_size = sizeof(datastore_page_t);
+	size_t piece_size = RANGE_LOCK_PAGES * page_size;
+	size_t done = 0;
+	int ret = 1;
+
+	while (done < size && ret == 1) {
+		size_t pos = offset + done;
+		size_t len = MIN(size - done, piece_size - pos % piece_size);
+
+		pthread_mutex_lock(&sim_lock);
+		if (page_cache != NULL) {
+			ret = cached_rw(&buf[done], len, pos, is_write,
+				(fsize + page_size - 1) / page_size);
+		} else if (is_write) {
+			lazy_prepare_range(len, pos, 1);
+			ret = sim->WriteRange(log_fp, pos, len, &buf[done]);
+		} else {
+			lazy_prepare_range(len, pos, 0);
+			ret = sim->ReadRange(log_fp, pos, len, &buf[done]);
+		}
+
+		if (is_write && ret == 1 && fsize < pos + len)
+			fsize = pos + len;
+		pthread_mutex_unlock(&sim_lock);
+
+		done += len;
+	}
+
+	return ret;
+}
+
+/*
+ * Writes back dirty cached pages of the simulated file
+ */
+static int flush_page_cache(void)
+{
+	int ret = 1;
+
+	pthread_mutex_lock(&sim_lock);
+	if (page_cache != NULL)
+		ret = page_cache->Flush();
+	pthread_mutex_unlock(&sim_lock);
+
+	if (ret != 1) {
+		dprintf("flush of page cache failed\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes back the data and then the metadata of the files on flash
+ */
+static int sync_extent_fs(void)
+{
+	int ret;
+
+	ret = flush_page_cache();
+	if (ret < 0)
+		return ret;
+
+	pthread_mutex_lock(&sim_lock);
+	ret = extent_fs->Sync();
+	pthread_mutex_unlock(&sim_lock);
+
+	if (ret != 1) {
+		dprintf("sync of extent metadata failed\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads or writes bytes of file ino on flash, one run of contiguous LBAs at
+ * a time. Pages with no LBA read as zeros and are skipped by writes, callers
+ * allocate first.
+ * Call with sim_lock held. Returns 1 on success
+ */
+static int extent_rw(int ino, char *buf, size_t size, off_t offset,
+			int is_write)
+{
+	size_t page_size = sizeof(datastore_page_t);
+	size_t done = 0;
+
+	while (done < size) {
+
+		size_t pos = offset + done;
+		size_t run, len, flash_offset;
+		size_t lba = extent_fs->Map(ino, pos / page_size, &run);
+		int ret;
+
+		/* Pages are mapped from 0 on, none after this one */
+		if (lba == EXTENTFS_NO_LBA) {
+			if (!is_write)
+				memset(&buf[done], 0, size - done);
+			return 1;
+		}
+
+		len = MIN(size - done, run * page_size - pos % page_size);
+		flash_offset = lba * page_size + pos % page_size;
+
+		if (page_cache != NULL)
+			ret = cached_rw(&buf[done], len, flash_offset, is_write,
+					lba + run);
+		else if (is_write)
+			ret = sim->WriteRange(log_fp, flash_offset, len,
+					&buf[done]);
+		else
+			ret = sim->ReadRange(log_fp, flash_offset, len,
+					&buf[done]);
+
+		if (ret != 1)
+			return ret;
+
+		done += len;
+	}
+
+	return 1;
+}
+
+/*
+ * Zeroes bytes from to end (exclusive) of file ino on flash where it has
+ * pages, they may hold stale data. Call with sim_lock held
+ */
+static int extent_zero(int ino, size_t from, size_t end)
+{
+	static char zeros[sizeof(datastore_page_t)];
+	int ret = 1;
+
+	while (from < end && ret == 1) {
+		size_t len = MIN(end - from, sizeof(zeros));
+
+		ret = extent_rw(ino, zeros, len, from, 1);
+		from += len;
+	}
+
+	return ret;
+}
+
+/*
+ * Reads a file on flash. Returns false if path is not on flash, else sets
+ * ret to the bytes read
+ */
+static bool extent_read(const char *path, char *buf, size_t size,
+			off_t offset, int *ret)
+{
+	int ino;
+
+	pthread_mutex_lock(&sim_lock);
+
+	ino = extent_fs->Lookup(path);
+	if (ino < 0) {
+		pthread_mutex_unlock(&sim_lock);
+		return false;
+	}
+
+	/* Nothing beyond the end of file */
+	if ((size_t)offset >= extent_fs->Size(ino))
+		size = 0;
+	else
+		size = MIN(size, extent_fs->Size(ino) - offset);
+
+	if (size > 0 && extent_rw(ino, buf, size, offset, 0) != 1) {
+		fprintf(stderr, "Fail to read file %s\n", path);
+		exit(-1);
+	}
+
+	pthread_mutex_unlock(&sim_lock);
+
+	*ret = size;
+	return true;
+}
+
+/*
+ * Writes a file on flash, allocating pages for it. Returns false if path is
+ * not on flash, else sets ret to the bytes written or -errno
+ */
+static bool extent_write(const char *path, const char *buf, size_t size,
+			off_t offset, int *ret)
+{
+	size_t page_size = sizeof(datastore_page_t);
+	size_t old_size, old_mapped, zero_from, zero_end;
+	int ino;
+
+	pthread_mutex_lock(&sim_lock);
+
+	ino = extent_fs->Lookup(path);
+	if (ino < 0) {
+		pthread_mutex_unlock(&sim_lock);
+		return false;
+	}
+
+	if (size == 0) {
+		pthread_mutex_unlock(&sim_lock);
+		*ret = 0;
+		return true;
+	}
+
+	old_size = extent_fs->Size(ino);
+	old_mapped = extent_fs->AllocPages(ino) * page_size;
+
+	*ret = extent_fs->Allocate(ino, (offset + size - 1) / page_size);
+	if (*ret < 0) {
+		pthread_mutex_unlock(&sim_lock);
+		return true;
+	}
+
+	/*
+	 * Bytes that had no page read as zeros, and so does the gap up to a
+	 * write beyond the end of file. Both may be stale on the new pages.
+	 */
+	zero_from = MIN(old_size, old_mapped);
+	zero_end = MIN(MAX(old_size, (size_t)offset),
+			extent_fs->AllocPages(ino) * page_size);
+	if (zero_from < zero_end &&
+		extent_zero(ino, zero_from, zero_end) != 1) {
+		fprintf(stderr, "Fail to write file %s\n", path);
+		exit(-1);
+	}
+
+	if (extent_rw(ino, (char *)buf, size, offset, 1) != 1) {
+		fprintf(stderr, "Fail to write file %s\n", path);
+		exit(-1);
+	}
+
+	if (old_size < offset + size)
+		extent_fs->SetSize(ino, offset + size);
+
+	pthread_mutex_unlock(&sim_lock);
+
+	*ret = size;
+	return true;
+}
+
+/*
+ * Truncates a file on flash. Returns false if path is not on flash
+ */
+static bool extent_truncate(const char *path, size_t newsize)
+{
+	size_t page_size = sizeof(datastore_page_t);
+	size_t old_size, old_mapped;
+	int ino;
+
+	pthread_mutex_lock(&sim_lock);
+
+	ino = extent_fs->Lookup(path);
+	if (ino < 0) {
+		pthread_mutex_unlock(&sim_lock);
+		return false;
+	}
+
+	old_size = extent_fs->Size(ino);
+	old_mapped = extent_fs->AllocPages(ino) * page_size;
+
+	/* Growing exposes what is left in pages beyond the old end */
+	if (newsize > old_size &&
+		extent_zero(ino, old_size, MIN(newsize, old_mapped)) != 1) {
+		fprintf(stderr, "Fail to truncate file %s\n", path);
+		exit(-1);
+	}
+
+	extent_fs->Truncate(ino, newsize);
+
+	pthread_mutex_unlock(&sim_lock);
+
+	return true;
+}
+
 static void *myFuse_init(struct fuse_conn_info *conn UNUSED)
 {
 	int ret;
@@ -99,12 +720,56 @@ static void *myFuse_init(struct fuse_conn_info *conn UNUSED)
 		dprintf("Failed to chdir to ref dir %s\n", abs_ref_path);
 		exit(-1);
 	}
+
+	/* Started here as fuse is done setting up the process by now */
+	if (load_mode == LOAD_LAZY_BG) {
+		ret = pthread_create(&loader_thread, NULL, loader_main, NULL);
+		if (ret != 0) {
+			dprintf("Failed to start loader\n");
+			exit(-1);
+		}
+		is_loader_running = 1;
+	}
+
 	return NULL;
 }
 
 static void myFuse_destroy(void *private_data UNUSED)
 {
 	dprintf("Destroyed\n");
+
+	if (is_loader_running) {
+		__atomic_store_n(&loader_stop, 1, __ATOMIC_RELAXED);
+		pthread_join(loader_thread, NULL);
+		is_loader_running = 0;
+	}
+
+	if (page_cache != NULL) {
+		char stats[256];
+
+		flush_page_cache();
+		page_cache->FormatStats(stats, sizeof(stats));
+		printf("Page cache: %s", stats);
+		fflush(stdout);
+
+		delete page_cache;
+		page_cache = NULL;
+	}
+
+	if (extent_fs != NULL) {
+		char stats[256];
+
+		/* Data went with the page cache, only metadata is left */
+		if (extent_fs->Sync() != 1)
+			fprintf(stderr, "Couldn't write extent metadata\n");
+		extent_fs->FormatStats(stats, sizeof(stats));
+		printf("Extent FS: %s", stats);
+		fflush(stdout);
+
+		delete extent_fs;
+		extent_fs = NULL;
+	}
+
 	deinit_flashsim();
 }
 
@@ -132,6 +797,29 @@ int myFuse_getxattr(const char *path, const char *name, char *value,
 	char rel_path[MAX_PATH_LEN];
 	get_rel_path(path, rel_path);
 
+	if ((page_cache != NULL && (is_sim_file(path) || is_multi_file) &&
+		strcmp(name, PAGECACHE_XATTR) == 0) ||
+		(extent_fs != NULL && strcmp(name, EXTENTFS_XATTR) == 0)) {
+
+		char stats[256];
+
+		pthread_mutex_lock(&sim_lock);
+		if (strcmp(name, PAGECACHE_XATTR) == 0)
+			ret = page_cache->FormatStats(stats, sizeof(stats));
+		else
+			ret = extent_fs->FormatStats(stats, sizeof(stats));
+		pthread_mutex_unlock(&sim_lock);
+
+		/* Size 0 asks for the length of the value */
+		if (size == 0)
+			return ret;
+		if ((size_t)ret > size)
+			return -ERANGE;
+
+		memcpy(value, stats, ret);
+		return ret;
+	}
+
 	ret = getxattr(rel_path, name, value, size);
 	if (ret < 0) {
 		dprintf("getxattr failed: Ret %d, Error %s\n", ret,
@@ -157,8 +845,21 @@ int myFuse_getattr(const char *path, struct stat *buf)
 		return -errno;
 	}
 
-	if (strcmp(path, rel_fname) == 0)
-		buf->st_size = fsize;
+	if (is_sim_file(path))
+		buf->st_size = get_fsize();
+
+	if (extent_fs != NULL) {
+		int ino;
+
+		pthread_mutex_lock(&sim_lock);
+		ino = extent_fs->Lookup(path);
+		if (ino >= 0) {
+			buf->st_size = extent_fs->Size(ino);
+			buf->st_blocks = extent_fs->AllocPages(ino) *
+				sizeof(datastore_page_t) / 512;
+		}
+		pthread_mutex_unlock(&sim_lock);
+	}
 
 	return ret;
 
@@ -224,13 +925,15 @@ int myFuse_read(const char *path, char *buf, size_t size, off_t offset,
 			struct fuse_file_info *fi)
 {
 	int ret;
-	class datastore_page_t page;
-	int page_size = sizeof(page.buf);
+	int page_size = sizeof(datastore_page_t);
 
 	dprintf("In read %s, Comparining with %s\n", path, rel_fname);
 
+	if (extent_fs != NULL && extent_read(path, buf, size, offset, &ret))
+		return ret;
+
 	/* Small Files */
-	if (strcmp(path, rel_fname) != 0) {
+	if (!is_sim_file(path)) {
 		ret = pread(fi->fh, buf, size, offset);
 		if (ret < 0) {
 			dprintf("read failed: Ret %d, Error %s\n", ret,
@@ -245,42 +948,26 @@ int myFuse_read(const char *path, char *buf, size_t size, off_t offset,
 		dprintf("Reading from sim: offset %zu, size %zu\n",
 			offset, size);
 
+		if (size == 0)
+			return 0;
+
 		int start_page_num = offset / page_size;
 		int end_page_num = (offset + size - 1) / page_size;
 
-		int page_num;
-		int buf_idx = 0;
-
-		for (page_num = start_page_num; page_num <= end_page_num;
-			page_num++) {
-
-			int start_offset, end_offset;
-			int start_idx = 0;
-			int end_idx = page_size - 1;
-
-			ret = sim->Read(log_fp, page_num, &page);
-			if (ret != 1) {
-
-				fprintf(stderr, "Fail to read input file\n");
-				exit(-1);
-			}
-
-			start_offset = page_num * page_size;
-			end_offset = (page_num + 1) * page_size - 1;
+		uint64_t lock_set = get_range_lock_set(start_page_num,
+							end_page_num);
 
-			if (offset > start_offset)
-				start_idx = offset - start_offset;
+		lock_ranges(lock_set, 0);
+		ret = sim_rw(buf, size, offset, 0);
+		unlock_ranges(lock_set);
 
-			if (offset + (int)size - 1 < end_offset)
-				end_idx = offset + size - 1 - start_offset;
-
-			memcpy(&buf[buf_idx], &page.buf[start_idx],
-				end_idx - start_idx + 1);
+		if (ret != 1) {
 
-			buf_idx += end_idx - start_idx + 1;
+			fprintf(stderr, "Fail to read input file\n");
+			exit(-1);
 		}
 
-		return buf_idx;
+		return size;
 	}
 }
 
@@ -288,12 +975,14 @@ int myFuse_write(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi)
 {
 	int ret;
-	class datastore_page_t page;
-	int page_size = sizeof(page.buf);
+	int page_size = sizeof(datastore_page_t);
 
 	dprintf("In write %s, size %zu, offset %zu\n", path, size, offset);
 
-	if (strcmp(path, rel_fname) != 0) {
+	if (extent_fs != NULL && extent_write(path, buf, size, offset, &ret))
+		return ret;
+
+	if (!is_sim_file(path)) {
 		ret = pwrite(fi->fh, buf, size, offset);
 		if (ret < 0) {
 			dprintf("write failed: Ret %d, Error %s\n", ret,
@@ -305,63 +994,42 @@ int myFuse_write(const char *path, const char *buf, size_t size, off_t offset,
 
 	} else {
 
+		if (size == 0)
+			return 0;
+
 		int start_page_num = offset / page_size;
 		int end_page_num = (offset + size - 1) / page_size;
 
-		int page_num;
-		int buf_idx = 0;
-
-		for (page_num = start_page_num; page_num <= end_page_num;
-			page_num++) {
-
-			int start_offset, end_offset;
-			int start_idx = 0;
-			int end_idx = page_size - 1;
-
-			start_offset = page_num * page_size;
-			end_offset = (page_num + 1) * page_size - 1;
-
-			if (offset > start_offset)
-				start_idx = offset - start_offset;
-
-			if (offset + (int)size - 1 < end_offset)
-				end_idx = offset + size - 1 - start_offset;
+		uint64_t lock_set = get_range_lock_set(start_page_num,
+							end_page_num);
 
+		lock_ranges(lock_set, 1);
+		/* Only partially written edge pages are read-modify-written */
+		ret = sim_rw((char *)buf, size, offset, 1);
+		unlock_ranges(lock_set);
 
-			if ((start_idx != 0) || (end_idx != page_size -1)) {
-
-				ret = sim->Read(log_fp, page_num, &page);
-				if (ret != 1) {
-					/* Might not be in the memory */
-					memset(page.buf, 0, sizeof(page.buf));
-				}
-			}
-
-			memcpy(&page.buf[start_idx], &buf[buf_idx],
-				end_idx - start_idx + 1);
-
-			ret = sim->Write(log_fp, page_num, page);
-			if (ret != 1) {
-				fprintf(stderr, "Fail to write to input file\n");
-				exit(-1);
-			}
-
-			buf_idx += end_idx - start_idx + 1;
+		if (ret != 1) {
+			fprintf(stderr, "Fail to write to input file\n");
+			exit(-1);
 		}
 
-		if (fsize < offset + size)
-			fsize = offset + size;
-
-		return buf_idx;
+		return size;
 	}
 
 	return 0;
 
 }
 /* This function is called on last close of file */
-int myFuse_release(const char *path UNUSED, struct fuse_file_info *fi)
+int myFuse_release(const char *path, struct fuse_file_info *fi)
 {
-	int ret = close(fi->fh);
+	int ret;
+
+	if (extent_fs != NULL)
+		sync_extent_fs();
+	else if (is_sim_file(path))
+		flush_page_cache();
+
+	ret = close(fi->fh);
 	if (ret < 0) {
 		dprintf("close failed: Ret %d, Error %s\n", ret,
 				strerror(errno));
@@ -375,8 +1043,13 @@ int myFuse_release(const char *path UNUSED, struct fuse_file_info *fi)
  * This is called on each close of file - Such as when a child process
  * closes a file it inherented
  */
-int myFuse_flush(const char *path UNUSED, struct fuse_file_info *fi UNUSED)
+int myFuse_flush(const char *path, struct fuse_file_info *fi UNUSED)
 {
+	if (extent_fs != NULL)
+		return sync_extent_fs();
+	else if (is_sim_file(path))
+		return flush_page_cache();
+
 	return 0;
 }
 
@@ -463,6 +1136,9 @@ int myFuse_ftruncate(const char *path UNUSED, off_t newsize,
 
 	dprintf("In ftruncate %s\n", path);
 
+	/* Reference file of a file on flash stays empty */
+	if (extent_fs != NULL && extent_truncate(path, newsize))
+		return 0;
 
 	ret = ftruncate(fi->fh, newsize);
 	if (ret < 0) {
@@ -474,8 +1150,8 @@ int myFuse_ftruncate(const char *path UNUSED, off_t newsize,
 
 	}
 
-	if (strcmp(path, rel_fname) == 0)
-		fsize = newsize;
+	if (is_sim_file(path))
+		set_fsize(newsize);
 
 	return ret;
 
@@ -489,6 +1165,8 @@ int myFuse_truncate(const char *path, off_t newsize)
 
 	dprintf("In truncate %s\n", rel_path);
 
+	if (extent_fs != NULL && extent_truncate(path, newsize))
+		return 0;
 
 	ret = truncate(rel_path, newsize);
 	if (ret < 0) {
@@ -500,8 +1178,8 @@ int myFuse_truncate(const char *path, off_t newsize)
 
 	}
 
-	if (strcmp(path, rel_fname) == 0)
-		fsize = newsize;
+	if (is_sim_file(path))
+		set_fsize(newsize);
 
 
 	return ret;
@@ -525,8 +1203,18 @@ int myFuse_unlink(const char *path)
 		return -errno;
 	}
 
-	if (strcmp(path, rel_fname) == 0)
-		fsize = 0;
+	if (is_sim_file(path))
+		set_fsize(0);
+
+	if (extent_fs != NULL) {
+		int ino;
+
+		pthread_mutex_lock(&sim_lock);
+		ino = extent_fs->Lookup(path);
+		if (ino >= 0)
+			extent_fs->Remove(ino);
+		pthread_mutex_unlock(&sim_lock);
+	}
 
 	return ret;
 }
@@ -608,6 +1296,25 @@ int myFuse_mknod(const char *path, mode_t mode, dev_t dev)
 		return -errno;
 	}
 
+	if (extent_fs != NULL && S_ISREG(mode)) {
+		int ino;
+
+		pthread_mutex_lock(&sim_lock);
+		ino = extent_fs->Lookup(path);
+		if (ino >= 0)
+			extent_fs->Truncate(ino, 0);
+		else
+			ino = extent_fs->Create(path);
+		pthread_mutex_unlock(&sim_lock);
+
+		if (ino < 0) {
+			dprintf("mknod on flash failed: Error %s\n",
+					strerror(-ino));
+			unlink(rel_path);
+			return ino;
+		}
+	}
+
 	return ret;
 }
 
@@ -617,6 +1324,83 @@ int myFuse_mknod(const char *path, mode_t mode, dev_t dev)
 static
 struct fuse_operations myFuse_operations;
 
+/*
+ * Returns the LBAs the FTL exposes, all blocks but the overprovisioned ones
+ */
+static size_t get_num_lbas(char *conf_file)
+{
+	FlashSimConf conf(conf_file);
+
+	return conf.GetNumLBAs();
+}
+
+/*
+ * Sets up the files on flash (-M 1) and copies the input file in
+ */
+static void initialize_extent_fs(char *conf_file, FILE *fp)
+{
+	class datastore_page_t page;
+	size_t page_count = 0;
+	size_t run = 0;
+	size_t lba = 0;
+	int ino;
+
+	extent_fs = new ExtentFS(get_num_lbas(conf_file), sizeof(page.buf),
+		[](size_t lba, char *data) {
+			return sim->Read(log_fp, lba, (datastore_page_t *)data);
+		},
+		[](size_t lba, const char *data) {
+			return sim->Write(log_fp, lba,
+				*(const datastore_page_t *)data);
+		},
+		[](size_t lba, size_t len) {
+			if (page_cache != NULL)
+				page_cache->Invalidate(lba, lba + len);
+			for (size_t i = 0; i < len; i++)
+				sim->Trim(log_fp, lba + i);
+		});
+
+	if (extent_fs->Mount() == 0)
+		dprintf("Formatted flash for files\n");
+
+	ino = extent_fs->Lookup(rel_fname);
+	if (ino >= 0)
+		extent_fs->Truncate(ino, 0);
+	else
+		ino = extent_fs->Create(rel_fname);
+
+	if (ino < 0 || (fsize > 0 && extent_fs->Allocate(ino,
+				(fsize - 1) / sizeof(page.buf)) < 0)) {
+		fprintf(stderr, "Input file doesn't fit on flash\n");
+		exit(-1);
+	}
+
+	/* Read whole file into its extents */
+	while (page_count * sizeof(page.buf) < fsize) {
+
+		size_t rbytes;
+
+		rbytes = fread(page.buf, 1, sizeof(page.buf), fp);
+
+		if (rbytes != sizeof(page.buf))
+			memset(&page.buf[rbytes], 0, sizeof(page.buf) - rbytes);
+
+		if (run == 0)
+			lba = extent_fs->Map(ino, page_count, &run);
+
+		if (sim->Write(log_fp, lba, page) != 1) {
+			fprintf(stderr, "Couldn't read in the input file\n");
+			exit(-1);
+		}
+
+		page_count++;
+		lba++;
+		run--;
+	}
+
+	extent_fs->SetSize(ino, fsize);
+}
+
 /**
  * @brief Initializes the flash simulator
  * @param conf_file Configuration file for the simulator
@@ -657,6 +1441,30 @@ int initialize_flashsim(char *conf_file, char *fname, char *log_fname)
 	/* We are not closing this file, so lets not buffer it */
 	setbuf(log_fp, NULL);
 
+	if (is_multi_file) {
+		initialize_extent_fs(conf_file, fp);
+		fclose(fp);
+		return 0;
+	}
+
+	if (load_mode != LOAD_EAGER) {
+
+		fclose(fp);
+
+		/* Pages are faulted in on first access, see lazy_prepare() */
+		src_fd = open(fname, O_RDONLY);
+		if (src_fd < 0) {
+			fprintf(stderr, "Couldn't open input file %s\n", fname);
+			exit(-1);
+		}
+
+		/* Same pages as the eager load below, last one maybe empty */
+		src_pages = fsize / sizeof(page.buf) + 1;
+		page_loaded.assign(src_pages, false);
+
+		return 0;
+	}
+
 	/* Read whole file into the simulator */
 	while (1) {
 
@@ -686,10 +1494,12 @@ int initialize_flashsim(char *conf_file, char *fname, char *log_fname)
 
 /*
  * Call like ./myFuse -c [abs conf file] -f [filename abs path] -m [mount point]
- * -s [ref point] -l [log file] -d [debug level]
+ * -s [ref point] -l [log file] -d [debug level] -t [threading]
+ * -C [page cache pages] -L [load mode] -M [multiple files]
  *
- * Run fuse in single threaded mode for ease of development
- * XXX: Does this slow down the application?
+ * By default fuse runs in single threaded mode for ease of development.
+ * With -t 1 fuse serves requests from multiple threads, see the
+ * concurrency note at the top of this file.
  */
 int main(int argc, char *argv[]) {
 
@@ -699,9 +1509,11 @@ int main(int argc, char *argv[]) {
 	/* Absolute conf file path */
 	char *abs_conf_file;
 	char *fuse_argv[5];
+	int fuse_argc = 0;
 	char *log_file = NULL;
+	int i;
 
-	while ((c = getopt (argc, argv, "f:m:c:s:l:d:")) != -1) {
+	while ((c = getopt (argc, argv, "f:m:c:s:l:d:t:C:L:M:")) != -1) {
 
 		switch (c) {
 
@@ -732,6 +1544,24 @@ int main(int argc, char *argv[]) {
 			if (atoi(optarg) != 0)
 				is_debug_enabled = 1;
 			break;
+		case 't':
+			if (atoi(optarg) != 0)
+				is_multithreaded = 1;
+			break;
+		case 'C':
+			page_cache_pages = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			load_mode = atoi(optarg);
+			if (load_mode < LOAD_EAGER || load_mode > LOAD_LAZY_BG) {
+				printf("Unknown load mode %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		case 'M':
+			if (atoi(optarg) != 0)
+				is_multi_file = 1;
+			break;
 		default:
 			printf("Unknown argument %c\n", c);
 			exit(-1);
@@ -749,7 +1579,19 @@ int main(int argc, char *argv[]) {
 				" -m <abs mount dir path >"
 				" -s <abs ref dir path >"
 				" -l <abs log file path>"
-				" -d <0-No Debug, 1-Debug Logs on stdout>\n");
+				" -d <0-No Debug, 1-Debug Logs on stdout>"
+				" [-t <0-Single threaded, 1-Multithreaded>]"
+				" [-C <page cache pages, 0-No cache>]"
+				" [-L <0-Load file before mount, 1-Lazy load,"
+				" 2-Lazy and background load>]"
+				" [-M <0-Only the input file on flash,"
+				" 1-All files on flash>]\n");
+		exit(-1);
+	}
+
+	/* Lazy load tracks pages of the input file, not of extents */
+	if (is_multi_file && load_mode != LOAD_EAGER) {
+		fprintf(stderr, "-L needs the input file alone on flash\n");
 		exit(-1);
 	}
 
@@ -761,6 +1603,29 @@ int main(int argc, char *argv[]) {
 	if (ret < 0)
 		return ret;
 
+	if (page_cache_pages != 0) {
+		page_cache = new PageCache(page_cache_pages,
+			sizeof(datastore_page_t),
+			[](size_t lba, char *data) {
+				lazy_prepare(lba, 0);
+				return sim->Read(log_fp, lba,
+					(datastore_page_t *)data);
+			},
+			[](size_t lba, const char *data) {
+				lazy_prepare(lba, 1);
+				return sim->Write(log_fp, lba,
+					*(const datastore_page_t *)data);
+			});
+	}
+
+	for (i = 0; i < NUM_RANGE_LOCKS; i++) {
+		ret = pthread_rwlock_init(&range_locks[i], NULL);
+		if (ret != 0) {
+			fprintf(stderr, "Couldn't init range locks\n");
+			exit(-1);
+		}
+	}
+
 	myFuse_operations.getattr	= myFuse_getattr;
 	myFuse_operations.mknod		= myFuse_mknod;
 	myFuse_operations.mkdir		= myFuse_mkdir;
@@ -784,11 +1649,12 @@ int main(int argc, char *argv[]) {
 	myFuse_operations.utimens	= myFuse_utimens;
 
 
-	fuse_argv[0] = argv[0];
-	fuse_argv[1] = "-s";
-	fuse_argv[2] = "-f";
-	fuse_argv[3] = abs_mount_path;
-	fuse_argv[4] = NULL;
+	fuse_argv[fuse_argc++] = argv[0];
+	if (!is_multithreaded)
+		fuse_argv[fuse_argc++] = "-s";
+	fuse_argv[fuse_argc++] = "-f";
+	fuse_argv[fuse_argc++] = abs_mount_path;
+	fuse_argv[fuse_argc] = NULL;
 
-	return fuse_main(4, fuse_argv, &myFuse_operations, NULL);
+	return fuse_main(fuse_argc, fuse_argv, &myFuse_operations, NULL);
 }
@@ -0,0 +1,446 @@
+/**
+ * @file pagecache.h
+ * @brief Page cache of the FUSE-mounted simulated file
+ *
+ * Pages are indexed by LBA and replaced with ARC (Megiddo and Modha,
+ * "ARC: A Self-Tuning, Low Overhead Replacement Cache", FAST'03): T1 holds
+ * pages seen once, T2 pages seen at least twice, and the ghost lists B1/B2
+ * remember recently evicted LBAs to adapt the target size p of T1. So a
+ * scan (iozone's write/read passes) can't flush out the pages that are
+ * reused (reread, stride).
+ *
+ * Writes are write-back: pages are only marked dirty, and written to the
+ * simulator when evicted or on Flush(). A dirty page that can't be written
+ * back stays resident and another one is evicted; if none can be, one is
+ * dropped and the next Flush() fails. Sequential reads trigger readahead
+ * with a window that doubles while the stream stays sequential and shrinks
+ * when readahead pages are evicted unused.
+ *
+ * Not thread safe, the caller serializes (myFuse.cpp holds sim_lock).
+ */
+
+#ifndef __PAGECACHE_H__
+#define __PAGECACHE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+/* Readahead window (in pages) when a stream turns sequential, and its cap */
+#define PAGECACHE_RA_MIN	4
+#define PAGECACHE_RA_MAX	64
+
+struct pagecache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t ra_pages;	/* Pages brought in by readahead */
+	uint64_t ra_hits;	/* Readahead pages later accessed */
+	uint64_t ra_wasted;	/* Readahead pages evicted unused */
+	uint64_t writebacks;
+};
+
+/*
+ * class PageCache - ARC cache of pages of the simulated file
+ */
+class PageCache {
+
+	public:
+
+	/* Read page lba into data, returns 1 on success like FlashSimTest */
+	using FetchFn = std::function<int(size_t lba, char *data)>;
+	/* Write data to page lba, returns 1 on success */
+	using WriteBackFn = std::function<int(size_t lba, const char *data)>;
+
+	private:
+
+	enum list_id_t {
+		LIST_T1,
+		LIST_T2,
+		LIST_B1,
+		LIST_B2,
+		NUM_LISTS,
+	};
+
+	struct entry {
+		list_id_t list;
+		std::list<size_t>::iterator it;
+		size_t slot;		/* Only for T1/T2 */
+		bool dirty;
+		bool prefetched;	/* Brought by readahead, not used yet */
+	};
+
+	size_t capacity;
+	size_t page_size;
+	FetchFn fetch;
+	WriteBackFn writeback;
+
+	/* ARC target size of T1 */
+	size_t p;
+
+	/* MRU at front, LRU at back */
+	std::list<size_t> lists[NUM_LISTS];
+	std::unordered_map<size_t, struct entry> entries;
+
+	/* Page data of resident entries */
+	std::vector<char> slots;
+	std::vector<size_t> free_slots;
+
+	/* Sequential stream detection */
+	size_t next_seq_lba;
+	size_t ra_window;
+
+	struct pagecache_stats stats;
+
+	/* A dirty page was dropped without being written back */
+	bool lost_writeback;
+
+	char *SlotData(size_t slot) {
+		return &slots[slot * page_size];
+	}
+
+	void MoveTo(size_t lba, struct entry &e, list_id_t to) {
+		lists[e.list].erase(e.it);
+		lists[to].push_front(lba);
+		e.it = lists[to].begin();
+		e.list = to;
+	}
+
+	void Drop(size_t lba) {
+		struct entry &e = entries.at(lba);
+
+		lists[e.list].erase(e.it);
+		entries.erase(lba);
+	}
+
+	/*
+	 * Evict() - Move the LRU page of a resident list to its ghost list,
+	 * writing it back if dirty
+	 *
+	 * If the writeback fails, the page stays dirty and becomes the MRU of
+	 * its list, and false is returned. With force it is dropped anyway.
+	 */
+	bool Evict(list_id_t from, list_id_t ghost, bool force = false) {
+		size_t lba = lists[from].back();
+		struct entry &e = entries.at(lba);
+
+		if (e.dirty) {
+			stats.writebacks++;
+			if (writeback(lba, SlotData(e.slot)) != 1) {
+				fprintf(stderr, "Page cache: couldn't write back"
+						" LBA %zu\n", lba);
+				if (!force) {
+					MoveTo(lba, e, from);
+					return false;
+				}
+				lost_writeback = true;
+			}
+		}
+
+		if (e.prefetched) {
+			stats.ra_wasted++;
+			ra_window = std::max(ra_window / 2,
+					(size_t)PAGECACHE_RA_MIN);
+		}
+
+		free_slots.push_back(e.slot);
+		e.dirty = false;
+		e.prefetched = false;
+		MoveTo(lba, e, ghost);
+
+		return true;
+	}
+
+	/*
+	 * EvictAny() - Evict() the first page of list from, from its LRU end,
+	 * that can be written back. Returns false if none could.
+	 */
+	bool EvictAny(list_id_t from, list_id_t ghost) {
+		for (size_t n = lists[from].size(); n > 0; n--) {
+			if (Evict(from, ghost))
+				return true;
+		}
+
+		return false;
+	}
+
+	/*
+	 * Replace() - ARC's REPLACE, frees one slot
+	 *
+	 * Falls back to the other resident list, then to dropping a page,
+	 * when no page of the chosen list can be written back
+	 */
+	void Replace(bool in_b2) {
+		size_t t1 = lists[LIST_T1].size();
+		bool from_t1 = t1 > 0 && (t1 > p || (in_b2 && t1 == p) ||
+					lists[LIST_T2].empty());
+		list_id_t first = from_t1 ? LIST_T1 : LIST_T2;
+		list_id_t second = from_t1 ? LIST_T2 : LIST_T1;
+
+		if (EvictAny(first, first == LIST_T1 ? LIST_B1 : LIST_B2) ||
+			EvictAny(second, second == LIST_T1 ? LIST_B1 : LIST_B2))
+			return;
+
+		Evict(first, first == LIST_T1 ? LIST_B1 : LIST_B2, true);
+	}
+
+	/*
+	 * Admit() - Make room for lba, which is not resident, and put it
+	 * on list to. Returns its slot.
+	 */
+	size_t Admit(size_t lba, list_id_t to) {
+		auto found = entries.find(lba);
+
+		if (found != entries.end() && found->second.list == LIST_B1) {
+
+			/* Case II: recently evicted from T1, grow T1 */
+			size_t delta = std::max(lists[LIST_B2].size() /
+					lists[LIST_B1].size(), (size_t)1);
+			p = std::min(capacity, p + delta);
+			if (free_slots.empty())
+				Replace(false);
+
+		} else if (found != entries.end() &&
+				found->second.list == LIST_B2) {
+
+			/* Case III: recently evicted from T2, grow T2 */
+			size_t delta = std::max(lists[LIST_B1].size() /
+					lists[LIST_B2].size(), (size_t)1);
+			p = p > delta ? p - delta : 0;
+			if (free_slots.empty())
+				Replace(true);
+
+		} else {
+
+			/* Case IV: not seen recently */
+			size_t l1 = lists[LIST_T1].size() +
+				lists[LIST_B1].size();
+			size_t total = l1 + lists[LIST_T2].size() +
+				lists[LIST_B2].size();
+
+			/*
+			 * Readahead admits ghosts to T1, so T1 + B1 may be
+			 * above capacity, hence >= where ARC has ==
+			 */
+			if (l1 >= capacity) {
+				if (!lists[LIST_B1].empty()) {
+					Drop(lists[LIST_B1].back());
+					if (free_slots.empty())
+						Replace(false);
+				} else {
+					/* T1 is full, drop its LRU */
+					if (!EvictAny(LIST_T1, LIST_B1))
+						Evict(LIST_T1, LIST_B1, true);
+					Drop(lists[LIST_B1].back());
+				}
+			} else if (total >= capacity) {
+				if (total >= 2 * capacity &&
+					!lists[LIST_B2].empty())
+					Drop(lists[LIST_B2].back());
+				if (free_slots.empty())
+					Replace(false);
+			}
+
+			struct entry e;
+			lists[to].push_front(lba);
+			e.list = to;
+			e.it = lists[to].begin();
+			entries[lba] = e;
+			found = entries.find(lba);
+		}
+
+		if (found->second.list != to)
+			MoveTo(lba, found->second, to);
+
+		struct entry &e = found->second;
+		e.slot = free_slots.back();
+		free_slots.pop_back();
+		e.dirty = false;
+		e.prefetched = false;
+
+		return e.slot;
+	}
+
+	public:
+
+	PageCache(size_t capacity, size_t page_size, FetchFn fetch,
+			WriteBackFn writeback) :
+		capacity{capacity},
+		page_size{page_size},
+		fetch{fetch},
+		writeback{writeback},
+		p{0},
+		slots(capacity * page_size),
+		next_seq_lba{0},
+		ra_window{0},
+		stats(),
+		lost_writeback{false} {
+
+		for (size_t i = capacity; i > 0; i--)
+			free_slots.push_back(i - 1);
+	}
+
+	/*
+	 * Get() - Data of page lba, brought in on a miss
+	 *
+	 * fill - Fetch the page on a miss. Pass false when the caller
+	 *        overwrites the whole page anyway
+	 * ok - Set to false if the fetch failed, the page then reads as zeros
+	 *
+	 * The pointer is valid until the next call into the cache
+	 */
+	char *Get(size_t lba, bool fill, bool *ok) {
+		auto found = entries.find(lba);
+
+		*ok = true;
+
+		if (found != entries.end() && (found->second.list == LIST_T1 ||
+					found->second.list == LIST_T2)) {
+
+			/* Case I: hit, page has been used twice */
+			struct entry &e = found->second;
+
+			stats.hits++;
+			if (e.prefetched) {
+				stats.ra_hits++;
+				e.prefetched = false;
+			}
+			MoveTo(lba, e, LIST_T2);
+
+			return SlotData(e.slot);
+		}
+
+		stats.misses++;
+
+		/* Ghost hits are promoted to T2, new pages start in T1 */
+		bool is_ghost = found != entries.end();
+		char *data = SlotData(Admit(lba, is_ghost ? LIST_T2 : LIST_T1));
+
+		if (!fill || fetch(lba, data) != 1) {
+			memset(data, 0, page_size);
+			*ok = !fill;
+		}
+
+		return data;
+	}
+
+	void MarkDirty(size_t lba) {
+		entries.at(lba).dirty = true;
+	}
+
+	/*
+	 * Readahead() - Tell the cache pages first_lba to last_lba were read
+	 *
+	 * If this continues the previous read, prefetch the pages following
+	 * it, never beyond limit_lba (exclusive)
+	 */
+	void Readahead(size_t first_lba, size_t last_lba, size_t limit_lba) {
+		bool is_seq = first_lba == next_seq_lba;
+
+		next_seq_lba = last_lba + 1;
+
+		if (!is_seq) {
+			ra_window = 0;
+			return;
+		}
+
+		ra_window = ra_window ? std::min(2 * ra_window,
+			(size_t)PAGECACHE_RA_MAX) : PAGECACHE_RA_MIN;
+
+		/* Never let readahead push out more than half the cache */
+		size_t window = std::min(ra_window, capacity / 2);
+
+		for (size_t lba = last_lba + 1;
+			lba <= last_lba + window && lba < limit_lba; lba++) {
+
+			auto found = entries.find(lba);
+			if (found != entries.end() &&
+				(found->second.list == LIST_T1 ||
+				 found->second.list == LIST_T2))
+				continue;
+
+			size_t slot = Admit(lba, LIST_T1);
+			if (fetch(lba, SlotData(slot)) != 1) {
+				free_slots.push_back(slot);
+				Drop(lba);
+				break;
+			}
+
+			entries.at(lba).prefetched = true;
+			stats.ra_pages++;
+		}
+	}
+
+	/*
+	 * Flush() - Write back all dirty pages
+	 *
+	 * Returns 1 if all were written, like FlashSimTest, and no dirty page
+	 * was dropped since the last Flush()
+	 */
+	int Flush() {
+		int ret = lost_writeback ? 0 : 1;
+
+		lost_writeback = false;
+
+		for (auto &kv : entries) {
+			struct entry &e = kv.second;
+
+			if ((e.list != LIST_T1 && e.list != LIST_T2) || !e.dirty)
+				continue;
+
+			if (writeback(kv.first, SlotData(e.slot)) != 1)
+				ret = 0;
+			else
+				e.dirty = false;
+
+			stats.writebacks++;
+		}
+
+		return ret;
+	}
+
+	/*
+	 * Invalidate() - Forget pages from first_lba up to end_lba (exclusive),
+	 * dirty or not (file was truncated or its pages freed)
+	 */
+	void Invalidate(size_t first_lba, size_t end_lba = SIZE_MAX) {
+		for (auto it = entries.begin(); it != entries.end(); ) {
+			struct entry &e = it->second;
+
+			if (it->first < first_lba || it->first >= end_lba) {
+				++it;
+				continue;
+			}
+
+			if (e.list == LIST_T1 || e.list == LIST_T2)
+				free_slots.push_back(e.slot);
+			lists[e.list].erase(e.it);
+			it = entries.erase(it);
+		}
+	}
+
+	const struct pagecache_stats &GetStats() const {
+		return stats;
+	}
+
+	/*
+	 * FormatStats() - Stats as one line of text, snprintf() semantics
+	 */
+	int FormatStats(char *buf, size_t size) const {
+		uint64_t accesses = stats.hits + stats.misses;
+
+		return snprintf(buf, size, "hits %lu misses %lu hit_ratio %.4f "
+			"ra_pages %lu ra_hits %lu ra_wasted %lu writebacks %lu "
+			"p %zu t1 %zu t2 %zu\n", stats.hits, stats.misses,
+			accesses ? (double)stats.hits / accesses : 0.0,
+			stats.ra_pages, stats.ra_hits, stats.ra_wasted,
+			stats.writebacks, p, lists[LIST_T1].size(),
+			lists[LIST_T2].size());
+	}
+};
+
+#endif /* __PAGECACHE_H__ */
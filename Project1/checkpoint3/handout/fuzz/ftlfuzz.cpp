@@ -0,0 +1,724 @@
+/**
+ * @file ftlfuzz.cpp
+ * @brief Deterministic fuzzer of the FTL through FlashSimTest
+ *
+ * Issues random interleavings of Write/Read/Trim and checks every read of a
+ * written LBA against a shadow model of the expected contents. Every run of
+ * a sequence is done in a forked child on a fresh FlashSimTest, so a crash
+ * or a hang of the FTL is caught like lost data. A failing sequence is
+ * minimized (ddmin, Zeller and Hildebrandt, "Simplifying and Isolating
+ * Failure-Inducing Input", TSE 2002) and saved to a replay file.
+ *
+ * Usage: ftlfuzz [options] <config_file>
+ *   -n ops       operations per sequence (default: 4 x LBA count)
+ *   -s seed      seed of the first sequence (default: 15746)
+ *   -N runs      sequences to run, seeds seed to seed + runs - 1 (default: 1)
+ *   -r fraction  fraction of reads (default: 0.3)
+ *   -t fraction  fraction of trims (default: 0.05)
+ *   -c interval  read back every written LBA each interval ops (default: 0,
+ *                only at the end of the sequence)
+ *   -i interval  print write amplification each interval ops (default: 0)
+ *   -m runs      cap on the runs spent minimizing a failure (default: 2000)
+ *   -T seconds   a run taking longer is a hang (default: 60)
+ *   -p fraction  power cycles per op (default: 0)
+ *   -k period    checkpoint period of power loss recovery, in host
+ *                operations (default: 100)
+ *   -R file      replay (and minimize) the sequence of a replay file
+ *   -v           keep the FTL's own output
+ *
+ * A sequence is made of phases of random length, each drawing its LBAs from
+ * one of the workload generators (uniform, zipfian, hot/cold, sequential,
+ * strided), so that both the steady state and cleaning see mixed patterns.
+ * Every write stores a value unique to it, which tells a stale page (an
+ * older value of the same LBA) from a misdirected one (a value of another
+ * LBA). Reads of LBAs never written, or trimmed, are not checked.
+ *
+ * A power cycle recreates the FTL and recovers it from its last mapping
+ * checkpoint and the OOB of flash pages (FlashSimTest::PowerCycle()), then
+ * reads back every written LBA. Sequences with power cycles run with
+ * recovery enabled.
+ *
+ * Replay files have one operation per line, "W lba value", "R lba",
+ * "T lba" or "P", and # comments. Minimized failures are saved to
+ * OUTDIR/fuzz_<seed>.ops. Exit status is 1 if any sequence failed.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "746FlashSim.h"
+#include "workload.h"
+
+#if (CONFIG_TWOPROC == 1)
+#error "ftlfuzz needs a fresh FTL per run, build it with CONFIG_TWOPROC=0"
+#endif
+
+/* Longest phase of a single pattern, in ops */
+#define FUZZ_MAX_PHASE		512
+
+/*
+ * enum fuzz_result_t - Outcome of running a sequence
+ */
+enum fuzz_result_t {
+	FUZZ_PASS,
+	FUZZ_LOST,		/* Written LBA not readable */
+	FUZZ_STALE,		/* Older value of the same LBA read back */
+	FUZZ_MISDIRECTED,	/* Value of another LBA read back */
+	FUZZ_CORRUPT,		/* Value never written anywhere read back */
+	FUZZ_FATAL,		/* Controller raised an exception */
+	FUZZ_CRASH,		/* Child died on a signal */
+	FUZZ_HANG,		/* Child exceeded the timeout */
+	FUZZ_UNRECOVERED,	/* Recovery after a power cycle failed */
+	NUM_FUZZ_RESULTS,
+};
+
+static const char *result_names[NUM_FUZZ_RESULTS] = {
+	"pass", "lost", "stale", "misdirected", "corrupt", "fatal", "crash",
+	"hang", "unrecovered",
+};
+
+/*
+ * struct FuzzOp - One host operation of a sequence
+ *
+ * value is what a write stores, unique within the sequence. Ops keep it
+ * when the sequence is minimized, so a replay writes the same values.
+ */
+struct FuzzOp {
+	char type;		/* 'W', 'R', 'T' or 'P' (power cycle) */
+	size_t lba;
+	uint32_t value;
+};
+
+/*
+ * struct fuzz_report - What a run tells its parent, in shared memory so
+ * that it survives a crash of the child
+ */
+struct fuzz_report {
+	int result;
+	size_t ops_done;	/* Op that failed, or ops.size() if the final
+				 * read back failed */
+	size_t lba;
+	uint32_t expected;
+	uint32_t got;
+	uint64_t host_writes;
+	uint64_t flash_writes;
+	uint64_t flash_erases;
+	uint64_t recoveries;
+	uint64_t recovery_ns;	/* Sum over all recoveries */
+	uint64_t replayed;	/* Host ops replayed, over all recoveries */
+	bool worn_out;		/* FTL refused a write, sequence cut short */
+};
+
+static const char *conf_path;
+static size_t num_lbas;
+static uint64_t check_interval;
+static uint64_t report_interval;
+static unsigned timeout_s = 60;
+static uint64_t checkpoint_period = 100;
+static bool verbose;
+
+/* Shared with the children */
+static struct fuzz_report *report;
+
+/* Stamp a page with a value which the shadow model can later compare */
+static inline void fill_page(TEST_PAGE_TYPE *page, uint32_t value) {
+#if ENABLE_LARGE_DATASTORE_PAGE
+	memset(page->buf, 0, sizeof(page->buf));
+	memcpy(page->buf, &value, sizeof(value));
+#else
+	*page = value;
+#endif
+}
+
+static inline uint32_t page_value(const TEST_PAGE_TYPE &page) {
+#if ENABLE_LARGE_DATASTORE_PAGE
+	uint32_t value;
+	memcpy(&value, page.buf, sizeof(value));
+	return value;
+#else
+	return page;
+#endif
+}
+
+/*
+ * generate() - Sequence of num_ops ops, fully determined by seed
+ */
+static std::vector<FuzzOp> generate(uint64_t seed, uint64_t num_ops,
+				double read_fraction, double trim_fraction,
+				double power_fraction) {
+
+	static const char *patterns[] = {
+		"uniform", "zipfian", "hotcold90", "seq", "strided",
+	};
+	const size_t num_patterns = sizeof(patterns) / sizeof(patterns[0]);
+
+	std::mt19937_64 rng(seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	std::vector<WorkloadGenerator> gens;
+	std::vector<FuzzOp> ops;
+
+	for (size_t i = 0; i < num_patterns; i++) {
+		WorkloadParams params;
+
+		params.SetPattern(patterns[i]);
+		params.seed = seed * num_patterns + i;
+		params.read_fraction = read_fraction;
+		params.trim_fraction = trim_fraction;
+		gens.emplace_back(params, num_lbas);
+	}
+
+	ops.reserve(num_ops);
+
+	while (ops.size() < num_ops) {
+		WorkloadGenerator &gen = gens[rng() % num_patterns];
+		size_t phase = 1 + rng() % FUZZ_MAX_PHASE;
+
+		for (size_t i = 0; i < phase && ops.size() < num_ops; i++) {
+			WorkloadOp wop = gen.Next();
+			FuzzOp op;
+
+			op.lba = wop.lba;
+			op.value = 0;
+			if (wop.type == WorkloadOpType::READ) {
+				op.type = 'R';
+			} else if (wop.type == WorkloadOpType::TRIM) {
+				op.type = 'T';
+			} else {
+				op.type = 'W';
+				/* 0 is kept for "never written" */
+				op.value = ops.size() + 1;
+			}
+			ops.push_back(op);
+
+			/* Drawn only when enabled, so that sequences without
+			 * power cycles stay the same */
+			if (power_fraction > 0 && ops.size() < num_ops &&
+				uniform(rng) < power_fraction) {
+				op.type = 'P';
+				op.lba = 0;
+				op.value = 0;
+				ops.push_back(op);
+			}
+		}
+	}
+
+	return ops;
+}
+
+/*
+ * classify() - Why the value read back from lba is not the expected one
+ */
+static int classify(const std::vector<size_t> &value_lba, size_t lba,
+		uint32_t got) {
+
+	if (got == 0 || got >= value_lba.size() ||
+		value_lba[got] == SIZE_MAX)
+		return FUZZ_CORRUPT;
+
+	return value_lba[got] == lba ? FUZZ_STALE : FUZZ_MISDIRECTED;
+}
+
+/*
+ * check() - Read back lba and compare with the shadow model
+ *
+ * Fills report and returns false on a mismatch
+ */
+static bool check(FlashSimTest &test, const std::vector<uint32_t> &shadow,
+		const std::vector<size_t> &value_lba, size_t lba,
+		size_t op_index) {
+
+	TEST_PAGE_TYPE page;
+	int r;
+
+	if (shadow[lba] == 0)
+		return true;
+
+	r = test.Read(NULL, lba, &page);
+	if (r == 1 && page_value(page) == shadow[lba])
+		return true;
+
+	report->ops_done = op_index;
+	report->lba = lba;
+	report->expected = shadow[lba];
+	report->got = r == 1 ? page_value(page) : 0;
+
+	if (r == -1)
+		report->result = FUZZ_FATAL;
+	else if (r == 0)
+		report->result = FUZZ_LOST;
+	else
+		report->result = classify(value_lba, lba, page_value(page));
+
+	return false;
+}
+
+/*
+ * check_all() - Read back every written LBA
+ */
+static bool check_all(FlashSimTest &test, const std::vector<uint32_t> &shadow,
+		const std::vector<size_t> &value_lba, size_t op_index) {
+
+	for (size_t lba = 0; lba < num_lbas; lba++)
+		if (!check(test, shadow, value_lba, lba, op_index))
+			return false;
+
+	return true;
+}
+
+static void update_stats(FlashSimTest &test, uint64_t host_writes) {
+	report->host_writes = host_writes;
+	report->flash_writes = test.TotalWritesPerformed();
+	report->flash_erases = test.TotalErasesPerformed();
+}
+
+static void print_stats(FILE *out, const char *prefix, size_t ops) {
+	uint64_t writes = report->host_writes;
+
+	fprintf(out, "%sops %zu host_writes %lu flash_writes %lu erases %lu "
+		"write_amp %.4f erases_per_write %.6f\n", prefix, ops, writes,
+		report->flash_writes, report->flash_erases, writes ?
+		(double)report->flash_writes / writes : 0.0, writes ?
+		(double)report->flash_erases / writes : 0.0);
+	if (report->recoveries)
+		fprintf(out, "%srecoveries %lu mean_recovery_us %.1f "
+			"replayed_per_recovery %.1f\n", prefix,
+			report->recoveries, report->recovery_ns / 1000.0 /
+			report->recoveries, (double)report->replayed /
+			report->recoveries);
+}
+
+/*
+ * run_child() - Run ops on a fresh FlashSimTest, the body of a child
+ */
+static void run_child(const std::vector<FuzzOp> &ops, bool quiet) {
+
+	/* 0 means never written (or trimmed) */
+	std::vector<uint32_t> shadow(num_lbas, 0);
+	/* LBA each value was written to, SIZE_MAX for values not written */
+	std::vector<size_t> value_lba;
+	uint64_t host_writes = 0;
+	TEST_PAGE_TYPE page;
+	int r;
+
+	for (const FuzzOp &op : ops) {
+		if (op.type != 'W')
+			continue;
+		if (op.value >= value_lba.size())
+			value_lba.resize(op.value + 1, SIZE_MAX);
+		value_lba[op.value] = op.lba;
+	}
+
+	/* FTL banner and FlashSimTest errors go to stdout */
+	if (!verbose) {
+		int null_fd = open("/dev/null", O_WRONLY);
+
+		dup2(null_fd, STDOUT_FILENO);
+		close(null_fd);
+	}
+
+	alarm(timeout_s);
+
+	FlashSimTest test(conf_path);
+
+	for (const FuzzOp &op : ops) {
+		if (op.type == 'P') {
+			test.EnableRecovery(checkpoint_period);
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < ops.size(); i++) {
+		const FuzzOp &op = ops[i];
+
+		report->ops_done = i;
+
+		if (op.type == 'P') {
+			r = test.PowerCycle(NULL);
+			if (r != 1) {
+				report->result = FUZZ_UNRECOVERED;
+				break;
+			}
+			report->recoveries++;
+			report->recovery_ns += test.RecoveryStats().recovery_ns;
+			report->replayed +=
+				test.RecoveryStats().records_replayed;
+
+			/* Nothing written before may be lost */
+			if (!check_all(test, shadow, value_lba, i))
+				break;
+		} else if (op.type == 'W') {
+			fill_page(&page, op.value);
+			r = test.Write(NULL, op.lba, page);
+			if (r == 1) {
+				shadow[op.lba] = op.value;
+				host_writes++;
+			} else if (r == 0) {
+				/* End of life, the contents must survive */
+				report->worn_out = true;
+				break;
+			}
+		} else if (op.type == 'T') {
+			r = test.Trim(NULL, op.lba);
+			if (r == 1)
+				shadow[op.lba] = 0;
+		} else if (shadow[op.lba] == 0) {
+			/* Any answer will do, but the FTL still gets the read */
+			r = test.Read(NULL, op.lba, &page);
+		} else {
+			if (!check(test, shadow, value_lba, op.lba, i))
+				break;
+			r = 1;
+		}
+
+		if (r == -1) {
+			report->result = FUZZ_FATAL;
+			break;
+		}
+
+		if (check_interval && (i + 1) % check_interval == 0 &&
+			!check_all(test, shadow, value_lba, i))
+			break;
+
+		if (report_interval && (i + 1) % report_interval == 0) {
+			update_stats(test, host_writes);
+			if (!quiet)
+				print_stats(stderr, "  ", i + 1);
+		}
+	}
+
+	if (report->result == FUZZ_PASS) {
+		if (!report->worn_out)
+			report->ops_done = ops.size();
+		check_all(test, shadow, value_lba, report->ops_done);
+	}
+
+	update_stats(test, host_writes);
+
+	fflush(stdout);
+	_exit(0);
+}
+
+/*
+ * run() - Run ops in a child, returns its fuzz_result_t
+ */
+static int run(const std::vector<FuzzOp> &ops, bool quiet) {
+	pid_t pid;
+	int status;
+
+	memset(report, 0, sizeof(*report));
+
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0)
+		run_child(ops, quiet);
+
+	if (waitpid(pid, &status, 0) < 0) {
+		perror("waitpid");
+		exit(EXIT_FAILURE);
+	}
+
+	if (WIFSIGNALED(status))
+		report->result = WTERMSIG(status) == SIGALRM ?
+				FUZZ_HANG : FUZZ_CRASH;
+	else if (WEXITSTATUS(status) != 0)
+		report->result = FUZZ_CRASH;
+
+	return report->result;
+}
+
+static void print_failure(FILE *out, const struct fuzz_report &rep) {
+	fprintf(out, "%s at op %zu", result_names[rep.result], rep.ops_done);
+	if (rep.result >= FUZZ_LOST && rep.result <= FUZZ_CORRUPT)
+		fprintf(out, ": LBA %zu expected %u got %u", rep.lba,
+			rep.expected, rep.got);
+	fprintf(out, "\n");
+}
+
+/*
+ * minimize() - Smallest sequence that still fails the same way
+ *
+ * ddmin over the ops: split the sequence in n chunks and drop one chunk
+ * whenever what remains still fails, else split finer. A failure counts as
+ * the same if its kind is, whatever the op or LBA.
+ */
+static std::vector<FuzzOp> minimize(std::vector<FuzzOp> ops, int result,
+				size_t max_runs) {
+
+	size_t runs = 0;
+	size_t n = 2;
+
+	/* Ops after the failing one can't matter, unless the child died
+	 * and the op it died at is only a guess */
+	if (result != FUZZ_CRASH && result != FUZZ_HANG &&
+		report->ops_done < ops.size())
+		ops.resize(report->ops_done + 1);
+
+	while (ops.size() >= 2 && runs < max_runs) {
+		size_t chunk = (ops.size() + n - 1) / n;
+		bool reduced = false;
+
+		for (size_t start = 0; start < ops.size() && runs < max_runs;
+			start += chunk) {
+
+			std::vector<FuzzOp> rest(ops.begin(), ops.begin() + start);
+			rest.insert(rest.end(), ops.begin() +
+				std::min(start + chunk, ops.size()), ops.end());
+
+			runs++;
+			if (run(rest, true) != result)
+				continue;
+
+			ops = rest;
+			n = std::max(n - 1, (size_t)2);
+			reduced = true;
+			break;
+		}
+
+		if (!reduced) {
+			if (n >= ops.size())
+				break;
+			n = std::min(2 * n, ops.size());
+		}
+	}
+
+	printf("Minimized to %zu ops in %zu runs%s\n", ops.size(), runs,
+		runs >= max_runs ? " (run cap reached)" : "");
+
+	return ops;
+}
+
+static void save_ops(const char *path, const std::vector<FuzzOp> &ops,
+		const char *origin) {
+
+	FILE *fp = fopen(path, "w");
+
+	if (fp == NULL) {
+		fprintf(stderr, "Can't open replay file %s\n", path);
+		return;
+	}
+
+	fprintf(fp, "# ftlfuzz replay of %s, config %s, %zu LBAs\n", origin,
+		conf_path, num_lbas);
+	for (const FuzzOp &op : ops) {
+		if (op.type == 'W')
+			fprintf(fp, "W %zu %u\n", op.lba, op.value);
+		else if (op.type == 'P')
+			fprintf(fp, "P\n");
+		else
+			fprintf(fp, "%c %zu\n", op.type, op.lba);
+	}
+
+	fclose(fp);
+	printf("Replay file %s\n", path);
+}
+
+static std::vector<FuzzOp> load_ops(const char *path) {
+	std::vector<FuzzOp> ops;
+	char line[256];
+	size_t line_no = 0;
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL) {
+		fprintf(stderr, "Can't open replay file %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		FuzzOp op;
+		int fields;
+
+		line_no++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		op.value = 0;
+		op.lba = 0;
+		fields = sscanf(line, "%c %zu %u", &op.type, &op.lba, &op.value);
+		if (fields == 1 && op.type == 'P')
+			fields = 2;
+		if (fields < 2 || (op.type != 'W' && op.type != 'R' &&
+				op.type != 'T' && op.type != 'P') ||
+				(op.type == 'W' &&
+				(fields != 3 || op.value == 0)) ||
+				op.lba >= num_lbas) {
+			fprintf(stderr, "%s:%zu: bad operation\n", path,
+				line_no);
+			exit(EXIT_FAILURE);
+		}
+		ops.push_back(op);
+	}
+
+	fclose(fp);
+	return ops;
+}
+
+/*
+ * fuzz() - Run a sequence, minimize and save it if it fails
+ *
+ * Returns true if it passed
+ */
+static bool fuzz(const std::vector<FuzzOp> &ops, const char *origin,
+		const char *replay_path, size_t max_runs) {
+
+	int result;
+
+	printf("%s: %zu ops\n", origin, ops.size());
+
+	result = run(ops, false);
+
+	if (result == FUZZ_PASS) {
+		print_stats(stdout, "  ", report->ops_done);
+		if (report->worn_out)
+			printf("  FTL refused a write at op %zu, rest of the "
+				"sequence skipped\n", report->ops_done);
+		return true;
+	}
+
+	printf("  FAILED: ");
+	print_failure(stdout, *report);
+
+	if (max_runs == 0)
+		return false;
+
+	std::vector<FuzzOp> min_ops = minimize(ops, result, max_runs);
+
+	/* Run it once more, for the details of the minimized failure */
+	run(min_ops, true);
+	printf("  Minimized failure: ");
+	print_failure(stdout, *report);
+	save_ops(replay_path, min_ops, origin);
+
+	return false;
+}
+
+static void usage(const char *prog) {
+	printf("usage: %s [-n ops] [-s seed] [-N runs] [-r read_fraction] "
+		"[-t trim_fraction]\n\t[-c check_interval] "
+		"[-i report_interval] [-m max_minimize_runs]\n\t[-T timeout] "
+		"[-p power_cycle_fraction] [-k checkpoint_period]\n\t"
+		"[-R replay_file] [-v] <config_file>\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+
+	uint64_t num_ops = 0;
+	uint64_t seed = 15746;
+	uint64_t num_runs = 1;
+	double read_fraction = 0.3;
+	double trim_fraction = 0.05;
+	double power_fraction = 0;
+	size_t max_runs = 2000;
+	const char *replay = NULL;
+	int failures = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:N:r:t:c:i:m:T:p:k:R:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			num_ops = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'N':
+			num_runs = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			read_fraction = atof(optarg);
+			break;
+		case 't':
+			trim_fraction = atof(optarg);
+			break;
+		case 'c':
+			check_interval = strtoull(optarg, NULL, 0);
+			break;
+		case 'i':
+			report_interval = strtoull(optarg, NULL, 0);
+			break;
+		case 'm':
+			max_runs = strtoull(optarg, NULL, 0);
+			break;
+		case 'T':
+			timeout_s = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			power_fraction = atof(optarg);
+			break;
+		case 'k':
+			checkpoint_period = strtoull(optarg, NULL, 0);
+			break;
+		case 'R':
+			replay = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 1 || read_fraction < 0 || trim_fraction < 0 ||
+		read_fraction + trim_fraction >= 1 || power_fraction < 0 ||
+		checkpoint_period == 0)
+		usage(argv[0]);
+
+	conf_path = argv[optind];
+
+	/* Same exported LBA count as the tests, derived from the geometry */
+	FlashSimConf conf(conf_path);
+	num_lbas = conf.GetNumLBAs();
+
+	if (num_ops == 0)
+		num_ops = 4 * num_lbas;
+
+	report = (struct fuzz_report *)mmap(NULL, sizeof(*report),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0);
+	if (report == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	if (replay != NULL) {
+		std::string path = std::string(replay) + ".min";
+
+		if (!fuzz(load_ops(replay), replay, path.c_str(), max_runs))
+			failures++;
+	} else {
+		for (uint64_t i = 0; i < num_runs; i++) {
+			char origin[64], path[PATH_MAX];
+
+			snprintf(origin, sizeof(origin), "seed %lu", seed + i);
+			snprintf(path, sizeof(path), "%s/fuzz_%lu.ops", OUTDIR,
+				seed + i);
+
+			if (!fuzz(generate(seed + i, num_ops, read_fraction,
+					trim_fraction, power_fraction), origin,
+					path, max_runs))
+				failures++;
+		}
+	}
+
+	printf("%d failing sequence(s)\n", failures);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,224 @@
+#!/bin/bash
+
+# Performance regression harness: runs a fixed iozone matrix over myFuse,
+# stores the results as csv and compares them with a stored baseline
+# Run as ./run_perf.sh [-b] [-n <baseline name>] [-t <threshold %>]
+#   -b  record the results as the new baseline instead of comparing
+#   -n  baseline name, default myFTL_<config file name>. Keep one per FTL
+#       and config
+#   -t  allowed slowdown in percent before a cell is flagged, default 10
+#
+# Run from the directory of this script after "make fuse iozone". Files of
+# all thread counts are on flash (myFuse -M 1). Extra myFuse options can be
+# given in FUSE_ARGS, e.g. FUSE_ARGS="-C 0" to run without the page cache.
+#
+# Results go to output/perf_<name>.csv, one line per cell and metric:
+# test,threads,record_kb,file_kb,metric,value
+# Metric kBps is throughput (higher is better), usop microseconds per
+# operation (lower is better). Baselines are kept in perf/<name>.csv.
+# Exit status is 1 if any cell regressed.
+
+set -e
+set -u
+
+FUSEDIR=`pwd`/fuse
+OUTDIR=`pwd`/output
+PERFDIR=`pwd`/perf
+IOZONE=`pwd`/iozone/src/current/iozone
+CONF=$FUSEDIR/ref/config.conf
+MOUNT=$FUSEDIR/mount
+
+# The matrix. File sizes in kB, record sizes in kB. Throughput runs split
+# the file size over the threads
+FILE_SIZES="512 1024"
+RECORD_SIZES="4 16 64"
+THREADS="1 2 4"
+
+record=0
+name=myFTL_`basename $CONF .conf`
+threshold=10
+
+while getopts "bn:t:" opt
+do
+	case $opt in
+	b)
+		record=1
+		;;
+	n)
+		name=$OPTARG
+		;;
+	t)
+		threshold=$OPTARG
+		;;
+	*)
+		echo "Usage: $0 [-b] [-n <baseline name>] [-t <threshold %>]"
+		exit 1
+		;;
+	esac
+done
+
+if [ ! -x $OUTDIR/myFuse ] || [ ! -x $IOZONE ]
+then
+	echo "Build first: make fuse iozone"
+	exit 1
+fi
+
+results=$OUTDIR/perf_${name}.csv
+baseline=$PERFDIR/${name}.csv
+raw=$OUTDIR/perf_${name}.log
+
+cleanup() {
+	fusermount -u $MOUNT 2> /dev/null || true
+	killall myFuse 2> /dev/null || true
+}
+
+# Starts a fresh myFuse, so every cell starts from the same flash state
+mount_fuse() {
+	cleanup
+	mkdir -p $MOUNT
+	rm -rf $MOUNT/*
+
+	$OUTDIR/myFuse -c $CONF -f $FUSEDIR/ref/text.txt -m $MOUNT	\
+		-s $FUSEDIR/ref -l $OUTDIR/fuse.log -t 1 -M 1		\
+		${FUSE_ARGS:-} -d 0 > $OUTDIR/fuse_debug.log &
+
+	for ((i=0; i<50; i++))
+	do
+		if mountpoint -q $MOUNT
+		then
+			return 0
+		fi
+		sleep 0.1
+	done
+
+	echo "myFuse did not mount"
+	exit 1
+}
+
+trap cleanup EXIT
+
+echo "test,threads,record_kb,file_kb,metric,value" > $results
+: > $raw
+
+for size in $FILE_SIZES
+do
+	for rec in $RECORD_SIZES
+	do
+		for threads in $THREADS
+		do
+			echo "Running iozone: $threads threads, ${size}kB file," \
+			     "${rec}kB records"
+
+			if [ $threads -eq 1 ]
+			then
+				# Throughput, then latency of the same tests
+				for metric in kBps usop
+				do
+					flag=""
+					if [ $metric = usop ]
+					then
+						flag="-N"
+					fi
+
+					mount_fuse
+					$IOZONE -i 0 -i 1 -i 2 -r $rec -s $size	\
+						$flag -f $MOUNT/perf.tmp > $raw.cell
+					cat $raw.cell >> $raw
+
+					# Row "kB reclen write rewrite read
+					# reread random-read random-write"
+					awk -v s=$size -v r=$rec -v m=$metric '
+					$1 == s && $2 == r && NF >= 8 {
+						split("write rewrite read reread " \
+						      "random_read random_write", t)
+						for (i = 1; i <= 6; i++)
+							printf("%s,1,%s,%s,%s,%s\n",
+							       t[i], r, s, m, $(i + 2))
+					}' $raw.cell >> $results
+				done
+			else
+				files=""
+				for ((i=0; i<$threads; i++))
+				do
+					files="$files $MOUNT/perf.$i"
+				done
+
+				mount_fuse
+				$IOZONE -i 0 -i 1 -t $threads -r $rec		\
+					-s $((size / threads)) -F $files > $raw.cell
+				cat $raw.cell >> $raw
+
+				# "Children see throughput for  2 initial
+				# writers  =  1234.56 kB/sec"
+				awk -v n=$threads -v s=$size -v r=$rec '
+				/Children see throughput for/ {
+					split($0, kv, "=")
+					test = kv[1]
+					sub(/.*for +[0-9]+ +/, "", test)
+					gsub(/[ \t]+$/, "", test)
+					gsub(/[ -]/, "_", test)
+					split(kv[2], val, " ")
+					printf("%s,%s,%s,%s,kBps,%s\n", test, n, r,
+					       s, val[1])
+				}' $raw.cell >> $results
+			fi
+		done
+	done
+done
+
+rm -f $raw.cell
+echo "Results in $results, iozone output in $raw"
+
+if [ $record -eq 1 ]
+then
+	mkdir -p $PERFDIR
+	cp $results $baseline
+	echo "Recorded baseline $baseline"
+	exit 0
+fi
+
+if [ ! -f $baseline ]
+then
+	echo "No baseline $baseline, record one with $0 -b"
+	exit 1
+fi
+
+# Join on all columns but the value, flag cells worse than the threshold
+awk -F, -v thr=$threshold '
+NR == FNR {
+	if (FNR > 1)
+		base[$1 "," $2 "," $3 "," $4 "," $5] = $6
+	next
+}
+FNR == 1 {
+	printf("%-24s %4s %6s %6s %5s %12s %12s %8s\n", "test", "thr", "rec_kb",
+	       "file_kb", "unit", "baseline", "current", "change")
+	next
+}
+{
+	key = $1 "," $2 "," $3 "," $4 "," $5
+	seen[key] = 1
+	if (!(key in base) || base[key] == 0)
+		next
+
+	change = ($6 - base[key]) * 100 / base[key]
+
+	# Lower is better for latency
+	worse = ($5 == "usop") ? change > thr : -change > thr
+
+	printf("%-24s %4s %6s %6s %5s %12s %12s %7.1f%%%s\n", $1, $2, $3, $4,
+	       $5, base[key], $6, change, worse ? "  REGRESSION" : "")
+	regressions += worse
+}
+END {
+	# A cell that did not run at all counts as a regression too
+	for (key in base) {
+		if (!(key in seen)) {
+			printf("%s missing\n", key)
+			regressions++
+		}
+	}
+
+	printf("%d regression(s) beyond %s%%\n", regressions, thr)
+	exit(regressions > 0)
+}' $baseline $results
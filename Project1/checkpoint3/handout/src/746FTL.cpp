@@ -24,11 +24,15 @@
 #include "myFTL.h"
 #include "746FTL.h"
 #include "memcheck.h"
+#include "memacct.h"
 
 #if (CONFIG_TWOPROC == 1)
 
 FTLBase<TEST_PAGE_TYPE> *ftl;
 
+/* Configuration the FTL is created with, again on every power cycle */
+static FTLConf *ftl_conf;
+
 #if MEMCHECK_ENABLED
 
 static void *stack_start;
@@ -90,6 +94,77 @@ static size_t RecvParentBytes(void *buf, size_t size)
 	return ret;
 }
 
+/*
+ * SendParentState - Sends the FTL's state regions over pipe, right after a
+ * 		     message
+ */
+static void SendParentState(FTLStateRegion *regions, size_t num)
+{
+	for (size_t i = 0; i < num; i++) {
+		char *p = (char *)regions[i].base;
+		size_t left = regions[i].size;
+
+		while (left > 0) {
+			ssize_t ret = write(Common.pipefd[PIPE_TX_END], p,
+						left);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0) {
+				perror("FATAL: Couldn't send child state");
+				assert(0 && "Failure in writing FTL state");
+			}
+			p += ret;
+			left -= ret;
+		}
+	}
+}
+
+/*
+ * RecvParentAll - Receives exactly size bytes from parent
+ */
+static void RecvParentAll(void *buf, size_t size)
+{
+	char *p = (char *)buf;
+
+	while (size > 0) {
+		size_t ret = RecvParentBytes(p, size);
+		if (ret == 0)
+			assert(0 && "Parent process shouldn't have died");
+		p += ret;
+		size -= ret;
+	}
+}
+
+/*
+ * RecvParentState - Receives size bytes of state sent after a message
+ *
+ * The bytes are copied into the FTL's regions if they add up to size,
+ * else dropped to keep the pipe in sync. Returns true if they were copied.
+ */
+static bool RecvParentState(FTLStateRegion *regions, size_t num, size_t size)
+{
+	size_t total = 0;
+	char scratch[4096];
+
+	for (size_t i = 0; i < num; i++)
+		total += regions[i].size;
+
+	if (num != 0 && total == size) {
+		for (size_t i = 0; i < num; i++)
+			RecvParentAll(regions[i].base, regions[i].size);
+		return true;
+	}
+
+	while (size > 0) {
+		size_t len = size < sizeof(scratch) ? size : sizeof(scratch);
+
+		RecvParentAll(scratch, len);
+		size -= len;
+	}
+
+	return false;
+}
+
 /*
  * IsRecvMsgPending - Indicates if any read messages are pending
  *
@@ -225,6 +300,8 @@ static void ProcessRequestFromFlashSim(FTLBase<TEST_PAGE_TYPE> *ftl,
 	size_t lba;
 	std::pair<ExecState, Address> read_write_resp;
 	ExecState trim_resp;
+	FTLStateRegion regions[FTL_MAX_STATE_REGIONS];
+	size_t num_regions;
 
 	memset(&send_msg, 0, sizeof(send_msg));
 
@@ -277,6 +354,46 @@ static void ProcessRequestFromFlashSim(FTLBase<TEST_PAGE_TYPE> *ftl,
 #endif /* MEMCEHCK_ENABLED */
 		break;
 
+	case MSG_FTL_BLOCK_ROLE_REQ:
+
+		send_msg.type = MSG_FTL_BLOCK_ROLE_RESP;
+		send_msg.ftl_resp_block_role =
+			ftl->GetBlockRole(recv_msg.ftl_req_addr);
+		break;
+
+	case MSG_FTL_STATE_SAVE_REQ:
+
+		/* Regions are streamed right after the response */
+		num_regions = ftl->GetStateRegions(regions,
+						FTL_MAX_STATE_REGIONS);
+		send_msg.type = MSG_FTL_STATE_SAVE_RESP;
+		send_msg.state_size = 0;
+		for (size_t i = 0; i < num_regions; i++)
+			send_msg.state_size += regions[i].size;
+
+		SendMsgToFlashSim(&send_msg);
+		SendParentState(regions, num_regions);
+		return;
+
+	case MSG_FTL_STATE_LOAD_REQ:
+
+		num_regions = ftl->GetStateRegions(regions,
+						FTL_MAX_STATE_REGIONS);
+		send_msg.type = MSG_FTL_STATE_LOAD_RESP;
+		send_msg.ftl_resp_execstate = RecvParentState(regions,
+				num_regions, recv_msg.state_size) ?
+				ExecState::SUCCESS : ExecState::FAILURE;
+		break;
+
+	case MSG_FTL_RESET_REQ:
+
+		/* All volatile state of the FTL is lost */
+		delete ftl;
+		ftl = CreateMyFTL(ftl_conf);
+		::ftl = ftl;
+		send_msg.type = MSG_FTL_RESET_RESP;
+		break;
+
 	default:
 		assert(0 && "Unknown message from Flashsim");
 	} /* Switch */
@@ -381,131 +498,11 @@ void  SendReqToFlashSim(IPC_Format *tx_msg,
 #if MALLOC_TRACE_ENABLED
 
 int malloc_trace_fd;
-void *(*old_malloc_hook)(size_t size, const void *caller);
-void (*old_free_hook)(void *ptr, const void *caller);
-void *(*old_realloc_hook)(void *ptr, size_t size, const void *caller);
-void *(*old_memalign_hook)(size_t alignment, size_t size, const void *caller);
-
-static void *my_malloc_hook(size_t size, const void *caller);
-static void my_free_hook(void *ptr, const void *caller);
-static void *my_realloc_hook(void *ptr, size_t size, const void *caller);
-static void *my_memalign_hook(size_t alignment, size_t size, const void *caller);
-
-static void restore_old_hooks()
-{
-	__malloc_hook = old_malloc_hook;
-	__free_hook = old_free_hook;
-	__realloc_hook = old_realloc_hook;
-	__memalign_hook = old_memalign_hook;
-}
-static void set_new_hooks()
-{
-	__malloc_hook = my_malloc_hook;
-	__free_hook = my_free_hook;
-	__realloc_hook = my_realloc_hook;
-	__memalign_hook = my_memalign_hook;
-}
-
-static void *my_malloc_hook(size_t size, const void *caller)
-{
-	struct mallinfo mi;
-	void *result;
-	char buf[100];
-	ssize_t buf_size, wsize;
-
-	(void)caller;
-
-	/* Restore all old hooks */
-	restore_old_hooks();
-
-  	result = malloc(size);
-	mi = mallinfo();
-
-	buf_size = sprintf(buf, "%d\n", mi.uordblks);
-	wsize = write(malloc_trace_fd, buf, buf_size);
-	assert(wsize >= 0);
-
-	/* Restore our own hooks */
-	set_new_hooks();
-
-	return result;
-}
-
-static void my_free_hook(void *ptr, const void *caller)
-{
-	struct mallinfo mi;
-	char buf[100];
-	ssize_t buf_size, wsize;
-
-	(void)caller;
-
-	/* Restore all old hooks */
-	restore_old_hooks();
-
-  	free(ptr);
-	mi = mallinfo();
-
-	buf_size = sprintf(buf, "%d\n", mi.uordblks);
-	wsize = write(malloc_trace_fd, buf, buf_size);
-	assert(wsize >= 0);
-
-	/* Restore our own hooks */
-	set_new_hooks();
-}
-
-static void *my_realloc_hook(void *ptr, size_t size, const void *caller)
-{
-	struct mallinfo mi;
-	char buf[100];
-	ssize_t buf_size, wsize;
-	void *result;
-
-	(void)caller;
-
-	/* Restore all old hooks */
-	restore_old_hooks();
-
-  	result = realloc(ptr, size);
-	mi = mallinfo();
-
-	buf_size = sprintf(buf, "%d\n", mi.uordblks);
-	wsize = write(malloc_trace_fd, buf, buf_size);
-	assert(wsize >= 0);
-
-	/* Restore our own hooks */
-	set_new_hooks();
-
-	return result;
-}
-
-static void *my_memalign_hook(size_t alignment, size_t size, const void *caller)
-{
-	struct mallinfo mi;
-	char buf[100];
-	ssize_t buf_size, wsize;
-	void *result;
-
-	(void)caller;
-
-	/* Restore all old hooks */
-	restore_old_hooks();
-
-  	result = memalign(alignment, size);
-	mi = mallinfo();
-
-	buf_size = sprintf(buf, "%d\n", mi.uordblks);
-	wsize = write(malloc_trace_fd, buf, buf_size);
-	assert(wsize >= 0);
-
-	/* Restore our own hooks */
-	set_new_hooks();
-
-	return result;
-}
-
-
-/* Calloc calls malloc internally so is not needed to be trapped */
 
+/*
+ * The trace is written by the allocator interposer (memacct.cpp), which
+ * replaced the deprecated __malloc_hook family
+ */
 static int init_malloc_trace()
 {
 	malloc_trace_fd = open(MALLOC_TRACE_FILE,
@@ -513,12 +510,7 @@ static int init_malloc_trace()
 	if (malloc_trace_fd < 0)
 		return malloc_trace_fd;
 
-	old_malloc_hook = __malloc_hook;
-	old_free_hook = __free_hook;
-	old_realloc_hook = __realloc_hook;
-	old_memalign_hook = __memalign_hook;
-
-	set_new_hooks();
+	memacct_trace(malloc_trace_fd);
 
 	return 0;
 }
@@ -598,6 +590,7 @@ void term_handler(int signal)
 #endif /* PRINT_STATS_ENABLE */
 
 #if MALLOC_TRACE_ENABLED
+	memacct_trace(-1);
 	close(malloc_trace_fd);
 #endif
 	/* Simply exit - No need to cleanup */
@@ -860,6 +853,20 @@ int main(int argc, char **argv)
 	/* We are the child */
 	Common.child_pid = 0;
 
+#if MEMCHECK_ENABLED && (HEAP_CHECK == HEAP_CHECK_ALLOC)
+	/* Move heap counters to the page shared with parent */
+	int memacct_fd;
+
+	if (argc < CHILD_MEMACCT_FD_ARGV_OFF + 1)
+		assert(0 && "Too few arguments");
+
+	sscanf(argv[CHILD_MEMACCT_FD_ARGV_OFF], "%d", &memacct_fd);
+
+	ret = memacct_attach(memacct_fd);
+	if (ret < 0)
+		return ret;
+#endif
+
 #if MEMCHECK_ENABLED
 	/* Init memcheck */
 	ret = init_memcheck_child();
@@ -876,6 +883,7 @@ int main(int argc, char **argv)
 
 	/* Creat FTL side of conf */
 	FTLConf conf;
+	ftl_conf = &conf;
 
 	/*
 	 * Create ExecCallBack object for allowing myFTL to request FlashSim
@@ -7,18 +7,13 @@
 #include "config.h"
 #include "common.h"
 #include "memcheck.h"
+#include "memacct.h"
 #include "746FlashSim.h"
 #include <signal.h>
 #include <sys/resource.h>
 
 bool is_inf = 1;
 
-#if ENABLE_TRANS_TRACING
-/* File for keeping a track on ftl transcations */
-FILE *trans_trace_fp;
-#endif
-
-
 #if (CONFIG_TWOPROC == 1)
 
 /*
@@ -45,6 +40,10 @@ void init_flashsim(void)
 	 */
 	int parent_write_pipefd[2], parent_read_pipefd[2];
 
+#if MEMCHECK_ENABLED && (HEAP_CHECK == HEAP_CHECK_ALLOC)
+	int memacct_fd;
+#endif
+
 	/* TODO: Make a macro for throwing these errors/exceptions */
 
 	/* Open pipes */
@@ -60,6 +59,15 @@ void init_flashsim(void)
 		assert(0 && "Failure in opening second pipe");
 	}
 
+#if MEMCHECK_ENABLED && (HEAP_CHECK == HEAP_CHECK_ALLOC)
+	/* Page where child's allocator keeps heap counters for us */
+	memacct_fd = memacct_create();
+	if (memacct_fd < 0) {
+		perror("FATAL: Couldn't create memacct page");
+		assert(0 && "Failure in creating memacct page");
+	}
+#endif
+
 
 	/* Fork child */
 	Common.child_pid = fork();
@@ -70,11 +78,14 @@ void init_flashsim(void)
 
 	} else if (Common.child_pid == 0) {
 
-		char *newargv[] = {CHILD_EXE_PATH, NULL, NULL, NULL};
+		char *newargv[] = {CHILD_EXE_PATH, NULL, NULL, NULL, NULL};
        		char *newenviron[] = {NULL};
 
 		char rx_pipe_fd[MAX_PIPEFD_STR_LEN];
 		char tx_pipe_fd[MAX_PIPEFD_STR_LEN];
+#if MEMCHECK_ENABLED && (HEAP_CHECK == HEAP_CHECK_ALLOC)
+		char memacct_fd_s[MAX_PIPEFD_STR_LEN];
+#endif
 
 #if MEMCHECK_ENABLED
 #if (STACK_CHECK == STACK_CHECK_EXPANSION)
@@ -115,6 +126,12 @@ void init_flashsim(void)
 		newargv[CHILD_PIPE_RX_FD_ARGV_OFF] = rx_pipe_fd;
 		newargv[CHILD_PIPE_TX_FD_ARGV_OFF] = tx_pipe_fd;
 
+#if MEMCHECK_ENABLED && (HEAP_CHECK == HEAP_CHECK_ALLOC)
+		snprintf(memacct_fd_s, sizeof(memacct_fd_s), "%02d",
+			memacct_fd);
+		newargv[CHILD_MEMACCT_FD_ARGV_OFF] = memacct_fd_s;
+#endif
+
 #if MEMCHECK_ENABLED
 
 #if (STACK_CHECK == STACK_CHECK_EXPANSION)
@@ -165,6 +182,11 @@ void init_flashsim(void)
 			assert(0 && "Failure in closing pipe");
 		}
 
+#if MEMCHECK_ENABLED && (HEAP_CHECK == HEAP_CHECK_ALLOC)
+		/* Parent keeps its mapping, fd is only for the child */
+		close(memacct_fd);
+#endif
+
 		/* Store the pipes in use by parent appropriately */
 		Common.pipefd[PIPE_RX_END] = parent_read_pipefd[PIPE_RX_END];
 		Common.pipefd[PIPE_TX_END] = parent_write_pipefd[PIPE_TX_END];
@@ -237,6 +259,12 @@ FTLBase<TEST_PAGE_TYPE> *FlashSimTest::CreateFlashSimFTL(FlashSimTest *fs_test)
 	return new FlashSimFTL<TEST_PAGE_TYPE>(fs_test);
 }
 
+/* The child keeps running, only its FTL is created again */
+void FlashSimTest::ResetFTL(void)
+{
+	static_cast<FlashSimFTL<TEST_PAGE_TYPE> *>(ftl)->Reset();
+}
+
 #else /* CONFIG_TWOPROC */
 void init_flashsim(void)
 {
@@ -245,4 +273,11 @@ void init_flashsim(void)
 void deinit_flashsim(void)
 {
 }
+
+void FlashSimTest::ResetFTL(void)
+{
+	delete ftl;
+	ftl = CreateMyFTL(&conf);
+	ctrl.SetFTL(ftl);
+}
 #endif /* CONFIG_TWOPROC */
@@ -15,9 +15,19 @@
 #define __746FLASHSIM_H__
 
 #include <poll.h>
+#include <time.h>
+#include <algorithm>
 #include "common.h"
 #include "memcheck.h"
 #include "config.h"
+#include "recovery.h"
+#include "ssdimage.h"
+#if ENABLE_TRANS_TRACING
+#include "transtrace.h"
+#endif
+#if ENABLE_WEAR_SNAPSHOT
+#include "wearsnap.h"
+#endif
 #if (CONFIG_TWOPROC == 0)
 #include "myFTL.h"
 #endif
@@ -66,10 +76,6 @@ IPC_Format send_req_to_ftl(class FlashSimTest *fs_test,
 
 template <typename PageType> class FlashSimFTL;
 
-#if ENABLE_TRANS_TRACING
-extern FILE *trans_trace_fp;
-#endif
-
 /* Function declarations */
 void init_flashsim();
 void deinit_flashsim();
@@ -577,12 +583,19 @@ class DataStore {
 	/* This records slots that are currently active */
 	std::unordered_set<size_t> active_slot_set;
 
+	/*
+	 * Out-of-band area of each slot, written together with its data.
+	 * Grows up to the highest slot written so far
+	 */
+	std::vector<struct page_oob> oob_area;
+
 	public:
 
 	DataStore(size_t p_slot_count) :
 		fp{tmpfile()}, /* Open temp file */
       		slot_count{p_slot_count}, /* Count of slots */
-      		active_slot_set{} {
+      		active_slot_set{},
+		oob_area{} {
 
       		/* Check whether we have created the temp file successfully */
 		if(fp == nullptr) {
@@ -593,10 +606,16 @@ class DataStore {
 		 * Next determine whether sparse file is supported
 		 * If not supported then we throw an exception
 		 * We need sparse files as data to spread out
+		 *
+		 * The answer can't change within a process, so the probe
+		 * only runs for the first data store
 		 */
-		bool sparse_file_support = DetermineSparseFileSupport();
+		static int sparse_file_support = -1;
 
-		if (sparse_file_support == false) {
+		if (sparse_file_support < 0)
+			sparse_file_support = DetermineSparseFileSupport();
+
+		if (sparse_file_support == 0) {
 			ThrowSparseFileNotSupportedError();
 		}
 
@@ -673,7 +692,8 @@ class DataStore {
 	 * a slot could not be overwritten without being erased first
 	 */
 
-	void WriteSlot(const T &data, size_t slot_id) {
+	void WriteSlot(const T &data, size_t slot_id,
+			const struct page_oob &oob = page_oob()) {
 
 		/* First check whether the slot is currently active or not */
 		auto it = active_slot_set.find(slot_id);
@@ -689,9 +709,27 @@ class DataStore {
 		int ret = fwrite(&data, sizeof(T), 1, fp);
       		assert(ret == 1);
 
+		if (slot_id >= oob_area.size())
+			oob_area.resize(slot_id + 1, page_oob());
+		oob_area[slot_id] = oob;
+
 		return;
 	}
 
+	/*
+	 * ReadOOB() - Reads the out-of-band area of a slot
+	 *
+	 * Returns false if the slot is not active, i.e. holds no data
+	 */
+	bool ReadOOB(size_t slot_id, struct page_oob *oob) const {
+
+		if (active_slot_set.find(slot_id) == active_slot_set.end())
+			return false;
+
+		*oob = oob_area[slot_id];
+		return true;
+	}
+
 	/*
 	 * EraseSlot() - Mark the slot as not used
 	 *
@@ -745,6 +783,7 @@ class DataStore {
 			 */
         		if (it != active_slot_set.end()) {
 				active_slot_set.erase(it);
+				oob_area[slot_id] = page_oob();
         		}
       		}
 
@@ -1038,11 +1077,11 @@ class Controller {
 	 * command please make sure the page buffer is empty, otherwise
 	 * an exception will be thrown
 	 *
-	 * The second component of the element is the logical LBA
-	 * associated with this piece of data
-	 * This is used to verify that we actually read the correct page
+	 * The second component of the element is the out-of-band area
+	 * written with this piece of data. Its logical LBA is used to verify
+	 * that we actually read the correct page
 	 */
-	std::queue<std::pair<PageType, size_t>> page_buffer;
+	std::queue<std::pair<PageType, struct page_oob>> page_buffer;
 
 	/*
 	 * We intentionally make it a ordered map such that we could
@@ -1104,6 +1143,34 @@ class Controller {
 	uint64_t num_reads;
 	uint64_t num_erases;
 
+	/* Sequence number of the last host write or trim, kept in the OOB */
+	uint64_t host_seq;
+
+	/* Checkpoint and log for power loss recovery, see recovery.h */
+	RecoveryArea recovery;
+
+	/*
+	 * Set while recovery replays host operations through the FTL. The
+	 * flash already holds their result, so commands are not executed
+	 */
+	bool replaying;
+
+#if ENABLE_WEAR_SNAPSHOT
+	/* Host writes so far, a snapshot is taken every WEAR_SNAPSHOT_PERIOD */
+	uint64_t num_host_writes;
+
+	/*
+	 * Physical LBA holding the latest copy of each logical LBA. Together
+	 * with physical_logical_map this tells which pages are still valid
+	 */
+	std::vector<size_t> logical_physical_map;
+
+	/* Number of valid pages in each block */
+	std::vector<uint16_t> valid_page_count;
+
+	WearSnapshotWriter wear_snap;
+#endif
+
 	public:
 
 	/*
@@ -1132,8 +1199,17 @@ class Controller {
 		page_per_ssd{page_per_package * ssd_size},
 		num_writes(0),
       		num_reads(0),
-		num_erases(0)
-   		{}
+		num_erases(0),
+		host_seq(0),
+		recovery(),
+		replaying(false)
+   		{
+#if ENABLE_WEAR_SNAPSHOT
+			num_host_writes = 0;
+			valid_page_count.assign(page_per_ssd / page_per_block,
+						0);
+#endif
+		}
 
 	/*
 	 * Destructor - Free member objects
@@ -1155,6 +1231,21 @@ class Controller {
 	}
 
 
+	/*
+	 * BlockToAddress() - Converts a linear block ID to an Address object
+	 */
+	Address BlockToAddress(size_t block) {
+
+		size_t lba = block * page_per_block;
+
+		return Address(lba / page_per_package,
+				(lba % page_per_package) / page_per_die,
+				(lba % page_per_die) / page_per_plane,
+				(lba % page_per_plane) / page_per_block,
+				0);
+	}
+
+
 	/*
 	 * ExecuteCommand() - Given a list of commands, execute them one by one
 	 *
@@ -1172,6 +1263,9 @@ class Controller {
 
 	void ExecuteCommand(OpCode operation, Address addr) {
 
+		if (replaying)
+			return;
+
 		switch(operation) {
 
 		case OpCode::READ: {
@@ -1180,6 +1274,8 @@ class Controller {
 
 			size_t logical_lba;
 
+			struct page_oob oob;
+
         		/*
 			 * This is the physical LBA where data will be
 			 * read from
@@ -1215,13 +1311,26 @@ class Controller {
 	   		 */
         		ds_p->ReadSlot(&page, physical_lba);
 
+			/*
+			 * A page written again by the FTL keeps the OOB of the
+			 * host write it came from, marked as a copy
+			 */
+			if (!ds_p->ReadOOB(physical_lba, &oob))
+				oob = page_oob();
+			oob.lba = logical_lba;
+			oob.is_copy = 1;
+
 			/*
 			 * And then push the page object back into the queue
 			 * We need both the page data and logical LBA
 			 * to let the following write operation know what is
 			 * the logical LBA associated with a page
 			 */
-          		page_buffer.push(std::make_pair(page, logical_lba));
+          		page_buffer.push(std::make_pair(page, oob));
+
+#if ENABLE_TRANS_TRACING
+			trans_trace_event(TT_READ, logical_lba, addr);
+#endif
 
           		num_reads++;
         		break;
@@ -1239,7 +1348,8 @@ class Controller {
 			 * This is the LBA that the physical LBA will
 			 * be associated to
 			 */
-        		size_t logical_lba = page_buffer.front().second;
+        		const struct page_oob &oob = page_buffer.front().second;
+        		size_t logical_lba = oob.lba;
 
           		/*
 			 * If there is already an entry for the physical address
@@ -1256,13 +1366,17 @@ class Controller {
           		}
 
 			/* And then write front element into the data store*/
-			ds_p->WriteSlot(page, physical_lba);
+			ds_p->WriteSlot(page, physical_lba, oob);
+
+#if ENABLE_WEAR_SNAPSHOT
+			TrackValidPage(logical_lba, physical_lba);
+#endif
 
 			/* Remove the front object from the page buffer */
         		page_buffer.pop();
 
 #if ENABLE_TRANS_TRACING
-			fprintf(trans_trace_fp, "W 1 %zu <%d,%d,%d>\n", logical_lba, addr.plane, addr.block, addr.page);
+			trans_trace_event(TT_WRITE, logical_lba, addr);
 #endif
 
 			num_writes++;
@@ -1292,6 +1406,10 @@ class Controller {
           		size_t start_lba = AddressToLBA(addr);
           		size_t end_lba = start_lba + page_per_block - 1;
 
+			/* Host writes the erase destroys go to the log first */
+			if (recovery.IsEnabled())
+				LogErasedWrites(start_lba, end_lba);
+
 			/*
 			 * TODO: No exception is thrown currently if block
 			 * is clean - Not an issue, but might give student's
@@ -1315,8 +1433,11 @@ class Controller {
 			}
 
 			num_erases++;
+#if ENABLE_WEAR_SNAPSHOT
+			valid_page_count[start_lba / page_per_block] = 0;
+#endif
 #if ENABLE_TRANS_TRACING
-			fprintf(trans_trace_fp, "E <%d,%d>\n", addr.plane, addr.block);
+			trans_trace_event(TT_ERASE, start_lba, addr);
 #endif
         		UpdateBlockErasure(start_lba);
 			break;
@@ -1348,6 +1469,10 @@ class Controller {
 	 */
 	ExecState ReadLBA(PageType *page_p, size_t lba) {
 
+#if ENABLE_TRANS_TRACING
+		trans_trace_event(TT_HOST_READ, lba);
+#endif
+
 		/*
 		 * Call FTL to translate single LBA read into a series of
 		 * commands
@@ -1391,6 +1516,10 @@ class Controller {
 	 */
 	ExecState WriteLBA(const PageType &page, size_t lba) {
 
+#if ENABLE_TRANS_TRACING
+		trans_trace_event(TT_HOST_WRITE, lba);
+#endif
+
 		/*
 		 * Call FTL to translate single LBA read into a
 		 * series of commands
@@ -1404,17 +1533,29 @@ class Controller {
 		/* Make sure nothing is left in page buffer after translation */
 		EnsureStateIsClean();
 
+		host_seq++;
+
 		/* If the return value is FAILURE then simply return */
 		if (ret.first == ExecState::FAILURE) {
+			if (recovery.IsEnabled()) {
+				recovery.Append(RECOVERY_WRITE_FAILED, host_seq,
+						lba, 0);
+				HostOpDone();
+			}
 			return ExecState::FAILURE;
 		}
 
 		/*
 		 * Push the page into the page buffer for writing
 		 * Note that the logical LBA is also required in order to
-		 * associate a physical page with a logical LBA
+		 * associate a physical page with a logical LBA, and the
+		 * sequence number to replay writes in order after power loss
 		 */
-		page_buffer.push(std::make_pair(page, lba));
+		struct page_oob oob = page_oob();
+
+		oob.lba = lba;
+		oob.seq = host_seq;
+		page_buffer.push(std::make_pair(page, oob));
 
 		/*
 		 * And then write the page data using the address returned from
@@ -1422,6 +1563,13 @@ class Controller {
 		 */
 		ExecuteCommand(OpCode::WRITE, ret.second);
 
+#if ENABLE_WEAR_SNAPSHOT
+		if (++num_host_writes % WEAR_SNAPSHOT_PERIOD == 0)
+			TakeWearSnapshot();
+#endif
+
+		HostOpDone();
+
 		return ExecState::SUCCESS;
 	}
 
@@ -1435,6 +1583,10 @@ class Controller {
 	 */
 	ExecState Trim(size_t lba) {
 
+#if ENABLE_TRANS_TRACING
+		trans_trace_event(TT_HOST_TRIM, lba);
+#endif
+
 		/* Call FTL to trim LBA */
 #if (CONFIG_TWOPROC == 1)
 		auto ret = ftl_p->Trim(lba, ExecCallBack<PageType>());
@@ -1444,9 +1596,299 @@ class Controller {
 #endif
 		/* Make sure nothing is left in page buffer after translation */
 		EnsureStateIsClean();
+
+#if ENABLE_WEAR_SNAPSHOT
+		if (ret == ExecState::SUCCESS)
+			TrackValidPage(lba, SIZE_MAX);
+#endif
+
+		/* Trims leave nothing in flash, only the log has them */
+		host_seq++;
+		if (recovery.IsEnabled()) {
+			recovery.Append(RECOVERY_TRIM, host_seq, lba, 0);
+			HostOpDone();
+		}
+
 		return ret;
 	}
 
+	/*
+	 * EnableRecovery() - Checkpoint the mapping every period host
+	 *                    operations, starting now
+	 *
+	 * Returns false if the FTL can't be checkpointed
+	 */
+	bool EnableRecovery(uint64_t period) {
+
+		recovery.Enable(period);
+		if (period == 0)
+			return true;
+
+		if (!Checkpoint()) {
+			recovery.Enable(0);
+			return false;
+		}
+
+		return true;
+	}
+
+	/*
+	 * Checkpoint() - Write the state of the FTL to the reserved area
+	 */
+	bool Checkpoint() {
+
+		if (!ftl_p->SaveState(recovery.GetCheckpoint()))
+			return false;
+
+		recovery.CheckpointTaken(host_seq);
+		return true;
+	}
+
+	/*
+	 * SetFTL() - The FTL was created again, after a power loss
+	 */
+	void SetFTL(FTLBase<PageType> *p_ftl_p) {
+		ftl_p = p_ftl_p;
+	}
+
+	/*
+	 * Recover() - Bring a freshly created FTL back to its state before
+	 *             power loss
+	 *
+	 * Loads the checkpoint, scans the OOB of every page for host writes
+	 * after it, merges them with the log and replays all of them in
+	 * sequence order. Each replayed operation must reach the result it had
+	 * the first time, otherwise FlashSimException is thrown.
+	 *
+	 * Returns false if recovery is not enabled
+	 */
+	bool Recover() {
+
+		struct timespec start, end;
+		struct page_oob oob;
+		uint64_t checkpoint_seq = recovery.GetCheckpointSeq();
+		uint64_t pages_scanned = 0;
+
+		if (!recovery.IsEnabled())
+			return false;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (!ftl_p->LoadState(recovery.GetCheckpoint()))
+			throw FlashSimException("FTL rejected the checkpoint");
+
+		std::vector<struct recovery_record> records =
+			recovery.GetLog();
+
+		for (size_t physical_lba = 0; physical_lba < page_per_ssd;
+			physical_lba++) {
+
+			if (!ds_p->ReadOOB(physical_lba, &oob))
+				continue;
+
+			pages_scanned++;
+			if (oob.is_copy || oob.seq <= checkpoint_seq)
+				continue;
+
+			struct recovery_record rec;
+
+			rec.seq = oob.seq;
+			rec.lba = oob.lba;
+			rec.physical = physical_lba;
+			rec.type = RECOVERY_WRITE;
+			rec.reserved = 0;
+			records.push_back(rec);
+		}
+
+		std::sort(records.begin(), records.end(),
+			[](const struct recovery_record &a,
+			   const struct recovery_record &b) {
+				return a.seq < b.seq;
+			});
+
+		replaying = true;
+		try {
+			for (const struct recovery_record &rec : records)
+				Replay(rec);
+		} catch (...) {
+			replaying = false;
+			throw;
+		}
+		replaying = false;
+
+		if (!records.empty())
+			host_seq = MAX(host_seq, records.back().seq);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		recovery.Recovered(pages_scanned, records.size(),
+			(end.tv_sec - start.tv_sec) * 1000000000ULL +
+			end.tv_nsec - start.tv_nsec);
+
+		return true;
+	}
+
+	const struct recovery_stats &GetRecoveryStats() const {
+		return recovery.GetStats();
+	}
+
+	/*
+	 * SaveImage() - Write the whole device to fp, see ssdimage.h
+	 *
+	 * Throws FlashSimException on failure
+	 */
+	void SaveImage(FILE *fp) {
+
+		struct ssd_image_hdr hdr;
+		std::vector<char> ftl_state;
+		size_t num_blocks = page_per_ssd / page_per_block;
+		std::vector<uint32_t> erases(num_blocks, 0);
+		std::vector<uint8_t> valid((page_per_ssd + 7) / 8, 0);
+		std::vector<struct page_oob> oob(page_per_ssd, page_oob());
+		PageType page{};
+
+		if (!ftl_p->SaveState(ftl_state))
+			throw FlashSimException("FTL can't be checkpointed");
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = SSD_IMAGE_MAGIC;
+		hdr.page_size = sizeof(PageType);
+		hdr.ssd_size = ssd_size;
+		hdr.package_size = package_size;
+		hdr.die_size = die_size;
+		hdr.plane_size = plane_size;
+		hdr.block_size = block_size;
+		hdr.block_erases = block_erase_count;
+		hdr.overprovisioning = config_p->GetOverprovisioning();
+		hdr.num_pages = page_per_ssd;
+		hdr.flash_writes = num_writes;
+		hdr.flash_reads = num_reads;
+		hdr.flash_erases = num_erases;
+		hdr.host_seq = host_seq;
+		hdr.ftl_state_size = ftl_state.size();
+
+		/* Blocks never erased are absent from the map */
+		for (auto it = block_erasure_map.begin();
+			it != block_erasure_map.end(); ++it) {
+			erases[it->first / page_per_block] =
+				block_erase_count - it->second;
+		}
+
+		for (size_t physical_lba = 0; physical_lba < page_per_ssd;
+			physical_lba++) {
+
+			if (!ds_p->ReadOOB(physical_lba, &oob[physical_lba]))
+				continue;
+
+			valid[physical_lba / 8] |= 1 << (physical_lba % 8);
+			hdr.num_valid++;
+		}
+
+		if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+			fwrite(erases.data(), sizeof(erases[0]), num_blocks,
+				fp) != num_blocks ||
+			fwrite(valid.data(), 1, valid.size(), fp) !=
+				valid.size() ||
+			fwrite(oob.data(), sizeof(oob[0]), page_per_ssd,
+				fp) != page_per_ssd ||
+			fwrite(ftl_state.data(), 1, ftl_state.size(), fp) !=
+				ftl_state.size())
+			ThrowImageError("write");
+
+		for (size_t physical_lba = 0; physical_lba < page_per_ssd;
+			physical_lba++) {
+
+			if (!(valid[physical_lba / 8] & (1 << (physical_lba % 8))))
+				continue;
+
+			ds_p->ReadSlot(&page, physical_lba);
+			if (fwrite(&page, sizeof(page), 1, fp) != 1)
+				ThrowImageError("write");
+		}
+	}
+
+	/*
+	 * LoadImage() - Restore a device written by SaveImage()
+	 *
+	 * Must be called before any operation. The geometry and FTL must be
+	 * the ones of the image. Throws FlashSimException on failure
+	 */
+	void LoadImage(FILE *fp) {
+
+		struct ssd_image_hdr hdr;
+		size_t num_blocks = page_per_ssd / page_per_block;
+
+		if (num_writes != 0 || num_erases != 0 ||
+			!physical_logical_map.empty())
+			throw FlashSimException("Image loaded into a used SSD");
+
+		if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+			ThrowImageError("read");
+
+		if (hdr.magic != SSD_IMAGE_MAGIC ||
+			hdr.page_size != sizeof(PageType) ||
+			hdr.ssd_size != ssd_size ||
+			hdr.package_size != package_size ||
+			hdr.die_size != die_size ||
+			hdr.plane_size != plane_size ||
+			hdr.block_size != block_size ||
+			hdr.block_erases != block_erase_count ||
+			hdr.overprovisioning != config_p->GetOverprovisioning() ||
+			hdr.num_pages != page_per_ssd)
+			throw FlashSimException("Image doesn't match the "
+						"configuration");
+
+		std::vector<uint32_t> erases(num_blocks);
+		std::vector<uint8_t> valid((page_per_ssd + 7) / 8);
+		std::vector<struct page_oob> oob(page_per_ssd);
+		std::vector<char> ftl_state(hdr.ftl_state_size);
+		PageType page{};
+
+		if (fread(erases.data(), sizeof(erases[0]), num_blocks, fp) !=
+				num_blocks ||
+			fread(valid.data(), 1, valid.size(), fp) !=
+				valid.size() ||
+			fread(oob.data(), sizeof(oob[0]), page_per_ssd, fp) !=
+				page_per_ssd ||
+			fread(ftl_state.data(), 1, ftl_state.size(), fp) !=
+				ftl_state.size())
+			ThrowImageError("read");
+
+		if (!ftl_p->LoadState(ftl_state))
+			throw FlashSimException("FTL rejected the image");
+
+		for (size_t block = 0; block < num_blocks; block++) {
+			if (erases[block] == 0)
+				continue;
+			if (erases[block] > block_erase_count)
+				ThrowImageError("read");
+			block_erasure_map[block * page_per_block] =
+				block_erase_count - erases[block];
+		}
+
+		for (size_t physical_lba = 0; physical_lba < page_per_ssd;
+			physical_lba++) {
+
+			if (!(valid[physical_lba / 8] & (1 << (physical_lba % 8))))
+				continue;
+
+			if (fread(&page, sizeof(page), 1, fp) != 1)
+				ThrowImageError("read");
+
+			ds_p->WriteSlot(page, physical_lba, oob[physical_lba]);
+			physical_logical_map[physical_lba] =
+				oob[physical_lba].lba;
+		}
+
+		num_writes = hdr.flash_writes;
+		num_reads = hdr.flash_reads;
+		num_erases = hdr.flash_erases;
+		host_seq = hdr.host_seq;
+
+#if ENABLE_WEAR_SNAPSHOT
+		RebuildValidPages(oob);
+#endif
+	}
+
 	/* Returns the stack size used by FTL */
 	size_t GetFTLStackSize(void) {
 		return ftl_p->GetFTLStackSize();
@@ -1488,10 +1930,235 @@ class Controller {
         }
 
 
+#if ENABLE_WEAR_SNAPSHOT
+	/*
+	 * OpenWearSnapshot() - Start writing wear snapshots to path
+	 *
+	 * Returns 0 on success, -1 on failure
+	 */
+	int OpenWearSnapshot(const char *path) {
+
+		struct wear_snapshot_hdr hdr;
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = WEAR_SNAPSHOT_MAGIC;
+		hdr.num_blocks = valid_page_count.size();
+		hdr.pages_per_block = page_per_block;
+		hdr.block_erases = block_erase_count;
+		hdr.period = WEAR_SNAPSHOT_PERIOD;
+
+		return wear_snap.Open(path, hdr);
+	}
+
+	void CloseWearSnapshot() {
+		wear_snap.Close();
+	}
+
+	/*
+	 * TakeWearSnapshot() - Append the current erase count, valid pages
+	 *                      and role of every block to the snapshot file
+	 *
+	 * Roles are asked from the FTL, so this must not be called while the
+	 * FTL is translating a request
+	 */
+	void TakeWearSnapshot() {
+
+		if (!wear_snap.IsOpen())
+			return;
+
+		size_t num_blocks = valid_page_count.size();
+		std::vector<uint16_t> erases(num_blocks, 0);
+		std::vector<uint8_t> roles(num_blocks);
+		struct wear_snapshot_frame frame;
+
+		/* Blocks never erased are absent from the map */
+		for (auto it = block_erasure_map.begin();
+			it != block_erasure_map.end(); ++it) {
+			erases[it->first / page_per_block] =
+				block_erase_count - it->second;
+		}
+
+		for (size_t block = 0; block < num_blocks; block++) {
+			roles[block] = static_cast<uint8_t>(
+				ftl_p->GetBlockRole(BlockToAddress(block)));
+		}
+
+		memset(&frame, 0, sizeof(frame));
+		frame.host_writes = num_host_writes;
+		frame.flash_writes = num_writes;
+		frame.flash_erases = num_erases;
+
+		wear_snap.Write(frame, erases.data(), valid_page_count.data(),
+				roles.data());
+	}
+#endif
+
 	private:
 
 	/* Functions used internally in class */
 
+	/*
+	 * HostOpDone() - Checkpoint when a period of host operations is over
+	 */
+	void HostOpDone() {
+
+		if (recovery.OpDone() && !Checkpoint())
+			throw FlashSimException("FTL can't be checkpointed");
+	}
+
+	/*
+	 * LogErasedWrites() - Summary of a block before it is erased: host
+	 *                     writes after the checkpoint it still holds
+	 *
+	 * Copies the FTL made are left out, the write they come from is either
+	 * still in flash or already in the log
+	 */
+	void LogErasedWrites(size_t start_lba, size_t end_lba) {
+
+		struct page_oob oob;
+
+		for (size_t physical_lba = start_lba; physical_lba <= end_lba;
+			physical_lba++) {
+
+			if (!ds_p->ReadOOB(physical_lba, &oob))
+				continue;
+
+			if (!oob.is_copy &&
+				oob.seq > recovery.GetCheckpointSeq())
+				recovery.Append(RECOVERY_WRITE, oob.seq,
+						oob.lba, physical_lba);
+		}
+	}
+
+	/*
+	 * Replay() - Run one host operation through the FTL again
+	 *
+	 * Commands are not executed, the FTL only rebuilds its state
+	 */
+	void Replay(const struct recovery_record &rec) {
+
+#if (CONFIG_TWOPROC == 1)
+		ExecCallBack<PageType> func;
+#else
+		FlashSimExecCallBack<PageType> func(this);
+#endif
+
+		switch (rec.type) {
+
+		case RECOVERY_WRITE: {
+
+			auto ret = ftl_p->WriteTranslate(rec.lba, func);
+
+			if (ret.first != ExecState::SUCCESS ||
+				AddressToLBA(ret.second) != rec.physical)
+				ThrowReplayError(rec);
+			break;
+		}
+
+		case RECOVERY_WRITE_FAILED:
+
+			if (ftl_p->WriteTranslate(rec.lba, func).first !=
+				ExecState::FAILURE)
+				ThrowReplayError(rec);
+			break;
+
+		case RECOVERY_TRIM:
+
+			ftl_p->Trim(rec.lba, func);
+			break;
+		}
+	}
+
+#if ENABLE_WEAR_SNAPSHOT
+	/*
+	 * RebuildValidPages() - Valid page counts of a loaded image
+	 *
+	 * Only the FTL knows which copy of an LBA is the latest, so it is asked
+	 * to translate a read of every LBA found in flash, without executing
+	 * the read
+	 */
+	void RebuildValidPages(const std::vector<struct page_oob> &oob) {
+
+#if (CONFIG_TWOPROC == 1)
+		ExecCallBack<PageType> func;
+#else
+		FlashSimExecCallBack<PageType> func(this);
+#endif
+		size_t num_lbas = 0;
+
+		for (auto it = physical_logical_map.begin();
+			it != physical_logical_map.end(); ++it)
+			num_lbas = MAX(num_lbas, oob[it->first].lba + 1);
+
+		replaying = true;
+		for (size_t lba = 0; lba < num_lbas; lba++) {
+			auto ret = ftl_p->ReadTranslate(lba, func);
+
+			if (ret.first != ExecState::SUCCESS)
+				continue;
+
+			auto it = physical_logical_map.find(
+					AddressToLBA(ret.second));
+			if (it != physical_logical_map.end() &&
+				it->second == lba)
+				TrackValidPage(lba, it->first);
+		}
+		replaying = false;
+	}
+#endif
+
+	/*
+	 * ThrowImageError() - I/O error on an image file
+	 */
+	void ThrowImageError(const char *op) {
+
+		throw FlashSimException(std::string{"Couldn't "} + op +
+					" the SSD image");
+	}
+
+	/*
+	 * ThrowReplayError() - The FTL did something else than before power
+	 *                      loss
+	 */
+	void ThrowReplayError(const struct recovery_record &rec) {
+
+		throw FlashSimException("Recovery diverged at host operation " +
+					std::to_string(rec.seq) + " on LBA " +
+					std::to_string(rec.lba));
+	}
+
+#if ENABLE_WEAR_SNAPSHOT
+	/*
+	 * TrackValidPage() - Logical LBA now lives at physical LBA, which
+	 *                    makes its previous copy invalid
+	 *
+	 * SIZE_MAX as physical LBA means the logical LBA was trimmed
+	 */
+	void TrackValidPage(size_t logical_lba, size_t physical_lba) {
+
+		if (logical_lba >= logical_physical_map.size())
+			logical_physical_map.resize(logical_lba + 1, SIZE_MAX);
+
+		size_t old_lba = logical_physical_map[logical_lba];
+
+		/*
+		 * The old copy only counts if its block was not erased since,
+		 * i.e. the physical page still maps to this logical LBA
+		 */
+		if (old_lba != SIZE_MAX && old_lba != physical_lba) {
+			auto it = physical_logical_map.find(old_lba);
+			if (it != physical_logical_map.end() &&
+				it->second == logical_lba)
+				valid_page_count[old_lba / page_per_block]--;
+		}
+
+		logical_physical_map[logical_lba] = physical_lba;
+
+		if (physical_lba != SIZE_MAX)
+			valid_page_count[physical_lba / page_per_block]++;
+	}
+#endif
+
 	/*
 	 * UpdateBlockErasure() - Decrease block erasure for a certain block
 	 * by 1
@@ -1687,6 +2354,29 @@ class FlashSimTest {
 	uint64_t trims_requested;
 	uint64_t trims_done;
 
+	/*
+	 * GetRangeSlice() - Part of page lba covered by a byte range
+	 *
+	 * Sets start (offset in the page) and len, returns where that part is
+	 * in buf
+	 */
+	static char *GetRangeSlice(size_t offset, size_t size, size_t lba,
+				char *buf, size_t *start, size_t *len) {
+
+		size_t page_start = lba * sizeof(PageType);
+		size_t from = MAX(offset, page_start);
+		size_t to = MIN(offset + size, page_start + sizeof(PageType));
+
+		*start = from - page_start;
+		*len = to - from;
+
+		return buf + (from - offset);
+	}
+
+	static bool IsPageAligned(const char *p) {
+		return reinterpret_cast<uintptr_t>(p) % alignof(PageType) == 0;
+	}
+
 
 	/* Public to allow tests to call this */
 	public:
@@ -1710,13 +2400,20 @@ class FlashSimTest {
     		trims_done{0}
   		{
 #if ENABLE_TRANS_TRACING
-			trans_trace_fp = fopen(TRANS_TRACE_FILE, "w");
-			if (trans_trace_fp == NULL) {
+			if (trans_trace_open(TRANS_TRACE_FILE) < 0) {
 
 				std::cout << "!!! Error opening trace file "
 				<< TRANS_TRACE_FILE << std::endl;;
 				exit(-1);
 			}
+#endif
+#if ENABLE_WEAR_SNAPSHOT
+			if (ctrl.OpenWearSnapshot(WEAR_SNAPSHOT_FILE) < 0) {
+
+				std::cout << "!!! Error opening wear snapshot "
+				<< WEAR_SNAPSHOT_FILE << std::endl;
+				exit(-1);
+			}
 #endif
 		}
 
@@ -1726,7 +2423,11 @@ class FlashSimTest {
 	~FlashSimTest() {
 
 #if ENABLE_TRANS_TRACING
-			fclose(trans_trace_fp);
+			trans_trace_close();
+#endif
+
+#if ENABLE_WEAR_SNAPSHOT
+			ctrl.CloseWearSnapshot();
 #endif
 
 		/* ftl was created using new and its pointer passed to us */
@@ -1736,6 +2437,9 @@ class FlashSimTest {
 
 	FTLBase<TEST_PAGE_TYPE>* CreateFlashSimFTL(FlashSimTest *fs_test);
 
+	/* Creates the FTL again, losing all its state */
+	void ResetFTL(void);
+
 	/*
 	 * Write() - Testing writing page into the given LBA
 	 *
@@ -1859,9 +2563,169 @@ class FlashSimTest {
 		}
 	}
 
+	/*
+	 * ReadRange() - Read size bytes at byte offset of the LBA space
+	 *
+	 * Fully covered pages are read straight into buf, only the two edge
+	 * pages go through a page on the stack. The request is logged once
+	 * instead of per page.
+	 *
+	 * Regarding the meanging of return values please refer to Write()
+	 */
+	int ReadRange(FILE* log, size_t offset, size_t size, char *buf) {
+
+		const size_t page_size = sizeof(PageType);
+
+		if (size == 0)
+			return 1;
+
+		size_t first_lba = offset / page_size;
+		size_t last_lba = (offset + size - 1) / page_size;
+
+		if (log)
+			fprintf(log, "----------------\nReading LBA %zu-%zu\n",
+					first_lba, last_lba);
+
+		ExecState status = ExecState::SUCCESS;
+		size_t lba;
+
+		try {
+
+			for (lba = first_lba; lba <= last_lba; lba++) {
+
+				size_t start, len;
+				char *dst = GetRangeSlice(offset, size, lba,
+							buf, &start, &len);
+
+				if (len == page_size && IsPageAligned(dst)) {
+					status = ctrl.ReadLBA(
+						reinterpret_cast<PageType *>(dst),
+						lba);
+				} else {
+					PageType page;
+					char *data = reinterpret_cast<char *>(&page);
+
+					/* Don't copy out a page that wasn't read */
+					status = ctrl.ReadLBA(&page, lba);
+					if (status == ExecState::SUCCESS)
+						memcpy(dst, data + start, len);
+				}
+
+				if (status != ExecState::SUCCESS)
+					break;
+			}
+
+		} catch (FlashSimException& err) {
+
+			std::cout << "!!! Error reading LBA " << lba <<
+				" !!!" << std::endl << err.what();
+			return -1;
+		}
+
+		if (status != ExecState::SUCCESS) {
+			if (log)
+				fprintf(log, "LBA %zu not readable\n", lba);
+			return 0;
+		} else {
+			if (log)
+				fprintf(log, "LBA %zu-%zu read\n", first_lba,
+						last_lba);
+
+			return 1;
+		}
+	}
+
+	/*
+	 * WriteRange() - Write size bytes at byte offset of the LBA space
+	 *
+	 * Only the two edge pages, when partially covered, are read, modified
+	 * and written back. A page that can't be read (never written) is
+	 * taken as zeros. Other pages are written straight from buf.
+	 *
+	 * Regarding the meanging of return values please refer to Write()
+	 */
+	int WriteRange(FILE* log, size_t offset, size_t size, const char *buf) {
+
+		const size_t page_size = sizeof(PageType);
+
+		if (size == 0)
+			return 1;
+
+		size_t first_lba = offset / page_size;
+		size_t last_lba = (offset + size - 1) / page_size;
+
+		if (log)
+			fprintf(log, "----------------\nWriting LBA %zu-%zu\n",
+					first_lba, last_lba);
+
+		ExecState status = ExecState::SUCCESS;
+		size_t lba;
+
+		try {
+
+			for (lba = first_lba; lba <= last_lba; lba++) {
+
+				size_t start, len;
+				const char *src = GetRangeSlice(offset, size,
+						lba, const_cast<char *>(buf),
+						&start, &len);
+
+				writes_requested++;
+
+				if (len == page_size && IsPageAligned(src)) {
+					status = ctrl.WriteLBA(
+						*reinterpret_cast<const PageType *>(src),
+						lba);
+				} else {
+					PageType page;
+
+					if (len != page_size &&
+						ctrl.ReadLBA(&page, lba) !=
+							ExecState::SUCCESS)
+						memset(reinterpret_cast<char *>(&page),
+							0, page_size);
+
+					memcpy(reinterpret_cast<char *>(&page) +
+						start, src, len);
+					status = ctrl.WriteLBA(page, lba);
+				}
+
+				if (status != ExecState::SUCCESS)
+					break;
+
+				writes_done++;
+			}
+
+		} catch (FlashSimException &err) {
+
+      			std::cout << "!!! Error writing LBA " << lba <<
+				" !!!" << std::endl << err.what() << std::endl;;
+      			return -1;
+		}
+
+		if (status != ExecState::SUCCESS) {
+
+			if (log)
+				fprintf(log, "LBA %zu not writable\n", lba);
+			return 0;
+		} else {
+
+			if (log)
+				fprintf(log, "LBA %zu-%zu written\n", first_lba,
+						last_lba);
+
+			return 1;
+		}
+	}
+
 
 	int Report(FILE* log) {
 
+#if ENABLE_WEAR_SNAPSHOT
+		/* Final state, while the FTL is still around to tell roles */
+		ctrl.TakeWearSnapshot();
+#endif
+
 		double write_amp = double(TotalWritesPerformed()) / writes_done;
 		fprintf(log,
 		"-----------------------------------------------------\n");
@@ -1963,6 +2827,120 @@ class FlashSimTest {
                 return ctrl.AtLeastOneBlockWornOut();
         }
 
+	/*
+	 * EnableRecovery() - Make the FTL survive PowerCycle(), checkpointing
+	 *                    its mapping every period host operations
+	 *
+	 * Returns false if the FTL can't be checkpointed
+	 */
+	bool EnableRecovery(uint64_t period) {
+		return ctrl.EnableRecovery(period);
+	}
+
+	/*
+	 * PowerCycle() - Power loss and restart of the FTL
+	 *
+	 * The FTL is created again, losing all its state, and recovered from
+	 * the reserved area and the OOB of flash pages. Flash contents and
+	 * wear are untouched.
+	 *
+	 * Returns 1 on success, 0 if recovery is not enabled and -1 if
+	 * recovery failed
+	 */
+	int PowerCycle(FILE *log) {
+
+		if (log)
+			fprintf(log, "----------------\nPower cycle\n");
+
+		try {
+			ResetFTL();
+			if (!ctrl.Recover())
+				return 0;
+
+		} catch (FlashSimException &err) {
+
+			std::cout << "!!! Error recovering after power loss !!!"
+				<< std::endl << err.what() << std::endl;
+			return -1;
+		}
+
+		if (log)
+			fprintf(log, "Recovered, %lu operations replayed\n",
+				ctrl.GetRecoveryStats().records_replayed);
+
+		return 1;
+	}
+
+	const struct recovery_stats &RecoveryStats() const {
+		return ctrl.GetRecoveryStats();
+	}
+
+	/*
+	 * SaveImage() - Save the device, with the state of the FTL, to path
+	 *
+	 * Returns 1 on success and -1 on failure
+	 */
+	int SaveImage(const char *path) {
+
+		FILE *fp = fopen(path, "w");
+
+		if (fp == NULL) {
+			std::cout << "!!! Error creating SSD image " << path
+				<< " !!!" << std::endl;
+			return -1;
+		}
+
+		try {
+			ctrl.SaveImage(fp);
+		} catch (FlashSimException &err) {
+
+			std::cout << "!!! Error saving SSD image " << path
+				<< " !!!" << std::endl << err.what()
+				<< std::endl;
+			fclose(fp);
+			return -1;
+		}
+
+		if (fclose(fp) != 0) {
+			std::cout << "!!! Error saving SSD image " << path
+				<< " !!!" << std::endl;
+			return -1;
+		}
+
+		return 1;
+	}
+
+	/*
+	 * LoadImage() - Resume from an image saved by SaveImage()
+	 *
+	 * Must be called before any operation, with the configuration the
+	 * image was saved with. Returns 1 on success and -1 on failure
+	 */
+	int LoadImage(const char *path) {
+
+		FILE *fp = fopen(path, "r");
+
+		if (fp == NULL) {
+			std::cout << "!!! Error opening SSD image " << path
+				<< " !!!" << std::endl;
+			return -1;
+		}
+
+		try {
+			ctrl.LoadImage(fp);
+		} catch (FlashSimException &err) {
+
+			std::cout << "!!! Error loading SSD image " << path
+				<< " !!!" << std::endl << err.what()
+				<< std::endl;
+			fclose(fp);
+			return -1;
+		}
+
+		fclose(fp);
+		return 1;
+	}
+
 };
 
 /************************** class FlashSimTest ends ***************************/
@@ -1988,6 +2966,13 @@ class FlashSimFTL : public FTLBase<PageType> {
 
 	FlashSimTest *fs_test;
 
+	/*
+	 * The child creates its FTL on the first request, and the FTL's
+	 * constructor talks to us. A request followed by a payload must not
+	 * be the first one, or the payload is taken for our answers
+	 */
+	bool child_ftl_created;
+
 	/*
 	 * Make all interface classes public so that class Controller
     	 * has access to them
@@ -1996,7 +2981,8 @@ class FlashSimFTL : public FTLBase<PageType> {
 	public:
 
 	FlashSimFTL(FlashSimTest *fs_test):
-		fs_test(fs_test) {
+		fs_test(fs_test),
+		child_ftl_created(false) {
 	};
 
     	/*
@@ -2081,6 +3067,73 @@ class FlashSimFTL : public FTLBase<PageType> {
 
 	}
 
+	/* Returns what the FTL uses the block at addr for */
+	BlockRole GetBlockRole(Address addr) {
+
+		IPC_Format tx_msg{}, rx_msg;
+
+		tx_msg.owner = OWNER_FLASHSIM;
+		tx_msg.type = MSG_FTL_BLOCK_ROLE_REQ;
+		tx_msg.ftl_req_addr = addr;
+
+		/* Send the IPC message to FTL and get response */
+		SendReqToFtl(&tx_msg, &rx_msg);
+
+		return rx_msg.ftl_resp_block_role;
+
+	}
+
+	/* Fetches the state of the child's FTL, see FTLBase::SaveState() */
+	bool SaveState(std::vector<char> &buf) {
+
+		IPC_Format tx_msg{}, rx_msg;
+
+		tx_msg.owner = OWNER_FLASHSIM;
+		tx_msg.type = MSG_FTL_STATE_SAVE_REQ;
+
+		/* The state follows the response */
+		SendReqToFtl(&tx_msg, &rx_msg);
+
+		buf.resize(rx_msg.state_size);
+		RecvChildAll(buf.data(), buf.size());
+
+		return rx_msg.state_size != 0;
+	}
+
+	/* Restores the state of the child's FTL, see FTLBase::LoadState() */
+	bool LoadState(const std::vector<char> &buf) {
+
+		IPC_Format tx_msg{}, rx_msg;
+
+		/* Any request without payload makes the child create it */
+		if (!child_ftl_created)
+			GetFTLStackSize();
+
+		tx_msg.owner = OWNER_FLASHSIM;
+		tx_msg.type = MSG_FTL_STATE_LOAD_REQ;
+		tx_msg.state_size = buf.size();
+
+		/* The state follows the request */
+		SendReqToFtl(&tx_msg, &rx_msg, buf.data(), buf.size());
+
+		return rx_msg.ftl_resp_execstate == ExecState::SUCCESS;
+	}
+
+	/*
+	 * Reset() - Power cycle of the child's FTL, which is created again
+	 * and loses all its state
+	 */
+	void Reset(void) {
+
+		IPC_Format tx_msg{}, rx_msg;
+
+		tx_msg.owner = OWNER_FLASHSIM;
+		tx_msg.type = MSG_FTL_RESET_REQ;
+
+		/* Send the IPC message to FTL and get response */
+		SendReqToFtl(&tx_msg, &rx_msg);
+	}
+
 
 	private:
 
@@ -2126,6 +3179,41 @@ class FlashSimFTL : public FTLBase<PageType> {
 		return ret;
 	}
 
+	/*
+	 * SendChildAll - Sends exactly size bytes to the child
+	 */
+	void SendChildAll(const void *buf, size_t size)
+	{
+		const char *p = (const char *)buf;
+
+		while (size > 0) {
+			ssize_t ret = write(Common.pipefd[PIPE_TX_END], p,
+						size);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0) {
+				perror("FATAL: Couldn't send child data");
+				assert(0 && "Failure in writing to child's rx pipe");
+			}
+			p += ret;
+			size -= ret;
+		}
+	}
+
+	/*
+	 * RecvChildAll - Receives exactly size bytes from the child
+	 */
+	void RecvChildAll(void *buf, size_t size)
+	{
+		char *p = (char *)buf;
+
+		while (size > 0) {
+			size_t ret = RecvChildBytes(p, size);
+			p += ret;
+			size -= ret;
+		}
+	}
+
 	/*
 	 * IsRecMsgPending - Indicates if any read messages are pending
 	 *
@@ -2350,6 +3438,18 @@ class FlashSimFTL : public FTLBase<PageType> {
 			case MSG_FTL_STACK_SIZE_RESP:
 				return;
 
+			case MSG_FTL_BLOCK_ROLE_RESP:
+				return;
+
+			case MSG_FTL_STATE_SAVE_RESP:
+				return;
+
+			case MSG_FTL_STATE_LOAD_RESP:
+				return;
+
+			case MSG_FTL_RESET_RESP:
+				return;
+
 			default:
 				assert(0 && "Unknown message from FTL");
 			} /* Switch */
@@ -2364,11 +3464,15 @@ class FlashSimFTL : public FTLBase<PageType> {
 	 *
 	 * tx_msg - The message (request) to send to ftl
 	 * rx_msg - The response of the message
+	 * payload - Bytes sent right after the request (Optional)
+	 * payload_size - Size of payload in bytes
 	 *
 	 * Returns another msg that is the response of the msg from ftl
 	 */
 	void  SendReqToFtl(IPC_Format *tx_msg,
-				IPC_Format *rx_msg) {
+				IPC_Format *rx_msg,
+				const void *payload = NULL,
+				size_t payload_size = 0) {
 
 		/* Expected message type of the response to msg transmitted */
 		enum message_type_t exp_rx_typ;
@@ -2395,12 +3499,35 @@ class FlashSimFTL : public FTLBase<PageType> {
 			exp_rx_typ = MSG_FTL_STACK_SIZE_RESP;
 			break;
 
+		case MSG_FTL_BLOCK_ROLE_REQ:
+
+			exp_rx_typ = MSG_FTL_BLOCK_ROLE_RESP;
+			break;
+
+		case MSG_FTL_STATE_SAVE_REQ:
+
+			exp_rx_typ = MSG_FTL_STATE_SAVE_RESP;
+			break;
+
+		case MSG_FTL_STATE_LOAD_REQ:
+
+			exp_rx_typ = MSG_FTL_STATE_LOAD_RESP;
+			break;
+
+		case MSG_FTL_RESET_REQ:
+
+			exp_rx_typ = MSG_FTL_RESET_RESP;
+			break;
+
 		default:
 			assert(0 && "Unknown msg typ");
 		}
 
 		/* Send the child request */
 		SendMsgToFtl(tx_msg);
+		if (payload_size)
+			SendChildAll(payload, payload_size);
+		child_ftl_created = true;
 
 		while (1) {
 			/* Now process request */
@@ -0,0 +1,186 @@
+/**
+ * @file arena.h
+ * @brief Region allocator for FTL metadata tables
+ *
+ * An FTL computes the bytes of all its tables from the ConfBase geometry
+ * (Arena::Bytes()), creates one Arena of that capacity and carves its tables
+ * out of it with Alloc(). The arena is a single allocation made up front:
+ * tables have no per-node or per-table allocator overhead, never reallocate
+ * and the footprint is known exactly before the first request.
+ *
+ * The region comes from malloc() rather than mmap(): the child tunes malloc
+ * to serve it from the heap, which is what memcheck accounts. An anonymous
+ * mapping would not be charged to the FTL.
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Alignment of every table in the arena */
+#define ARENA_ALIGN		16
+
+/* Tables an arena keeps footprint records of */
+#define ARENA_MAX_TABLES	16
+
+/*
+ * class ArenaTable - Fixed size array placed in an Arena
+ *
+ * Cheap to copy, the arena owns the memory
+ */
+template <typename T>
+class ArenaTable {
+
+	private:
+
+	T *data;
+	size_t count;
+
+	public:
+
+	ArenaTable() : data{NULL}, count{0} {}
+	ArenaTable(T *data, size_t count) : data{data}, count{count} {}
+
+	T &operator[](size_t i) {
+		return data[i];
+	}
+
+	const T &operator[](size_t i) const {
+		return data[i];
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	size_t Bytes() const {
+		return count * sizeof(T);
+	}
+
+	T *begin() {
+		return data;
+	}
+
+	T *end() {
+		return data + count;
+	}
+};
+
+/*
+ * class Arena - Owns the region, hands out tables and reports their sizes
+ */
+class Arena {
+
+	private:
+
+	char *base;
+	size_t capacity;
+	size_t used;
+
+	/* Footprint of each table, for Report() */
+	size_t num_tables;
+	const char *table_name[ARENA_MAX_TABLES];
+	size_t table_bytes[ARENA_MAX_TABLES];
+
+	public:
+
+	/*
+	 * Bytes() - Room a table of count elements of T takes in an arena
+	 */
+	template <typename T>
+	static size_t Bytes(size_t count) {
+		return (count * sizeof(T) + ARENA_ALIGN - 1) &
+			~(size_t)(ARENA_ALIGN - 1);
+	}
+
+	Arena() : base{NULL}, capacity{0}, used{0}, num_tables{0} {}
+
+	explicit Arena(size_t capacity) : Arena() {
+		Init(capacity);
+	}
+
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	~Arena() {
+		free(base);
+	}
+
+	/*
+	 * Init() - Allocate the region. Any failure here is fatal.
+	 */
+	void Init(size_t bytes) {
+		assert(base == NULL && "Arena initialized twice");
+
+		base = (char *)aligned_alloc(ARENA_ALIGN, Bytes<char>(bytes));
+		assert(base != NULL && "Couldn't allocate arena");
+		capacity = bytes;
+	}
+
+	/*
+	 * Alloc() - Carve a table of count elements, each set to init
+	 *
+	 * name must outlive the arena (string literals do). Running out of
+	 * room means the FTL sized the arena wrong, so it is fatal.
+	 */
+	template <typename T>
+	ArenaTable<T> Alloc(const char *name, size_t count, const T &init) {
+		size_t bytes = Bytes<T>(count);
+
+		assert(used + bytes <= capacity && "Arena too small");
+		assert(num_tables < ARENA_MAX_TABLES && "Too many arena tables");
+
+		T *data = reinterpret_cast<T *>(base + used);
+		for (size_t i = 0; i < count; i++)
+			data[i] = init;
+
+		used += bytes;
+		table_name[num_tables] = name;
+		table_bytes[num_tables] = count * sizeof(T);
+		num_tables++;
+
+		return ArenaTable<T>(data, count);
+	}
+
+	/* Start of the region, the tables carved so far span Used() bytes */
+	char *Base() {
+		return base;
+	}
+
+	size_t Capacity() const {
+		return capacity;
+	}
+
+	size_t Used() const {
+		return used;
+	}
+
+	size_t NumTables() const {
+		return num_tables;
+	}
+
+	const char *TableName(size_t i) const {
+		return table_name[i];
+	}
+
+	/* Exact bytes of table i, without alignment padding */
+	size_t TableBytes(size_t i) const {
+		return table_bytes[i];
+	}
+
+	/*
+	 * Report() - Print the footprint of every table and of the arena
+	 */
+	void Report(FILE *fp) const {
+		for (size_t i = 0; i < num_tables; i++)
+			fprintf(fp, "Arena table %s: %zu bytes\n", table_name[i],
+				table_bytes[i]);
+		fprintf(fp, "Arena used %zu of %zu bytes\n", used, capacity);
+	}
+};
+
+#endif /* __ARENA_H__ */
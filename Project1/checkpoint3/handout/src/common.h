@@ -26,6 +26,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <math.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
@@ -38,6 +39,18 @@
 /* Takes maximum */
 #define MAX(a, b)	((a) > (b) ? (a) : (b))
 
+/*
+ * Returns the LBAs exposed by raw_blocks blocks of block_size pages, with
+ * op percent of the blocks overprovisioned. The overprovisioned blocks are
+ * rounded, as MyFTL does, so all the tools agree on the device size.
+ */
+static inline size_t NumExportedLBAs(size_t raw_blocks, size_t block_size,
+		double op)
+{
+	return (raw_blocks - (size_t)round((double)raw_blocks * op / 100)) *
+		block_size;
+}
+
 /* Pipes recevie and transmit end - As per <unistd.h> */
 #define PIPE_RX_END	0
 #define PIPE_TX_END	1
@@ -45,6 +58,7 @@
 /* Parent passed pipe fd in argv to child. These define the offset in argv */
 #define CHILD_PIPE_RX_FD_ARGV_OFF 1 /* 0th is reserved for child's exe name */
 #define CHILD_PIPE_TX_FD_ARGV_OFF 2
+#define CHILD_MEMACCT_FD_ARGV_OFF 3 /* Only with HEAP_CHECK_ALLOC */
 
 /* Max length of string when pipefd when converted to string */
 #define MAX_PIPEFD_STR_LEN 10
@@ -176,6 +190,13 @@ class ConfBase {
 		return size_t(-1);
 	}
 
+	/* Returns the LBAs exposed, see NumExportedLBAs() */
+	size_t GetNumLBAs(void) const {
+		return NumExportedLBAs(GetSSDSize() * GetPackageSize() *
+				GetDieSize() * GetPlaneSize(), GetBlockSize(),
+				GetOverprovisioning());
+	}
+
 	/*
 	 * Returns the string corresponding to string (as in conf file)
 	 * It is preferred not to call this function directly
@@ -288,6 +309,11 @@ class Address {
 		page{addr.page}
 		{}
 
+	/*
+	 * Copy Assignment - Same as the copy constructor
+	 */
+	Address &operator=(const Address &addr) = default;
+
 	/*
 	 * Prints the address - Useful for debugging
 	 * fp - File pointer
@@ -324,6 +350,31 @@ enum class ExecState {
 	FAILURE,
 };
 
+/*
+ * enum class BlockRole - What an FTL currently uses a physical block for
+ *
+ * Only used for visualization (see ENABLE_WEAR_SNAPSHOT)
+ */
+enum class BlockRole {
+	UNKNOWN = 0,
+	DATA,
+	LOG,
+	CLEANING,
+};
+
+/* Most state regions an FTL can report, see FTLBase::GetStateRegions() */
+#define FTL_MAX_STATE_REGIONS	16
+
+/*
+ * struct FTLStateRegion - Memory holding part of the state of an FTL
+ *
+ * Only used for mapping checkpoints (power loss recovery)
+ */
+struct FTLStateRegion {
+	void *base;
+	size_t size;
+};
+
 /*
  * class ExecCallBack() - Proxy class for controller to let FTL call
  *                        	  its function without exposing controller
@@ -440,6 +491,77 @@ class FTLBase {
 		return 0;
 	};
 
+	/*
+	 * Optional. Tells what the block at addr (page is ignored) is used
+	 * for. Only queried when wear snapshots are enabled.
+	 */
+	virtual BlockRole GetBlockRole(Address) {
+
+		return BlockRole::UNKNOWN;
+	}
+
+	/*
+	 * Optional. Regions of memory that together hold all the state of the
+	 * FTL. Stores at most max of them in regions, returns how many, 0 if
+	 * the FTL can't be checkpointed.
+	 *
+	 * A checkpoint is restored by copying it back into the regions of a
+	 * freshly created FTL, so they must hold no pointers and be laid out
+	 * the same for any FTL of the same configuration. Only queried when
+	 * power loss recovery is enabled.
+	 */
+	virtual size_t GetStateRegions(FTLStateRegion *regions, size_t max) {
+
+		(void)regions;
+		(void)max;
+		return 0;
+	}
+
+	/*
+	 * SaveState() - Copy of all the state of the FTL into buf
+	 *
+	 * Returns false if the FTL can't be checkpointed
+	 */
+	virtual bool SaveState(std::vector<char> &buf) {
+
+		FTLStateRegion regions[FTL_MAX_STATE_REGIONS];
+		size_t num = GetStateRegions(regions, FTL_MAX_STATE_REGIONS);
+
+		buf.clear();
+		for (size_t i = 0; i < num; i++)
+			buf.insert(buf.end(), (char *)regions[i].base,
+				(char *)regions[i].base + regions[i].size);
+
+		return num != 0;
+	}
+
+	/*
+	 * LoadState() - Restore state saved by SaveState()
+	 *
+	 * Returns false if buf doesn't fit this FTL
+	 */
+	virtual bool LoadState(const std::vector<char> &buf) {
+
+		FTLStateRegion regions[FTL_MAX_STATE_REGIONS];
+		size_t num = GetStateRegions(regions, FTL_MAX_STATE_REGIONS);
+		size_t size = 0;
+
+		for (size_t i = 0; i < num; i++)
+			size += regions[i].size;
+
+		if (num == 0 || size != buf.size())
+			return false;
+
+		size = 0;
+		for (size_t i = 0; i < num; i++) {
+			memcpy(regions[i].base, buf.data() + size,
+				regions[i].size);
+			size += regions[i].size;
+		}
+
+		return true;
+	}
+
 };
 
 
@@ -497,6 +619,23 @@ enum message_type_t {
 	/* Used to gather information from child about stack */
 	MSG_FTL_STACK_SIZE_REQ = 27,
 	MSG_FTL_STACK_SIZE_RESP = 28,
+
+	/* Used to gather the role of a block from the FTL */
+	MSG_FTL_BLOCK_ROLE_REQ = 29,
+	MSG_FTL_BLOCK_ROLE_RESP = 30,
+
+	/*
+	 * Mapping checkpoints. The bytes of the state follow the save
+	 * response and the load request on the pipe
+	 */
+	MSG_FTL_STATE_SAVE_REQ = 31,
+	MSG_FTL_STATE_SAVE_RESP = 32,
+	MSG_FTL_STATE_LOAD_REQ = 33,
+	MSG_FTL_STATE_LOAD_RESP = 34,
+
+	/* Power cycle: the child drops its FTL and creates a fresh one */
+	MSG_FTL_RESET_REQ = 35,
+	MSG_FTL_RESET_RESP = 36,
 };
 
 /* Structure to specify format of communication between parent and child */
@@ -547,6 +686,13 @@ class IPC_Format {
 	/* Address sent to flashsim along with request */
 	Address sim_req_addr;
 
+	/* Block whose role is asked and the FTL's answer */
+	Address ftl_req_addr;
+	BlockRole ftl_resp_block_role;
+
+	/* Bytes of FTL state following the message */
+	size_t state_size;
+
 	IPC_Format() {
 	}
 
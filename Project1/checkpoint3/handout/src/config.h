@@ -22,10 +22,8 @@
  * Helps in gathering malloc trace and gives a visual chart of
  * how memory is being used along on heap using malloc
  *
- * FIXME: Currently when this option is enabled, you might see lots of warnings
- * given out by gcc. This is because we are trapping malloc using
- * deprecated functions. A better way exists and should be implemented,
- * but logically there shouldn't be any issue with current implementation
+ * The child's allocator is interposed for this (see memacct.h), each call
+ * appends the live heap bytes to MALLOC_TRACE_FILE
  */
 #define MALLOC_TRACE_ENABLED	0
 
@@ -44,12 +42,34 @@
 /* Which method to use to track stack consumption */
 #define STACK_CHECK	STACK_CHECK_CANARY
 
+/*
+ * Methods to heap check
+ * Procmaps - Parent parses child's /proc smaps every PERIOD_US_MEMCHECK
+ * Alloc - Child's allocator is interposed and keeps exact live/peak heap
+ * counters in a page shared with the parent, no timer is used (see memacct.h)
+ * Enable one and only one
+ */
+#define HEAP_CHECK_PROCMAPS	0
+#define HEAP_CHECK_ALLOC	1
+
+/* Which method to use to track heap consumption */
+#define HEAP_CHECK	HEAP_CHECK_PROCMAPS
+
 /* Enable's large page for the datastore - 4k */
 #define ENABLE_LARGE_DATASTORE_PAGE 0
 
-/* Enables tracing of all reads/writes (transcations) requested/performed */
+/*
+ * Enables tracing of all reads/writes (transcations) requested/performed
+ * The trace is binary, decode it with output/trans_decode (make tools)
+ */
 #define ENABLE_TRANS_TRACING	0
 
+/*
+ * Periodically snapshots erase count, valid pages and role of every block
+ * Render the snapshots with output/wear_heatmap (make tools)
+ */
+#define ENABLE_WEAR_SNAPSHOT	0
+
 
 /******************************************************************************/
 /*                         Don't modify below this                            */
@@ -80,7 +100,13 @@
 #define STACK_CANARY			(0xFACEDEAD)
 
 /* File to use to output transaction tracing data (if feature enabled) */
-#define TRANS_TRACE_FILE	OUTDIR "/trans_trace.log"
+#define TRANS_TRACE_FILE	OUTDIR "/trans_trace.bin"
+
+/* File to output wear snapshots to (if feature enabled) */
+#define WEAR_SNAPSHOT_FILE	OUTDIR "/wear_snapshot.bin"
+
+/* Host writes between two wear snapshots */
+#define WEAR_SNAPSHOT_PERIOD	1024
 
 /*
  * If Two proc is not enabled, some of the features become unaccessible
@@ -0,0 +1,225 @@
+/**
+ * @file memacct.cpp
+ * @brief Allocator interposer of the child, see memacct.h
+ *
+ * Only linked into the child. Nothing in here may allocate: the wrappers run
+ * before main() and from inside every malloc() of the process.
+ */
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "memacct.h"
+
+#if MEMACCT_INTERPOSE
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void __libc_free(void *ptr);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void *__libc_valloc(size_t size);
+void *__libc_pvalloc(size_t size);
+}
+
+/* Counters until the shared page is attached */
+static struct memacct_page early_page;
+static struct memacct_page *page = &early_page;
+
+static int trace_fd = -1;
+
+/*
+ * trace_live() - Append live_bytes as a line to the malloc trace
+ *
+ * Formats by hand, as stdio may allocate
+ */
+static void trace_live(uint64_t live)
+{
+	char buf[24];
+	int i = sizeof(buf);
+
+	buf[--i] = '\n';
+	do {
+		buf[--i] = '0' + live % 10;
+		live /= 10;
+	} while (live);
+
+	if (write(trace_fd, &buf[i], sizeof(buf) - i) < 0)
+		trace_fd = -1;
+}
+
+static void account_alloc(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	uint64_t size = malloc_usable_size(ptr);
+	uint64_t live = __atomic_add_fetch(&page->live_bytes, size,
+						__ATOMIC_RELAXED);
+	uint64_t peak = __atomic_load_n(&page->peak_bytes, __ATOMIC_RELAXED);
+
+	while (live > peak && !__atomic_compare_exchange_n(&page->peak_bytes,
+				&peak, live, true, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED))
+		;
+
+	__atomic_add_fetch(&page->num_allocs, 1, __ATOMIC_RELAXED);
+
+	if (trace_fd >= 0)
+		trace_live(live);
+}
+
+static void account_free(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	uint64_t live = __atomic_sub_fetch(&page->live_bytes,
+				malloc_usable_size(ptr), __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&page->num_frees, 1, __ATOMIC_RELAXED);
+
+	if (trace_fd >= 0)
+		trace_live(live);
+}
+
+int memacct_attach(int fd)
+{
+	struct memacct_page *shared;
+
+	shared = (struct memacct_page *)mmap(NULL, PAGE_SIZE,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shared == MAP_FAILED)
+		return -1;
+
+	/* Child is still single threaded, nothing races with the copy */
+	memcpy(shared, page, sizeof(*shared));
+	page = shared;
+
+	close(fd);
+	return 0;
+}
+
+void memacct_trace(int fd)
+{
+	trace_fd = fd;
+}
+
+/*
+ * The wrappers. glibc supports replacing its allocator this way, its own
+ * internal allocations are routed here too.
+ */
+extern "C" {
+
+void *malloc(size_t size)
+{
+	void *ptr = __libc_malloc(size);
+
+	account_alloc(ptr);
+	return ptr;
+}
+
+void free(void *ptr)
+{
+	account_free(ptr);
+	__libc_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	void *ptr = __libc_calloc(nmemb, size);
+
+	account_alloc(ptr);
+	return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+	void *new_ptr;
+
+	if (ptr != NULL && size == 0) {
+		free(ptr);
+		return NULL;
+	}
+
+	new_ptr = __libc_realloc(ptr, size);
+	if (new_ptr == NULL)
+		return NULL;	/* Old block untouched */
+
+	if (ptr != NULL) {
+		__atomic_sub_fetch(&page->live_bytes, old_size,
+					__ATOMIC_RELAXED);
+		__atomic_sub_fetch(&page->num_allocs, 1, __ATOMIC_RELAXED);
+	}
+	account_alloc(new_ptr);
+
+	return new_ptr;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	size_t bytes;
+
+	if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return realloc(ptr, bytes);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	void *ptr = __libc_memalign(alignment, size);
+
+	account_alloc(ptr);
+	return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (alignment % sizeof(void *) != 0 ||
+			(alignment & (alignment - 1)) != 0)
+		return EINVAL;
+
+	ptr = memalign(alignment, size);
+	if (ptr == NULL)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+void *valloc(size_t size)
+{
+	void *ptr = __libc_valloc(size);
+
+	account_alloc(ptr);
+	return ptr;
+}
+
+void *pvalloc(size_t size)
+{
+	void *ptr = __libc_pvalloc(size);
+
+	account_alloc(ptr);
+	return ptr;
+}
+
+} /* extern "C" */
+
+#endif /* MEMACCT_INTERPOSE */
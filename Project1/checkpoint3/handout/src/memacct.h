@@ -0,0 +1,65 @@
+/**
+ * @file memacct.h
+ * @brief Exact heap accounting of the child through an interposed allocator
+ *
+ * When enabled, the child (myFTL) defines malloc() and friends itself. Every
+ * call is forwarded to glibc's allocator and the usable size of the block is
+ * added to/removed from live and peak counters. The counters live in a page
+ * of shared memory created by the parent before fork() (its fd is passed in
+ * argv), so the parent reads them at any time without polling /proc.
+ *
+ * The same interposer drives the malloc trace (MALLOC_TRACE_ENABLED), which
+ * previously relied on the deprecated __malloc_hook family.
+ */
+
+#ifndef __MEMACCT_H__
+#define __MEMACCT_H__
+
+#include <stdint.h>
+#include "config.h"
+
+/* Is the child's allocator interposed? */
+#define MEMACCT_INTERPOSE ((MEMCHECK_ENABLED && \
+			(HEAP_CHECK == HEAP_CHECK_ALLOC)) || MALLOC_TRACE_ENABLED)
+
+/* Layout of the page shared by the parent and the child */
+struct memacct_page {
+	uint64_t live_bytes;	/* Usable bytes of blocks currently allocated */
+	uint64_t peak_bytes;	/* All time high of live_bytes */
+	uint64_t num_allocs;
+	uint64_t num_frees;
+};
+
+/*
+ * Child side
+ */
+
+/*
+ * memacct_attach() - Move the counters to the shared page behind fd
+ *
+ * Allocations done before the call (by the loader and static constructors)
+ * are carried over.
+ * Returns 0 on success, < 0 on error
+ */
+int memacct_attach(int fd);
+
+/*
+ * memacct_trace() - Write live_bytes to fd after every allocator call
+ */
+void memacct_trace(int fd);
+
+/*
+ * Parent side (memcheck.cpp)
+ */
+
+/*
+ * memacct_create() - Create the shared page. Call before fork()
+ *
+ * Returns the fd to pass to the child, < 0 on error
+ */
+int memacct_create(void);
+
+/* Counters of the child, valid after memacct_create() */
+const struct memacct_page *memacct_get(void);
+
+#endif /* __MEMACCT_H__ */
@@ -1,7 +1,8 @@
 /*
  * @file memcheck.cpp
  * @brief This file keeps track of memory usage by the child by periodically
- * checking the proc maps
+ * checking the proc maps, or for the heap with HEAP_CHECK_ALLOC, by reading
+ * the counters kept by the child's allocator (see memacct.h)
  *
  * @author Saksham Jain (sakshamj)
  * @bug No known bugs
@@ -9,6 +10,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <sys/time.h>
@@ -16,6 +18,7 @@
 #include <stdlib.h>
 #include "common.h"
 #include "memcheck.h"
+#include "memacct.h"
 #include "config.h"
 
 /*
@@ -64,6 +67,64 @@ struct memcheck_glb_t {
 /* All values initialized to zero */
 static struct memcheck_glb_t memcheck_glb;
 
+#if (HEAP_CHECK == HEAP_CHECK_ALLOC)
+
+/* Page where the child's allocator keeps its counters */
+static struct memacct_page *memacct;
+
+/**
+ * @brief Creates the page shared with the child's allocator
+ * @return fd to be inherited by the child, < 0 on error
+ */
+int memacct_create(void)
+{
+	int fd, ret;
+
+	/* Not close-on-exec, the child maps it after execve */
+	fd = memfd_create("memacct", 0);
+	if (fd < 0)
+		return fd;
+
+	ret = ftruncate(fd, PAGE_SIZE);
+	if (ret < 0)
+		goto err;
+
+	memacct = (struct memacct_page *)mmap(NULL, PAGE_SIZE,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (memacct == MAP_FAILED) {
+		memacct = NULL;
+		ret = -1;
+		goto err;
+	}
+
+	return fd;
+
+err:
+	close(fd);
+	return ret;
+}
+
+/**
+ * @brief Gives the counters of the child's allocator
+ */
+const struct memacct_page *memacct_get(void)
+{
+	return memacct;
+}
+
+/**
+ * @brief Takes the heap usage from the child's allocator counters
+ */
+static void update_heap_from_memacct(void)
+{
+	memcheck_glb.cur_heap_size = __atomic_load_n(&memacct->live_bytes,
+							__ATOMIC_RELAXED);
+	memcheck_glb.max_heap_size = __atomic_load_n(&memacct->peak_bytes,
+							__ATOMIC_RELAXED);
+}
+
+#endif /* HEAP_CHECK */
+
 #if PRINT_STATS_ENABLE
 
 /**
@@ -103,6 +164,10 @@ void print_memusage(size_t stack_size)
 	printf("MEMCHECK:Max usage: %zu\n", memcheck_glb.max_usage);
 	printf("MEMCHECK:Initial usage %zu\n", memcheck_glb.init_usage);
 	printf("MEMCHECK:Update count %d\n", memcheck_glb.update_count);
+#if (HEAP_CHECK == HEAP_CHECK_ALLOC)
+	printf("MEMCHECK:Heap allocs %lu\n", memacct->num_allocs);
+	printf("MEMCHECK:Heap frees %lu\n", memacct->num_frees);
+#endif
 	printf("MEMCHECK:PID is %d\n", memcheck_glb.pid);
 
 	printf("############## MEMCHECK SIDE STATS END ####################\n");
@@ -121,6 +186,11 @@ size_t get_child_total_mem(size_t child_stack_size)
 	/* Can't call from here as race condition with the alarm signal */
 	/* update_memusage(); */
 
+#if (HEAP_CHECK == HEAP_CHECK_ALLOC)
+	/* Counters are exact and always current, no need for the timer */
+	update_heap_from_memacct();
+#endif
+
 #if PRINT_STATS_ENABLE
 	print_memusage(child_stack_size);
 #endif
@@ -360,6 +430,14 @@ int update_memusage(void)
 	assert(memcheck_glb.cur_data_size > 0);
 	assert(memcheck_glb.cur_misc_size > 0);
 
+#if (HEAP_CHECK == HEAP_CHECK_ALLOC)
+	/*
+	 * [heap] only shows the brk area and counts free chunks too, take
+	 * the allocator's own counters instead
+	 */
+	update_heap_from_memacct();
+#endif
+
 	memcheck_glb.max_usage = MAX(memcheck_glb.max_usage,
 					memcheck_glb.cur_stack_size +
 					memcheck_glb.cur_heap_size +
@@ -419,6 +497,14 @@ int init_memcheck_parent(pid_t pid)
 
 	memcheck_glb.init_usage = memcheck_glb.max_usage;
 
+#if (HEAP_CHECK == HEAP_CHECK_ALLOC)
+	/*
+	 * Heap is tracked by the child's allocator, stack by the child
+	 * itself and data doesn't grow, so no need for polling
+	 */
+	return 0;
+#endif
+
 	/* Install timer handler */
 	old_sighandler = signal(SIGALRM, timer_handler);
 	if (old_sighandler == SIG_ERR)
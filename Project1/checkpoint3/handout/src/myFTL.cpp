@@ -1,6 +1,6 @@
 #include "common.h"
 #include "myFTL.h"
-#include "unordered_map"
+#include "arena.h"
 #include "math.h"
 #include <time.h>
 
@@ -46,16 +46,22 @@ size_t cleaning_reservation_block_number;
 size_t upper_threshold_for_log_reservation_page_number;
 /* Erase threshold to change corresponding block */
 size_t full_cleaning_erase_threshod;
+/* Holds all the tables below, sized from the geometry */
+Arena arena;
 /* Given a lba, compute it's corresponding block index, then find the used pba block index with this map */
-std::vector<size_t> lba_block_index_to_pba_block_index_map;
+ArenaTable<size_t> lba_block_index_to_pba_block_index_map;
 /* Given a pba block index, finding the log reservation block it's used */
-std::vector<size_t> pba_data_block_index_to_log_reservation_block_index_map;
+ArenaTable<size_t> pba_data_block_index_to_log_reservation_block_index_map;
 /* Given a pba page index, finding corresponding actual saved paged index */
-std::vector<size_t> pba_page_index_map;
+ArenaTable<size_t> pba_page_index_map;
 /* To record block erase times */
-std::vector<size_t> erase_record_map;
+ArenaTable<size_t> erase_record_map;
 /* The index is the log reservation block index, the value is the corresponding page in data blocks */
-std::vector<size_t> log_reservation_to_available_page_map;
+ArenaTable<size_t> log_reservation_to_available_page_map;
+/* Scratch for performErase, the i-th valid page goes to the i-th cleaning page: where it is saved now */
+ArenaTable<size_t> erase_copy_from_map;
+/* Scratch for performErase: the page in the data block it belongs to */
+ArenaTable<size_t> erase_copy_home_map;
 /* Log reservation page to allocate */
 size_t log_reservation_page_index;
 /* Page to clean */
@@ -90,11 +96,18 @@ public:
     cleaning_reservation_page_index = upper_threshold_for_log_reservation_page_number;
     garbage_collection_log_reservation_page_index = available_pages_number;
     full_cleaning_erase_threshod = block_erase_count - 2;
-    lba_block_index_to_pba_block_index_map = std::vector<size_t>(available_block_number, -1);
-    pba_data_block_index_to_log_reservation_block_index_map = std::vector<size_t>(available_block_number, -1);
-    pba_page_index_map = std::vector<size_t>(available_pages_number, -1);
-    erase_record_map = std::vector<size_t>(overall_block_capacity, 0);
-    log_reservation_to_available_page_map = std::vector<size_t>(overprovision_block_number, -1);
+    arena.Init(2 * Arena::Bytes<size_t>(available_block_number) +
+               Arena::Bytes<size_t>(available_pages_number) +
+               Arena::Bytes<size_t>(overall_block_capacity) +
+               Arena::Bytes<size_t>(overprovision_block_number) +
+               2 * Arena::Bytes<size_t>(block_size));
+    lba_block_index_to_pba_block_index_map = arena.Alloc<size_t>("lba_block_index_to_pba_block_index_map", available_block_number, -1);
+    pba_data_block_index_to_log_reservation_block_index_map = arena.Alloc<size_t>("pba_data_block_index_to_log_reservation_block_index_map", available_block_number, -1);
+    pba_page_index_map = arena.Alloc<size_t>("pba_page_index_map", available_pages_number, -1);
+    erase_record_map = arena.Alloc<size_t>("erase_record_map", overall_block_capacity, 0);
+    log_reservation_to_available_page_map = arena.Alloc<size_t>("log_reservation_to_available_page_map", overprovision_block_number, -1);
+    erase_copy_from_map = arena.Alloc<size_t>("erase_copy_from_map", block_size, -1);
+    erase_copy_home_map = arena.Alloc<size_t>("erase_copy_home_map", block_size, -1);
     printf("SSD Configuration: %zu, %zu, %zu, %zu, %zu\n",
 		ssd_size, package_size, die_size, plane_size, block_size);
 	printf("Max Erase Count: %zu, Overprovisioning: %zu\n", 
@@ -325,38 +338,34 @@ public:
      * Erase certain block.
      */
     bool performErase(size_t cleaning_reservation_page_index, size_t start_page_for_original_block, size_t start_page_for_overprovision_block, const ExecCallBack<PageType> &func) {
-        size_t curr_cleaning_page_index = cleaning_reservation_page_index;
         Address overprovision_page_address = translatePageNumberToAddress(start_page_for_overprovision_block);
-        std::unordered_map<size_t, size_t> copy_map;
-        std::unordered_map<size_t, size_t> corresponding_map;
+        /* The k-th valid page is copied to cleaning page cleaning_reservation_page_index + k */
+        size_t copy_count = 0;
         bool ans = false;
         for (size_t i = start_page_for_original_block; i < start_page_for_original_block + block_size; i++) {
             if (pba_page_index_map[i] != -1) {
-                copy_map[curr_cleaning_page_index] = pba_page_index_map[i];
-                corresponding_map[curr_cleaning_page_index] = i;
+                erase_copy_from_map[copy_count] = pba_page_index_map[i];
+                erase_copy_home_map[copy_count] = i;
                 pba_page_index_map[i] = i;
-                curr_cleaning_page_index++;
+                copy_count++;
             }
         }
-        if (copy_map.size() == 1) {
+        if (copy_count == 1) {
             func(OpCode::ERASE, translatePageNumberToAddress(start_page_for_original_block));
-            for (auto it = copy_map.begin(); it !=copy_map.end(); ++it) {
-                func(OpCode::READ, translatePageNumberToAddress(it->second));
-                Address original = translatePageNumberToAddress(corresponding_map.find(it->first)->second);
-                func(OpCode::WRITE, original);
-            }
+            func(OpCode::READ, translatePageNumberToAddress(erase_copy_from_map[0]));
+            func(OpCode::WRITE, translatePageNumberToAddress(erase_copy_home_map[0]));
             func(OpCode::ERASE, overprovision_page_address);
         } else {
             ans = true;
-            for (auto it = copy_map.begin(); it !=copy_map.end(); ++it) {
-                func(OpCode::READ, translatePageNumberToAddress(it->second));
-                func(OpCode::WRITE, translatePageNumberToAddress(it->first));
+            for (size_t k = 0; k < copy_count; k++) {
+                func(OpCode::READ, translatePageNumberToAddress(erase_copy_from_map[k]));
+                func(OpCode::WRITE, translatePageNumberToAddress(cleaning_reservation_page_index + k));
             }
             func(OpCode::ERASE, overprovision_page_address);
             func(OpCode::ERASE, translatePageNumberToAddress(start_page_for_original_block));
-            for (auto it = corresponding_map.begin(); it != corresponding_map.end(); ++it) {
-                func(OpCode::READ, translatePageNumberToAddress(it->first));
-                func(OpCode::WRITE, translatePageNumberToAddress(it->second));
+            for (size_t k = 0; k < copy_count; k++) {
+                func(OpCode::READ, translatePageNumberToAddress(cleaning_reservation_page_index + k));
+                func(OpCode::WRITE, translatePageNumberToAddress(erase_copy_home_map[k]));
             }
             func(OpCode::ERASE, translatePageNumberToAddress(cleaning_reservation_page_index));
         }
@@ -442,6 +451,33 @@ public:
         return ans;
     }
 
+    /*
+     * State for mapping checkpoints: every table lives in the arena, plus
+     * the three allocation cursors.
+     */
+    size_t GetStateRegions(FTLStateRegion *regions, size_t max) {
+        if (max < 4) return 0;
+        regions[0] = {arena.Base(), arena.Used()};
+        regions[1] = {&log_reservation_page_index, sizeof(size_t)};
+        regions[2] = {&cleaning_reservation_page_index, sizeof(size_t)};
+        regions[3] = {&garbage_collection_log_reservation_page_index, sizeof(size_t)};
+        return 4;
+    }
+
+    /*
+     * Role of a physical block, used for wear snapshots.
+     */
+    BlockRole GetBlockRole(Address address) {
+        size_t block_index = translateAddressToBlockIndex(address);
+        if (block_index < available_block_number) {
+            return BlockRole::DATA;
+        }
+        if (block_index < upper_threshold_for_log_reservation_page_number / block_size) {
+            return BlockRole::LOG;
+        }
+        return BlockRole::CLEANING;
+    }
+
     /*
      * Optionally mark a LBA as a garbage.
      */
@@ -0,0 +1,189 @@
+/**
+ * @file recovery.h
+ * @brief Reserved metadata area of the simulated device for power loss
+ * recovery
+ *
+ * The controller keeps the state of the FTL recoverable with three pieces
+ * of persistent metadata:
+ *   - the out-of-band area of every page (struct page_oob, in DataStore),
+ *     written together with the data: logical LBA and sequence number
+ *   - a mapping checkpoint: a copy of all the FTL's state, taken every
+ *     checkpoint period host operations
+ *   - a log of what the OOB scan can't find: trims, writes the FTL refused
+ *     and the OOB of host written pages whose block was erased since the
+ *     checkpoint (the summary of the block, written before the erase)
+ *
+ * Both the checkpoint and the log live in reserved blocks, outside of the
+ * geometry the FTL manages. They are modeled in memory and only accounted in
+ * metadata pages of RECOVERY_META_PAGE_SIZE bytes.
+ *
+ * Recovery loads the checkpoint into a fresh FTL, then scans the OOB of all
+ * pages and merges the host writes newer than the checkpoint with the log.
+ * Replaying them in sequence order through the FTL, without touching flash,
+ * brings it back to its state before the power loss. Replay is bounded by
+ * the checkpoint period.
+ */
+
+#ifndef __RECOVERY_H__
+#define __RECOVERY_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+/* Size of a page of the reserved metadata area, for accounting */
+#define RECOVERY_META_PAGE_SIZE		4096
+
+/*
+ * struct page_oob - Out-of-band area of a page, written with its data
+ *
+ * seq orders all host writes and trims. A page the FTL moved keeps the OOB
+ * of the host write it came from, with is_copy set.
+ */
+struct page_oob {
+	uint64_t lba;		/* Logical LBA of the data */
+	uint64_t seq;		/* Host write the data comes from, 0 if erased */
+	uint8_t is_copy;	/* Written by the FTL, not by the host */
+	uint8_t reserved[7];
+};
+
+/*
+ * enum recovery_record_t - Host operations kept in the log
+ */
+enum recovery_record_t {
+	RECOVERY_WRITE,		/* Host write whose page was erased */
+	RECOVERY_WRITE_FAILED,	/* Host write the FTL refused */
+	RECOVERY_TRIM,
+};
+
+struct recovery_record {
+	uint64_t seq;
+	uint64_t lba;
+	uint64_t physical;	/* Page written, RECOVERY_WRITE only */
+	uint32_t type;
+	uint32_t reserved;
+};
+
+struct recovery_stats {
+	uint64_t checkpoints;
+	uint64_t meta_pages;		/* Metadata pages written */
+	uint64_t recoveries;
+	uint64_t pages_scanned;		/* OOB read by the last recovery */
+	uint64_t records_replayed;	/* Host ops the last recovery replayed */
+	uint64_t recovery_ns;		/* Duration of the last recovery */
+};
+
+/*
+ * class RecoveryArea - Checkpoint and log in the reserved blocks
+ */
+class RecoveryArea {
+
+	private:
+
+	/* Host operations between two checkpoints, 0 if disabled */
+	uint64_t period;
+	uint64_t ops_since_checkpoint;
+
+	/* Last operation the checkpoint includes, and the FTL's state then */
+	uint64_t checkpoint_seq;
+	std::vector<char> checkpoint;
+
+	/* Operations after checkpoint_seq the OOB scan can't find */
+	std::vector<struct recovery_record> log;
+
+	/* Bytes of the log's last metadata page already accounted */
+	size_t log_page_bytes;
+
+	struct recovery_stats stats;
+
+	public:
+
+	RecoveryArea() :
+		period{0},
+		ops_since_checkpoint{0},
+		checkpoint_seq{0},
+		log_page_bytes{0},
+		stats() {}
+
+	void Enable(uint64_t p_period) {
+		period = p_period;
+	}
+
+	bool IsEnabled() const {
+		return period != 0;
+	}
+
+	uint64_t GetCheckpointSeq() const {
+		return checkpoint_seq;
+	}
+
+	std::vector<char> &GetCheckpoint() {
+		return checkpoint;
+	}
+
+	const std::vector<struct recovery_record> &GetLog() const {
+		return log;
+	}
+
+	/*
+	 * OpDone() - Count a host operation, returns true when a checkpoint
+	 * is due
+	 */
+	bool OpDone() {
+		return period != 0 && ++ops_since_checkpoint >= period;
+	}
+
+	/*
+	 * CheckpointTaken() - The checkpoint now holds the state after
+	 * operation seq, the log before it is no longer needed
+	 */
+	void CheckpointTaken(uint64_t seq) {
+		checkpoint_seq = seq;
+		ops_since_checkpoint = 0;
+		log.clear();
+		log_page_bytes = 0;
+
+		stats.checkpoints++;
+		stats.meta_pages += (checkpoint.size() +
+			RECOVERY_META_PAGE_SIZE - 1) / RECOVERY_META_PAGE_SIZE;
+	}
+
+	void Append(enum recovery_record_t type, uint64_t seq, uint64_t lba,
+			uint64_t physical) {
+
+		struct recovery_record rec;
+
+		rec.seq = seq;
+		rec.lba = lba;
+		rec.physical = physical;
+		rec.type = type;
+		rec.reserved = 0;
+		log.push_back(rec);
+
+		/* A page is written each time the log crosses into a new one */
+		if (log_page_bytes == 0)
+			stats.meta_pages++;
+		log_page_bytes += sizeof(rec);
+		if (log_page_bytes + sizeof(rec) > RECOVERY_META_PAGE_SIZE)
+			log_page_bytes = 0;
+	}
+
+	/*
+	 * Recovered() - Record what the last recovery did
+	 */
+	void Recovered(uint64_t pages_scanned, uint64_t records_replayed,
+			uint64_t ns) {
+
+		stats.recoveries++;
+		stats.pages_scanned = pages_scanned;
+		stats.records_replayed = records_replayed;
+		stats.recovery_ns = ns;
+	}
+
+	const struct recovery_stats &GetStats() const {
+		return stats;
+	}
+};
+
+#endif /* __RECOVERY_H__ */
@@ -0,0 +1,50 @@
+/**
+ * @file ssdimage.h
+ * @brief Format of a saved image of the simulated SSD
+ *
+ * An image holds everything needed to resume a run on an aged device:
+ * struct ssd_image_hdr, then in this order
+ *   uint32_t erases[num_blocks]        erases performed on each block
+ *   uint8_t  valid[(num_pages + 7) / 8] bitmap of pages holding data
+ *   struct page_oob oob[num_pages]     OOB area of every page
+ *   char ftl_state[ftl_state_size]     state of the FTL (FTLBase::SaveState)
+ *   PageType data[num_valid]           contents of the valid pages, in order
+ *
+ * Blocks and pages are in linear order. The FTL state only fits the FTL and
+ * configuration that saved it, which the header geometry partly checks.
+ * Images are written by Controller::SaveImage() and read back into a fresh
+ * simulator by Controller::LoadImage().
+ */
+
+#ifndef __SSDIMAGE_H__
+#define __SSDIMAGE_H__
+
+#include <stdint.h>
+#include "recovery.h"
+
+#define SSD_IMAGE_MAGIC		0x31495353	/* "SSI1" */
+
+struct ssd_image_hdr {
+	uint32_t magic;
+	uint32_t page_size;		/* sizeof(PageType) */
+	uint32_t ssd_size;
+	uint32_t package_size;
+	uint32_t die_size;
+	uint32_t plane_size;
+	uint32_t block_size;
+	uint32_t block_erases;
+	uint32_t overprovisioning;
+	uint32_t reserved;
+	uint64_t num_pages;
+	uint64_t num_valid;
+	uint64_t flash_writes;
+	uint64_t flash_reads;
+	uint64_t flash_erases;
+	uint64_t host_seq;
+	uint64_t ftl_state_size;
+};
+
+static_assert(sizeof(struct ssd_image_hdr) == 96, "header changed");
+static_assert(sizeof(struct page_oob) == 24, "OOB changed");
+
+#endif /* __SSDIMAGE_H__ */
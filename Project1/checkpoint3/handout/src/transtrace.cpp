@@ -0,0 +1,144 @@
+/**
+ * @file transtrace.cpp
+ * @brief Binary transaction tracing of the flash simulator
+ *
+ * The trace file is preallocated (sparse) and mapped once. A ring that
+ * fills up reserves its slots in the file with a single atomic add and
+ * copies its records in, so threads never wait on each other and no
+ * syscall is made on the tracing path.
+ */
+
+#include "config.h"
+#include "transtrace.h"
+
+#if ENABLE_TRANS_TRACING
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+uint64_t trans_trace_seq;
+thread_local TransTraceRing trans_trace_ring;
+
+/* State of the trace file */
+static int trace_fd = -1;
+static size_t trace_map_size;
+static struct trans_trace_hdr *trace_hdr;
+static struct trans_trace_rec *trace_recs;
+static uint64_t trace_next_rec;
+static uint64_t trace_dropped;
+
+/* All rings of live threads */
+static std::mutex ring_list_lock;
+static std::vector<TransTraceRing *> ring_list;
+
+TransTraceRing::TransTraceRing() : count{0} {
+
+	std::lock_guard<std::mutex> guard(ring_list_lock);
+	ring_list.push_back(this);
+}
+
+TransTraceRing::~TransTraceRing() {
+
+	Flush();
+
+	std::lock_guard<std::mutex> guard(ring_list_lock);
+	ring_list.erase(std::remove(ring_list.begin(), ring_list.end(), this),
+			ring_list.end());
+}
+
+void TransTraceRing::Flush() {
+
+	size_t n = count;
+
+	count = 0;
+	if (n == 0 || trace_recs == NULL)
+		return;
+
+	uint64_t idx = __atomic_fetch_add(&trace_next_rec, n,
+					__ATOMIC_RELAXED);
+
+	if (idx >= TRANS_TRACE_MAX_RECS) {
+		__atomic_fetch_add(&trace_dropped, n, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (idx + n > TRANS_TRACE_MAX_RECS) {
+		__atomic_fetch_add(&trace_dropped,
+			idx + n - TRANS_TRACE_MAX_RECS, __ATOMIC_RELAXED);
+		n = TRANS_TRACE_MAX_RECS - idx;
+	}
+
+	memcpy(&trace_recs[idx], recs, n * sizeof(recs[0]));
+}
+
+int trans_trace_open(const char *path) {
+
+	trace_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (trace_fd < 0)
+		return -1;
+
+	trace_map_size = sizeof(struct trans_trace_hdr) +
+		TRANS_TRACE_MAX_RECS * sizeof(struct trans_trace_rec);
+
+	if (ftruncate(trace_fd, trace_map_size) < 0)
+		goto err;
+
+	trace_hdr = (struct trans_trace_hdr *)mmap(NULL, trace_map_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED, trace_fd, 0);
+	if (trace_hdr == MAP_FAILED) {
+		trace_hdr = NULL;
+		goto err;
+	}
+
+	trace_recs = (struct trans_trace_rec *)(trace_hdr + 1);
+	trace_next_rec = 0;
+	trace_dropped = 0;
+	trans_trace_seq = 0;
+
+	return 0;
+
+err:
+	close(trace_fd);
+	trace_fd = -1;
+	return -1;
+}
+
+void trans_trace_close() {
+
+	if (trace_hdr == NULL)
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(ring_list_lock);
+		for (TransTraceRing *ring : ring_list)
+			ring->Flush();
+	}
+
+	uint64_t num_recs = std::min(trace_next_rec,
+				(uint64_t)TRANS_TRACE_MAX_RECS);
+
+	trace_hdr->magic = TRANS_TRACE_MAGIC;
+	trace_hdr->rec_size = sizeof(struct trans_trace_rec);
+	trace_hdr->num_recs = num_recs;
+	trace_hdr->dropped = trace_dropped;
+	trace_hdr->reserved = 0;
+
+	munmap(trace_hdr, trace_map_size);
+	trace_hdr = NULL;
+	trace_recs = NULL;
+
+	if (ftruncate(trace_fd, sizeof(struct trans_trace_hdr) +
+			num_recs * sizeof(struct trans_trace_rec)) < 0)
+		perror("trans_trace_close: ftruncate");
+
+	close(trace_fd);
+	trace_fd = -1;
+}
+
+#endif /* ENABLE_TRANS_TRACING */
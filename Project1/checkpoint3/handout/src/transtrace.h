@@ -0,0 +1,136 @@
+/**
+ * @file transtrace.h
+ * @brief Binary transaction tracing of the flash simulator
+ *
+ * Every traced event is a fixed size record. Records are appended to a
+ * per-thread ring without any locking or formatting, and a full ring is
+ * copied in one go into a memory mapped trace file. The trace file is decoded
+ * offline by tools/trans_decode.
+ *
+ * Layout of the trace file: struct trans_trace_hdr, followed by num_recs
+ * records of struct trans_trace_rec. Records of different threads may be
+ * interleaved in chunks of a ring; seq gives the global order.
+ *
+ * The header is only written by trans_trace_close(). If the process dies
+ * before that, the records still in the rings (up to TRANS_TRACE_RING_RECS
+ * per thread) are lost, and trans_decode finds the end of the records that
+ * did reach the file by skipping the unused, zero slots.
+ */
+
+#ifndef __TRANSTRACE_H__
+#define __TRANSTRACE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "common.h"
+
+#define TRANS_TRACE_MAGIC	0x31525454	/* "TTR1" */
+
+/* Records buffered per thread before they are copied into the trace file */
+#define TRANS_TRACE_RING_RECS	4096
+
+/*
+ * Capacity of the trace file in records. The file is sparse, so only what
+ * is actually written takes space on disk. Records beyond this are dropped
+ * and counted in trans_trace_hdr::dropped.
+ */
+#define TRANS_TRACE_MAX_RECS	(1UL << 26)
+
+/* Type of a traced event */
+enum TransTraceOp {
+	TT_HOST_READ = 0,	/* Host read of lba */
+	TT_HOST_WRITE = 1,	/* Host write of lba */
+	TT_HOST_TRIM = 2,	/* Host trim of lba */
+	TT_READ = 3,		/* Flash read of addr holding lba */
+	TT_WRITE = 4,		/* Flash write of lba at addr */
+	TT_ERASE = 5,		/* Flash erase of the block at addr */
+	TT_MAX
+};
+
+struct trans_trace_hdr {
+	uint32_t magic;
+	uint32_t rec_size;
+	uint64_t num_recs;
+	uint64_t dropped;
+	uint64_t reserved;
+};
+
+struct trans_trace_rec {
+	uint64_t seq;
+	uint32_t lba;
+	uint16_t plane;
+	uint16_t block;
+	uint16_t page;
+	uint8_t package;
+	uint8_t die;
+	uint8_t op;
+	uint8_t pad[3];
+};
+
+static_assert(sizeof(struct trans_trace_hdr) == 32, "trace header changed");
+static_assert(sizeof(struct trans_trace_rec) == 24, "trace record changed");
+
+/*
+ * class TransTraceRing - Per-thread buffer of trace records
+ *
+ * Registered on construction so that trans_trace_close() can drain the
+ * rings of threads which are still alive. Drained on thread exit.
+ */
+class TransTraceRing {
+
+	public:
+
+	size_t count;
+	struct trans_trace_rec recs[TRANS_TRACE_RING_RECS];
+
+	TransTraceRing();
+	~TransTraceRing();
+
+	/* Copy buffered records into the trace file and empty the ring */
+	void Flush();
+};
+
+extern thread_local TransTraceRing trans_trace_ring;
+extern uint64_t trans_trace_seq;
+
+/*
+ * trans_trace_open() - Create the trace file at path. Returns 0 on success
+ * and -1 on failure (errno set).
+ */
+int trans_trace_open(const char *path);
+
+/*
+ * trans_trace_close() - Drain all rings, finalize the header and truncate
+ * the trace file to the records written. Must be called once the simulator
+ * is idle.
+ */
+void trans_trace_close();
+
+/*
+ * trans_trace_event() - Record one event. This is the hot path, so it only
+ * fills in a slot of the ring of the calling thread.
+ */
+static inline void trans_trace_event(enum TransTraceOp op, size_t lba,
+					const Address &addr) {
+
+	TransTraceRing &ring = trans_trace_ring;
+	struct trans_trace_rec &rec = ring.recs[ring.count];
+
+	rec.seq = __atomic_fetch_add(&trans_trace_seq, 1, __ATOMIC_RELAXED);
+	rec.lba = lba;
+	rec.plane = addr.plane;
+	rec.block = addr.block;
+	rec.page = addr.page;
+	rec.package = addr.package;
+	rec.die = addr.die;
+	rec.op = op;
+
+	if (++ring.count == TRANS_TRACE_RING_RECS)
+		ring.Flush();
+}
+
+static inline void trans_trace_event(enum TransTraceOp op, size_t lba) {
+	trans_trace_event(op, lba, Address(0, 0, 0, 0, 0));
+}
+
+#endif /* __TRANSTRACE_H__ */
@@ -0,0 +1,48 @@
+/**
+ * @file wearsnap.cpp
+ * @brief Writer of the per-block wear/validity/role snapshot file
+ */
+
+#include "wearsnap.h"
+
+int WearSnapshotWriter::Open(const char *path,
+				const struct wear_snapshot_hdr &hdr) {
+
+	Close();
+
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		return -1;
+
+	num_blocks = hdr.num_blocks;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+		Close();
+		return -1;
+	}
+
+	return 0;
+}
+
+void WearSnapshotWriter::Write(const struct wear_snapshot_frame &frame,
+			const uint16_t *erases, const uint16_t *valid,
+			const uint8_t *roles) {
+
+	if (fp == NULL)
+		return;
+
+	/* One frame per call, stdio coalesces them into large writes */
+	fwrite(&frame, sizeof(frame), 1, fp);
+	fwrite(erases, sizeof(erases[0]), num_blocks, fp);
+	fwrite(valid, sizeof(valid[0]), num_blocks, fp);
+	fwrite(roles, sizeof(roles[0]), num_blocks, fp);
+}
+
+void WearSnapshotWriter::Close() {
+
+	if (fp == NULL)
+		return;
+
+	fclose(fp);
+	fp = NULL;
+}
@@ -0,0 +1,88 @@
+/**
+ * @file wearsnap.h
+ * @brief Periodic per-block wear/validity/role snapshots of the simulator
+ *
+ * The snapshot file is columnar: struct wear_snapshot_hdr, then one frame per
+ * snapshot. A frame is struct wear_snapshot_frame followed by three columns
+ * of num_blocks entries each, in linear block order:
+ *   uint16_t erases[num_blocks]     erases performed on the block so far
+ *   uint16_t valid[num_blocks]      pages holding the latest copy of an LBA
+ *   uint8_t  role[num_blocks]       BlockRole reported by the FTL
+ *
+ * All frames have the same size, see wear_snapshot_frame_size(). The file is
+ * decoded by tools/wear_heatmap.
+ */
+
+#ifndef __WEARSNAP_H__
+#define __WEARSNAP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define WEAR_SNAPSHOT_MAGIC	0x314e5357	/* "WSN1" */
+
+struct wear_snapshot_hdr {
+	uint32_t magic;
+	uint32_t num_blocks;
+	uint32_t pages_per_block;
+	uint32_t block_erases;
+	uint64_t period;
+	uint64_t reserved;
+};
+
+struct wear_snapshot_frame {
+	uint64_t host_writes;
+	uint64_t flash_writes;
+	uint64_t flash_erases;
+	uint64_t reserved;
+};
+
+static_assert(sizeof(struct wear_snapshot_hdr) == 32, "header changed");
+static_assert(sizeof(struct wear_snapshot_frame) == 32, "frame changed");
+
+static inline size_t wear_snapshot_frame_size(size_t num_blocks) {
+	return sizeof(struct wear_snapshot_frame) +
+		num_blocks * (2 * sizeof(uint16_t) + sizeof(uint8_t));
+}
+
+/*
+ * class WearSnapshotWriter - Appends snapshot frames to the snapshot file
+ */
+class WearSnapshotWriter {
+
+	private:
+
+	FILE *fp;
+	size_t num_blocks;
+
+	public:
+
+	WearSnapshotWriter() : fp{NULL}, num_blocks{0} {}
+
+	~WearSnapshotWriter() {
+		Close();
+	}
+
+	/*
+	 * Open() - Create the snapshot file and write its header
+	 *
+	 * Returns 0 on success, -1 on failure
+	 */
+	int Open(const char *path, const struct wear_snapshot_hdr &hdr);
+
+	/*
+	 * Write() - Append one frame. Each column holds num_blocks entries.
+	 */
+	void Write(const struct wear_snapshot_frame &frame,
+			const uint16_t *erases, const uint16_t *valid,
+			const uint8_t *roles);
+
+	void Close();
+
+	bool IsOpen() const {
+		return fp != NULL;
+	}
+};
+
+#endif /* __WEARSNAP_H__ */
@@ -32,9 +32,8 @@ int main(int argc, char *argv[]) {
 
     int r;
     const size_t num_raw_blocks = SSD_SIZE * PACKAGE_SIZE * DIE_SIZE * PLANE_SIZE;
-    const size_t num_nondata_blocks = OVERPROVISIONING * num_raw_blocks;
-    const size_t num_blocks = num_raw_blocks - num_nondata_blocks;
-    const size_t num_pages = num_blocks * BLOCK_SIZE;
+    const size_t num_pages = NumExportedLBAs(num_raw_blocks, BLOCK_SIZE,
+                                             OVERPROVISIONING * 100);
     FlashSimTest test(argv[1]);
 
     TEST_PAGE_TYPE latest_value = 0;
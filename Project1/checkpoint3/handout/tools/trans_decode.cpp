@@ -0,0 +1,271 @@
+/**
+ * @file trans_decode.cpp
+ * @brief Offline decoder of the binary transaction trace (see transtrace.h)
+ *
+ * Usage: trans_decode [-s] [-a interval [-g]] <trace_file>
+ *   (default)    print one line per event
+ *   -s           print a summary of the trace
+ *   -a interval  print "host_writes flash_writes write_amp" every interval
+ *                host writes, suitable as gnuplot data
+ *   -g           with -a, plot the write amplification into
+ *                trans_trace_graph.png using gnuplot
+ *
+ * Text format, one event per line:
+ *   HR <lba>                       host read
+ *   HW <lba>                       host write
+ *   HT <lba>                       host trim
+ *   R <lba> <plane,block,page>     flash read
+ *   W 1 <lba> <plane,block,page>   flash write
+ *   E <plane,block>                flash erase
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+
+#include "transtrace.h"
+
+static void usage(const char *prog) {
+	printf("usage: %s [-s] [-a interval [-g]] <trace_file>\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+static void print_event(const struct trans_trace_rec &rec) {
+
+	switch (rec.op) {
+	case TT_HOST_READ:
+		printf("HR %u\n", rec.lba);
+		break;
+	case TT_HOST_WRITE:
+		printf("HW %u\n", rec.lba);
+		break;
+	case TT_HOST_TRIM:
+		printf("HT %u\n", rec.lba);
+		break;
+	case TT_READ:
+		printf("R %u <%d,%d,%d>\n", rec.lba, rec.plane, rec.block,
+			rec.page);
+		break;
+	case TT_WRITE:
+		printf("W 1 %u <%d,%d,%d>\n", rec.lba, rec.plane, rec.block,
+			rec.page);
+		break;
+	case TT_ERASE:
+		printf("E <%d,%d>\n", rec.plane, rec.block);
+		break;
+	default:
+		printf("? %u\n", rec.op);
+	}
+}
+
+/*
+ * Number of records in the trace of a crashed run. The file is preallocated
+ * sparse, so skip to the end of its last data extent and then back over the
+ * unused (all zero) slots before it.
+ */
+static uint64_t crashed_num_recs(int fd, off_t file_size,
+				const struct trans_trace_rec *recs) {
+
+	static const struct trans_trace_rec zero_rec = {};
+	off_t end = 0, pos = 0;
+
+	for (;;) {
+		off_t data = lseek(fd, pos, SEEK_DATA);
+
+		if (data < 0) {
+			/* No hole support, look at the whole file */
+			if (errno != ENXIO)
+				end = file_size;
+			break;
+		}
+
+		pos = lseek(fd, data, SEEK_HOLE);
+		if (pos < 0) {
+			end = file_size;
+			break;
+		}
+		end = pos;
+	}
+
+	if (end <= (off_t)sizeof(struct trans_trace_hdr))
+		return 0;
+
+	uint64_t num_recs = (end - sizeof(struct trans_trace_hdr) +
+		sizeof(struct trans_trace_rec) - 1) /
+		sizeof(struct trans_trace_rec);
+
+	num_recs = std::min(num_recs, (uint64_t)(file_size -
+		sizeof(struct trans_trace_hdr)) / sizeof(struct trans_trace_rec));
+
+	while (num_recs > 0 &&
+		memcmp(&recs[num_recs - 1], &zero_rec, sizeof(zero_rec)) == 0)
+		num_recs--;
+
+	return num_recs;
+}
+
+int main(int argc, char *argv[]) {
+
+	bool summary = false;
+	bool plot = false;
+	uint64_t interval = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "sa:g")) != -1) {
+		switch (opt) {
+		case 's':
+			summary = true;
+			break;
+		case 'a':
+			interval = strtoull(optarg, NULL, 0);
+			break;
+		case 'g':
+			plot = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 1 || (plot && interval == 0))
+		usage(argv[0]);
+
+	int fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 ||
+			(size_t)st.st_size < sizeof(struct trans_trace_hdr)) {
+		printf("%s: not a trace file\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	const struct trans_trace_hdr *hdr =
+		(const struct trans_trace_hdr *)map;
+
+	const struct trans_trace_rec *recs =
+		(const struct trans_trace_rec *)(hdr + 1);
+	uint64_t num_recs = (st.st_size - sizeof(*hdr)) /
+		sizeof(struct trans_trace_rec);
+
+	/*
+	 * A trace of a crashed run has no header. The records copied into the
+	 * file are still usable, those still in the per-thread rings are lost.
+	 */
+	if (hdr->magic == TRANS_TRACE_MAGIC) {
+		if (hdr->rec_size != sizeof(struct trans_trace_rec)) {
+			printf("Unsupported record size %u\n", hdr->rec_size);
+			exit(EXIT_FAILURE);
+		}
+		num_recs = std::min(num_recs, hdr->num_recs);
+	} else {
+		fprintf(stderr, "Warning: trace was not closed, header is "
+				"missing and up to %d records per thread are "
+				"lost\n", TRANS_TRACE_RING_RECS);
+		num_recs = crashed_num_recs(fd, st.st_size, recs);
+	}
+
+	/*
+	 * Rings of different threads land in the file chunk by chunk. Only
+	 * pay for sorting when the trace actually is out of order.
+	 */
+	std::vector<struct trans_trace_rec> sorted;
+	for (uint64_t i = 1; i < num_recs; i++) {
+		if (recs[i].seq < recs[i - 1].seq) {
+			sorted.assign(recs, recs + num_recs);
+			std::sort(sorted.begin(), sorted.end(),
+				[](const struct trans_trace_rec &a,
+				   const struct trans_trace_rec &b) {
+					return a.seq < b.seq;
+				});
+			recs = sorted.data();
+			break;
+		}
+	}
+
+	FILE *dat = stdout;
+	if (plot) {
+		dat = fopen("__write.dat", "w");
+		if (dat == NULL) {
+			perror("__write.dat");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	uint64_t counts[TT_MAX] = {0};
+
+	for (uint64_t i = 0; i < num_recs; i++) {
+
+		const struct trans_trace_rec &rec = recs[i];
+
+		if (rec.op < TT_MAX)
+			counts[rec.op]++;
+
+		if (interval) {
+			if (rec.op == TT_HOST_WRITE &&
+				counts[TT_HOST_WRITE] % interval == 0)
+				fprintf(dat, "%lu %lu %f\n",
+					counts[TT_HOST_WRITE],
+					counts[TT_WRITE],
+					(double)counts[TT_WRITE] /
+					counts[TT_HOST_WRITE]);
+		} else if (!summary) {
+			print_event(rec);
+		}
+	}
+
+	if (plot) {
+		fclose(dat);
+		FILE *gp = popen("gnuplot", "w");
+		if (gp == NULL) {
+			perror("gnuplot");
+			exit(EXIT_FAILURE);
+		}
+		fprintf(gp, "set title 'Writes Amplification Tracker'\n"
+			"set ylabel 'Write Amplification Ratio'\n"
+			"set xlabel 'Host Writes'\n"
+			"set term png\n"
+			"set output \"trans_trace_graph.png\"\n"
+			"plot \"__write.dat\" using 1:3 with lines notitle\n");
+		pclose(gp);
+	}
+
+	if (summary) {
+		uint64_t host_writes = counts[TT_HOST_WRITE];
+
+		printf("RECORDS = %lu\n", num_recs);
+		printf("DROPPED = %lu\n", hdr->magic == TRANS_TRACE_MAGIC ?
+			hdr->dropped : 0);
+		printf("HOST READS = %lu\n", counts[TT_HOST_READ]);
+		printf("HOST WRITES = %lu\n", host_writes);
+		printf("HOST TRIMS = %lu\n", counts[TT_HOST_TRIM]);
+		printf("FLASH READS = %lu\n", counts[TT_READ]);
+		printf("FLASH WRITES = %lu\n", counts[TT_WRITE]);
+		printf("FLASH ERASES = %lu\n", counts[TT_ERASE]);
+		printf("WRITE AMPLIFICATION = %f\n", host_writes ?
+			(double)counts[TT_WRITE] / host_writes : 0.0);
+		printf("ERASES PER HOST WRITE = %f\n", host_writes ?
+			(double)counts[TT_ERASE] / host_writes : 0.0);
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,231 @@
+/**
+ * @file wear_heatmap.cpp
+ * @brief Renders the wear snapshot file (see wearsnap.h) as heatmaps
+ *
+ * Usage: wear_heatmap [-m erase|valid|role [-g]] <snapshot_file>
+ *   (default)  print one summary line per snapshot: host writes, write
+ *              amplification, min/max/mean/stddev of block erases and the
+ *              mean valid pages of data, log and cleaning blocks
+ *   -m column  print the column as a gnuplot matrix, one row per snapshot
+ *              and one column per block
+ *   -g         with -m, plot the matrix into wear_<column>.png using gnuplot
+ */
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "wearsnap.h"
+
+enum column_t {
+	COL_NONE,
+	COL_ERASE,
+	COL_VALID,
+	COL_ROLE,
+};
+
+static void usage(const char *prog) {
+	printf("usage: %s [-m erase|valid|role [-g]] <snapshot_file>\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+/* Columns of frame i */
+struct frame_view {
+	const struct wear_snapshot_frame *frame;
+	const uint16_t *erases;
+	const uint16_t *valid;
+	const uint8_t *roles;
+};
+
+static struct frame_view get_frame(const char *base, size_t num_blocks,
+					size_t i) {
+
+	struct frame_view v;
+	const char *p = base + sizeof(struct wear_snapshot_hdr) +
+		i * wear_snapshot_frame_size(num_blocks);
+
+	v.frame = (const struct wear_snapshot_frame *)p;
+	p += sizeof(struct wear_snapshot_frame);
+	v.erases = (const uint16_t *)p;
+	p += num_blocks * sizeof(uint16_t);
+	v.valid = (const uint16_t *)p;
+	p += num_blocks * sizeof(uint16_t);
+	v.roles = (const uint8_t *)p;
+
+	return v;
+}
+
+static void print_summary(const struct frame_view &v, size_t num_blocks) {
+
+	uint16_t min = UINT16_MAX, max = 0;
+	double sum = 0, sq_sum = 0;
+	double valid_sum[4] = {0};
+	size_t role_count[4] = {0};
+
+	for (size_t b = 0; b < num_blocks; b++) {
+		uint16_t e = v.erases[b];
+		min = e < min ? e : min;
+		max = e > max ? e : max;
+		sum += e;
+		sq_sum += (double)e * e;
+
+		size_t role = v.roles[b] < 4 ? v.roles[b] : 0;
+		valid_sum[role] += v.valid[b];
+		role_count[role]++;
+	}
+
+	double mean = sum / num_blocks;
+	double stddev = sqrt(sq_sum / num_blocks - mean * mean);
+
+	auto avg = [&](BlockRole r) {
+		size_t i = static_cast<size_t>(r);
+		return role_count[i] ? valid_sum[i] / role_count[i] : 0.0;
+	};
+
+	printf("%lu %f %u %u %f %f %f %f %f\n", v.frame->host_writes,
+		v.frame->host_writes ?
+		(double)v.frame->flash_writes / v.frame->host_writes : 0.0,
+		min, max, mean, stddev, avg(BlockRole::DATA),
+		avg(BlockRole::LOG), avg(BlockRole::CLEANING));
+}
+
+int main(int argc, char *argv[]) {
+
+	enum column_t column = COL_NONE;
+	const char *column_name = NULL;
+	bool plot = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:g")) != -1) {
+		switch (opt) {
+		case 'm':
+			column_name = optarg;
+			if (strcmp(optarg, "erase") == 0)
+				column = COL_ERASE;
+			else if (strcmp(optarg, "valid") == 0)
+				column = COL_VALID;
+			else if (strcmp(optarg, "role") == 0)
+				column = COL_ROLE;
+			else
+				usage(argv[0]);
+			break;
+		case 'g':
+			plot = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 1 || (plot && column == COL_NONE))
+		usage(argv[0]);
+
+	int fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 ||
+			(size_t)st.st_size < sizeof(struct wear_snapshot_hdr)) {
+		printf("%s: not a snapshot file\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *base = (const char *)mmap(NULL, st.st_size, PROT_READ,
+						MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	const struct wear_snapshot_hdr *hdr =
+		(const struct wear_snapshot_hdr *)base;
+
+	if (hdr->magic != WEAR_SNAPSHOT_MAGIC || hdr->num_blocks == 0) {
+		printf("%s: not a snapshot file\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	size_t num_blocks = hdr->num_blocks;
+	size_t num_frames = (st.st_size - sizeof(*hdr)) /
+		wear_snapshot_frame_size(num_blocks);
+
+	FILE *out = stdout;
+	char dat_name[64], png_name[64];
+
+	if (plot) {
+		snprintf(dat_name, sizeof(dat_name), "__wear_%s.dat",
+				column_name);
+		snprintf(png_name, sizeof(png_name), "wear_%s.png",
+				column_name);
+		out = fopen(dat_name, "w");
+		if (out == NULL) {
+			perror(dat_name);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (column == COL_NONE)
+		printf("# host_writes write_amp erase_min erase_max erase_mean "
+			"erase_stddev valid_data valid_log valid_cleaning\n");
+
+	for (size_t i = 0; i < num_frames; i++) {
+
+		struct frame_view v = get_frame(base, num_blocks, i);
+
+		if (column == COL_NONE) {
+			print_summary(v, num_blocks);
+			continue;
+		}
+
+		for (size_t b = 0; b < num_blocks; b++) {
+			unsigned int val;
+
+			if (column == COL_ERASE)
+				val = v.erases[b];
+			else if (column == COL_VALID)
+				val = v.valid[b];
+			else
+				val = v.roles[b];
+
+			fprintf(out, b ? " %u" : "%u", val);
+		}
+		fprintf(out, "\n");
+	}
+
+	if (plot) {
+		fclose(out);
+
+		unsigned int cbmax = column == COL_ERASE ? hdr->block_erases :
+			column == COL_VALID ? hdr->pages_per_block : 3;
+
+		FILE *gp = popen("gnuplot", "w");
+		if (gp == NULL) {
+			perror("gnuplot");
+			exit(EXIT_FAILURE);
+		}
+		fprintf(gp, "set title 'Block %s (one row every %lu host "
+			"writes)'\n"
+			"set xlabel 'Linear Block ID'\n"
+			"set ylabel 'Snapshot'\n"
+			"set cbrange [0:%u]\n"
+			"set term png size 1200,800\n"
+			"set output \"%s\"\n"
+			"plot \"%s\" matrix with image notitle\n",
+			column_name, hdr->period, cbmax, png_name, dat_name);
+		pclose(gp);
+	}
+
+	munmap((void *)base, st.st_size);
+	close(fd);
+
+	return 0;
+}
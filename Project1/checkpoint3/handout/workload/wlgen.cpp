@@ -0,0 +1,341 @@
+/**
+ * @file wlgen.cpp
+ * @brief Driver that runs a synthetic workload against the FTL through
+ * FlashSimTest and reports write amplification, erases per host write and
+ * per-op latency percentiles
+ *
+ * Usage: wlgen [options] <config_file> <log_file>
+ *   -p pattern   uniform, zipfian, hotcold80, hotcold90, seq, strided, mixed
+ *   -n ops       number of operations to issue (default: 10 x LBA count)
+ *   -s seed      seed of the generator (default: 15746)
+ *   -r fraction  fraction of reads (overrides the pattern preset)
+ *   -t fraction  fraction of trims
+ *   -z theta     zipfian skew, not 1 (default: 0.99)
+ *   -S stride    stride in pages for the strided pattern (default: 64)
+ *   -o fraction  random overwrite probability of seq (default: 0.1)
+ *   -P           fill every LBA sequentially before measuring
+ *   -v           verify every successful read against a shadow copy
+ *   -k period    checkpoint the FTL's mapping every period host operations
+ *   -C interval  power cycle the FTL every interval operations (needs -k),
+ *                and report the latency of recovery
+ *   -l image     start from an SSD image instead of a fresh device
+ *   -w image     save an SSD image at the end of the run
+ *
+ * Images keep flash contents, wear and the FTL's state, so an aged device
+ * can be preconditioned once (e.g. -P -n <many> -w aged.img) and reused by
+ * later runs with -l aged.img. -v only knows the contents written in the
+ * current run.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "746FlashSim.h"
+#include "workload.h"
+
+static void usage(const char *prog) {
+	printf("usage: %s [-p pattern] [-n ops] [-s seed] [-r read_fraction] "
+		"[-t trim_fraction]\n\t[-z theta] [-S stride] "
+		"[-o overwrite_fraction] [-P] [-v]\n\t[-k checkpoint_period] "
+		"[-C cycle_interval] [-l image] [-w image]\n\t"
+		"<config_file> <log_file>\n",
+		prog);
+	printf("patterns: uniform zipfian hotcold80 hotcold90 seq strided "
+		"mixed\n");
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Stamp a page with a value which the shadow copy can later compare */
+static inline void fill_page(TEST_PAGE_TYPE *page, uint32_t value) {
+#if ENABLE_LARGE_DATASTORE_PAGE
+	memset(page->buf, 0, sizeof(page->buf));
+	memcpy(page->buf, &value, sizeof(value));
+#else
+	*page = value;
+#endif
+}
+
+static inline uint32_t page_value(const TEST_PAGE_TYPE &page) {
+#if ENABLE_LARGE_DATASTORE_PAGE
+	uint32_t value;
+	memcpy(&value, page.buf, sizeof(value));
+	return value;
+#else
+	return page;
+#endif
+}
+
+int main(int argc, char *argv[]) {
+
+	WorkloadParams params;
+	uint64_t num_ops = 0;
+	bool prefill = false;
+	bool verify = false;
+	double read_fraction = -1;
+	uint64_t checkpoint_period = 0;
+	uint64_t cycle_interval = 0;
+	const char *load_image = NULL;
+	const char *save_image = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:n:s:r:t:z:S:o:Pvk:C:l:w:")) != -1) {
+		switch (opt) {
+		case 'p':
+			if (!params.SetPattern(optarg)) {
+				printf("Unknown pattern %s\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 'n':
+			num_ops = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			params.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			read_fraction = atof(optarg);
+			break;
+		case 't':
+			params.trim_fraction = atof(optarg);
+			break;
+		case 'z':
+			params.zipf_theta = atof(optarg);
+			break;
+		case 'S':
+			params.stride = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			params.random_overwrite = atof(optarg);
+			break;
+		case 'P':
+			prefill = true;
+			break;
+		case 'v':
+			verify = true;
+			break;
+		case 'k':
+			checkpoint_period = strtoull(optarg, NULL, 0);
+			break;
+		case 'C':
+			cycle_interval = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			load_image = optarg;
+			break;
+		case 'w':
+			save_image = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	/* The zeta/eta setup of the zipfian generator divides by 1 - theta */
+	if (params.zipf_theta == 1.0) {
+		printf("Zipfian skew (-z) must not be 1\n");
+		usage(argv[0]);
+	}
+
+	if (cycle_interval && !checkpoint_period) {
+		printf("Power cycles need a checkpoint period (-k)\n");
+		usage(argv[0]);
+	}
+
+	/* -r is applied last so that it wins over the presets of -p */
+	if (read_fraction >= 0)
+		params.read_fraction = read_fraction;
+
+	const char *conf_path = argv[optind];
+	const char *log_path = argv[optind + 1];
+
+	FILE *log = fopen(log_path, "w+");
+	if (log == NULL) {
+		printf("Can't open log file %s\n", log_path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Same exported LBA count as the tests, derived from the geometry */
+	FlashSimConf conf(conf_path);
+	const size_t num_lbas = conf.GetNumLBAs();
+
+	if (num_ops == 0)
+		num_ops = 10 * num_lbas;
+
+	init_flashsim();
+
+	FlashSimTest test(conf_path);
+	WorkloadGenerator gen(params, num_lbas);
+	uint64_t load_ns = 0;
+
+	if (load_image) {
+		uint64_t start = now_ns();
+
+		if (test.LoadImage(load_image) != 1)
+			exit(EXIT_FAILURE);
+		load_ns = now_ns() - start;
+	}
+
+	if (checkpoint_period && !test.EnableRecovery(checkpoint_period)) {
+		printf("The FTL can't be checkpointed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* 0 means never written (or trimmed), as in the tests */
+	std::vector<uint32_t> shadow(num_lbas, 0);
+	uint32_t next_value = 1;
+	TEST_PAGE_TYPE page;
+	int ret = 0;
+	int r;
+
+	if (prefill) {
+		for (size_t lba = 0; lba < num_lbas; lba++) {
+			fill_page(&page, next_value);
+			r = test.Write(NULL, lba, page);
+			if (r != 1) {
+				fprintf(log, "Prefill stopped at LBA %zu\n", lba);
+				break;
+			}
+			shadow[lba] = next_value++;
+		}
+	}
+
+	/* Only the measured phase counts towards the reported ratios */
+	uint64_t base_writes = test.TotalWritesPerformed();
+	uint64_t base_erases = test.TotalErasesPerformed();
+
+	LatencyRecorder read_lat, write_lat, trim_lat, recover_lat;
+	uint64_t replayed = 0, scanned = 0;
+	uint64_t host_writes = 0;
+	uint64_t ops_done = 0;
+	uint64_t mismatches = 0;
+	bool worn_out = false;
+
+	for (ops_done = 0; ops_done < num_ops && !worn_out; ops_done++) {
+
+		WorkloadOp op = gen.Next();
+		uint64_t start = now_ns();
+
+		switch (op.type) {
+		case WorkloadOpType::READ:
+			r = test.Read(NULL, op.lba, &page);
+			read_lat.Add(now_ns() - start);
+			if (verify && shadow[op.lba] != 0 && r != -1 &&
+				(r == 0 || page_value(page) != shadow[op.lba])) {
+				fprintf(log, "Lost or corrupted LBA %zu\n", op.lba);
+				mismatches++;
+			}
+			break;
+
+		case WorkloadOpType::TRIM:
+			r = test.Trim(NULL, op.lba);
+			trim_lat.Add(now_ns() - start);
+			if (r == 1)
+				shadow[op.lba] = 0;
+			break;
+
+		case WorkloadOpType::WRITE:
+			fill_page(&page, next_value);
+			start = now_ns();
+			r = test.Write(NULL, op.lba, page);
+			write_lat.Add(now_ns() - start);
+			if (r == 1) {
+				shadow[op.lba] = next_value++;
+				host_writes++;
+			} else if (r == 0) {
+				fprintf(log, "FTL refused write to LBA %zu after "
+					"%lu ops\n", op.lba, ops_done);
+				worn_out = true;
+			}
+			break;
+		}
+
+		if (r == -1) {
+			fprintf(log, "Fatal error at LBA %zu\n", op.lba);
+			ret = 1;
+			break;
+		}
+
+		if (cycle_interval && (ops_done + 1) % cycle_interval == 0) {
+			start = now_ns();
+			r = test.PowerCycle(log);
+			recover_lat.Add(now_ns() - start);
+			if (r != 1) {
+				fprintf(log, "Recovery failed after %lu ops\n",
+					ops_done + 1);
+				ret = 1;
+				break;
+			}
+			replayed += test.RecoveryStats().records_replayed;
+			scanned += test.RecoveryStats().pages_scanned;
+		}
+	}
+
+	uint64_t flash_writes = test.TotalWritesPerformed() - base_writes;
+	uint64_t flash_erases = test.TotalErasesPerformed() - base_erases;
+
+	if (save_image && test.SaveImage(save_image) != 1)
+		ret = 1;
+
+	FILE *outs[] = { stdout, log };
+	for (FILE *out : outs) {
+		fprintf(out,
+		"-----------------------------------------------------\n");
+		fprintf(out, "PATTERN = %s\n", gen.PatternName());
+		fprintf(out, "SEED = %lu\n", params.seed);
+		fprintf(out, "LBAS = %zu\n", num_lbas);
+		if (load_image)
+			fprintf(out, "IMAGE LOAD = %.3f ms\n", load_ns / 1e6);
+		fprintf(out, "OPS = %lu\n", ops_done);
+		fprintf(out, "HOST WRITES = %lu\n", host_writes);
+		fprintf(out, "FLASH WRITES = %lu\n", flash_writes);
+		fprintf(out, "FLASH ERASES = %lu\n", flash_erases);
+		fprintf(out, "WRITE AMPLIFICATION = %f\n", host_writes ?
+			(double)flash_writes / host_writes : 0.0);
+		fprintf(out, "ERASES PER HOST WRITE = %f\n", host_writes ?
+			(double)flash_erases / host_writes : 0.0);
+		if (verify)
+			fprintf(out, "READ MISMATCHES = %lu\n", mismatches);
+		read_lat.Report(out, "read");
+		write_lat.Report(out, "write");
+		trim_lat.Report(out, "trim");
+		if (checkpoint_period) {
+			const struct recovery_stats &stats =
+				test.RecoveryStats();
+
+			fprintf(out, "CHECKPOINTS = %lu\n", stats.checkpoints);
+			fprintf(out, "METADATA PAGES = %lu\n",
+				stats.meta_pages);
+		}
+		if (recover_lat.Count()) {
+			fprintf(out, "OPS REPLAYED PER RECOVERY = %f\n",
+				(double)replayed / recover_lat.Count());
+			fprintf(out, "PAGES SCANNED PER RECOVERY = %f\n",
+				(double)scanned / recover_lat.Count());
+			recover_lat.Report(out, "recover");
+		}
+		fprintf(out,
+		"-----------------------------------------------------\n");
+	}
+
+	if (mismatches)
+		ret = 1;
+
+	fclose(log);
+	deinit_flashsim();
+
+	return ret;
+}
@@ -0,0 +1,231 @@
+/**
+ * @file workload.cpp
+ * @brief Implementation of the synthetic workload generator
+ */
+
+#include <math.h>
+#include <algorithm>
+#include "workload.h"
+
+bool WorkloadParams::SetPattern(const std::string &name) {
+
+	if (name == "uniform") {
+		pattern = WorkloadPattern::UNIFORM;
+	} else if (name == "zipfian") {
+		pattern = WorkloadPattern::ZIPFIAN;
+	} else if (name == "hotcold80") {
+		pattern = WorkloadPattern::HOTCOLD;
+		hot_fraction = 0.2;
+		hot_access = 0.8;
+	} else if (name == "hotcold90") {
+		pattern = WorkloadPattern::HOTCOLD;
+		hot_fraction = 0.1;
+		hot_access = 0.9;
+	} else if (name == "seq") {
+		pattern = WorkloadPattern::SEQ_OVERWRITE;
+	} else if (name == "strided") {
+		pattern = WorkloadPattern::STRIDED;
+	} else if (name == "mixed") {
+		pattern = WorkloadPattern::MIXED;
+		read_fraction = 0.5;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+WorkloadGenerator::WorkloadGenerator(const WorkloadParams &p_params,
+		size_t p_num_lbas) :
+	params(p_params),
+	num_lbas{p_num_lbas},
+	rng(p_params.seed),
+	coin(0.0, 1.0),
+	cursor{0},
+	stride_base{0},
+	zipf_alpha{0},
+	zipf_zetan{0},
+	zipf_eta{0},
+	zipf_scatter{}
+{
+	if (params.pattern != WorkloadPattern::ZIPFIAN)
+		return;
+
+	double theta = params.zipf_theta;
+	for (size_t i = 1; i <= num_lbas; i++)
+		zipf_zetan += 1.0 / pow((double)i, theta);
+
+	double zeta2 = 1.0 + pow(0.5, theta);
+	zipf_alpha = 1.0 / (1.0 - theta);
+	zipf_eta = (1.0 - pow(2.0 / num_lbas, 1.0 - theta)) /
+		(1.0 - zeta2 / zipf_zetan);
+
+	/*
+	 * Popular ranks are scattered over the address space. Otherwise all
+	 * hot LBAs would sit in the first few blocks, which is just a hot/cold
+	 * workload with a different name.
+	 */
+	zipf_scatter.resize(num_lbas);
+	for (size_t i = 0; i < num_lbas; i++)
+		zipf_scatter[i] = i;
+	std::shuffle(zipf_scatter.begin(), zipf_scatter.end(), rng);
+}
+
+size_t WorkloadGenerator::NextUniform() {
+	return std::uniform_int_distribution<size_t>(0, num_lbas - 1)(rng);
+}
+
+size_t WorkloadGenerator::NextZipfian() {
+
+	double u = coin(rng);
+	double uz = u * zipf_zetan;
+	size_t rank;
+
+	if (uz < 1.0)
+		rank = 0;
+	else if (uz < 1.0 + pow(0.5, params.zipf_theta))
+		rank = 1;
+	else
+		rank = (size_t)(num_lbas *
+			pow(zipf_eta * u - zipf_eta + 1.0, zipf_alpha));
+
+	if (rank >= num_lbas)
+		rank = num_lbas - 1;
+
+	return zipf_scatter[rank];
+}
+
+size_t WorkloadGenerator::NextHotCold() {
+
+	size_t hot_lbas = (size_t)(params.hot_fraction * num_lbas);
+
+	if (hot_lbas == 0 || hot_lbas >= num_lbas)
+		return NextUniform();
+
+	if (coin(rng) < params.hot_access)
+		return std::uniform_int_distribution<size_t>(0,
+				hot_lbas - 1)(rng);
+
+	return std::uniform_int_distribution<size_t>(hot_lbas,
+			num_lbas - 1)(rng);
+}
+
+size_t WorkloadGenerator::NextSeqOverwrite() {
+
+	if (coin(rng) < params.random_overwrite)
+		return NextUniform();
+
+	size_t lba = cursor;
+	cursor = (cursor + 1) % num_lbas;
+	return lba;
+}
+
+size_t WorkloadGenerator::NextStrided() {
+
+	size_t lba = cursor;
+
+	cursor += params.stride ? params.stride : 1;
+	if (cursor >= num_lbas) {
+		/*
+		 * Shift by one so that every LBA gets visited eventually. A
+		 * stride past the end visits the LBAs in order.
+		 */
+		stride_base = (stride_base + 1) %
+			std::min(std::max(params.stride, (size_t)1), num_lbas);
+		cursor = stride_base;
+	}
+
+	return lba;
+}
+
+WorkloadOp WorkloadGenerator::Next() {
+
+	WorkloadOp op;
+	double dice = coin(rng);
+
+	if (dice < params.read_fraction)
+		op.type = WorkloadOpType::READ;
+	else if (dice < params.read_fraction + params.trim_fraction)
+		op.type = WorkloadOpType::TRIM;
+	else
+		op.type = WorkloadOpType::WRITE;
+
+	switch (params.pattern) {
+	case WorkloadPattern::ZIPFIAN:
+		op.lba = NextZipfian();
+		break;
+	case WorkloadPattern::HOTCOLD:
+		op.lba = NextHotCold();
+		break;
+	case WorkloadPattern::SEQ_OVERWRITE:
+		op.lba = NextSeqOverwrite();
+		break;
+	case WorkloadPattern::STRIDED:
+		op.lba = NextStrided();
+		break;
+	case WorkloadPattern::UNIFORM:
+	case WorkloadPattern::MIXED:
+	default:
+		op.lba = NextUniform();
+		break;
+	}
+
+	return op;
+}
+
+const char *WorkloadGenerator::PatternName() const {
+
+	switch (params.pattern) {
+	case WorkloadPattern::UNIFORM:
+		return "uniform";
+	case WorkloadPattern::ZIPFIAN:
+		return "zipfian";
+	case WorkloadPattern::HOTCOLD:
+		return "hotcold";
+	case WorkloadPattern::SEQ_OVERWRITE:
+		return "seq";
+	case WorkloadPattern::STRIDED:
+		return "strided";
+	case WorkloadPattern::MIXED:
+		return "mixed";
+	}
+
+	return "unknown";
+}
+
+uint64_t LatencyRecorder::Percentile(double p) {
+
+	if (samples.empty())
+		return 0;
+
+	if (!sorted) {
+		std::sort(samples.begin(), samples.end());
+		sorted = true;
+	}
+
+	size_t idx = (size_t)ceil(p / 100.0 * samples.size());
+	if (idx > 0)
+		idx--;
+	if (idx >= samples.size())
+		idx = samples.size() - 1;
+
+	return samples[idx];
+}
+
+void LatencyRecorder::Report(FILE *out, const char *name) {
+
+	if (samples.empty()) {
+		fprintf(out, "%-6s count=0\n", name);
+		return;
+	}
+
+	double sum = 0;
+	for (uint64_t ns : samples)
+		sum += ns;
+
+	fprintf(out, "%-6s count=%zu mean=%.0fns p50=%luns p90=%luns "
+			"p99=%luns p99.9=%luns max=%luns\n", name,
+			samples.size(), sum / samples.size(),
+			Percentile(50), Percentile(90), Percentile(99),
+			Percentile(99.9), Percentile(100));
+}
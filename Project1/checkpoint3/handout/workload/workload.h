@@ -0,0 +1,180 @@
+/**
+ * @file workload.h
+ * @brief Reusable synthetic workload generator for driving any FTL through
+ * FlashSimTest. Every generator is fully determined by its parameters and
+ * seed, so that two runs with the same arguments issue the same operations.
+ */
+
+#ifndef __WORKLOAD_H__
+#define __WORKLOAD_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+ * enum class WorkloadPattern - Address patterns the generator can produce
+ */
+enum class WorkloadPattern {
+	UNIFORM,	/* Uniformly random LBAs */
+	ZIPFIAN,	/* Zipfian popularity, hot LBAs scattered over space */
+	HOTCOLD,	/* hot_access of the ops go to hot_fraction of LBAs */
+	SEQ_OVERWRITE,	/* Sequential sweeps with random overwrites mixed in */
+	STRIDED,	/* Fixed stride, shifted by one on every wrap around */
+	MIXED,		/* Uniform LBAs, read_fraction defaults to 0.5 */
+};
+
+/*
+ * enum class WorkloadOpType - Kind of host operation to issue
+ */
+enum class WorkloadOpType {
+	READ,
+	WRITE,
+	TRIM,
+};
+
+/*
+ * struct WorkloadOp - One host operation produced by the generator
+ */
+struct WorkloadOp {
+	WorkloadOpType type;
+	size_t lba;
+};
+
+/*
+ * struct WorkloadParams - Knobs for WorkloadGenerator
+ *
+ * Fractions are in [0, 1]. Parameters that do not apply to the selected
+ * pattern are ignored.
+ */
+struct WorkloadParams {
+	WorkloadPattern pattern;
+	uint64_t seed;
+
+	/* Fraction of ops that are reads/trims, rest are writes */
+	double read_fraction;
+	double trim_fraction;
+
+	/* ZIPFIAN: skew, 0.99 is the customary YCSB value, must not be 1 */
+	double zipf_theta;
+
+	/* HOTCOLD: hot_access of the accesses hit hot_fraction of the LBAs */
+	double hot_fraction;
+	double hot_access;
+
+	/* SEQ_OVERWRITE: probability of a random LBA instead of the next one */
+	double random_overwrite;
+
+	/* STRIDED: distance between two consecutive LBAs */
+	size_t stride;
+
+	WorkloadParams() :
+		pattern{WorkloadPattern::UNIFORM},
+		seed{15746},
+		read_fraction{0.0},
+		trim_fraction{0.0},
+		zipf_theta{0.99},
+		hot_fraction{0.2},
+		hot_access{0.8},
+		random_overwrite{0.1},
+		stride{64}
+	{}
+
+	/*
+	 * SetPattern() - Select a pattern by name and apply its presets
+	 *
+	 * Accepts uniform, zipfian, hotcold80 (80/20), hotcold90 (90/10),
+	 * seq, strided and mixed. Returns false on an unknown name.
+	 */
+	bool SetPattern(const std::string &name);
+};
+
+/*
+ * class WorkloadGenerator - Produces a stream of WorkloadOp over the LBA
+ * range [0, num_lbas)
+ */
+class WorkloadGenerator {
+
+	private:
+
+	WorkloadParams params;
+	size_t num_lbas;
+	std::mt19937_64 rng;
+	std::uniform_real_distribution<double> coin;
+
+	/* Cursor of SEQ_OVERWRITE and STRIDED */
+	size_t cursor;
+	size_t stride_base;
+
+	/* ZIPFIAN state, see Gray et al., "Quickly generating billion-record
+	 * synthetic databases", SIGMOD 1994 */
+	double zipf_alpha;
+	double zipf_zetan;
+	double zipf_eta;
+	std::vector<uint32_t> zipf_scatter;
+
+	size_t NextUniform();
+	size_t NextZipfian();
+	size_t NextHotCold();
+	size_t NextSeqOverwrite();
+	size_t NextStrided();
+
+	public:
+
+	WorkloadGenerator(const WorkloadParams &p_params, size_t p_num_lbas);
+
+	/*
+	 * Next() - Return the next operation of the workload
+	 */
+	WorkloadOp Next();
+
+	/*
+	 * PatternName() - Human readable name of the configured pattern
+	 */
+	const char *PatternName() const;
+
+	size_t GetNumLBAs() const {
+		return num_lbas;
+	}
+};
+
+/*
+ * class LatencyRecorder - Collects per-op latencies in nanoseconds and
+ * reports percentiles
+ */
+class LatencyRecorder {
+
+	private:
+
+	std::vector<uint64_t> samples;
+	bool sorted;
+
+	public:
+
+	LatencyRecorder() : samples{}, sorted{true} {}
+
+	void Add(uint64_t ns) {
+		samples.push_back(ns);
+		sorted = false;
+	}
+
+	size_t Count() const {
+		return samples.size();
+	}
+
+	/*
+	 * Percentile() - Return the p-th percentile (0 < p <= 100), 0 if
+	 * there are no samples
+	 */
+	uint64_t Percentile(double p);
+
+	/*
+	 * Report() - Print count, mean and the usual percentiles on one line
+	 */
+	void Report(FILE *out, const char *name);
+};
+
+#endif /* __WORKLOAD_H__ */
@@ -79,6 +79,12 @@ int test() {
   fclose(infile);
   cloud_print_error();
 
+  printf("Put object multipart\n");
+  int fd = open("/home/student/Project/Project2/checkpoint1/src/tests/checkpoint_1/test_1_2/big_test/a/big1", O_RDONLY);
+  lstat("/home/student/Project/Project2/checkpoint1/src/tests/checkpoint_1/test_1_2/big_test/a/big1", &stat_buf);
+  printf("S3Status %d\n", cloud_put_object_multipart("test2", "helloworld3", fd, stat_buf.st_size));
+  close(fd);
+
   printf("List bucket test:\n");
   cloud_list_bucket("test2", list_bucket);
 
@@ -88,6 +94,12 @@ int test() {
   fclose(outfile);
   cloud_print_error();
 
+  printf("Get object range:\n");
+  outfile = fopen("/tmp/README.part", "wb");
+  cloud_get_object_range("test2", "helloworld2", 10, 20, get_buffer);
+  fclose(outfile);
+  cloud_print_error();
+
   printf("Delete object:\n");
   cloud_delete_object("test", "helloworld");
   cloud_print_error();
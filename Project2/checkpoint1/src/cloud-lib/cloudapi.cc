@@ -22,10 +22,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <fcntl.h>
+#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <curl/curl.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 #include "cloudapi.h"
 #define UNUSED __attribute__((unused))
@@ -47,8 +59,9 @@ static const char secretAccessKeyG[16] = "";
 
 // Request results, saved as globals -------------------------------------------
 
-static int statusG = 0;
-static char errorDetailsG[4096] = { 0 };
+// Per thread, so that requests can be issued from several threads at once
+static thread_local int statusG = 0;
+static thread_local char errorDetailsG[4096] = { 0 };
 
 // response properties callback ------------------------------------------------
 
@@ -137,7 +150,13 @@ static void responseCompleteCallback(S3Status status,
 }
 
 
+// Host of the requests libs3 doesn't make
+static char hostNameG[256] = S3_DEFAULT_HOSTNAME;
+
 S3Status cloud_init(const char* hostname) {
+  if (hostname) {
+    snprintf(hostNameG, sizeof(hostNameG), "%s", hostname);
+  }
   return S3_initialize("s3", S3_INIT_ALL, hostname);
 }
 
@@ -387,6 +406,72 @@ S3Status cloud_put_object(const char *bucketName, const char *key,
     return static_cast<S3Status>(statusG);
 }
 
+// Put object from a buffer ---------------------------------------------------
+typedef struct put_buffer_callback_data
+{
+    const char *buffer;
+    uint64_t remainingLength;
+} put_buffer_callback_data;
+
+static int putBufferDataCallback(int bufferSize, char *buffer,
+                                 void *callbackData)
+{
+    put_buffer_callback_data *data = 
+        (put_buffer_callback_data *) callbackData;
+
+    int toCopy = ((data->remainingLength > (unsigned) bufferSize) ?
+                  (unsigned) bufferSize : data->remainingLength);
+    memcpy(buffer, data->buffer, toCopy);
+    data->buffer += toCopy;
+    data->remainingLength -= toCopy;
+
+    return toCopy;
+}
+
+S3Status cloud_put_object_from_buffer(const char *bucketName, const char *key,
+                                      const char *buffer,
+                                      uint64_t contentLength) {
+
+    S3BucketContext bucketContext =
+    {
+        0,
+        bucketName,
+        protocolG,
+        uriStyleG,
+        accessKeyIdG,
+        secretAccessKeyG
+    };
+
+    S3PutProperties putProperties =
+    {
+        NULL, 
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        -1,
+        cannedAcl,
+        0,
+        NULL 
+    };
+
+    S3PutObjectHandler putObjectHandler =
+    {
+        { &responsePropertiesCallback, &responseCompleteCallback },
+        &putBufferDataCallback
+    };
+
+    put_buffer_callback_data data;
+
+    data.buffer = buffer;
+    data.remainingLength = contentLength;
+
+    S3_put_object(&bucketContext, key, contentLength, &putProperties, 0,
+                  &putObjectHandler, &data);
+
+    return static_cast<S3Status>(statusG);
+}
+
 // Get object -----------------------------------------------------------------
 
 static S3Status getObjectDataCallback(int bufferSize, const char *buffer,
@@ -402,8 +487,13 @@ static S3Status getObjectDataCallback(int bufferSize, const char *buffer,
 
 S3Status cloud_get_object(const char *bucketName, const char *key,
                     get_filler_t filler) {
+  return cloud_get_object_range(bucketName, key, 0, 0, filler);
+}
+
+S3Status cloud_get_object_range(const char *bucketName, const char *key,
+                                uint64_t startByte, uint64_t byteCount,
+                                get_filler_t filler) {
 
-  uint64_t startByte = 0, byteCount = 0;
   int64_t ifModifiedSince = -1, ifNotModifiedSince = -1;
   const char *ifMatch = 0, *ifNotMatch = 0;
 
@@ -437,6 +527,71 @@ S3Status cloud_get_object(const char *bucketName, const char *key,
   return static_cast<S3Status>(statusG);
 }
 
+// Get object into a buffer --------------------------------------------------
+typedef struct get_buffer_callback_data
+{
+    char *buffer;
+    uint64_t remainingLength;
+} get_buffer_callback_data;
+
+static S3Status getBufferDataCallback(int bufferSize, const char *buffer,
+                                      void *callbackData)
+{
+    get_buffer_callback_data *data =
+        (get_buffer_callback_data *) callbackData;
+
+    if ((uint64_t) bufferSize > data->remainingLength) {
+        return S3StatusAbortedByCallback;
+    }
+    memcpy(data->buffer, buffer, bufferSize);
+    data->buffer += bufferSize;
+    data->remainingLength -= bufferSize;
+
+    return S3StatusOK;
+}
+
+S3Status cloud_get_object_to_buffer(const char *bucketName, const char *key,
+                                    uint64_t startByte, uint64_t byteCount,
+                                    char *buffer) {
+
+  S3BucketContext bucketContext =
+  {
+      0,
+      bucketName,
+      protocolG,
+      uriStyleG,
+      accessKeyIdG,
+      secretAccessKeyG
+  };
+
+  S3GetConditions getConditions =
+  {
+      -1,
+      -1,
+      0,
+      0
+  };
+
+  S3GetObjectHandler getObjectHandler =
+  {
+      { &responsePropertiesCallback, &responseCompleteCallback },
+      &getBufferDataCallback
+  };
+
+  get_buffer_callback_data data;
+
+  data.buffer = buffer;
+  data.remainingLength = byteCount;
+
+  S3_get_object(&bucketContext, key, &getConditions, startByte,
+                byteCount, 0, &getObjectHandler, &data);
+
+  if (statusG == S3StatusOK && data.remainingLength) {
+      return S3StatusErrorIncompleteBody;
+  }
+  return static_cast<S3Status>(statusG);
+}
+
 S3Status cloud_delete_object(const char *bucketName, const char *key) {
   S3BucketContext bucketContext =
   {
@@ -459,4 +614,569 @@ S3Status cloud_delete_object(const char *bucketName, const char *key) {
   return static_cast<S3Status>(statusG);
 }
 
+// Asynchronous requests ------------------------------------------------------
+
+typedef struct async_request
+{
+    int isPut;
+    std::string bucketName;
+    std::string key;
+    uint64_t startByte;
+    uint64_t byteCount;
+    char *buffer;            // where the next bytes go, or come from
+    uint64_t remainingLength;
+    cloud_async_done_t done;
+    void *data;
+} async_request;
+
+// State of the event loop, requests are handed to it through submittedG
+static std::mutex asyncMutexG;
+static std::condition_variable asyncIdleG;
+static std::deque<async_request *> submittedG;
+static int pendingG = 0;         // submitted and not completed
+static int stopG = 0;
+static int wakeFdsG[2] = { -1, -1 };
+static std::thread asyncThreadG;
+
+static void asyncCompleteCallback(S3Status status,
+                                  const S3ErrorDetails *error UNUSED,
+                                  void *callbackData)
+{
+    async_request *request = (async_request *) callbackData;
+
+    if (status == S3StatusOK && request->remainingLength) {
+        status = S3StatusErrorIncompleteBody;
+    }
+    request->done(status, request->data);
+    delete request;
+
+    std::lock_guard<std::mutex> lock(asyncMutexG);
+    if (--pendingG == 0) {
+        asyncIdleG.notify_all();
+    }
+}
+
+static int asyncPutDataCallback(int bufferSize, char *buffer,
+                                void *callbackData)
+{
+    async_request *request = (async_request *) callbackData;
+
+    int toCopy = ((request->remainingLength > (unsigned) bufferSize) ?
+                  (unsigned) bufferSize : request->remainingLength);
+    memcpy(buffer, request->buffer, toCopy);
+    request->buffer += toCopy;
+    request->remainingLength -= toCopy;
+
+    return toCopy;
+}
+
+static S3Status asyncGetDataCallback(int bufferSize, const char *buffer,
+                                     void *callbackData)
+{
+    async_request *request = (async_request *) callbackData;
+
+    if ((uint64_t) bufferSize > request->remainingLength) {
+        return S3StatusAbortedByCallback;
+    }
+    memcpy(request->buffer, buffer, bufferSize);
+    request->buffer += bufferSize;
+    request->remainingLength -= bufferSize;
+
+    return S3StatusOK;
+}
+
+// Adds the request to the context, the callbacks run in the event loop
+static void asyncStart(S3RequestContext *context, async_request *request)
+{
+    S3BucketContext bucketContext =
+    {
+        0,
+        request->bucketName.c_str(),
+        protocolG,
+        uriStyleG,
+        accessKeyIdG,
+        secretAccessKeyG
+    };
+
+    if (request->isPut) {
+        S3PutProperties putProperties =
+        {
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            -1,
+            cannedAcl,
+            0,
+            NULL
+        };
+
+        S3PutObjectHandler putObjectHandler =
+        {
+            { &responsePropertiesCallback, &asyncCompleteCallback },
+            &asyncPutDataCallback
+        };
+
+        S3_put_object(&bucketContext, request->key.c_str(),
+                      request->remainingLength, &putProperties, context,
+                      &putObjectHandler, request);
+    }
+    else {
+        S3GetConditions getConditions =
+        {
+            -1,
+            -1,
+            0,
+            0
+        };
+
+        S3GetObjectHandler getObjectHandler =
+        {
+            { &responsePropertiesCallback, &asyncCompleteCallback },
+            &asyncGetDataCallback
+        };
+
+        S3_get_object(&bucketContext, request->key.c_str(), &getConditions,
+                      request->startByte, request->byteCount, context,
+                      &getObjectHandler, request);
+    }
+}
+
+static void asyncLoop(S3RequestContext *context)
+{
+    int running = 0;
+
+    while (1) {
+        std::deque<async_request *> starting;
+        {
+            std::lock_guard<std::mutex> lock(asyncMutexG);
+            if (stopG && !pendingG) {
+                break;
+            }
+            while (!submittedG.empty() &&
+                   running + (int) starting.size() <
+                   CLOUD_ASYNC_MAX_IN_FLIGHT) {
+                starting.push_back(submittedG.front());
+                submittedG.pop_front();
+            }
+        }
+        // Without the lock, libs3 may complete a request right away
+        for (size_t i = 0; i < starting.size(); i++) {
+            asyncStart(context, starting[i]);
+            running++;
+        }
+
+        fd_set readFds, writeFds, exceptFds;
+        int maxFd = -1;
+        FD_ZERO(&readFds);
+        FD_ZERO(&writeFds);
+        FD_ZERO(&exceptFds);
+        S3_get_request_context_fdsets(context, &readFds, &writeFds,
+                                      &exceptFds, &maxFd);
+        FD_SET(wakeFdsG[0], &readFds);
+        if (wakeFdsG[0] > maxFd) {
+            maxFd = wakeFdsG[0];
+        }
+
+        // Without requests only a submission can wake us up
+        struct timeval timeout, *timeoutp = NULL;
+        if (running) {
+            int64_t ms = S3_get_request_context_timeout(context);
+            if (ms < 0 || ms > 100) {
+                ms = 100;
+            }
+            timeout.tv_sec = ms / 1000;
+            timeout.tv_usec = (ms % 1000) * 1000;
+            timeoutp = &timeout;
+        }
+        if (select(maxFd + 1, &readFds, &writeFds, &exceptFds,
+                   timeoutp) > 0 && FD_ISSET(wakeFdsG[0], &readFds)) {
+            char drain[64];
+            while (read(wakeFdsG[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+
+        if (running) {
+            S3_runonce_request_context(context, &running);
+        }
+    }
+}
+
+static void asyncWake()
+{
+    char c = 0;
+    if (write(wakeFdsG[1], &c, 1) < 0) {
+        // The pipe is full, the loop is already awake
+    }
+}
+
+S3Status cloud_async_init()
+{
+    S3RequestContext *context;
+
+    S3Status status = S3_create_request_context(&context);
+    if (status != S3StatusOK) {
+        return status;
+    }
+    if (pipe(wakeFdsG) < 0) {
+        S3_destroy_request_context(context);
+        return S3StatusInternalError;
+    }
+    fcntl(wakeFdsG[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakeFdsG[1], F_SETFL, O_NONBLOCK);
+
+    stopG = 0;
+    asyncThreadG = std::thread([context] {
+        asyncLoop(context);
+        S3_destroy_request_context(context);
+    });
+    return S3StatusOK;
+}
+
+void cloud_async_destroy()
+{
+    if (!asyncThreadG.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(asyncMutexG);
+        stopG = 1;
+    }
+    asyncWake();
+    asyncThreadG.join();
+    close(wakeFdsG[0]);
+    close(wakeFdsG[1]);
+    wakeFdsG[0] = wakeFdsG[1] = -1;
+}
+
+static S3Status asyncSubmit(async_request *request)
+{
+    {
+        std::lock_guard<std::mutex> lock(asyncMutexG);
+        if (!asyncThreadG.joinable() || stopG) {
+            delete request;
+            return S3StatusInternalError;
+        }
+        submittedG.push_back(request);
+        pendingG++;
+    }
+    asyncWake();
+    return S3StatusOK;
+}
+
+S3Status cloud_put_object_from_buffer_async(const char *bucketName,
+                                            const char *key,
+                                            const char *buffer,
+                                            uint64_t contentLength,
+                                            cloud_async_done_t done,
+                                            void *data)
+{
+    async_request *request = new async_request;
+
+    request->isPut = 1;
+    request->bucketName = bucketName;
+    request->key = key;
+    request->startByte = 0;
+    request->byteCount = 0;
+    request->buffer = (char *) buffer;
+    request->remainingLength = contentLength;
+    request->done = done;
+    request->data = data;
+
+    return asyncSubmit(request);
+}
+
+S3Status cloud_get_object_to_buffer_async(const char *bucketName,
+                                          const char *key,
+                                          uint64_t startByte,
+                                          uint64_t byteCount, char *buffer,
+                                          cloud_async_done_t done,
+                                          void *data)
+{
+    async_request *request = new async_request;
+
+    request->isPut = 0;
+    request->bucketName = bucketName;
+    request->key = key;
+    request->startByte = startByte;
+    request->byteCount = byteCount;
+    request->buffer = buffer;
+    request->remainingLength = byteCount;
+    request->done = done;
+    request->data = data;
+
+    return asyncSubmit(request);
+}
+
+void cloud_async_wait()
+{
+    std::unique_lock<std::mutex> lock(asyncMutexG);
+    asyncIdleG.wait(lock, [] { return pendingG == 0; });
+}
+
+// Multipart upload -----------------------------------------------------------
+
+typedef struct multipart_response
+{
+    std::string body;
+    std::string eTag;
+} multipart_response;
+
+static size_t multipartBodyCallback(char *ptr, size_t size, size_t nmemb,
+                                    void *userdata)
+{
+    ((multipart_response *) userdata)->body.append(ptr, size * nmemb);
+    return size * nmemb;
+}
+
+static size_t multipartHeaderCallback(char *buffer, size_t size,
+                                      size_t nitems, void *userdata)
+{
+    size_t len = size * nitems;
+    if (len > 5 && !strncasecmp(buffer, "ETag:", 5)) {
+        std::string value(buffer + 5, len - 5);
+        size_t first = value.find_first_not_of(" \t");
+        size_t last = value.find_last_not_of(" \t\r\n");
+        if (first != std::string::npos) {
+            ((multipart_response *) userdata)->eTag =
+                value.substr(first, last - first + 1);
+        }
+    }
+    return len;
+}
+
+// Text of the element name in xml, empty if it is missing
+static std::string xmlElement(const std::string &xml, const char *name)
+{
+    std::string open = std::string("<") + name + ">";
+    std::string close = std::string("</") + name + ">";
+    size_t start = xml.find(open);
+    if (start == std::string::npos) {
+        return "";
+    }
+    start += open.size();
+    size_t end = xml.find(close, start);
+    if (end == std::string::npos) {
+        return "";
+    }
+    return xml.substr(start, end - start);
+}
+
+// Sends method on key?subResource with body, signed like libs3 (AWS
+// signature version 2), the response goes in response
+static S3Status multipartRequest(CURL *curl, const char *method,
+                                 const char *bucketName, const char *key,
+                                 const std::string &subResource,
+                                 const char *contentType,
+                                 const char *body, uint64_t bodyLength,
+                                 multipart_response *response)
+{
+    char *escapedKey = curl_easy_escape(curl, key, 0);
+    if (!escapedKey) {
+        return S3StatusOutOfMemory;
+    }
+    std::string resource = std::string("/") + bucketName + "/" + escapedKey +
+        "?" + subResource;
+    curl_free(escapedKey);
+
+    char date[64];
+    time_t now = time(NULL);
+    struct tm gmt;
+    gmtime_r(&now, &gmt);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+
+    std::string stringToSign = std::string(method) + "\n\n" + contentType +
+        "\n" + date + "\n" + resource;
+    unsigned char hmac[EVP_MAX_MD_SIZE];
+    unsigned int hmacLength = 0;
+    HMAC(EVP_sha1(), secretAccessKeyG, strlen(secretAccessKeyG),
+         (const unsigned char *) stringToSign.data(), stringToSign.size(),
+         hmac, &hmacLength);
+    unsigned char signature[((EVP_MAX_MD_SIZE + 2) / 3) * 4 + 1];
+    EVP_EncodeBlock(signature, hmac, hmacLength);
+
+    struct curl_slist *headers = NULL;
+    headers = curl_slist_append(headers, (std::string("Date: ") +
+                                          date).c_str());
+    headers = curl_slist_append(headers, (std::string("Content-Type: ") +
+                                          contentType).c_str());
+    headers = curl_slist_append(headers, (std::string("Authorization: AWS ") +
+                                          accessKeyIdG + ":" +
+                                          (char *) signature).c_str());
+    headers = curl_slist_append(headers, "Expect:");
+
+    std::string url = std::string(protocolG == S3ProtocolHTTPS ?
+                                   "https://" : "http://") + hostNameG +
+        resource;
+
+    response->body.clear();
+    response->eTag.clear();
+    curl_easy_reset(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &multipartBodyCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &multipartHeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, response);
+    if (strcmp(method, "DELETE")) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                         (curl_off_t) bodyLength);
+    }
+
+    CURLcode code = curl_easy_perform(curl);
+    long httpCode = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
+    curl_slist_free_all(headers);
+
+    if (code != CURLE_OK) {
+        return S3StatusConnectionFailed;
+    }
+    // S3 may fail a complete with an error in a 200 response
+    if (httpCode / 100 == 2 &&
+        response->body.find("<Error>") == std::string::npos) {
+        return S3StatusOK;
+    }
+    switch (httpCode) {
+    case 400:
+        return S3StatusHttpErrorBadRequest;
+    case 403:
+        return S3StatusHttpErrorForbidden;
+    case 404:
+        return S3StatusHttpErrorNotFound;
+    case 409:
+        return S3StatusHttpErrorConflict;
+    default:
+        return S3StatusHttpErrorUnknown;
+    }
+}
+
+// Uploads the parts left of an upload, from one thread
+static void multipartUploadParts(const char *bucketName, const char *key,
+                                 const std::string &uploadId, int fd,
+                                 uint64_t contentLength,
+                                 std::atomic<int> *nextPart,
+                                 std::vector<std::string> *eTags,
+                                 std::atomic<int> *status)
+{
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        *status = S3StatusOutOfMemory;
+        return;
+    }
+    std::string part;
+    multipart_response response;
+
+    int partNumber;
+    while (*status == S3StatusOK &&
+           (partNumber = (*nextPart)++) < (int) eTags->size()) {
+        uint64_t offset = (uint64_t) partNumber * CLOUD_MULTIPART_PART_SIZE;
+        uint64_t length = contentLength - offset;
+        if (length > CLOUD_MULTIPART_PART_SIZE) {
+            length = CLOUD_MULTIPART_PART_SIZE;
+        }
+        part.resize(length);
+        uint64_t done = 0;
+        while (done < length) {
+            ssize_t n = pread(fd, &part[done], length - done, offset + done);
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        if (done < length) {
+            *status = S3StatusErrorIncompleteBody;
+            break;
+        }
+
+        // Part numbers start at 1
+        char subResource[512];
+        snprintf(subResource, sizeof(subResource),
+                 "partNumber=%d&uploadId=%s", partNumber + 1,
+                 uploadId.c_str());
+        S3Status partStatus = S3StatusOK;
+        for (int retry = 0; retry < CLOUD_MULTIPART_RETRIES; retry++) {
+            if (retry) {
+                sleep(1 << (retry - 1));
+            }
+            partStatus = multipartRequest(curl, "PUT", bucketName, key,
+                                          subResource,
+                                          "application/octet-stream",
+                                          part.data(), part.size(),
+                                          &response);
+            if (partStatus == S3StatusOK) {
+                break;
+            }
+        }
+        if (partStatus != S3StatusOK) {
+            *status = partStatus;
+            break;
+        }
+        (*eTags)[partNumber] = response.eTag;
+    }
+    curl_easy_cleanup(curl);
+}
+
+S3Status cloud_put_object_multipart(const char *bucketName, const char *key,
+                                    int fd, uint64_t contentLength)
+{
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        return S3StatusOutOfMemory;
+    }
+    multipart_response response;
+
+    S3Status status = multipartRequest(curl, "POST", bucketName, key,
+                                       "uploads", "application/octet-stream",
+                                       "", 0, &response);
+    std::string uploadId = xmlElement(response.body, "UploadId");
+    if (status == S3StatusOK && uploadId.empty()) {
+        status = S3StatusXmlParseFailure;
+    }
+    if (status != S3StatusOK) {
+        curl_easy_cleanup(curl);
+        return status;
+    }
+
+    // An empty object is still one part
+    uint64_t numParts = (contentLength + CLOUD_MULTIPART_PART_SIZE - 1) /
+        CLOUD_MULTIPART_PART_SIZE;
+    std::vector<std::string> eTags(numParts ? numParts : 1);
+    std::atomic<int> nextPart(0);
+    std::atomic<int> partsStatus(S3StatusOK);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < CLOUD_MULTIPART_THREADS && i < (int) eTags.size();
+         i++) {
+        threads.push_back(std::thread(multipartUploadParts, bucketName, key,
+                                      uploadId, fd, contentLength,
+                                      &nextPart, &eTags, &partsStatus));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    status = (S3Status) partsStatus.load();
+
+    if (status == S3StatusOK) {
+        std::string body = "<CompleteMultipartUpload>";
+        for (size_t i = 0; i < eTags.size(); i++) {
+            body += "<Part><PartNumber>" + std::to_string(i + 1) +
+                "</PartNumber><ETag>" + eTags[i] + "</ETag></Part>";
+        }
+        body += "</CompleteMultipartUpload>";
+        status = multipartRequest(curl, "POST", bucketName, key,
+                                  "uploadId=" + uploadId, "application/xml",
+                                  body.data(), body.size(), &response);
+    }
+    if (status != S3StatusOK) {
+        // Free the parts uploaded
+        multipartRequest(curl, "DELETE", bucketName, key,
+                         "uploadId=" + uploadId, "", "", 0, &response);
+    }
+    curl_easy_cleanup(curl);
+    return status;
+}
+
 #endif
@@ -36,9 +36,84 @@ S3Status cloud_list_bucket(const char *bucketName,
 S3Status cloud_put_object(const char *bucketName, const char *key,
                           uint64_t contentLength, put_filler_t filler);
 
+// Same as cloud_put_object, with the content in memory. Unlike the filler
+// callbacks it needs no global state, so it can be called from several
+// threads at once
+S3Status cloud_put_object_from_buffer(const char *bucketName, const char *key,
+                                      const char *buffer,
+                                      uint64_t contentLength);
+
 S3Status cloud_get_object(const char *bucketName, const char *key,
                           get_filler_t filler);
 
+// Same as cloud_get_object, for byteCount bytes from startByte only. A
+// byteCount of 0 reads up to the end of the object
+S3Status cloud_get_object_range(const char *bucketName, const char *key,
+                                uint64_t startByte, uint64_t byteCount,
+                                get_filler_t filler);
+
+// Reads byteCount bytes of the object from startByte into buffer, which
+// must hold them. Thread safe, like cloud_put_object_from_buffer
+S3Status cloud_get_object_to_buffer(const char *bucketName, const char *key,
+                                    uint64_t startByte, uint64_t byteCount,
+                                    char *buffer);
+
 S3Status cloud_delete_object(const char *bucketName, const char *key);
 
+// Asynchronous requests ------------------------------------------------------
+//
+// Requests are queued and run concurrently by an event loop thread, on one
+// libs3 request context, at most CLOUD_ASYNC_MAX_IN_FLIGHT at once. done is
+// called from the event loop thread when the request completes, it must
+// not call the async functions nor wait for other requests. The buffers
+// must stay valid until then.
+
+#define CLOUD_ASYNC_MAX_IN_FLIGHT 32
+
+typedef void(* cloud_async_done_t) (S3Status status, void *data);
+
+// Start the event loop, after cloud_init
+S3Status cloud_async_init();
+
+// Wait for the requests queued and stop the event loop, before
+// cloud_destroy
+void cloud_async_destroy();
+
+S3Status cloud_put_object_from_buffer_async(const char *bucketName,
+                                            const char *key,
+                                            const char *buffer,
+                                            uint64_t contentLength,
+                                            cloud_async_done_t done,
+                                            void *data);
+
+S3Status cloud_get_object_to_buffer_async(const char *bucketName,
+                                          const char *key,
+                                          uint64_t startByte,
+                                          uint64_t byteCount, char *buffer,
+                                          cloud_async_done_t done,
+                                          void *data);
+
+// Wait until all the requests queued so far completed
+void cloud_async_wait();
+
+// Multipart upload -----------------------------------------------------------
+//
+// libs3 has no multipart upload, so these requests are sent with libcurl,
+// signed the way libs3 signs its own. The parts are uploaded by
+// CLOUD_MULTIPART_THREADS threads, a part is retried up to
+// CLOUD_MULTIPART_RETRIES times and the upload is aborted if one of them
+// still fails.
+
+// Size of the parts, S3 needs at least 5MB for all of them but the last
+#define CLOUD_MULTIPART_PART_SIZE (8 << 20)
+
+#define CLOUD_MULTIPART_THREADS 4
+
+#define CLOUD_MULTIPART_RETRIES 3
+
+// Uploads the contentLength first bytes of fd as the object key, reading
+// them with pread
+S3Status cloud_put_object_multipart(const char *bucketName, const char *key,
+                                    int fd, uint64_t contentLength);
+
 #endif
@@ -0,0 +1,234 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "chunk_cache.h"
+
+#define CHUNK_CACHE_INDEX "/index"
+
+ChunkCache::ChunkCache() : capacity_(0), bytes_(0), protected_bytes_(0), dirty_(false) {}
+
+ChunkCache::~ChunkCache() {
+  Close();
+}
+
+std::string ChunkCache::ChunkPath(const std::string &md5) const {
+  return dir_ + "/" + md5;
+}
+
+int ChunkCache::Open(const std::string &dir, uint64_t capacity) {
+  Close();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (capacity == 0) {
+    return 0;
+  }
+  dir_ = dir;
+  if (mkdir(dir_.c_str(), S_IRWXU) < 0 && errno != EEXIST) {
+    return -1;
+  }
+  capacity_ = capacity;
+
+  // The index lists each segment from its least recently used chunk
+  FILE *fp = fopen((dir_ + CHUNK_CACHE_INDEX).c_str(), "r");
+  if (fp) {
+    char md5[64];
+    unsigned int size;
+    char segment;
+    while (fscanf(fp, "%63s %u %c", md5, &size, &segment) == 3) {
+      struct stat statbuf;
+      if (strlen(md5) == 32 && !entries_.count(md5) &&
+          stat(ChunkPath(md5).c_str(), &statbuf) == 0 && statbuf.st_size == size) {
+        Add(md5, size, segment == 'p', true);
+      }
+    }
+    fclose(fp);
+  }
+
+  // Chunks cached since the index was written, and files of inserts cut short
+  DIR *dirp = opendir(dir_.c_str());
+  if (dirp) {
+    struct dirent *dirinfo;
+    while ((dirinfo = readdir(dirp)) != NULL) {
+      std::string name = dirinfo->d_name;
+      if (name == "." || name == ".." || "/" + name == CHUNK_CACHE_INDEX || entries_.count(name)) {
+        continue;
+      }
+      struct stat statbuf;
+      if (name.size() == 32 && stat(ChunkPath(name).c_str(), &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+        Add(name, statbuf.st_size, false, false);
+      } else {
+        unlink(ChunkPath(name).c_str());
+      }
+    }
+    closedir(dirp);
+  }
+
+  // The capacity may be smaller than on the last mount
+  Evict();
+  return 0;
+}
+
+void ChunkCache::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!capacity_) {
+    return;
+  }
+  if (dirty_) {
+    WriteIndex();
+  }
+  probation_.clear();
+  protected_.clear();
+  entries_.clear();
+  capacity_ = bytes_ = protected_bytes_ = 0;
+}
+
+// Adds a chunk to a segment, as its most or least recently used
+void ChunkCache::Add(const std::string &md5, uint32_t size, bool is_protected, bool recent) {
+  std::list<std::string> &segment = is_protected ? protected_ : probation_;
+  struct entry e;
+  e.size = size;
+  e.is_protected = is_protected;
+  e.unread = false;
+  e.position = recent ? segment.insert(segment.begin(), md5) : segment.insert(segment.end(), md5);
+  entries_[md5] = e;
+  bytes_ += size;
+  if (is_protected) {
+    protected_bytes_ += size;
+  }
+  dirty_ = true;
+}
+
+void ChunkCache::Remove(std::unordered_map<std::string, struct entry>::iterator iter) {
+  unlink(ChunkPath(iter->first).c_str());
+  if (iter->second.is_protected) {
+    protected_.erase(iter->second.position);
+    protected_bytes_ -= iter->second.size;
+  } else {
+    probation_.erase(iter->second.position);
+  }
+  bytes_ -= iter->second.size;
+  entries_.erase(iter);
+  dirty_ = true;
+}
+
+// Demotes the protected chunks beyond its share, then evicts until the
+// chunks fit in the capacity
+void ChunkCache::Evict() {
+  uint64_t protected_max = capacity_ * CHUNK_CACHE_PROTECTED_PERCENT / 100;
+  while (protected_bytes_ > protected_max) {
+    struct entry &e = entries_[protected_.back()];
+    probation_.splice(probation_.begin(), protected_, e.position);
+    e.is_protected = false;
+    protected_bytes_ -= e.size;
+  }
+  while (bytes_ > capacity_) {
+    std::list<std::string> &segment = probation_.empty() ? protected_ : probation_;
+    Remove(entries_.find(segment.back()));
+  }
+}
+
+void ChunkCache::WriteIndex() {
+  std::string path = dir_ + CHUNK_CACHE_INDEX;
+  FILE *fp = fopen((path + ".tmp").c_str(), "w");
+  if (fp == NULL) {
+    return;
+  }
+  for (std::list<std::string>::reverse_iterator iter = protected_.rbegin(); iter != protected_.rend(); iter++) {
+    fprintf(fp, "%s %u p\n", iter->c_str(), entries_[*iter].size);
+  }
+  for (std::list<std::string>::reverse_iterator iter = probation_.rbegin(); iter != probation_.rend(); iter++) {
+    fprintf(fp, "%s %u b\n", iter->c_str(), entries_[*iter].size);
+  }
+  if (fclose(fp) == 0 && rename((path + ".tmp").c_str(), path.c_str()) == 0) {
+    dirty_ = false;
+  }
+}
+
+bool ChunkCache::Read(const std::string &md5, uint32_t offset, uint32_t len, char *buf) {
+  int fd;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unordered_map<std::string, struct entry>::iterator iter = entries_.find(md5);
+    if (iter == entries_.end()) {
+      return false;
+    }
+    struct entry &e = iter->second;
+    if (offset > e.size || len > e.size - offset) {
+      return false;
+    }
+    // Opened with the lock, an eviction may unlink it before it is read
+    fd = open(ChunkPath(md5).c_str(), O_RDONLY);
+    if (fd < 0) {
+      Remove(iter);
+      return false;
+    }
+    if (e.is_protected) {
+      protected_.splice(protected_.begin(), protected_, e.position);
+    } else if (e.unread) {
+      probation_.splice(probation_.begin(), probation_, e.position);
+      e.unread = false;
+    } else {
+      protected_.splice(protected_.begin(), probation_, e.position);
+      e.is_protected = true;
+      protected_bytes_ += e.size;
+      Evict();
+    }
+    dirty_ = true;
+  }
+
+  uint32_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, buf + done, len - done, offset + done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  close(fd);
+  return done == len;
+}
+
+bool ChunkCache::Contains(const std::string &md5) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.count(md5) != 0;
+}
+
+void ChunkCache::Insert(const std::string &md5, const char *data, uint32_t size, bool read_ahead) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!capacity_ || size > capacity_ || md5.size() != 32 || entries_.count(md5)) {
+    return;
+  }
+
+  std::string path = ChunkPath(md5);
+  int fd = open((path + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return;
+  }
+  uint32_t done = 0;
+  while (done < size) {
+    ssize_t n = write(fd, data + done, size - done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  close(fd);
+  if (done < size || rename((path + ".tmp").c_str(), path.c_str()) < 0) {
+    unlink((path + ".tmp").c_str());
+    return;
+  }
+  Add(md5, size, false, true);
+  entries_[md5].unread = read_ahead;
+  Evict();
+}
+
+void ChunkCache::Erase(const std::string &md5) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::unordered_map<std::string, struct entry>::iterator iter = entries_.find(md5);
+  if (iter != entries_.end()) {
+    Remove(iter);
+  }
+}
@@ -0,0 +1,87 @@
+#ifndef __CHUNK_CACHE_H_
+#define __CHUNK_CACHE_H_
+
+#include <stdint.h>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Directory of the cache, in ssd_path, hidden from the file system
+#define CHUNK_CACHE_DIR ".chunk_cache"
+
+// Share of the capacity for the chunks read more than once
+#define CHUNK_CACHE_PROTECTED_PERCENT 80
+
+// Cache of chunks downloaded from the cloud, keyed by the hex md5 of the
+// chunk, one file per chunk in a directory of the SSD, at most capacity
+// bytes.
+//
+// Segmented LRU: a chunk enters the probationary segment and moves to the
+// protected one when it is read again, which holds at most
+// CHUNK_CACHE_PROTECTED_PERCENT of the capacity and demotes its least
+// recently used chunks back to probation. Chunks are evicted from the end
+// of probation, so a scan of chunks read once doesn't evict the ones read
+// often.
+//
+// Chunks never change, so cached chunks are never dirty, only the order of
+// the segments is. It is written to the index file of the directory on
+// Close if it changed, so that a remount starts warm. Chunk files missing
+// from the index, after a crash, are kept as the least recently used.
+// Thread safe.
+class ChunkCache {
+ public:
+  ChunkCache();
+  ~ChunkCache();
+
+  // Open the cache in dir with capacity bytes, 0 disables it. Returns 0 or
+  // -1.
+  int Open(const std::string &dir, uint64_t capacity);
+  void Close();
+
+  bool Enabled() const { return capacity_ != 0; }
+
+  // Reads len bytes from offset in the chunk md5 into buf, false if it is
+  // not cached
+  bool Read(const std::string &md5, uint32_t offset, uint32_t len, char *buf);
+
+  // Whether the chunk md5 is cached, without using it
+  bool Contains(const std::string &md5);
+
+  // Caches the size bytes of the chunk md5. A chunk read_ahead, not read
+  // yet, stays in probation on its first read.
+  void Insert(const std::string &md5, const char *data, uint32_t size,
+              bool read_ahead = false);
+
+  // The chunk md5 is not in the cloud anymore
+  void Erase(const std::string &md5);
+
+  uint64_t Size() const { return bytes_; }
+
+ private:
+  struct entry {
+    uint32_t size;
+    bool is_protected;
+    bool unread;    // prefetched
+    std::list<std::string>::iterator position;
+  };
+
+  std::string ChunkPath(const std::string &md5) const;
+  void Add(const std::string &md5, uint32_t size, bool is_protected, bool recent);
+  void Remove(std::unordered_map<std::string, struct entry>::iterator iter);
+  void Evict();
+  void WriteIndex();
+
+  std::mutex mutex_;
+  std::string dir_;
+  uint64_t capacity_;
+  uint64_t bytes_;
+  uint64_t protected_bytes_;
+  bool dirty_;    // the index is out of date
+  // Most recently used first
+  std::list<std::string> probation_;
+  std::list<std::string> protected_;
+  std::unordered_map<std::string, struct entry> entries_;
+};
+
+#endif
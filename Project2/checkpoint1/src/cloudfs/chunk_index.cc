@@ -0,0 +1,472 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include "chunk_index.h"
+
+#define MD5_KEY_LEN 16
+
+// Binary key of a hex md5, false if md5 is not 32 hex digits
+static bool md5_to_key(const std::string &md5, std::string &key) {
+  if (md5.size() != 2 * MD5_KEY_LEN) {
+    return false;
+  }
+  key.resize(MD5_KEY_LEN);
+  for (int i = 0; i < MD5_KEY_LEN; i++) {
+    int value = 0;
+    for (int j = 0; j < 2; j++) {
+      char c = md5[2 * i + j];
+      value <<= 4;
+      if (c >= '0' && c <= '9') {
+        value |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        value |= c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        value |= c - 'A' + 10;
+      } else {
+        return false;
+      }
+    }
+    key[i] = (char) value;
+  }
+  return true;
+}
+
+static std::string key_to_md5(const unsigned char *key) {
+  char md5[2 * MD5_KEY_LEN + 1];
+  for (int i = 0; i < MD5_KEY_LEN; i++) {
+    sprintf(&md5[2 * i], "%02x", key[i]);
+  }
+  return std::string(md5, 2 * MD5_KEY_LEN);
+}
+
+static int partition_of(const std::string &key) {
+  return (unsigned char) key[0];
+}
+
+static bool record_less(const struct chunk_index_record &a,
+                        const struct chunk_index_record &b) {
+  return memcmp(a.md5, b.md5, MD5_KEY_LEN) < 0;
+}
+
+ChunkIndex::ChunkIndex() : open_(false), bloom_bits_(0), entries_(0) {
+  for (int p = 0; p < CHUNK_INDEX_PARTITIONS; p++) {
+    partitions_[p].base_fd = -1;
+    partitions_[p].base_records = 0;
+    partitions_[p].log_fd = -1;
+  }
+}
+
+ChunkIndex::~ChunkIndex() {
+  Close();
+}
+
+std::string ChunkIndex::PartitionPath(int p, const char *suffix) const {
+  char name[16];
+  snprintf(name, sizeof(name), "/%02x%s", p, suffix);
+  return dir_ + name;
+}
+
+int ChunkIndex::Open(const std::string &dir) {
+  Close();
+  dir_ = dir;
+  if (mkdir(dir_.c_str(), S_IRWXU) < 0 && errno != EEXIST) {
+    return -1;
+  }
+
+  for (int p = 0; p < CHUNK_INDEX_PARTITIONS; p++) {
+    struct partition &part = partitions_[p];
+    struct stat statbuf;
+
+    part.base_fd = open(PartitionPath(p, ".idx").c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    part.log_fd = open(PartitionPath(p, ".log").c_str(), O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+    if (part.base_fd < 0 || part.log_fd < 0 || fstat(part.base_fd, &statbuf) < 0) {
+      open_ = true;
+      Close();
+      return -1;
+    }
+    part.base_records = statbuf.st_size / sizeof(struct chunk_index_record);
+
+    // Replay the log, the last update of a chunk wins
+    struct chunk_index_record record;
+    off_t log_size = 0;
+    while (read(part.log_fd, &record, sizeof(record)) == sizeof(record)) {
+      overlay_entry entry = { record.count, record.erased != 0, record.location };
+      part.overlay[std::string((const char *) record.md5, MD5_KEY_LEN)] = entry;
+      log_size += sizeof(record);
+    }
+    // Drop a record torn by a crash, the next ones are appended after it
+    if (fstat(part.log_fd, &statbuf) == 0 && statbuf.st_size != log_size &&
+        ftruncate(part.log_fd, log_size) < 0) {
+      open_ = true;
+      Close();
+      return -1;
+    }
+  }
+  open_ = true;
+
+  for (int p = 0; p < CHUNK_INDEX_PARTITIONS; p++) {
+    if (partitions_[p].overlay.size() >= CHUNK_INDEX_OVERLAY_MAX) {
+      Merge(p, 0);
+    }
+  }
+  BloomRebuild(CHUNK_INDEX_BLOOM_BITS);
+  return 0;
+}
+
+void ChunkIndex::Close() {
+  if (!open_) {
+    return;
+  }
+  for (int p = 0; p < CHUNK_INDEX_PARTITIONS; p++) {
+    struct partition &part = partitions_[p];
+    if (part.base_fd >= 0) {
+      close(part.base_fd);
+    }
+    if (part.log_fd >= 0) {
+      close(part.log_fd);
+    }
+    part.base_fd = part.log_fd = -1;
+    part.base_records = 0;
+    part.overlay.clear();
+  }
+  std::vector<uint64_t>().swap(bloom_);
+  bloom_bits_ = 0;
+  entries_ = 0;
+  zero_counts_.clear();
+  open_ = false;
+}
+
+// Bloom filter ----------------------------------------------------------------
+
+// The key is an md5, its two halves are as good as two independent hashes
+void ChunkIndex::BloomInsert(const std::string &key) {
+  uint64_t h1, h2;
+  memcpy(&h1, key.data(), sizeof(h1));
+  memcpy(&h2, key.data() + sizeof(h1), sizeof(h2));
+  h2 |= 1;
+  for (int i = 0; i < CHUNK_INDEX_BLOOM_HASHES; i++) {
+    uint64_t bit = (h1 + i * h2) & (bloom_bits_ - 1);
+    bloom_[bit / 64] |= 1ULL << (bit % 64);
+  }
+}
+
+bool ChunkIndex::BloomMayContain(const std::string &key) const {
+  uint64_t h1, h2;
+  memcpy(&h1, key.data(), sizeof(h1));
+  memcpy(&h2, key.data() + sizeof(h1), sizeof(h2));
+  h2 |= 1;
+  for (int i = 0; i < CHUNK_INDEX_BLOOM_HASHES; i++) {
+    uint64_t bit = (h1 + i * h2) & (bloom_bits_ - 1);
+    if (!(bloom_[bit / 64] & (1ULL << (bit % 64)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Rebuild the filter from all the chunks with at least bits bits, also
+// recounts the chunks. Removed chunks stay in the filter until then.
+void ChunkIndex::BloomRebuild(size_t bits) {
+  std::vector<struct chunk_index_record> records;
+
+  do {
+    bloom_bits_ = bits;
+    bloom_.assign(bloom_bits_ / 64, 0);
+    entries_ = 0;
+    for (int p = 0; p < CHUNK_INDEX_PARTITIONS; p++) {
+      Collect(p, 0, records);
+      for (size_t i = 0; i < records.size(); i++) {
+        std::string key((const char *) records[i].md5, MD5_KEY_LEN);
+        BloomInsert(key);
+        if (records[i].count == 0) {
+          zero_counts_.insert(key_to_md5(records[i].md5));
+        }
+      }
+      entries_ += records.size();
+    }
+    bits *= 2;
+  } while (entries_ * CHUNK_INDEX_BLOOM_BITS_PER_KEY > bloom_bits_);
+}
+
+// Partitions ------------------------------------------------------------------
+
+bool ChunkIndex::LookupBase(int p, const std::string &key, struct overlay_entry *entry) {
+  struct partition &part = partitions_[p];
+  size_t low = 0, high = part.base_records;
+
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    struct chunk_index_record record;
+    if (pread(part.base_fd, &record, sizeof(record), mid * sizeof(record)) != sizeof(record)) {
+      return false;
+    }
+    int cmp = memcmp(record.md5, key.data(), MD5_KEY_LEN);
+    if (cmp == 0) {
+      entry->count = record.count;
+      entry->erased = false;
+      entry->location = record.location;
+      return true;
+    }
+    if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return false;
+}
+
+bool ChunkIndex::Lookup(const std::string &key, struct overlay_entry *entry) {
+  if (!open_ || !BloomMayContain(key)) {
+    return false;
+  }
+  int p = partition_of(key);
+  std::unordered_map<std::string, overlay_entry>::iterator iter = partitions_[p].overlay.find(key);
+  if (iter != partitions_[p].overlay.end()) {
+    *entry = iter->second;
+    return !iter->second.erased;
+  }
+  return LookupBase(p, key, entry);
+}
+
+// All the chunks of partition p, sorted, with delta added to their count
+void ChunkIndex::Collect(int p, int delta, std::vector<struct chunk_index_record> &records) {
+  struct partition &part = partitions_[p];
+  std::unordered_map<std::string, overlay_entry> pending = part.overlay;
+
+  records.resize(part.base_records);
+  if (part.base_records &&
+      pread(part.base_fd, &records[0], part.base_records * sizeof(records[0]), 0) !=
+      (ssize_t) (part.base_records * sizeof(records[0]))) {
+    records.clear();
+  }
+
+  size_t kept = 0;
+  for (size_t i = 0; i < records.size(); i++) {
+    std::string key((const char *) records[i].md5, MD5_KEY_LEN);
+    std::unordered_map<std::string, overlay_entry>::iterator iter = pending.find(key);
+    if (iter != pending.end()) {
+      if (iter->second.erased) {
+        pending.erase(iter);
+        continue;
+      }
+      records[i].count = iter->second.count;
+      records[i].location = iter->second.location;
+      pending.erase(iter);
+    }
+    records[kept++] = records[i];
+  }
+  records.resize(kept);
+
+  for (std::unordered_map<std::string, overlay_entry>::iterator iter = pending.begin(); iter != pending.end(); iter++) {
+    if (iter->second.erased) {
+      continue;
+    }
+    struct chunk_index_record record;
+    memcpy(record.md5, iter->first.data(), MD5_KEY_LEN);
+    record.count = iter->second.count;
+    record.erased = 0;
+    record.location = iter->second.location;
+    records.push_back(record);
+  }
+  std::sort(records.begin(), records.end(), record_less);
+
+  for (size_t i = 0; i < records.size(); i++) {
+    records[i].count += delta;
+  }
+}
+
+// Write the log of partition p into its sorted file, adding delta to
+// every count
+void ChunkIndex::Merge(int p, int delta) {
+  struct partition &part = partitions_[p];
+  std::vector<struct chunk_index_record> records;
+
+  Collect(p, delta, records);
+
+  std::string path = PartitionPath(p, ".idx");
+  std::string tmp_path = PartitionPath(p, ".tmp");
+  int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return;
+  }
+  size_t bytes = records.size() * sizeof(struct chunk_index_record);
+  if ((bytes && write(fd, &records[0], bytes) != (ssize_t) bytes) ||
+      rename(tmp_path.c_str(), path.c_str()) < 0) {
+    close(fd);
+    unlink(tmp_path.c_str());
+    return;
+  }
+
+  close(part.base_fd);
+  part.base_fd = fd;
+  part.base_records = records.size();
+  if (ftruncate(part.log_fd, 0) < 0) {
+    return;
+  }
+  part.overlay.clear();
+
+  if (delta) {
+    for (size_t i = 0; i < records.size(); i++) {
+      if (records[i].count == 0) {
+        zero_counts_.insert(key_to_md5(records[i].md5));
+      }
+    }
+  }
+}
+
+void ChunkIndex::Update(const std::string &key, const struct overlay_entry &entry) {
+  int p = partition_of(key);
+  struct partition &part = partitions_[p];
+  struct chunk_index_record record;
+
+  memcpy(record.md5, key.data(), MD5_KEY_LEN);
+  record.count = entry.count;
+  record.erased = entry.erased;
+  record.location = entry.location;
+  if (write(part.log_fd, &record, sizeof(record)) != sizeof(record)) {
+    return;
+  }
+
+  part.overlay[key] = entry;
+  if (!entry.erased) {
+    BloomInsert(key);
+  }
+  if (part.overlay.size() >= CHUNK_INDEX_OVERLAY_MAX) {
+    Merge(p, 0);
+  }
+}
+
+// Accessors -------------------------------------------------------------------
+
+bool ChunkIndex::Contains(const std::string &md5) {
+  std::string key;
+  struct overlay_entry entry;
+  return md5_to_key(md5, key) && Lookup(key, &entry);
+}
+
+int ChunkIndex::Get(const std::string &md5) {
+  std::string key;
+  struct overlay_entry entry;
+  if (md5_to_key(md5, key) && Lookup(key, &entry)) {
+    return entry.count;
+  }
+  return 0;
+}
+
+bool ChunkIndex::GetLocation(const std::string &md5, struct chunk_location *location) {
+  std::string key;
+  struct overlay_entry entry;
+  if (md5_to_key(md5, key) && Lookup(key, &entry)) {
+    *location = entry.location;
+    return true;
+  }
+  return false;
+}
+
+void ChunkIndex::SetLocation(const std::string &md5, const struct chunk_location &location) {
+  std::string key;
+  struct overlay_entry entry;
+  if (md5_to_key(md5, key) && Lookup(key, &entry)) {
+    entry.location = location;
+    Update(key, entry);
+  }
+}
+
+void ChunkIndex::Set(const std::string &md5, int count) {
+  std::string key;
+  struct overlay_entry entry;
+  if (!open_ || !md5_to_key(md5, key)) {
+    return;
+  }
+  if (!Lookup(key, &entry)) {
+    memset(&entry.location, 0, sizeof(entry.location));
+    entries_++;
+  }
+  entry.count = count;
+  entry.erased = false;
+  Update(key, entry);
+  if (count == 0) {
+    zero_counts_.insert(md5);
+  }
+  if (entries_ * CHUNK_INDEX_BLOOM_BITS_PER_KEY > bloom_bits_) {
+    BloomRebuild(bloom_bits_ * 2);
+  }
+}
+
+void ChunkIndex::Add(const std::string &md5, int delta) {
+  Set(md5, Get(md5) + delta);
+}
+
+void ChunkIndex::Erase(const std::string &md5) {
+  std::string key;
+  struct overlay_entry entry;
+  if (md5_to_key(md5, key) && Lookup(key, &entry)) {
+    entries_--;
+    entry.count = 0;
+    entry.erased = true;
+    Update(key, entry);
+  }
+  zero_counts_.erase(md5);
+}
+
+void ChunkIndex::AddAll(int delta) {
+  if (!open_) {
+    return;
+  }
+  for (int p = 0; p < CHUNK_INDEX_PARTITIONS; p++) {
+    Merge(p, delta);
+  }
+}
+
+void ChunkIndex::Clear() {
+  if (!open_) {
+    return;
+  }
+  for (int p = 0; p < CHUNK_INDEX_PARTITIONS; p++) {
+    struct partition &part = partitions_[p];
+    if (ftruncate(part.base_fd, 0) < 0 || ftruncate(part.log_fd, 0) < 0) {
+      continue;
+    }
+    part.base_records = 0;
+    part.overlay.clear();
+  }
+  entries_ = 0;
+  zero_counts_.clear();
+  bloom_bits_ = CHUNK_INDEX_BLOOM_BITS;
+  bloom_.assign(bloom_bits_ / 64, 0);
+}
+
+void ChunkIndex::ForEach(const std::function<void(const std::string &, int,
+                                                  const struct chunk_location &)> &fn) {
+  std::vector<struct chunk_index_record> records;
+
+  if (!open_) {
+    return;
+  }
+  for (int p = 0; p < CHUNK_INDEX_PARTITIONS; p++) {
+    Collect(p, 0, records);
+    for (size_t i = 0; i < records.size(); i++) {
+      fn(key_to_md5(records[i].md5), records[i].count, records[i].location);
+    }
+  }
+}
+
+std::vector<std::string> ChunkIndex::TakeZeroCounts() {
+  std::vector<std::string> zeros;
+  std::string key;
+  struct overlay_entry entry;
+
+  for (std::unordered_set<std::string>::iterator iter = zero_counts_.begin(); iter != zero_counts_.end(); iter++) {
+    if (md5_to_key(*iter, key) && Lookup(key, &entry) && entry.count == 0) {
+      zeros.push_back(*iter);
+    }
+  }
+  zero_counts_.clear();
+  std::sort(zeros.begin(), zeros.end());
+  return zeros;
+}
@@ -0,0 +1,124 @@
+#ifndef __CHUNK_INDEX_H_
+#define __CHUNK_INDEX_H_
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Directory of the index, in ssd_path, hidden from the file system
+#define CHUNK_INDEX_DIR ".chunk_index"
+
+// Partitions, by the first byte of the md5
+#define CHUNK_INDEX_PARTITIONS 256
+
+// Updates a partition keeps in memory (and in its log) before they are
+// merged into its sorted file
+#define CHUNK_INDEX_OVERLAY_MAX 256
+
+// Initial size of the Bloom filter, doubled as the index grows
+#define CHUNK_INDEX_BLOOM_BITS (1 << 20)
+
+// Bits of the Bloom filter per chunk before it is doubled, ~1% false
+// positives with CHUNK_INDEX_BLOOM_HASHES hashes
+#define CHUNK_INDEX_BLOOM_BITS_PER_KEY 10
+#define CHUNK_INDEX_BLOOM_HASHES 7
+
+// Where the data of a chunk is in the cloud
+struct chunk_location {
+  uint32_t container;   // 0 if the chunk is its own object, md5 in bucket md5
+  uint32_t offset;      // in the container
+  uint32_t size;
+};
+
+// On disk record: a chunk, its reference count and location
+struct chunk_index_record {
+  unsigned char md5[16];
+  int32_t count;
+  uint32_t erased;    // log only, the chunk was removed
+  struct chunk_location location;
+};
+
+// Persistent reference counts of the chunks in the cloud, keyed by the hex
+// md5 of the chunk, in hidden files on the SSD.
+//
+// Each partition is a file of records sorted by md5 (NN.idx) and a log of
+// the updates since it was written (NN.log). The latest update of each
+// chunk in the log is also kept in memory and the two are merged when it
+// reaches CHUNK_INDEX_OVERLAY_MAX chunks, so memory only depends on the
+// number of partitions and the Bloom filter. A Bloom filter of all the
+// chunks answers most lookups of new chunks without touching the disk.
+//
+// The accessors follow std::unordered_map<std::string, int>: Add on a
+// missing chunk inserts it with a count of delta, at location 0. Keys
+// other than 32 hex digits are ignored. Not thread safe.
+class ChunkIndex {
+ public:
+  ChunkIndex();
+  ~ChunkIndex();
+
+  // Open or create the index in dir, returns 0 or -1
+  int Open(const std::string &dir);
+  void Close();
+
+  bool Contains(const std::string &md5);
+  // Count of the chunk, 0 if missing
+  int Get(const std::string &md5);
+  void Set(const std::string &md5, int count);
+  // Location of the chunk, false if missing
+  bool GetLocation(const std::string &md5, struct chunk_location *location);
+  // Moves an existing chunk, keeps its count
+  void SetLocation(const std::string &md5, const struct chunk_location &location);
+  void Add(const std::string &md5, int delta);
+  void Erase(const std::string &md5);
+  // Add delta to the count of every chunk
+  void AddAll(int delta);
+  void Clear();
+
+  // Calls fn for every chunk, in md5 order
+  void ForEach(const std::function<void(const std::string &, int,
+                                        const struct chunk_location &)> &fn);
+
+  // Chunks whose count went to 0 since the last call and still is
+  std::vector<std::string> TakeZeroCounts();
+
+  size_t Size() const { return entries_; }
+
+ private:
+  struct overlay_entry {
+    int count;
+    bool erased;
+    struct chunk_location location;
+  };
+
+  struct partition {
+    int base_fd;
+    size_t base_records;
+    int log_fd;
+    // Latest update of each chunk in the log, keyed by the binary md5
+    std::unordered_map<std::string, overlay_entry> overlay;
+  };
+
+  std::string PartitionPath(int p, const char *suffix) const;
+  bool Lookup(const std::string &key, struct overlay_entry *entry);
+  bool LookupBase(int p, const std::string &key, struct overlay_entry *entry);
+  void Update(const std::string &key, const struct overlay_entry &entry);
+  void Collect(int p, int delta, std::vector<struct chunk_index_record> &records);
+  void Merge(int p, int delta);
+
+  void BloomInsert(const std::string &key);
+  bool BloomMayContain(const std::string &key) const;
+  void BloomRebuild(size_t bits);
+
+  std::string dir_;
+  bool open_;
+  struct partition partitions_[CHUNK_INDEX_PARTITIONS];
+  std::vector<uint64_t> bloom_;
+  size_t bloom_bits_;
+  size_t entries_;
+  std::unordered_set<std::string> zero_counts_;
+};
+
+#endif
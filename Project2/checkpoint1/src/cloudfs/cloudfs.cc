@@ -20,6 +20,11 @@
 #include "cloudapi.h"
 #include "dedup.h"
 #include "cloudfs.h"
+#include "upload_pipeline.h"
+#include "chunk_index.h"
+#include "container_store.h"
+#include "chunk_cache.h"
+#include "prefetcher.h"
 #include <sys/time.h>
 #include <fcntl.h> /* Definition of AT_* constants */
 #include <sys/stat.h>
@@ -34,6 +39,8 @@
 #include <vector>
 #include "../snapshot/snapshot-api.h"
 #include <algorithm> 
+#include <thread>
+#include <functional>
 
 #define UNUSED __attribute__((unused))
 #define CLOUDFS_IOCTL_NAME "/.snapshot"
@@ -54,12 +61,26 @@ static struct cloudfs_state state_;
 static FILE *logfile;
 static FILE *infile;
 static FILE *outfile;
-static std::unordered_map<std::string, int> md5_to_frequency_map;
+static ChunkIndex md5_to_frequency_map;
+static ContainerStore containers;
+static ChunkCache chunk_cache;
+static Prefetcher prefetcher(containers, chunk_cache);
 static rabinpoly_t *rp;
-static int uploadFdCh2;
-static int uploadFdCh2Offset;
+static gearcdc_t *gp;
+static struct upload_pipeline_conf pipeline_conf;
 static int verbosePrint = 0;
 static std::unordered_map<std::string, bool> keys_in_bucket_map;
+// Sequential reads of each open file in the cloud, by file handle, the segments after them are prefetched
+// into the chunk cache
+struct read_ahead {
+  off_t next_offset;      // where a sequential read starts
+  int window;             // segments to prefetch after it, 0 if the reads are not sequential
+  off_t prefetched_to;    // end of the segments prefetched
+};
+static std::unordered_map<uint64_t, struct read_ahead> read_aheads;
+// Without dedup, files opened read only while in the cloud are not downloaded, their reads fetch
+// the bytes asked for from the object, by file handle
+static std::unordered_map<uint64_t, std::string> cloud_read_handles;
 
 // Copied from reference code https://www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/
 void log_msg(FILE *logfile, const char *format, ...)
@@ -225,6 +246,25 @@ void log_fi (struct fuse_file_info *fi)
   }
 }
 
+// Start segmenting a new file with the configured chunker
+void segment_reset() {
+  if (state_.chunker == CHUNKER_GEAR) {
+    gear_reset(gp);
+  } else {
+    rabin_reset(rp);
+  }
+}
+
+// Find all the segment boundaries in buf, same contract as
+// rabin_segment_boundaries()
+int segment_boundaries(const char *buf, unsigned int bytes,
+                       unsigned int *offsets, unsigned int max_offsets) {
+  if (state_.chunker == CHUNKER_GEAR) {
+    return gear_segment_boundaries(gp, buf, bytes, offsets, max_offsets);
+  }
+  return rabin_segment_boundaries(rp, buf, bytes, offsets, max_offsets);
+}
+
 // Callback function for putting content to cloud
 // from infile.
 int put_buffer_in_cloud(char *buffer, int bufferLength) {
@@ -233,12 +273,6 @@ int put_buffer_in_cloud(char *buffer, int bufferLength) {
   return retstat;
 }
 
-int put_buffer_in_cloud_for_ch2(char *buffer, int bufferLength) {
-  int retstat = pread(uploadFdCh2, buffer, bufferLength, uploadFdCh2Offset);
-  if (verbosePrint >= 2) log_msg(logfile, "put_buffer %d\n", bufferLength);
-  return retstat;
-}
-
 // Callback function for getting content of from cloud and
 // put those content in outfile.
 int get_buffer_save_in_file(const char *buffer, int bufferLength) {
@@ -386,8 +420,9 @@ int cloudfs_getattr(const char *path UNUSED, struct stat *statbuf UNUSED)
   return retstat;
 }
 
-void recover_md5_frequency_map(const char *bucket_name, const char *key_name, std::unordered_map<std::string, int> &map) {
-  map.clear();
+// Calls fn for each md5, frequency and location of a map uploaded by upload_md5_frequecy_map_to_cloud,
+// the location is 0 in maps without one
+void download_md5_frequency_map(const char *bucket_name, const char *key_name, const std::function<void(const std::string &, int, const struct chunk_location &)> &fn) {
   S3Status s3status = cloud_list_bucket(bucket_name, cloudfs_list_bucket);
   log_msg(logfile, "S3Status of cloud_list_bucket in recover_md5_frequency_map %d\n", s3status);
   if (s3status == S3StatusOK) {
@@ -407,14 +442,181 @@ void recover_md5_frequency_map(const char *bucket_name, const char *key_name, st
         len = strlen(buf);
         buf[len-1] = '\0';
         std::vector<std::string> allStr = split(buf, " ");
-        map[allStr.at(0)] = atoi(allStr.at(1).c_str());
-        log_msg(logfile, "md5 %s, md5 frequency %d in recover_md5_frequency_map\n", allStr.at(0).c_str(), map[allStr.at(0)]);
+        struct chunk_location location = { 0, 0, 0 };
+        if (allStr.size() >= 5) {
+          location.container = strtoul(allStr.at(2).c_str(), NULL, 10);
+          location.offset = strtoul(allStr.at(3).c_str(), NULL, 10);
+          location.size = strtoul(allStr.at(4).c_str(), NULL, 10);
+        }
+        fn(allStr.at(0), atoi(allStr.at(1).c_str()), location);
+        log_msg(logfile, "md5 %s, md5 frequency %s in recover_md5_frequency_map\n", allStr.at(0).c_str(), allStr.at(1).c_str());
     }
     fclose(fp);
     remove(fpath);
   }
 }
 
+void recover_md5_frequency_map(const char *bucket_name, const char *key_name, std::unordered_map<std::string, int> &map) {
+  map.clear();
+  download_md5_frequency_map(bucket_name, key_name, [&map](const std::string &md5, int frequency, const struct chunk_location &location UNUSED) {
+    map[md5] = frequency;
+  });
+}
+
+void recover_md5_frequency_map(const char *bucket_name, const char *key_name, ChunkIndex &index) {
+  index.Clear();
+  download_md5_frequency_map(bucket_name, key_name, [&index](const std::string &md5, int frequency, const struct chunk_location &location) {
+    index.Set(md5, frequency);
+    index.SetLocation(md5, location);
+  });
+}
+
+// Remove a chunk no file or snapshot refers to anymore from the index and its container
+void release_chunk(const std::string &md5) {
+  struct chunk_location location;
+  if (md5_to_frequency_map.GetLocation(md5, &location)) {
+    if (verbosePrint >= 2) log_msg(logfile, "deleting md5 %s in container %u\n", md5.c_str(), location.container);
+    containers.Release(md5, location);
+    chunk_cache.Erase(md5);
+    md5_to_frequency_map.Erase(md5);
+  }
+}
+
+// Delete the chunks no file or snapshot refers to anymore, then compact the containers they leave mostly empty
+void delete_unreferenced_chunks() {
+  std::vector<std::string> md5s_to_delete = md5_to_frequency_map.TakeZeroCounts();
+  for (size_t i = 0; i < md5s_to_delete.size(); i++) {
+    release_chunk(md5s_to_delete[i]);
+  }
+  if (!md5s_to_delete.empty()) {
+    int compacted = containers.Compact(md5_to_frequency_map);
+    if (verbosePrint >= 2) log_msg(logfile, "compacted %d containers\n", compacted);
+  }
+}
+
+// Takes back the references dropped by a write or truncate that failed to
+// store its new chunks, and releases the chunks it did store
+void restore_chunks(const std::deque<file_content_index> &released_vector) {
+  for (size_t i = 0; i < released_vector.size(); i++) {
+    md5_to_frequency_map.Add(released_vector[i].md5, 1);
+  }
+  delete_unreferenced_chunks();
+}
+
+// Adds the read of len bytes from offset in chunk into buf to reads
+int add_chunk_read(std::vector<struct chunk_read> &reads, const file_content_index &chunk, int offset, int len, char *buf) {
+  struct chunk_read read;
+  if (!md5_to_frequency_map.GetLocation(chunk.md5, &read.location)) {
+    log_msg(logfile, "chunk %s is not in the index\n", chunk.md5.c_str());
+    return -1;
+  }
+  if (read.location.container == 0) {
+    read.location.size = chunk.size;
+  }
+  read.md5 = chunk.md5;
+  read.offset = offset;
+  read.len = len;
+  read.buf = buf;
+  reads.push_back(read);
+  return 0;
+}
+
+// Reads the chunks of reads, from the SSD cache when it has them. The others are fetched whole from the
+// cloud and cached.
+int read_chunks(std::vector<struct chunk_read> &reads) {
+  if (!chunk_cache.Enabled()) {
+    return containers.ReadAll(reads);
+  }
+  std::vector<struct chunk_read> misses;
+  std::vector<size_t> missed;
+  std::deque<std::string> data;
+  for (size_t i = 0; i < reads.size(); i++) {
+    prefetcher.Wait(reads[i].md5);
+    if (chunk_cache.Read(reads[i].md5, reads[i].offset, reads[i].len, reads[i].buf)) {
+      continue;
+    }
+    data.push_back(std::string(reads[i].location.size, '\0'));
+    struct chunk_read whole = reads[i];
+    whole.offset = 0;
+    whole.len = whole.location.size;
+    whole.buf = &data.back()[0];
+    misses.push_back(whole);
+    missed.push_back(i);
+  }
+  if (verbosePrint >= 2) log_msg(logfile, "chunk cache hits %zu, misses %zu, cached bytes %llu\n",
+    reads.size() - misses.size(), misses.size(), (unsigned long long) chunk_cache.Size());
+  if (misses.empty()) {
+    return 0;
+  }
+  if (containers.ReadAll(misses) < 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < misses.size(); i++) {
+    struct chunk_read &read = reads[missed[i]];
+    chunk_cache.Insert(read.md5, data[i].data(), data[i].size());
+    memcpy(read.buf, data[i].data() + read.offset, read.len);
+  }
+  return 0;
+}
+
+// Grows the prefetch window of the file handle fh if the read at offset continues the previous one, or
+// closes it, then prefetches the segments of file_map in the window after the read
+void read_ahead_after(uint64_t fh, std::map<int, file_content_index> &file_map, off_t offset, int size) {
+  struct read_ahead &ahead = read_aheads[fh];
+  if (offset == ahead.next_offset) {
+    ahead.window = ahead.window ? std::min(2 * ahead.window, PREFETCH_WINDOW_MAX) : PREFETCH_WINDOW_MIN;
+  } else {
+    ahead.window = 0;
+    ahead.prefetched_to = 0;
+  }
+  ahead.next_offset = offset + size;
+  if (!ahead.window || !chunk_cache.Enabled()) {
+    return;
+  }
+
+  // At most half of the cache ahead, not to evict the segments before they are read
+  std::vector<struct chunk_read> reads;
+  uint64_t bytes = 0;
+  int segments = 0;
+  for (std::map<int, file_content_index>::iterator iter = file_map.lower_bound(ahead.next_offset);
+       iter != file_map.end() && segments < ahead.window && bytes + iter->second.size <= (uint64_t) state_.cache_size / 2;
+       iter++, segments++) {
+    file_content_index &chunk = iter->second;
+    bytes += chunk.size;
+    if (chunk.offset < ahead.prefetched_to) {
+      continue;
+    }
+    ahead.prefetched_to = chunk.offset + chunk.size;
+    if (!chunk_cache.Contains(chunk.md5)) {
+      add_chunk_read(reads, chunk, 0, chunk.size, NULL);
+    }
+  }
+  if (verbosePrint >= 2) log_msg(logfile, "prefetch window %d, prefetching %zu segments up to %lld\n",
+    ahead.window, reads.size(), (long long) ahead.prefetched_to);
+  prefetcher.Prefetch(reads);
+}
+
+// Appends the data of chunks to outfile in order, they are fetched from the cloud concurrently
+int get_chunks_save_in_file(const std::deque<file_content_index> &chunks) {
+  std::vector<std::string> data(chunks.size());
+  std::vector<struct chunk_read> reads;
+  int ret = 0;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    data[i].resize(chunks[i].size);
+    if (add_chunk_read(reads, chunks[i], 0, chunks[i].size, &data[i][0]) < 0) {
+      ret = -1;
+    }
+  }
+  if (read_chunks(reads) < 0) {
+    log_msg(logfile, "Failed to get %zu chunks from the containers\n", reads.size());
+    ret = -1;
+  }
+  for (size_t i = 0; i < data.size(); i++) {
+    fwrite(data[i].data(), 1, data[i].size(), outfile);
+  }
+  return ret;
+}
+
 void download_whole_file_from_cloud(const char *bucket_name, const char *key_name, const char *fileName) {
   char fpath[PATH_MAX];
   cloudfs_fullpath((char *) "download_whole_file_from_cloud", fpath, fileName);
@@ -435,6 +637,9 @@ void download_whole_file_from_cloud(const char *bucket_name, const char *key_nam
 void *cloudfs_init(struct fuse_conn_info *conn UNUSED)
 {
   cloud_init(state_.hostname);
+  if (cloud_async_init() != S3StatusOK) {
+    log_msg(logfile, "\nFailed to start the async requests, using blocking ones\n");
+  }
   log_msg(logfile, "\ncloudfs_init called\n");
   if (state_.no_dedup == NULL) {
     FILE *fp;
@@ -445,20 +650,54 @@ void *cloudfs_init(struct fuse_conn_info *conn UNUSED)
     fp = fopen(fpath_ioctl, "w");
     fclose(fp);
     cloudfs_chmod(ioctlName.c_str(), S_IRUSR|S_IRGRP|S_IROTH);  
-    recover_md5_frequency_map("system_status", "system_status", md5_to_frequency_map);
+    char fpath_index[PATH_MAX];
+    cloudfs_fullpath((char *) "cloudfs_init", fpath_index, "/" CHUNK_INDEX_DIR);
+    if (md5_to_frequency_map.Open(fpath_index) < 0) {
+      log_msg(logfile, "\nFailed to open the chunk index %s\n", fpath_index);
+    }
+    // The index is lost with the SSD, rebuild it from the last copy in the cloud
+    if (md5_to_frequency_map.Size() == 0) {
+      recover_md5_frequency_map("system_status", "system_status", md5_to_frequency_map);
+    }
+    if (containers.Init(md5_to_frequency_map) < 0) {
+      log_msg(logfile, "\nFailed to list the containers\n");
+    }
+    char fpath_cache[PATH_MAX];
+    cloudfs_fullpath((char *) "cloudfs_init", fpath_cache, "/" CHUNK_CACHE_DIR);
+    if (chunk_cache.Open(fpath_cache, state_.cache_size) < 0) {
+      log_msg(logfile, "\nFailed to open the chunk cache %s\n", fpath_cache);
+    }
+    // Segments are prefetched into the cache
+    if (chunk_cache.Enabled()) {
+      prefetcher.Start();
+    }
   }
   return NULL;
 }
 
+// Uploads the size bytes of the file at fpath, in parts uploaded in parallel if it has more than one
+S3Status put_file_in_cloud(const char *fpath, const char *bucket_name, const char *key_name, off_t size) {
+  S3Status s3status;
+  if (size > CLOUD_MULTIPART_PART_SIZE) {
+    int fd = open(fpath, O_RDONLY);
+    s3status = cloud_put_object_multipart(bucket_name, key_name, fd, size);
+    close(fd);
+  } else {
+    infile = fopen(fpath, "rb");
+    s3status = cloud_put_object(bucket_name, key_name, size, put_buffer_in_cloud);
+    fclose(infile);
+  }
+  if (verbosePrint >= 2) log_msg(logfile, "S3Status of put %s/%s with size %lld: %d\n", bucket_name, key_name, (long long) size, s3status);
+  return s3status;
+}
+
 void upload_whole_file_in_clould(const char *relative_file_path, const char *bucket_name, const char *key_name, bool deleteFile) {
     char fpath[PATH_MAX];
     cloudfs_fullpath((char *) "upload_whole_file_in_clould", fpath, relative_file_path);
     struct stat statbuf;
     cloudfs_getattr(relative_file_path, &statbuf);
     log_stat(&statbuf);
-    infile = fopen(fpath, "rb");
-    cloud_put_object(bucket_name, key_name, statbuf.st_size, put_buffer_in_cloud);
-    fclose(infile);
+    put_file_in_cloud(fpath, bucket_name, key_name, statbuf.st_size);
     cloud_list_bucket(bucket_name, cloudfs_list_bucket);
     if (deleteFile) {
       remove(fpath);
@@ -483,7 +722,29 @@ void upload_md5_frequecy_map_to_cloud(const char *bucket_name, const char *key_n
   upload_whole_file_in_clould(fileName.c_str(), bucket_name, key_name, true);
 }
 
+void upload_md5_frequecy_map_to_cloud(const char *bucket_name, const char *key_name, ChunkIndex &index) {
+  std::string fileName = "/.frequecyMap";
+  char fpath[PATH_MAX];
+  cloudfs_fullpath((char *) "upload_md5_frequecy_map_to_cloud", fpath, fileName.c_str());
+  FILE *fptr;
+  fptr = fopen(fpath, "w");
+  if (fptr == NULL) {
+    log_msg(logfile, "open file error\n");
+    exit(0);
+  }
+  index.ForEach([fptr](const std::string &md5, int frequency, const struct chunk_location &location) {
+    fprintf(fptr, "%s %d %u %u %u\n", md5.c_str(), frequency, location.container, location.offset, location.size);
+  });
+  fclose(fptr);
+  upload_whole_file_in_clould(fileName.c_str(), bucket_name, key_name, true);
+}
+
 void cloudfs_destroy(void *data UNUSED) {
+  if (state_.no_dedup == NULL) {
+    prefetcher.Stop();
+    containers.Flush();
+  }
+  cloud_async_destroy();
   cloud_destroy();
   log_msg(logfile, "\ncloudfs_destroy called\n");
   if (state_.no_dedup == NULL) {
@@ -492,6 +753,8 @@ void cloudfs_destroy(void *data UNUSED) {
     cloudfs_fullpath((char *) "cloudfs_destroy", fpath, fileName.c_str());
     upload_md5_frequecy_map_to_cloud("system_status", "system_status", md5_to_frequency_map);
     remove(fpath);
+    md5_to_frequency_map.Close();
+    chunk_cache.Close();
   }
 }
 
@@ -595,7 +858,14 @@ int cloudfs_open(const char *path, struct fuse_file_info *fi) {
     int oncloud_signal = cloudfs_getxattr(path, "user.on_cloud", on_cloud, 2);
     struct stat statbuf;
     lstat(fpath, &statbuf);
-    if (oncloud_signal > 0) {
+    if (oncloud_signal > 0 && fd >= 0 && (fi->flags & O_ACCMODE) == O_RDONLY) {
+      char bucket_name[PATH_MAX];
+      char file_name[PATH_MAX];
+      generate_bucket_name(path, bucket_name, file_name);
+      strcat(bucket_name, file_name);
+      if (verbosePrint >= 2) log_msg(logfile, "read only, object %s stays in the cloud\n", bucket_name);
+      cloud_read_handles[fd] = bucket_name;
+    } else if (oncloud_signal > 0) {
       if (verbosePrint >= 2) log_msg(logfile, "\ncloudfs_utimens(path=\"%s\", last access time before=%ld %ld, last modificaton time before=%ld %ld)\n", 
         fpath, ((&statbuf)->st_atim).tv_sec, fpath, ((&statbuf)->st_atim).tv_nsec, ((&statbuf)->st_mtim).tv_sec, ((&statbuf)->st_mtim).tv_nsec);
       struct timespec timesaved[2];
@@ -675,61 +945,46 @@ int cloudfs_read(const char *path, char *buf, size_t size, off_t offset, struct
       return restat;
     } else {
       if (verbosePrint >= 2) log_msg(logfile, "\n content on the cloud\n");
-      struct timespec timesaved[2];
       struct stat statbuf;
       lstat(fpath, &statbuf);
-      timesaved[1] = statbuf.st_mtim;
       mode_t old_mode =  statbuf.st_mode;
       cloudfs_chmod(path, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
 
       std::map<int, file_content_index> file_map = generateFileLocationMap(path);
 
-      log_msg(logfile, "debug1\n");
-      int fd = open(fpath, O_RDWR);
-      ftruncate(fd,0);
-      lseek(fd,0,SEEK_SET);
-      close(fd);
-      log_msg(logfile, "debug2\n");
-
-      std::deque<file_content_index> changed_vector;
-      for (std::map<int, file_content_index>::iterator iter = file_map.begin(); iter != file_map.end(); iter++) {
-        if ((iter->second.offset < offset && iter->second.offset + iter->second.size > offset) || 
-                (iter->second.offset >= offset && iter->second.offset < offset + size)) {
-            changed_vector.push_back(iter->second);
-            log_msg(logfile, "related chunks offset %d, size %d, md5 %s\n", iter->second.offset, iter->second.size, iter->second.md5.c_str());
+      // Copy the requested bytes straight from the chunks that hold them, the partial chunks at either end
+      // are fetched with ranged reads, all of them concurrently
+      std::map<int, file_content_index>::iterator iter = file_map.upper_bound(offset);
+      if (iter != file_map.begin()) {
+        iter--;
+      }
+      int restat = 0;
+      std::vector<struct chunk_read> reads;
+      for (; iter != file_map.end() && iter->second.offset < offset + (off_t) size; iter++) {
+        file_content_index chunk = iter->second;
+        off_t start = std::max((off_t) chunk.offset, offset);
+        off_t end = std::min((off_t) chunk.offset + chunk.size, offset + (off_t) size);
+        if (start >= end) {
+          continue;
+        }
+        if (verbosePrint >= 2) log_msg(logfile, "related chunks offset %d, size %d, md5 %s, read from %lld to %lld\n",
+          chunk.offset, chunk.size, chunk.md5.c_str(), (long long) start, (long long) end);
+        if (add_chunk_read(reads, chunk, start - chunk.offset, end - start, buf + (start - offset)) < 0) {
+          restat = -EIO;
+          break;
         }
+        restat = end - offset;
       }
-
-      if (changed_vector.size() == 0) {
-        log_msg(logfile, "no realted chunk");
-        return 0;
+      if (restat > 0 && read_chunks(reads) < 0) {
+        restat = -EIO;
       }
-      log_msg(logfile, "debug3\n");
-      outfile = fopen(fpath, "wb");
-      for (int i = 0; i < changed_vector.size(); i++) {
-        file_content_index chunk = changed_vector.at(i);
-        S3Status s3status = cloud_list_bucket(chunk.md5.c_str(), cloudfs_list_bucket);
-        if (verbosePrint >= 2) log_msg(logfile, "S3Status of cloud_list_bucket %d, %s\n", s3status, chunk.md5.c_str());
-        cloud_get_object(chunk.md5.c_str(), chunk.md5.c_str(), get_buffer_save_in_file);
+      if (restat > 0) {
+        read_ahead_after(fi->fh, file_map, offset, restat);
+      }
+      if (restat == 0) {
+        log_msg(logfile, "no realted chunk");
       }
-      fclose(outfile);
-      log_msg(logfile, "debug4\n");
-      
-      int real_offset = offset - changed_vector.at(0).offset;
-      if (verbosePrint >= 2) log_msg(logfile, "\noffset %d, changed_vector.at(0).offset %d, real_offset %d\n", offset, changed_vector.at(0).offset, real_offset);
-      int restat = log_syscall((char *) "cloudfs_read", pread(fi->fh, buf, size, real_offset), 0);
-
 
-      fd = open(fpath, O_RDWR);
-      ftruncate(fd,0);
-      lseek(fd,0,SEEK_SET);
-      close(fd);
-      
-      saveInfoInMapToFile(path, file_map);
-      lstat(fpath, &statbuf);
-      timesaved[0] = statbuf.st_atim;
-      int reverttime = utimensat(0, fpath, timesaved, 0);
-      if (verbosePrint >= 2) log_msg(logfile, "revert time result %d\n", reverttime);
       cloudfs_chmod(path, old_mode);
       return restat;
     }
@@ -739,6 +994,18 @@ int cloudfs_read(const char *path, char *buf, size_t size, off_t offset, struct
     if (verbosePrint >= 2) log_msg(logfile, "\ncloudfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
         path, buf, size, offset, fi);
     log_fi(fi);
+    std::unordered_map<uint64_t, std::string>::iterator handle = cloud_read_handles.find(fi->fh);
+    if (handle != cloud_read_handles.end()) {
+      struct stat statbuf;
+      cloudfs_getattr(path, &statbuf);
+      if (offset >= statbuf.st_size) {
+        return 0;
+      }
+      size_t len = std::min((off_t) size, statbuf.st_size - offset);
+      S3Status s3status = cloud_get_object_to_buffer(handle->second.c_str(), handle->second.c_str(), offset, len, buf);
+      if (verbosePrint >= 2) log_msg(logfile, "S3Status of ranged get %d, offset %lld, len %d\n", s3status, offset, len);
+      return s3status == S3StatusOK ? len : -EIO;
+    }
     int restat = log_syscall((char *) "cloudfs_read", pread(fi->fh, buf, size, offset), 0);
     return restat;
   }
@@ -768,14 +1035,9 @@ int cloudfs_write(const char *path, const char *buf, size_t size, off_t offset,
     }
     int fd;
     std::map<int, file_content_index> file_map;
-    MD5_CTX ctx;
-    unsigned char md5[MD5_DIGEST_LENGTH];		
-    int new_segment = 0;
-    int len, segment_len = 0, b;
-    int bytes;
-    MD5_Init(&ctx);
-    rabin_reset(rp);
-    char fileContentBuffer[1024];
+    std::vector<upload_segment> segments;
+    std::deque<file_content_index> released_vector;
+    segment_reset();
     int initial_offset = 0, upload_start_index = 0;
     struct timespec timesaved[2];
     struct stat statbuf;
@@ -803,7 +1065,8 @@ int cloudfs_write(const char *path, const char *buf, size_t size, off_t offset,
               changed_vector.push_back(iter->second);
             }
         }
-        md5_to_frequency_map[iter->second.md5] -= 1;
+        md5_to_frequency_map.Add(iter->second.md5, -1);
+        released_vector.push_back(iter->second);
       }
       for (int i = 0; i < changed_vector.size(); i++) {
         file_content_index chunk = changed_vector.at(i);
@@ -823,12 +1086,7 @@ int cloudfs_write(const char *path, const char *buf, size_t size, off_t offset,
       }
 
       outfile = fopen(fpath, "wb");
-      for (int i = 0; i < changed_vector.size(); i++) {
-        file_content_index chunk = changed_vector.at(i);
-        S3Status s3status = cloud_list_bucket(chunk.md5.c_str(), cloudfs_list_bucket);
-        if (verbosePrint >= 2) log_msg(logfile, "S3Status of cloud_list_bucket %d, %s\n", s3status, chunk.md5.c_str());
-        cloud_get_object(chunk.md5.c_str(), chunk.md5.c_str(), get_buffer_save_in_file);
-      }
+      get_chunks_save_in_file(changed_vector);
       fclose(outfile);
 
       if (verbosePrint >= 2) {
@@ -866,113 +1124,37 @@ int cloudfs_write(const char *path, const char *buf, size_t size, off_t offset,
     }
 
     fd = open(fpath, O_RDONLY);
-    while((bytes = read(fd, fileContentBuffer, sizeof fileContentBuffer)) > 0 ) {
-      char *buftoread = (char *)&fileContentBuffer[0];
-      while ((len = rabin_segment_next(rp, fileContentBuffer, bytes, 
-                        &new_segment)) > 0) {
-        MD5_Update(&ctx, buftoread, len);
-        segment_len += len;
-        if (new_segment) {
-          MD5_Final(md5, &ctx);
-          std::string md5String;
-          char bytePresentation[3];
-          for(b = 0; b < MD5_DIGEST_LENGTH; b++) {
-            if (verbosePrint >= 2) log_msg(logfile, "%02x", md5[b]);
-            sprintf(bytePresentation, "%02x", md5[b]);
-            md5String += std::string(bytePresentation);
-          }
-          if (verbosePrint >= 2) log_msg(logfile, "\n find segements with md5 value %s, initial_offset %d, size %d\n", md5String.c_str(), initial_offset, segment_len);
-          file_content_index new_index = {
-            segment_index: -1,
-            offset: initial_offset,
-            size: segment_len,
-            md5: md5String,
-            complete: 1,
-          };
-          file_map[new_index.offset] = new_index;
-          if (md5_to_frequency_map.find(md5String) == md5_to_frequency_map.end()) {
-            if (verbosePrint >= 2) log_msg(logfile, "\n segements with md5 %s firstly used in completed md5\n", md5String.c_str());
-            md5_to_frequency_map[md5String] = 0;
-            S3Status s3status = cloud_create_bucket(md5String.c_str());
-            if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-            uploadFdCh2 = fd;
-            uploadFdCh2Offset = initial_offset - upload_start_index;
-            if (verbosePrint >= 2) log_msg(logfile, "start upload to cloud from file offset %d, actual offset %d\n", uploadFdCh2Offset, initial_offset);
-            cloud_put_object(md5String.c_str(), md5String.c_str(), segment_len, put_buffer_in_cloud_for_ch2);
-            s3status = cloud_list_bucket(md5String.c_str(), cloudfs_list_bucket);
-            if (verbosePrint >= 2) log_msg(logfile, "S3Status of cloud_list_bucket %d\n", s3status);
-          } else {
-            if (verbosePrint >= 2) log_msg(logfile, "\n segements with md5 %s previoud frequency %d\n", md5String.c_str(), md5_to_frequency_map.find(md5String)->second);
-          }
-          MD5_Init(&ctx);
-          initial_offset += segment_len;
-          segment_len = 0;
-        }
-        buftoread += len;
-        bytes -= len;
-        if (!bytes) {
-          break;
-        }
-      }
-      if (len == -1) {
-        log_msg(logfile, "Failed to process the segment\n");
+    // The chunks must be in the cloud before the local copy is dropped
+    if (upload_pipeline_run(&pipeline_conf, fd, md5_to_frequency_map, segments) < 0 || containers.Flush() < 0) {
+      log_msg(logfile, "Failed to process the segment\n");
+      close(fd);
+      // A file still on the SSD keeps the write, a file on the cloud keeps its old chunks
+      restore_chunks(released_vector);
+      if (oncloud_signal > 0) {
+        truncate(fpath, 0);
       }
+      return -EIO;
     }
-    if (segment_len != 0) {
-      MD5_Final(md5, &ctx);
-      std::string md5String;
-      char bytePresentation[3];
-      if (verbosePrint >= 2) log_msg(logfile, "%u ", segment_len);
-      for(b = 0; b < MD5_DIGEST_LENGTH; b++) {
-        if (verbosePrint >= 2) log_msg(logfile, "%02x", md5[b]);
-        sprintf(bytePresentation, "%02x", md5[b]);
-        md5String += std::string(bytePresentation);
-      }
-      if (verbosePrint >= 2) log_msg(logfile, "\n uncompleted segements with md5 value %s, initial_offset %d, size %d\n", md5String.c_str(), initial_offset, segment_len);
+    for (size_t i = 0; i < segments.size(); i++) {
+      if (verbosePrint >= 2) log_msg(logfile, "\n find segements with md5 value %s, initial_offset %d, size %d, complete %d, uploaded %d\n",
+        segments[i].md5.c_str(), initial_offset + segments[i].offset, segments[i].size, segments[i].complete, segments[i].is_new);
       file_content_index new_index = {
-          segment_index: -1,
-          offset: initial_offset,
-          size: segment_len,
-          md5: md5String,
-          complete: 0,
+        segment_index: -1,
+        offset: initial_offset + segments[i].offset,
+        size: segments[i].size,
+        md5: segments[i].md5,
+        complete: segments[i].complete,
       };
       file_map[new_index.offset] = new_index;
-      if (md5_to_frequency_map.find(md5String) == md5_to_frequency_map.end()) {
-        if (verbosePrint >= 2) log_msg(logfile, "\n segements with md5 %s firstly used in uncompleted md5\n", md5String.c_str());
-        md5_to_frequency_map[md5String] = 0;
-        uploadFdCh2 = fd;
-        uploadFdCh2Offset = initial_offset - upload_start_index;
-        if (verbosePrint >= 2) log_msg(logfile, "start upload to cloud from file offset %d, actual offset %d\n", uploadFdCh2Offset, initial_offset);
-        S3Status s3status = cloud_create_bucket(md5String.c_str());
-        if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-        cloud_put_object(md5String.c_str(), md5String.c_str(), segment_len, put_buffer_in_cloud_for_ch2);
-        s3status = cloud_list_bucket(md5String.c_str(), cloudfs_list_bucket);
-        if (verbosePrint >= 2) log_msg(logfile, "S3Status of cloud_list_bucket %d\n", s3status);
-      } else {
-        if (verbosePrint >= 2) log_msg(logfile, "\n segements with md5 %s previous frequency %d\n", md5String.c_str(), md5_to_frequency_map.find(md5String)->second);
-      }
     }
     close(fd);
     
     cloudfs_setxattr(path, "user.on_cloud", "1", strlen("1"), 0);
     for (std::map<int, file_content_index>::iterator iter = file_map.begin(); iter != file_map.end(); iter++) {
-      int frequency = md5_to_frequency_map[iter->second.md5];
-      md5_to_frequency_map[iter->second.md5] = frequency + 1;
+      md5_to_frequency_map.Add(iter->second.md5, 1);
       // log_msg(logfile, "Filemap status after finishing new write segment in after round key %d, index %d, offset %d, size %d, md5 %s\n", iter->first, iter->second.segment_index, iter->second.offset, iter->second.size, iter->second.md5.c_str());
     }
-    for (std::unordered_map<std::string, int>::iterator iter = md5_to_frequency_map.begin(); iter != md5_to_frequency_map.end();) {
-      if (iter->second == 0) {
-        std::string md5_to_delete = iter->first;
-        if (verbosePrint >= 2) log_msg(logfile, "deleting md5 %s\n", md5_to_delete.c_str());
-        S3Status s3status = cloud_delete_object(md5_to_delete.c_str(), md5_to_delete.c_str());
-        if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-        s3status = cloud_delete_bucket(md5_to_delete.c_str());
-        if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-        md5_to_frequency_map.erase(iter++);
-      } else {
-        iter++;
-      }
-    }
+    delete_unreferenced_chunks();
     int on_cloud_char_length = cloudfs_getxattr(path, "user.on_cloud_size", on_cloud, 0);
     if (on_cloud_char_length < 0) {
       cloudfs_setxattr(path, "user.on_cloud_size", std::to_string(offset + size).c_str(), strlen(std::to_string(offset + size).c_str()), 0);
@@ -1036,6 +1218,10 @@ int cloudfs_release(const char *path, struct fuse_file_info *fi) {
         fpath, ((&statbuf)->st_atim).tv_sec, fpath, ((&statbuf)->st_atim).tv_nsec, ((&statbuf)->st_mtim).tv_sec, ((&statbuf)->st_mtim).tv_nsec);
     int file_size = statbuf.st_size;
     int retstat = log_syscall((char *) "cloudfs_release", close(fi->fh), 0);
+    read_aheads.erase(fi->fh);
+    if (containers.Flush() < 0) {
+      log_msg(logfile, "Failed to upload the open container\n");
+    }
     return retstat;
   } else {
     char fpath[PATH_MAX];
@@ -1049,6 +1235,10 @@ int cloudfs_release(const char *path, struct fuse_file_info *fi) {
         fpath, ((&statbuf)->st_atim).tv_sec, fpath, ((&statbuf)->st_atim).tv_nsec, ((&statbuf)->st_mtim).tv_sec, ((&statbuf)->st_mtim).tv_nsec);
     int file_size = statbuf.st_size;
     int retstat = log_syscall((char *) "cloudfs_release", close(fi->fh), 0);
+    if (cloud_read_handles.erase(fi->fh)) {
+      // Nothing was downloaded, the object is unchanged
+      return retstat;
+    }
     char on_cloud[2];
     int oncloud_signal = cloudfs_getxattr(path, "user.on_cloud", on_cloud, 2);
     if (file_size > state_.threshold) {
@@ -1065,9 +1255,7 @@ int cloudfs_release(const char *path, struct fuse_file_info *fi) {
       S3Status s3status = cloud_create_bucket(bucket_name);
       if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
       cloudfs_chmod(path, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-      infile = fopen(fpath, "rb");
-      cloud_put_object(bucket_name, bucket_name, statbuf.st_size, put_buffer_in_cloud);
-      fclose(infile);
+      put_file_in_cloud(fpath, bucket_name, bucket_name, statbuf.st_size);
       s3status = cloud_list_bucket(bucket_name, cloudfs_list_bucket);
       if (verbosePrint >= 2) log_msg(logfile, "S3Status of cloud_list_bucket %d\n", s3status);
       cloudfs_setxattr(path, "user.on_cloud", "1", strlen("1"), 0);
@@ -1153,6 +1341,8 @@ int couldfs_readdir_contains_lost_found_dir(const char *path, char* filename) {
   int root_compare = strcmp(root_path, path);
   int filename_compare = strcmp(lost_found_file_path, filename);
   if (root_compare == 0 && filename_compare == 0) return 0;
+  if (root_compare == 0 && strcmp(CHUNK_INDEX_DIR, filename) == 0) return 0;
+  if (root_compare == 0 && strcmp(CHUNK_CACHE_DIR, filename) == 0) return 0;
   return 1;
 }
 
@@ -1294,18 +1484,14 @@ int cloudfs_unlink(const char *path) {
     if (oncloud_signal > 0) {
       std::map<int, file_content_index> file_map = generateFileLocationMap(path);
       for (std::map<int, file_content_index>::iterator iter = file_map.begin(); iter != file_map.end(); iter++) {
-        md5_to_frequency_map[iter->second.md5] -= 1;
-        // log_msg(logfile, "md5 %s remaininig frequency %d\n", iter->second.md5.c_str(), md5_to_frequency_map[iter->second.md5]);
-        if (md5_to_frequency_map[iter->second.md5] == 0) {
-          std::string md5_to_delete = iter->second.md5;
-          if (verbosePrint >= 2) log_msg(logfile, "deleting md5 %s\n", md5_to_delete.c_str());
-          S3Status s3status = cloud_delete_object(md5_to_delete.c_str(), md5_to_delete.c_str());
-          if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-          s3status = cloud_delete_bucket(md5_to_delete.c_str());
-          if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-          md5_to_frequency_map.erase(md5_to_delete);
+        md5_to_frequency_map.Add(iter->second.md5, -1);
+        // log_msg(logfile, "md5 %s remaininig frequency %d\n", iter->second.md5.c_str(), md5_to_frequency_map.Get(iter->second.md5));
+        if (md5_to_frequency_map.Get(iter->second.md5) == 0) {
+          release_chunk(iter->second.md5);
         }
       }
+      int compacted = containers.Compact(md5_to_frequency_map);
+      if (verbosePrint >= 2) log_msg(logfile, "compacted %d containers\n", compacted);
     }
     return log_syscall((char *) "cloudfs_unlink", unlink(fpath), 0);
   } else {
@@ -1371,10 +1557,10 @@ int cloudfs_truncate(const char *path, off_t length) {
         log_msg(logfile, "segment index in generateFileLocationMap %d, offset %d, size %d, md5 %s, md5 length %d\n", iter->second.segment_index, iter->second.offset, iter->second.size, iter->second.md5.c_str(), strlen(iter->second.md5.c_str()));
         if (iter->second.offset >= length) {
           deleted_vector.push_back(iter->second);
-          md5_to_frequency_map[iter->second.md5] -= 1;
+          md5_to_frequency_map.Add(iter->second.md5, -1);
         } else if (iter->second.offset < length && iter->second.offset + iter->second.size > length) {
           changed_vector.push_back(iter->second);
-          md5_to_frequency_map[iter->second.md5] -= 1;
+          md5_to_frequency_map.Add(iter->second.md5, -1);
         }
       }
       for (int i = 0; i < deleted_vector.size(); i++) {
@@ -1390,178 +1576,59 @@ int cloudfs_truncate(const char *path, off_t length) {
       if (length <= state_.threshold) {
         log_msg(logfile, "\ncloudfs_truncate less than threshold\n");
         outfile = fopen(fpath, "wb");
+        std::deque<file_content_index> kept_vector;
         for (std::map<int, file_content_index>::iterator iter = file_map.begin(); iter != file_map.end(); iter++) {
-          md5_to_frequency_map[iter->second.md5] -= 1;
-          file_content_index chunk = iter->second;
-          S3Status s3status = cloud_list_bucket(chunk.md5.c_str(), cloudfs_list_bucket);
-          if (verbosePrint >= 2) log_msg(logfile, "S3Status of cloud_list_bucket %d, %s\n", s3status, chunk.md5.c_str());
-          cloud_get_object(chunk.md5.c_str(), chunk.md5.c_str(), get_buffer_save_in_file);
-        }
-        for (int i = 0; i < changed_vector.size(); i++) {
-          file_content_index chunk = changed_vector.at(i);
-          S3Status s3status = cloud_list_bucket(chunk.md5.c_str(), cloudfs_list_bucket);
-          if (verbosePrint >= 2) log_msg(logfile, "S3Status of cloud_list_bucket %d, %s\n", s3status, chunk.md5.c_str());
-          cloud_get_object(chunk.md5.c_str(), chunk.md5.c_str(), get_buffer_save_in_file);
+          md5_to_frequency_map.Add(iter->second.md5, -1);
+          kept_vector.push_back(iter->second);
         }
+        kept_vector.insert(kept_vector.end(), changed_vector.begin(), changed_vector.end());
+        get_chunks_save_in_file(kept_vector);
         fclose(outfile);
         int retstat = log_syscall((char *) "cloudfs_truncate", truncate(fpath, length), 0);
         cloudfs_removexattr(path, "user.on_cloud");
         cloudfs_removexattr(path, "user.on_cloud_size");
-        for (std::unordered_map<std::string, int>::iterator iter = md5_to_frequency_map.begin(); iter != md5_to_frequency_map.end();) {
-          if (iter->second == 0) {
-            std::string md5_to_delete = iter->first;
-            if (verbosePrint >= 2) log_msg(logfile, "deleting md5 %s\n", md5_to_delete.c_str());
-            S3Status s3status = cloud_delete_object(md5_to_delete.c_str(), md5_to_delete.c_str());
-            if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-            s3status = cloud_delete_bucket(md5_to_delete.c_str());
-            if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-            md5_to_frequency_map.erase(iter++);
-          } else {
-            iter++;
-          }
-        }
+        delete_unreferenced_chunks();
         return retstat;
       } else {
         if (changed_vector.empty()) {
-          for (std::unordered_map<std::string, int>::iterator iter = md5_to_frequency_map.begin(); iter != md5_to_frequency_map.end();) {
-            if (iter->second == 0) {
-              std::string md5_to_delete = iter->first;
-              if (verbosePrint >= 2) log_msg(logfile, "deleting md5 %s\n", md5_to_delete.c_str());
-              S3Status s3status = cloud_delete_object(md5_to_delete.c_str(), md5_to_delete.c_str());
-              if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-              s3status = cloud_delete_bucket(md5_to_delete.c_str());
-              if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-              md5_to_frequency_map.erase(iter++);
-            } else {
-              iter++;
-            }
-          }
+          delete_unreferenced_chunks();
           cloudfs_setxattr(path, "user.on_cloud_size", std::to_string(length).c_str(), strlen(std::to_string(length).c_str()), 0);
           saveInfoInMapToFile(path, file_map);
           return 0;
         } else {
           outfile = fopen(fpath, "wb");
-          for (int i = 0; i < changed_vector.size(); i++) {
-            file_content_index chunk = changed_vector.at(i);
-            S3Status s3status = cloud_list_bucket(chunk.md5.c_str(), cloudfs_list_bucket);
-            if (verbosePrint >= 2) log_msg(logfile, "S3Status of cloud_list_bucket %d, %s\n", s3status, chunk.md5.c_str());
-            cloud_get_object(chunk.md5.c_str(), chunk.md5.c_str(), get_buffer_save_in_file);
-          }
+          get_chunks_save_in_file(changed_vector);
           fclose(outfile);
 
   
-          MD5_CTX ctx;
-          unsigned char md5[MD5_DIGEST_LENGTH];       
-          int new_segment = 0;
-          int len, segment_len = 0, b;
-          int bytes;
-          MD5_Init(&ctx);
-          rabin_reset(rp);
-          char fileContentBuffer[1024];
-          int initial_offset = changed_vector.at(0).offset, upload_start_index = changed_vector.at(0).offset;
+          std::vector<upload_segment> segments;
+          segment_reset();
+          int initial_offset = changed_vector.at(0).offset;
           int retstat = log_syscall((char *) "cloudfs_truncate", truncate(fpath, length - initial_offset), 0);
           fd = open(fpath, O_RDONLY);
-          while((bytes = read(fd, fileContentBuffer, sizeof fileContentBuffer)) > 0 ) {
-            char *buftoread = (char *)&fileContentBuffer[0];
-            while ((len = rabin_segment_next(rp, fileContentBuffer, bytes, 
-                              &new_segment)) > 0) {
-              MD5_Update(&ctx, buftoread, len);
-              segment_len += len;
-              if (new_segment) {
-                MD5_Final(md5, &ctx);
-                std::string md5String;
-                char bytePresentation[3];
-                for(b = 0; b < MD5_DIGEST_LENGTH; b++) {
-                  if (verbosePrint >= 2) log_msg(logfile, "%02x", md5[b]);
-                  sprintf(bytePresentation, "%02x", md5[b]);
-                  md5String += std::string(bytePresentation);
-                }
-                if (verbosePrint >= 2) log_msg(logfile, "\n find segements with md5 value %s, initial_offset %d, size %d\n", md5String.c_str(), initial_offset, segment_len);
-                file_content_index new_index = {
-                  segment_index: -1,
-                  offset: initial_offset,
-                  size: segment_len,
-                  md5: md5String,
-                };
-                file_map[new_index.offset] = new_index;
-                if (md5_to_frequency_map.find(md5String) == md5_to_frequency_map.end()) {
-                  if (verbosePrint >= 2) log_msg(logfile, "\n segements with md5 %s firstly used in completed md5\n", md5String.c_str());
-                  md5_to_frequency_map[md5String] = 1;
-                  S3Status s3status = cloud_create_bucket(md5String.c_str());
-                  if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-                  uploadFdCh2 = fd;
-                  uploadFdCh2Offset = initial_offset - upload_start_index;
-                  if (verbosePrint >= 2) log_msg(logfile, "start upload to cloud from file offset %d, actual offset %d\n", uploadFdCh2Offset, initial_offset);
-                  cloud_put_object(md5String.c_str(), md5String.c_str(), segment_len, put_buffer_in_cloud_for_ch2);
-                  s3status = cloud_list_bucket(md5String.c_str(), cloudfs_list_bucket);
-                  if (verbosePrint >= 2) log_msg(logfile, "S3Status of cloud_list_bucket %d\n", s3status);
-                } else {
-                  md5_to_frequency_map[md5String] += 1;
-                  if (verbosePrint >= 2) log_msg(logfile, "\n segements with md5 %s previoud frequency %d\n", md5String.c_str(), md5_to_frequency_map.find(md5String)->second);
-                }
-                MD5_Init(&ctx);
-                initial_offset += segment_len;
-                segment_len = 0;
-              }
-              buftoread += len;
-              bytes -= len;
-              if (!bytes) {
-                break;
-              }
-            }
-            if (len == -1) {
-              log_msg(logfile, "Failed to process the segment\n");
-            }
+          if (upload_pipeline_run(&pipeline_conf, fd, md5_to_frequency_map, segments) < 0 || containers.Flush() < 0) {
+            log_msg(logfile, "Failed to process the segment\n");
+            close(fd);
+            deleted_vector.insert(deleted_vector.end(), changed_vector.begin(), changed_vector.end());
+            restore_chunks(deleted_vector);
+            truncate(fpath, 0);
+            return -EIO;
           }
-          if (segment_len != 0) {
-            MD5_Final(md5, &ctx);
-            std::string md5String;
-            char bytePresentation[3];
-            if (verbosePrint >= 2) log_msg(logfile, "%u ", segment_len);
-            for(b = 0; b < MD5_DIGEST_LENGTH; b++) {
-              if (verbosePrint >= 2) log_msg(logfile, "%02x", md5[b]);
-              sprintf(bytePresentation, "%02x", md5[b]);
-              md5String += std::string(bytePresentation);
-            }
-            if (verbosePrint >= 2) log_msg(logfile, "\n uncompleted segements with md5 value %s, initial_offset %d, size %d\n", md5String.c_str(), initial_offset, segment_len);
+          for (size_t i = 0; i < segments.size(); i++) {
+            if (verbosePrint >= 2) log_msg(logfile, "\n find segements with md5 value %s, initial_offset %d, size %d, uploaded %d\n",
+              segments[i].md5.c_str(), initial_offset + segments[i].offset, segments[i].size, segments[i].is_new);
             file_content_index new_index = {
-                segment_index: -1,
-                offset: initial_offset,
-                size: segment_len,
-                md5: md5String,
+              segment_index: -1,
+              offset: initial_offset + segments[i].offset,
+              size: segments[i].size,
+              md5: segments[i].md5,
             };
             file_map[new_index.offset] = new_index;
-            if (md5_to_frequency_map.find(md5String) == md5_to_frequency_map.end()) {
-              if (verbosePrint >= 2) log_msg(logfile, "\n segements with md5 %s firstly used in uncompleted md5\n", md5String.c_str());
-              md5_to_frequency_map[md5String] = 1;
-              uploadFdCh2 = fd;
-              uploadFdCh2Offset = initial_offset - upload_start_index;
-              if (verbosePrint >= 2) log_msg(logfile, "start upload to cloud from file offset %d, actual offset %d\n", uploadFdCh2Offset, initial_offset);
-              S3Status s3status = cloud_create_bucket(md5String.c_str());
-              if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-              cloud_put_object(md5String.c_str(), md5String.c_str(), segment_len, put_buffer_in_cloud_for_ch2);
-              s3status = cloud_list_bucket(md5String.c_str(), cloudfs_list_bucket);
-              if (verbosePrint >= 2) log_msg(logfile, "S3Status of cloud_list_bucket %d\n", s3status);
-            } else {
-              md5_to_frequency_map[md5String] += 1;
-              if (verbosePrint >= 2) log_msg(logfile, "\n segements with md5 %s previous frequency %d\n", md5String.c_str(), md5_to_frequency_map.find(md5String)->second);
-            }
+            md5_to_frequency_map.Add(segments[i].md5, 1);
           }
           close(fd);
           cloudfs_setxattr(path, "user.on_cloud_size", std::to_string(length).c_str(), strlen(std::to_string(length).c_str()), 0);
-          for (std::unordered_map<std::string, int>::iterator iter = md5_to_frequency_map.begin(); iter != md5_to_frequency_map.end();) {
-            if (iter->second == 0) {
-              std::string md5_to_delete = iter->first;
-              if (verbosePrint >= 2) log_msg(logfile, "deleting md5 %s\n", md5_to_delete.c_str());
-              S3Status s3status = cloud_delete_object(md5_to_delete.c_str(), md5_to_delete.c_str());
-              if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-              s3status = cloud_delete_bucket(md5_to_delete.c_str());
-              if (verbosePrint >= 2) log_msg(logfile, "S3Status %d\n", s3status);
-              md5_to_frequency_map.erase(iter++);
-            } else {
-              iter++;
-            }
-          }
+          delete_unreferenced_chunks();
           fd = open(fpath, O_RDWR);
           ftruncate(fd,0);
           lseek(fd,0,SEEK_SET);
@@ -1645,6 +1712,12 @@ void create(const char *filename, const char *folderpath) {
         archive_entry_free(entry);
         continue;
       }
+      // The chunk index and cache follow the cloud, not the snapshots
+      if (strcmp(relative_path, CHUNK_INDEX_DIR) == 0 || strncmp(relative_path, CHUNK_INDEX_DIR "/", strlen(CHUNK_INDEX_DIR "/")) == 0 ||
+          strcmp(relative_path, CHUNK_CACHE_DIR) == 0 || strncmp(relative_path, CHUNK_CACHE_DIR "/", strlen(CHUNK_CACHE_DIR "/")) == 0) {
+        archive_entry_free(entry);
+        continue;
+      }
       const char* assigned_path = relative_path;
       archive_entry_set_pathname(entry, assigned_path);
     }
@@ -1788,11 +1861,13 @@ int cloudfs_snapshort(unsigned long *timestamp) {
     log_error((char *) "cloudfs_snapshort");
   }
   std::string snapshot_name = "cloudfs_snapshort_" + std::to_string(time.tv_usec);
+  if (containers.Flush() < 0) {
+    log_msg(logfile, "\nFailed to upload the open container before the snapshot\n");
+    return -1;
+  }
   create(("/" + snapshot_name).c_str(), state_.ssd_path);
   s3status = cloud_create_bucket("cloudfs_snapshort_bucket");
-  for (std::unordered_map<std::string, int>::iterator iter = md5_to_frequency_map.begin(); iter != md5_to_frequency_map.end(); iter++) {
-    md5_to_frequency_map[iter->first] += 1;
-  }
+  md5_to_frequency_map.AddAll(1);
   upload_whole_file_in_clould(("/" + snapshot_name).c_str(), "cloudfs_snapshort_bucket", snapshot_name.c_str(), true);
   upload_md5_frequecy_map_to_cloud("cloudfs_snapshort_bucket", (snapshot_name  + "_md5_frequency").c_str(), md5_to_frequency_map);
   *timestamp = time.tv_usec;
@@ -1825,7 +1900,7 @@ bool deleteFileInDirectory(const char* path, bool rootDir) {
         if ((dir = opendir(path)) == NULL)
             return 1;
         while ((dirinfo = readdir(dir)) != NULL) {
-            if (strcmp(dirinfo->d_name, ".") == 0 || strcmp(dirinfo->d_name, "..") == 0 || strcmp(dirinfo->d_name, ".snapshot") == 0 || strcmp(dirinfo->d_name, "lost+found") == 0) {
+            if (strcmp(dirinfo->d_name, ".") == 0 || strcmp(dirinfo->d_name, "..") == 0 || strcmp(dirinfo->d_name, ".snapshot") == 0 || strcmp(dirinfo->d_name, "lost+found") == 0 || strcmp(dirinfo->d_name, CHUNK_INDEX_DIR) == 0 || strcmp(dirinfo->d_name, CHUNK_CACHE_DIR) == 0) {
               continue;
             }
             getfilepath(path, dirinfo->d_name, filepath);
@@ -1979,25 +2054,37 @@ int cloudfs_restore(unsigned long timestamp) {
   char fpath[PATH_MAX];
   cloudfs_fullpath((char *) "cloudfs_restore", fpath, ("/" + snapshot_name).c_str());
   remove(fpath);
-  recover_md5_frequency_map("cloudfs_snapshort_bucket", (snapshot_name  + "_md5_frequency").c_str(), md5_to_frequency_map);
-  for (std::unordered_map<std::string, int>::iterator iter = md5_to_frequency_map.begin(); iter != md5_to_frequency_map.end(); iter++) {
-    log_msg(logfile, "\ndebug cloudfs_restore md5_to_frequency_map, key %s, value %d\n", iter->first.c_str(), iter->second);
+  // Chunks may have moved to other containers since the snapshot, keep their current location. The chunks
+  // the snapshot doesn't have are only used by the files and the snapshots after it, which are gone.
+  std::unordered_map<std::string, std::pair<int, struct chunk_location> > restored_map;
+  download_md5_frequency_map("cloudfs_snapshort_bucket", (snapshot_name  + "_md5_frequency").c_str(),
+    [&restored_map](const std::string &md5, int frequency, const struct chunk_location &location) {
+      restored_map[md5] = std::make_pair(frequency, location);
+    });
+  std::vector<std::pair<std::string, struct chunk_location> > released_chunks;
+  md5_to_frequency_map.ForEach([&restored_map, &released_chunks](const std::string &md5, int frequency UNUSED, const struct chunk_location &location) {
+    std::unordered_map<std::string, std::pair<int, struct chunk_location> >::iterator iter = restored_map.find(md5);
+    if (iter != restored_map.end()) {
+      iter->second.second = location;
+    } else {
+      released_chunks.push_back(std::make_pair(md5, location));
+    }
+  });
+  md5_to_frequency_map.Clear();
+  for (std::unordered_map<std::string, std::pair<int, struct chunk_location> >::iterator iter = restored_map.begin(); iter != restored_map.end(); iter++) {
+    log_msg(logfile, "\ndebug cloudfs_restore md5_to_frequency_map, key %s, value %d\n", iter->first.c_str(), iter->second.first);
+    md5_to_frequency_map.Set(iter->first, iter->second.first);
+    md5_to_frequency_map.SetLocation(iter->first, iter->second.second);
+  }
+  for (size_t i = 0; i < released_chunks.size(); i++) {
+    log_msg(logfile, "\ncloudfs_restore, delete md5 frequency debug md5 %s\n", released_chunks[i].first.c_str());
+    containers.Release(released_chunks[i].first, released_chunks[i].second);
   }
+  containers.Compact(md5_to_frequency_map);
   std::vector<unsigned long> bigger_timestamp_list = snapshort_after_timestamp_in_the_cloud(timestamp);
-  std::unordered_map<std::string, int> deleted_snapshot_map;
-  std::unordered_map<std::string, bool> not_exists_map;
   for (int i = 0; i < bigger_timestamp_list.size(); i++) {
     log_msg(logfile, "\ncloudfs_restore, exists snapshot %ul after this one, need to delete\n", bigger_timestamp_list.at(i));
     std::string snapshot_to_update_name = "cloudfs_snapshort_" + std::to_string(bigger_timestamp_list.at(i));
-    recover_md5_frequency_map("cloudfs_snapshort_bucket", (snapshot_to_update_name  + "_md5_frequency").c_str(), deleted_snapshot_map);
-    for (std::unordered_map<std::string, int>::iterator iter = deleted_snapshot_map.begin(); iter != deleted_snapshot_map.end(); iter++) {
-      if (md5_to_frequency_map.find(iter->first) == md5_to_frequency_map.end() && not_exists_map.find(iter->first) == not_exists_map.end()) {
-        log_msg(logfile, "\ncloudfs_restore, delete md5 frequency debug md5 %s, frequency %d\n", iter->first.c_str(), iter->second);
-        not_exists_map[iter->first] = true;
-        cloud_delete_object(iter->first.c_str(), iter->first.c_str());
-        cloud_delete_bucket(iter->first.c_str());
-      }
-    }
     cloud_delete_object("cloudfs_snapshort_bucket", (snapshot_to_update_name  + "_md5_frequency").c_str());
     cloud_delete_object("cloudfs_snapshort_bucket", snapshot_to_update_name.c_str());
     S3Status s3Status = cloud_delete_bucket("cloudfs_snapshort_bucket");
@@ -2039,16 +2126,14 @@ int cloudfs_delete_snapshort(unsigned long timestamp) {
     upload_md5_frequecy_map_to_cloud("cloudfs_snapshort_bucket", (snapshot_to_update_name + "_md5_frequency").c_str(), snapshot_to_update_map);
   }
   for (std::unordered_map<std::string, int>::iterator iter = deleted_snapshot_map.begin(); iter != deleted_snapshot_map.end(); iter++) {
-    if (md5_to_frequency_map.find(iter->first) != md5_to_frequency_map.end()) {
+    if (md5_to_frequency_map.Contains(iter->first)) {
       log_msg(logfile, "\ncloudfs_delete_snapshort, md5 frequency debug md5 %s, frequency %d\n", iter->first.c_str(), iter->second);
-      md5_to_frequency_map[iter->first] = md5_to_frequency_map[iter->first] - (bigger_timestamp_list.size() + 1); // need to consider carefully
-      if (md5_to_frequency_map[iter->first] == 0) {
+      md5_to_frequency_map.Add(iter->first, -(int) (bigger_timestamp_list.size() + 1)); // need to consider carefully
+      if (md5_to_frequency_map.Get(iter->first) == 0) {
         log_msg(logfile, "\ncloudfs_delete_snapshort, need to delete md5 %s\n", iter->first.c_str());
-        cloud_delete_object(iter->first.c_str(), iter->first.c_str());
-        cloud_delete_bucket(iter->first.c_str());
-        md5_to_frequency_map.erase(iter->first);
+        release_chunk(iter->first);
       } else {
-        md5_to_frequency_map[iter->first] = md5_to_frequency_map[iter->first] + 1; // tricky
+        md5_to_frequency_map.Add(iter->first, 1); // tricky
       }
     }
   }
@@ -2173,12 +2258,31 @@ int cloudfs_start(struct cloudfs_state *state,
   } else {
     printf("Disable Dedup mode\n");   
   }
-  rp = rabin_init(state_.rabin_window_size, state_.avg_seg_size, 
+  if (state_.chunker == CHUNKER_GEAR) {
+    printf("Gear chunker\n");
+    gp = gear_init(state_.avg_seg_size, state_.min_seg_size,
+                   state_.max_seg_size);
+    if (!gp) {
+      printf("Failed to init gear chunker\n");
+      exit(1);
+    }
+  } else {
+    rp = rabin_init(state_.rabin_window_size, state_.avg_seg_size, 
 								  state_.min_seg_size, state_.max_seg_size);
-  if (!rp) {
+    if (!rp) {
 		printf("Failed to init rabinhash algorithm\n");
 		exit(1);
 	}
+  }
+  pipeline_conf.boundaries = segment_boundaries;
+  pipeline_conf.hash_threads = state_.hash_threads;
+  if (pipeline_conf.hash_threads <= 0) {
+    pipeline_conf.hash_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  pipeline_conf.upload_threads = state_.upload_threads;
+  pipeline_conf.containers = &containers;
+  printf("Upload pipeline with %d hashers, %d uploaders\n",
+    pipeline_conf.hash_threads, pipeline_conf.upload_threads);
   logfile = fopen("/tmp/cloudfs.log", "w");
   setvbuf(logfile, NULL, _IOLBF, 0);
   log_msg(logfile, "cloudfs_init()\n");
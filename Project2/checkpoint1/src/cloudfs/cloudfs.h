@@ -4,6 +4,10 @@
 #define MAX_PATH_LEN 4096
 #define MAX_HOSTNAME_LEN 1024
 
+/* Content-defined chunking algorithm used for deduplication */
+#define CHUNKER_RABIN 0
+#define CHUNKER_GEAR 1
+
 struct cloudfs_state {
   char ssd_path[MAX_PATH_LEN];
   char fuse_path[MAX_PATH_LEN];
@@ -15,6 +19,9 @@ struct cloudfs_state {
   int max_seg_size;
   int cache_size;
   int rabin_window_size;
+  int chunker;
+  int hash_threads;
+  int upload_threads;
   char no_dedup;
 };
 
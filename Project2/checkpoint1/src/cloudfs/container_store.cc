@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <string.h>
+#include <set>
+#include <vector>
+#include "cloudapi.h"
+#include "container_store.h"
+
+// Containers listed by cloud_list_bucket, the filler takes no argument
+static std::map<uint32_t, uint64_t> listed_containers;
+
+// A container being uploaded by the event loop
+struct upload_context {
+  ContainerStore *store;
+  uint32_t id;
+  std::shared_ptr<std::string> data;    // kept alive until uploaded
+};
+
+// Reads of a ReadAll still in flight
+struct read_batch {
+  std::mutex mutex;
+  std::condition_variable done;
+  int remaining;
+  bool failed;
+};
+
+static void read_done(S3Status status, void *data) {
+  struct read_batch *batch = (struct read_batch *) data;
+  std::lock_guard<std::mutex> lock(batch->mutex);
+  if (status != S3StatusOK) {
+    batch->failed = true;
+  }
+  if (--batch->remaining == 0) {
+    batch->done.notify_all();
+  }
+}
+
+static int list_container(const char *key, time_t modified_time, uint64_t size) {
+  unsigned int id;
+  (void) modified_time;
+  if (sscanf(key, "container_%x", &id) == 1 && id != 0) {
+    listed_containers[id] = size;
+  }
+  return 0;
+}
+
+ContainerStore::ContainerStore() : next_id_(1), open_id_(0) {}
+
+std::string ContainerStore::Key(uint32_t id) {
+  char key[32];
+  snprintf(key, sizeof(key), "container_%08x", id);
+  return key;
+}
+
+int ContainerStore::Init(ChunkIndex &index) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  containers_.clear();
+  uploading_.clear();
+  failed_.clear();
+  released_.clear();
+  open_id_ = 0;
+  open_data_.reset();
+  next_id_ = 1;
+
+  cloud_create_bucket(CONTAINER_BUCKET);
+  listed_containers.clear();
+  if (cloud_list_bucket(CONTAINER_BUCKET, list_container) != S3StatusOK) {
+    return -1;
+  }
+  for (std::map<uint32_t, uint64_t>::iterator iter = listed_containers.begin(); iter != listed_containers.end(); iter++) {
+    struct container_info info = { iter->second, 0 };
+    containers_[iter->first] = info;
+    next_id_ = iter->first + 1;
+  }
+  listed_containers.clear();
+
+  // A container the index still points to may be missing from the listing,
+  // its id must not be reused
+  index.ForEach([this](const std::string &md5, int count, const struct chunk_location &location) {
+    (void) md5;
+    (void) count;
+    if (location.container >= next_id_) {
+      next_id_ = location.container + 1;
+    }
+    std::map<uint32_t, struct container_info>::iterator iter = containers_.find(location.container);
+    if (iter != containers_.end()) {
+      iter->second.live += location.size;
+    }
+  });
+
+  std::vector<uint32_t> empty;
+  for (std::map<uint32_t, struct container_info>::iterator iter = containers_.begin(); iter != containers_.end(); iter++) {
+    if (iter->second.live == 0) {
+      empty.push_back(iter->first);
+    }
+  }
+  for (size_t i = 0; i < empty.size(); i++) {
+    Delete(empty[i]);
+  }
+  return 0;
+}
+
+// Called by the event loop, or by Seal, when a container is uploaded
+void ContainerStore::Uploaded(S3Status status, void *data) {
+  struct upload_context *context = (struct upload_context *) data;
+  ContainerStore *store = context->store;
+
+  {
+    std::lock_guard<std::mutex> lock(store->mutex_);
+    store->uploading_.erase(context->id);
+    // All its chunks were released during the upload
+    std::map<uint32_t, struct container_info>::iterator iter = store->containers_.find(context->id);
+    if (iter != store->containers_.end() && iter->second.live == 0) {
+      store->released_.push_back(context->id);
+    } else if (status != S3StatusOK) {
+      store->failed_[context->id] = context->data;
+    }
+    store->uploaded_.notify_all();
+  }
+  delete context;
+}
+
+// Starts the upload of the open container, called with the lock held, which
+// is released while waiting for CONTAINER_UPLOADS_MAX and submitting it.
+// Without the event loop the upload is done here.
+void ContainerStore::Seal(std::unique_lock<std::mutex> &lock) {
+  uploaded_.wait(lock, [this] { return uploading_.size() < CONTAINER_UPLOADS_MAX; });
+  DeleteReleased();
+  if (!open_id_) {
+    return;
+  }
+  struct upload_context *context = new upload_context;
+  context->store = this;
+  context->id = open_id_;
+  context->data = open_data_;
+  uploading_[open_id_] = open_data_;
+  open_id_ = 0;
+  open_data_.reset();
+
+  lock.unlock();
+  std::string key = Key(context->id);
+  const std::string &data = *context->data;
+  S3Status s3status = cloud_put_object_from_buffer_async(CONTAINER_BUCKET, key.c_str(), data.data(), data.size(),
+                                                         Uploaded, context);
+  if (s3status != S3StatusOK) {
+    s3status = cloud_put_object_from_buffer(CONTAINER_BUCKET, key.c_str(), data.data(), data.size());
+    Uploaded(s3status, context);
+  }
+  lock.lock();
+}
+
+// Uploads the failed containers again, called with the lock held, which is
+// released during the uploads. Returns 0, or -1 if some of them failed
+// CONTAINER_UPLOAD_RETRIES more times.
+int ContainerStore::RetryFailed(std::unique_lock<std::mutex> &lock) {
+  std::map<uint32_t, std::shared_ptr<std::string> > failed = failed_;
+  std::vector<uint32_t> uploaded;
+
+  lock.unlock();
+  for (std::map<uint32_t, std::shared_ptr<std::string> >::iterator iter = failed.begin(); iter != failed.end(); iter++) {
+    const std::string &data = *iter->second;
+    for (int i = 0; i < CONTAINER_UPLOAD_RETRIES; i++) {
+      if (cloud_put_object_from_buffer(CONTAINER_BUCKET, Key(iter->first).c_str(), data.data(), data.size()) == S3StatusOK) {
+        uploaded.push_back(iter->first);
+        break;
+      }
+    }
+  }
+  lock.lock();
+
+  for (size_t i = 0; i < uploaded.size(); i++) {
+    failed_.erase(uploaded[i]);
+    // Released while it was uploaded again
+    if (!containers_.count(uploaded[i])) {
+      cloud_delete_object(CONTAINER_BUCKET, Key(uploaded[i]).c_str());
+    }
+  }
+  return failed_.empty() ? 0 : -1;
+}
+
+void ContainerStore::Delete(uint32_t id) {
+  cloud_delete_object(CONTAINER_BUCKET, Key(id).c_str());
+  containers_.erase(id);
+}
+
+// Deletes the containers released during their upload, called with the
+// lock held
+void ContainerStore::DeleteReleased() {
+  for (size_t i = 0; i < released_.size(); i++) {
+    Delete(released_[i]);
+  }
+  released_.clear();
+}
+
+int ContainerStore::Append(const char *data, uint32_t size, struct chunk_location *location) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  // The cloud is failing, don't keep more chunks in memory
+  if (failed_.size() >= CONTAINER_UPLOADS_MAX) {
+    return -1;
+  }
+  if (!open_id_) {
+    open_id_ = next_id_++;
+    open_data_ = std::make_shared<std::string>();
+    open_data_->reserve(CONTAINER_SIZE);
+    struct container_info info = { 0, 0 };
+    containers_[open_id_] = info;
+  }
+  location->container = open_id_;
+  location->offset = open_data_->size();
+  location->size = size;
+  open_data_->append(data, size);
+  containers_[open_id_].size += size;
+  containers_[open_id_].live += size;
+
+  if (open_data_->size() >= CONTAINER_SIZE) {
+    Seal(lock);
+  }
+  return 0;
+}
+
+// Copies the bytes from memory if the container is not in the cloud yet,
+// returns whether it did
+bool ContainerStore::ReadBuffered(const struct chunk_location &location,
+                                  uint32_t offset, uint32_t len, char *buf) {
+  if (!location.container) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::shared_ptr<std::string> data;
+  if (location.container == open_id_) {
+    data = open_data_;
+  } else if (uploading_.count(location.container)) {
+    data = uploading_[location.container];
+  } else if (failed_.count(location.container)) {
+    data = failed_[location.container];
+  }
+  if (!data) {
+    return false;
+  }
+  memcpy(buf, data->data() + location.offset + offset, len);
+  return true;
+}
+
+int ContainerStore::Read(const std::string &md5, const struct chunk_location &location,
+                         uint32_t offset, uint32_t len, char *buf) {
+  if (offset > location.size || len > location.size - offset) {
+    return -1;
+  }
+  if (len == 0 || ReadBuffered(location, offset, len, buf)) {
+    return 0;
+  }
+
+  S3Status s3status;
+  if (location.container) {
+    s3status = cloud_get_object_to_buffer(CONTAINER_BUCKET, Key(location.container).c_str(),
+                                          location.offset + offset, len, buf);
+  } else {
+    s3status = cloud_get_object_to_buffer(md5.c_str(), md5.c_str(), offset, len, buf);
+  }
+  return s3status == S3StatusOK ? 0 : -1;
+}
+
+int ContainerStore::ReadAll(std::vector<struct chunk_read> &reads) {
+  struct read_batch batch;
+  batch.remaining = 1;    // until all are submitted
+  batch.failed = false;
+
+  for (size_t i = 0; i < reads.size(); i++) {
+    const struct chunk_read &read = reads[i];
+    if (read.offset > read.location.size || read.len > read.location.size - read.offset) {
+      std::lock_guard<std::mutex> lock(batch.mutex);
+      batch.failed = true;
+      continue;
+    }
+    if (read.len == 0 || ReadBuffered(read.location, read.offset, read.len, read.buf)) {
+      continue;
+    }
+
+    std::string bucket = read.location.container ? CONTAINER_BUCKET : read.md5;
+    std::string key = read.location.container ? Key(read.location.container) : read.md5;
+    uint64_t start = (read.location.container ? read.location.offset : 0) + read.offset;
+    {
+      std::lock_guard<std::mutex> lock(batch.mutex);
+      batch.remaining++;
+    }
+    if (cloud_get_object_to_buffer_async(bucket.c_str(), key.c_str(), start, read.len, read.buf,
+                                         read_done, &batch) != S3StatusOK) {
+      read_done(cloud_get_object_to_buffer(bucket.c_str(), key.c_str(), start, read.len, read.buf), &batch);
+    }
+  }
+
+  read_done(S3StatusOK, &batch);
+  std::unique_lock<std::mutex> lock(batch.mutex);
+  batch.done.wait(lock, [&batch] { return batch.remaining == 0; });
+  return batch.failed ? -1 : 0;
+}
+
+int ContainerStore::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Seal(lock);
+  uploaded_.wait(lock, [this] { return uploading_.empty(); });
+  DeleteReleased();
+  if (failed_.empty()) {
+    return 0;
+  }
+  return RetryFailed(lock);
+}
+
+void ContainerStore::Release(const std::string &md5, const struct chunk_location &location) {
+  if (!location.container) {
+    cloud_delete_object(md5.c_str(), md5.c_str());
+    cloud_delete_bucket(md5.c_str());
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<uint32_t, struct container_info>::iterator iter = containers_.find(location.container);
+  if (iter == containers_.end()) {
+    return;
+  }
+  iter->second.live -= location.size < iter->second.live ? location.size : iter->second.live;
+  if (iter->second.live) {
+    return;
+  }
+  if (location.container == open_id_) {
+    // Nothing in it is needed anymore, don't upload it
+    open_id_ = 0;
+    open_data_.reset();
+    containers_.erase(iter);
+  } else if (failed_.count(location.container)) {
+    // Not in the cloud, unless being retried, then RetryFailed deletes it
+    failed_.erase(location.container);
+    containers_.erase(iter);
+  } else if (!uploading_.count(location.container)) {
+    Delete(location.container);
+  }
+}
+
+int ContainerStore::Compact(ChunkIndex &index) {
+  std::map<uint32_t, std::string> victims;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::map<uint32_t, struct container_info>::iterator iter = containers_.begin(); iter != containers_.end(); iter++) {
+      if (iter->first != open_id_ && !uploading_.count(iter->first) && !failed_.count(iter->first) && iter->second.live &&
+          iter->second.live * 100 < iter->second.size * CONTAINER_GC_LIVE_PERCENT) {
+        victims[iter->first].resize(iter->second.size);
+      }
+    }
+  }
+  if (victims.empty()) {
+    return 0;
+  }
+
+  for (std::map<uint32_t, std::string>::iterator iter = victims.begin(); iter != victims.end();) {
+    if (cloud_get_object_to_buffer(CONTAINER_BUCKET, Key(iter->first).c_str(), 0,
+                                   iter->second.size(), &iter->second[0]) != S3StatusOK) {
+      victims.erase(iter++);
+    } else {
+      iter++;
+    }
+  }
+
+  // Not moved during ForEach, updating the index may rewrite it
+  std::vector<std::pair<std::string, struct chunk_location> > moves;
+  index.ForEach([&victims, &moves](const std::string &md5, int count, const struct chunk_location &location) {
+    (void) count;
+    if (victims.count(location.container)) {
+      moves.push_back(std::make_pair(md5, location));
+    }
+  });
+
+  // Index in moves and new location of the chunks moved
+  std::vector<std::pair<size_t, struct chunk_location> > moved;
+  // Victims with a live chunk that could not be moved, they are not deleted
+  std::set<uint32_t> kept;
+  for (size_t i = 0; i < moves.size(); i++) {
+    const struct chunk_location &old_location = moves[i].second;
+    const std::string &data = victims[old_location.container];
+    struct chunk_location location;
+    if (old_location.offset + (uint64_t) old_location.size > data.size() ||
+        Append(data.data() + old_location.offset, old_location.size, &location) < 0) {
+      kept.insert(old_location.container);
+      continue;
+    }
+    index.SetLocation(moves[i].first, location);
+    moved.push_back(std::make_pair(i, location));
+  }
+  if (Flush() < 0) {
+    // The victims are still there, point back to them
+    for (size_t i = 0; i < moved.size(); i++) {
+      const std::string &md5 = moves[moved[i].first].first;
+      index.SetLocation(md5, moves[moved[i].first].second);
+      Release(md5, moved[i].second);
+    }
+    return -1;
+  }
+
+  // The chunks moved out of a kept victim are not live in it anymore
+  for (size_t i = 0; i < moved.size(); i++) {
+    const struct chunk_location &old_location = moves[moved[i].first].second;
+    if (kept.count(old_location.container)) {
+      Release(moves[moved[i].first].first, old_location);
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (std::map<uint32_t, std::string>::iterator iter = victims.begin(); iter != victims.end(); iter++) {
+    if (!kept.count(iter->first)) {
+      Delete(iter->first);
+    }
+  }
+  return victims.size() - kept.size();
+}
@@ -0,0 +1,122 @@
+#ifndef __CONTAINER_STORE_H_
+#define __CONTAINER_STORE_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "chunk_index.h"
+#include "libs3.h"
+
+// Bucket of all the containers, each object container_<id in hex>
+#define CONTAINER_BUCKET "cloudfs_containers"
+
+// Bytes of chunks after which a container is uploaded
+#define CONTAINER_SIZE (4 << 20)
+
+// Containers with less than this percentage of live bytes are compacted
+#define CONTAINER_GC_LIVE_PERCENT 50
+
+// Containers uploaded at once, Append waits for one of them beyond that.
+// Append also fails while as many containers wait for a retry.
+#define CONTAINER_UPLOADS_MAX 8
+
+// Uploads of a failed container by each Flush
+#define CONTAINER_UPLOAD_RETRIES 3
+
+// A read of ContainerStore::ReadAll
+struct chunk_read {
+  std::string md5;
+  struct chunk_location location;
+  uint32_t offset;
+  uint32_t len;
+  char *buf;
+};
+
+// Packs the chunks into container objects, so that each PUT carries many
+// chunks, and reads them back with ranged GETs.
+//
+// Chunks are appended to the open container, which is uploaded once it
+// reaches CONTAINER_SIZE or on Flush, in the background with the async
+// cloud-lib requests when cloud_async_init was called. Until the upload
+// completes they are read from memory. A container whose upload failed
+// stays in memory until a Flush uploads it again. A container is deleted
+// when its last chunk is released, and the live chunks of containers
+// mostly released are copied into a new one by Compact.
+//
+// Chunks at container 0 are the objects md5 in bucket md5 of the format
+// before containers, they are read and deleted as such.
+class ContainerStore {
+ public:
+  ContainerStore();
+
+  // Finds the containers in the cloud and their live bytes from the
+  // locations in index, deletes the ones without any. New containers get
+  // ids above all of them. Returns 0 or -1.
+  int Init(ChunkIndex &index);
+
+  // Appends a chunk to the open container, location receives where.
+  // Starts the upload of the container if it is full. Thread safe. Returns
+  // 0, or -1 if the chunk was not stored because CONTAINER_UPLOADS_MAX
+  // containers wait for a retry. Failed uploads are returned by Flush.
+  int Append(const char *data, uint32_t size, struct chunk_location *location);
+
+  // Reads len bytes from offset in the chunk md5 at location into buf.
+  // Thread safe. Returns 0 or -1.
+  int Read(const std::string &md5, const struct chunk_location &location,
+           uint32_t offset, uint32_t len, char *buf);
+
+  // Reads all of reads concurrently, thread safe. Returns 0, or -1 if any
+  // of them failed.
+  int ReadAll(std::vector<struct chunk_read> &reads);
+
+  // Uploads the open container, waits for all the uploads and retries the
+  // failed ones. Returns 0, or -1 if some containers are still not in the
+  // cloud, they are kept for the next Flush.
+  int Flush();
+
+  // The chunk md5 at location is not referenced anymore
+  void Release(const std::string &md5, const struct chunk_location &location);
+
+  // Moves the live chunks of the containers below
+  // CONTAINER_GC_LIVE_PERCENT live bytes to new containers, updating their
+  // location in index, then deletes them. A container with a chunk that
+  // could not be moved is kept. Returns the containers deleted, or -1 if
+  // the new containers could not be uploaded, the chunks are left where
+  // they were then.
+  int Compact(ChunkIndex &index);
+
+ private:
+  struct container_info {
+    uint64_t size;    // bytes of chunks written in it
+    uint64_t live;    // bytes of chunks still referenced
+  };
+
+  static std::string Key(uint32_t id);
+  static void Uploaded(S3Status status, void *data);
+  void Seal(std::unique_lock<std::mutex> &lock);
+  int RetryFailed(std::unique_lock<std::mutex> &lock);
+  void Delete(uint32_t id);
+  void DeleteReleased();
+  bool ReadBuffered(const struct chunk_location &location, uint32_t offset,
+                    uint32_t len, char *buf);
+
+  std::mutex mutex_;
+  uint32_t next_id_;
+  uint32_t open_id_;    // 0 if no chunks are waiting for an upload
+  std::shared_ptr<std::string> open_data_;
+  // Containers being uploaded, still read from memory
+  std::map<uint32_t, std::shared_ptr<std::string> > uploading_;
+  std::condition_variable uploaded_;
+  // Containers whose upload failed, still read from memory
+  std::map<uint32_t, std::shared_ptr<std::string> > failed_;
+  // Released while being uploaded, deleted once uploaded, outside of the
+  // event loop
+  std::vector<uint32_t> released_;
+  std::map<uint32_t, struct container_info> containers_;
+};
+
+#endif
@@ -23,6 +23,9 @@ static void usageExit(FILE *out)
 "   -/--max-seg-size    :  Desired maximum segment size for deduplication(in KB)\n"
 "   -/--rabin-window-size: Size of the internal rolling window used for"
 "                           calculating Rabin fingerprint(in bytes)\n"
+"   -/--chunker         :  Segmentation algorithm, rabin (default) or gear\n"
+"   -/--hash-threads    :  Threads hashing segments (default: one per core)\n"
+"   -/--upload-threads  :  Threads uploading segments (default: 4)\n"
 "\n"
 " Commands (with <required parameters> and [optional parameters]) :\n"
 "\n");
@@ -42,6 +45,9 @@ static struct option longOptionsG[] =
     { "min-seg-size",		required_argument,			0,  'm' },
     { "max-seg-size",		required_argument,			0,  'M' },
     { "cache-size",		required_argument,			0,  'c' },
+    { "chunker",			required_argument,			0,  'C' },
+    { "hash-threads",		required_argument,			0,  'H' },
+    { "upload-threads",		required_argument,			0,  'U' },
     { 0,					0,							0,   0	}
 };
 
@@ -59,12 +65,15 @@ static void parse_arguments(int argc, char* argv[],
     state->avg_seg_size = 4096;
     state->max_seg_size = 6144;
     state->rabin_window_size = 48;
+    state->chunker = CHUNKER_RABIN;
+    state->hash_threads = 0; // Default: one per core.
+    state->upload_threads = 4;
     state->cache_size = 0; // Default: no cache.
 
     // Parse args
     while (1) {
         int idx = 0;
-        int c = getopt_long(argc, argv, "s:f:h:a:t:dS:w:m:M:", longOptionsG, &idx);
+        int c = getopt_long(argc, argv, "s:f:h:a:t:dS:w:m:M:C:H:U:", longOptionsG, &idx);
 
         if (c == -1) {
             // End of options
@@ -105,6 +114,22 @@ static void parse_arguments(int argc, char* argv[],
        case 'w': 
             state->rabin_window_size = atoi(optarg);
             break;
+       case 'C':
+            if (!strcmp(optarg, "rabin")) {
+                state->chunker = CHUNKER_RABIN;
+            } else if (!strcmp(optarg, "gear")) {
+                state->chunker = CHUNKER_GEAR;
+            } else {
+                fprintf(stderr, "\nERROR: Unknown chunker: %s\n", optarg);
+                usageExit(stderr);
+            }
+            break;
+       case 'H':
+            state->hash_threads = atoi(optarg);
+            break;
+       case 'U':
+            state->upload_threads = atoi(optarg);
+            break;
         default:
             fprintf(stderr, "\nERROR: Unknown option: -%c\n", c);
             // Usage exit
@@ -118,6 +143,12 @@ static void parse_arguments(int argc, char* argv[],
       // Usage exit
       usageExit(stderr);
     }
+
+    if (state->hash_threads < 0 || state->upload_threads < 1) {
+      fprintf(stderr, "\nERROR: Thread counts seem wrong: (%d, %d)",
+          state->hash_threads, state->upload_threads);
+      usageExit(stderr);
+    }
 }
 
 // main ------------------------------------------------------------------------
@@ -0,0 +1,94 @@
+#include "prefetcher.h"
+
+Prefetcher::Prefetcher(ContainerStore &containers, ChunkCache &cache)
+    : containers_(containers), cache_(cache), stop_(false) {}
+
+Prefetcher::~Prefetcher() {
+  Stop();
+}
+
+void Prefetcher::Start() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (thread_.joinable()) {
+    return;
+  }
+  stop_ = false;
+  thread_ = std::thread(&Prefetcher::Run, this);
+}
+
+void Prefetcher::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!thread_.joinable()) {
+      return;
+    }
+    stop_ = true;
+    for (size_t i = 0; i < queue_.size(); i++) {
+      pending_.erase(queue_[i].md5);
+    }
+    queue_.clear();
+    queued_.notify_all();
+    fetched_.notify_all();
+  }
+  thread_.join();
+}
+
+void Prefetcher::Prefetch(const std::vector<struct chunk_read> &reads) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!thread_.joinable() || stop_) {
+    return;
+  }
+  for (size_t i = 0; i < reads.size(); i++) {
+    if (pending_.insert(reads[i].md5).second) {
+      queue_.push_back(reads[i]);
+    }
+  }
+  queued_.notify_all();
+}
+
+void Prefetcher::Wait(const std::string &md5) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  fetched_.wait(lock, [this, &md5] { return !pending_.count(md5); });
+}
+
+void Prefetcher::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    queued_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+    if (stop_) {
+      break;
+    }
+    std::vector<struct chunk_read> reads;
+    while (!queue_.empty() && reads.size() < PREFETCH_WINDOW_MAX) {
+      reads.push_back(queue_.front());
+      queue_.pop_front();
+    }
+    lock.unlock();
+
+    std::vector<std::string> data(reads.size());
+    for (size_t i = 0; i < reads.size(); i++) {
+      data[i].resize(reads[i].location.size);
+      reads[i].offset = 0;
+      reads[i].len = reads[i].location.size;
+      reads[i].buf = &data[i][0];
+    }
+    // One failure fails the batch, fetch them one by one then
+    if (containers_.ReadAll(reads) == 0) {
+      for (size_t i = 0; i < reads.size(); i++) {
+        cache_.Insert(reads[i].md5, data[i].data(), data[i].size(), true);
+      }
+    } else {
+      for (size_t i = 0; i < reads.size(); i++) {
+        if (containers_.Read(reads[i].md5, reads[i].location, 0, reads[i].len, reads[i].buf) == 0) {
+          cache_.Insert(reads[i].md5, data[i].data(), data[i].size(), true);
+        }
+      }
+    }
+
+    lock.lock();
+    for (size_t i = 0; i < reads.size(); i++) {
+      pending_.erase(reads[i].md5);
+    }
+    fetched_.notify_all();
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef __PREFETCHER_H_
+#define __PREFETCHER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "chunk_cache.h"
+#include "container_store.h"
+
+// Segments prefetched ahead of a sequential reader, at first and at most,
+// the window doubles with each sequential read
+#define PREFETCH_WINDOW_MIN 4
+#define PREFETCH_WINDOW_MAX 64
+
+// Fetches chunks into the cache in the background, so that a sequential
+// reader finds the segments after the one it reads already there.
+//
+// The chunks queued are fetched by a thread, up to PREFETCH_WINDOW_MAX at
+// once with ContainerStore::ReadAll, and inserted in the cache. A read of a
+// chunk being prefetched waits for it with Wait rather than fetching it
+// again. Thread safe.
+class Prefetcher {
+ public:
+  Prefetcher(ContainerStore &containers, ChunkCache &cache);
+  ~Prefetcher();
+
+  void Start();
+  // Drops the chunks queued and waits for the ones being fetched
+  void Stop();
+
+  // Queues the chunks of reads, whole, their offset, len and buf are
+  // ignored. Chunks already queued are skipped.
+  void Prefetch(const std::vector<struct chunk_read> &reads);
+
+  // Waits until the chunk md5 is not queued or being fetched
+  void Wait(const std::string &md5);
+
+ private:
+  void Run();
+
+  ContainerStore &containers_;
+  ChunkCache &cache_;
+  std::mutex mutex_;
+  std::condition_variable queued_;
+  std::condition_variable fetched_;
+  std::deque<struct chunk_read> queue_;
+  // Chunks queued or being fetched
+  std::unordered_set<std::string> pending_;
+  std::thread thread_;
+  bool stop_;
+};
+
+#endif
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/md5.h>
+#include <atomic>
+#include <thread>
+#include "upload_pipeline.h"
+
+// A segment on its way through the pipeline
+struct pipeline_segment {
+  struct upload_segment meta;
+  std::string data;    // released once hashed or uploaded
+};
+
+struct pipeline_run {
+  const struct upload_pipeline_conf *conf;
+  int fd;
+  ChunkIndex *known;
+
+  BoundedQueue<std::string *> blocks;
+  BoundedQueue<struct pipeline_segment *> to_hash;
+  BoundedQueue<struct pipeline_segment *> to_upload;
+
+  // Guards known, hashers add the new md5s and packers their location
+  std::mutex known_mutex;
+  std::atomic<int> failed;
+
+  pipeline_run(const struct upload_pipeline_conf *p_conf, int p_fd,
+               ChunkIndex *p_known) :
+    conf(p_conf),
+    fd(p_fd),
+    known(p_known),
+    blocks(PIPELINE_READ_DEPTH),
+    to_hash(PIPELINE_QUEUE_DEPTH * p_conf->hash_threads),
+    to_upload(PIPELINE_QUEUE_DEPTH * p_conf->upload_threads),
+    failed(0) {}
+};
+
+static void release_data(struct pipeline_segment *segment) {
+  std::string().swap(segment->data);
+}
+
+// Reader stage: the file in blocks of PIPELINE_BLOCK_SIZE
+static void pipeline_read(struct pipeline_run *run) {
+  while (1) {
+    std::string *block = new std::string(PIPELINE_BLOCK_SIZE, '\0');
+    size_t filled = 0;
+    ssize_t bytes = 0;
+    while (filled < block->size() &&
+           (bytes = read(run->fd, &(*block)[filled], block->size() - filled)) > 0) {
+      filled += bytes;
+    }
+    if (bytes < 0) {
+      run->failed++;
+    }
+    if (filled == 0) {
+      delete block;
+      break;
+    }
+    block->resize(filled);
+    run->blocks.Push(block);
+    if (filled < PIPELINE_BLOCK_SIZE) {
+      break;
+    }
+  }
+  run->blocks.Close();
+}
+
+// Hasher stage: md5 of the segment, then to the uploaders if it is new
+static void pipeline_hash(struct pipeline_run *run) {
+  struct pipeline_segment *segment;
+  unsigned char md5[MD5_DIGEST_LENGTH];
+  char md5String[2 * MD5_DIGEST_LENGTH + 1];
+
+  while (run->to_hash.Pop(segment)) {
+    MD5((const unsigned char *) segment->data.data(), segment->data.size(), md5);
+    for (int b = 0; b < MD5_DIGEST_LENGTH; b++) {
+      sprintf(&md5String[2 * b], "%02x", md5[b]);
+    }
+    segment->meta.md5 = md5String;
+
+    {
+      std::lock_guard<std::mutex> lock(run->known_mutex);
+      if (!run->known->Contains(segment->meta.md5)) {
+        run->known->Set(segment->meta.md5, 0);
+        segment->meta.is_new = 1;
+      }
+    }
+
+    if (segment->meta.is_new) {
+      run->to_upload.Push(segment);
+    } else {
+      release_data(segment);
+    }
+  }
+}
+
+// Packer stage: new segments into the containers, uploading the full ones
+static void pipeline_upload(struct pipeline_run *run) {
+  struct pipeline_segment *segment;
+  struct chunk_location location;
+
+  while (run->to_upload.Pop(segment)) {
+    int ret = run->conf->containers->Append(segment->data.data(), segment->data.size(),
+                                            &location);
+    {
+      std::lock_guard<std::mutex> lock(run->known_mutex);
+      if (ret < 0) {
+        // Not stored, it must not be found by the next writes
+        run->known->Erase(segment->meta.md5);
+        segment->meta.is_new = 0;
+        run->failed++;
+      } else {
+        run->known->SetLocation(segment->meta.md5, location);
+      }
+    }
+    release_data(segment);
+  }
+}
+
+// Chunker stage: cuts the blocks into segments, the last one may continue
+// in the next block
+static void pipeline_chunk(struct pipeline_run *run,
+                           std::deque<struct pipeline_segment> &all) {
+  unsigned int ends[PIPELINE_MAX_BOUNDARIES];
+  std::string pending;
+  int offset = 0;
+  std::string *block;
+
+  while (run->blocks.Pop(block)) {
+    unsigned int pos = 0;
+    while (pos < block->size()) {
+      int n = run->conf->boundaries(block->data() + pos, block->size() - pos,
+                                    ends, PIPELINE_MAX_BOUNDARIES);
+      if (n < 0) {
+        run->failed++;
+        pending.append(*block, pos, std::string::npos);
+        break;
+      }
+      for (int i = 0; i < n; i++) {
+        pending.append(*block, pos, ends[i] - (i ? ends[i - 1] : 0));
+        pos += ends[i] - (i ? ends[i - 1] : 0);
+
+        struct pipeline_segment segment;
+        segment.meta.offset = offset;
+        segment.meta.size = pending.size();
+        segment.meta.complete = 1;
+        segment.meta.is_new = 0;
+        segment.data.swap(pending);
+        offset += segment.meta.size;
+        all.push_back(std::move(segment));
+        run->to_hash.Push(&all.back());
+      }
+      if (n < PIPELINE_MAX_BOUNDARIES) {
+        pending.append(*block, pos, std::string::npos);
+        break;
+      }
+    }
+    delete block;
+  }
+
+  if (!pending.empty()) {
+    struct pipeline_segment segment;
+    segment.meta.offset = offset;
+    segment.meta.size = pending.size();
+    segment.meta.complete = 0;
+    segment.meta.is_new = 0;
+    segment.data.swap(pending);
+    all.push_back(std::move(segment));
+    run->to_hash.Push(&all.back());
+  }
+}
+
+int upload_pipeline_run(const struct upload_pipeline_conf *conf, int fd,
+                        ChunkIndex &known,
+                        std::vector<struct upload_segment> &segments) {
+  struct pipeline_run run(conf, fd, &known);
+  // Elements of a deque don't move as it grows, the workers point to them
+  std::deque<struct pipeline_segment> all;
+  std::vector<std::thread> hashers, uploaders;
+
+  std::thread reader(pipeline_read, &run);
+  for (int i = 0; i < conf->hash_threads; i++) {
+    hashers.push_back(std::thread(pipeline_hash, &run));
+  }
+  for (int i = 0; i < conf->upload_threads; i++) {
+    uploaders.push_back(std::thread(pipeline_upload, &run));
+  }
+
+  pipeline_chunk(&run, all);
+
+  reader.join();
+  run.to_hash.Close();
+  for (size_t i = 0; i < hashers.size(); i++) {
+    hashers[i].join();
+  }
+  run.to_upload.Close();
+  for (size_t i = 0; i < uploaders.size(); i++) {
+    uploaders[i].join();
+  }
+
+  segments.clear();
+  segments.reserve(all.size());
+  for (size_t i = 0; i < all.size(); i++) {
+    segments.push_back(all[i].meta);
+  }
+  return run.failed ? -1 : 0;
+}
@@ -0,0 +1,106 @@
+#ifndef __UPLOAD_PIPELINE_H_
+#define __UPLOAD_PIPELINE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "chunk_index.h"
+#include "container_store.h"
+
+// Bytes the reader stage reads from the file at once
+#define PIPELINE_BLOCK_SIZE (1 << 20)
+
+// Blocks read ahead of the chunker
+#define PIPELINE_READ_DEPTH 4
+
+// Segments waiting for a hasher or an uploader, per worker
+#define PIPELINE_QUEUE_DEPTH 64
+
+// Segment boundaries asked from the chunker per call
+#define PIPELINE_MAX_BOUNDARIES 1024
+
+// Finds the segment boundaries in buf, like rabin_segment_boundaries()
+// for the configured chunker
+typedef int (*segment_boundaries_t)(const char *buf, unsigned int bytes,
+                                    unsigned int *offsets,
+                                    unsigned int max_offsets);
+
+struct upload_pipeline_conf {
+  segment_boundaries_t boundaries;
+  int hash_threads;
+  int upload_threads;
+  ContainerStore *containers;
+};
+
+// A segment of the file, as found by the pipeline
+struct upload_segment {
+  int offset;      // from the start of the data read
+  int size;
+  std::string md5;
+  int complete;    // 0 for the tail of the data, not ended by a boundary
+  int is_new;      // 1 if the pipeline stored it
+};
+
+// Fixed capacity FIFO between two stages. Push blocks while it is full,
+// Pop while it is empty, until Close is called.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+  void Push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return queue_.size() < capacity_; });
+    queue_.push_back(std::move(item));
+    not_empty_.notify_one();
+  }
+
+  // Returns false once the queue is closed and drained
+  bool Pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return !queue_.empty() || closed_; });
+    if (queue_.empty()) {
+      return false;
+    }
+    item = std::move(queue_.front());
+    queue_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<T> queue_;
+  size_t capacity_;
+  bool closed_;
+};
+
+// Segment the data read from fd, hash the segments and store the ones
+// whose md5 is not in known yet in conf->containers. New md5s are added to
+// known with a count of 0 and their location, or erased again if they
+// could not be stored.
+//
+// Reading, chunking, hashing and uploading run concurrently: a reader
+// thread, the chunker in the calling thread, then pools of
+// conf->hash_threads hashers and conf->upload_threads packers, which
+// append to the containers and upload the full ones, all connected by
+// bounded queues. The chunker must have been reset. Chunks may stay in the
+// open container, see ContainerStore::Flush.
+//
+// segments receives all the segments in file order. Returns 0, or -1 if
+// reading the file or an upload failed.
+int upload_pipeline_run(const struct upload_pipeline_conf *conf, int fd,
+                        ChunkIndex &known,
+                        std::vector<struct upload_segment> &segments);
+
+#endif
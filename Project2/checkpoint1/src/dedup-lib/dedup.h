@@ -13,6 +13,9 @@
  * Note that the memory allocated by rabin_init() has to be freed
  * the calling rabin_free() in the end. You can reuse the same 
  * rabinpoly_t structure by calling a rabin_reset().
+ *
+ * The gear_*() functions are a faster chunker with the same pattern,
+ * based on the gear hash of FastCDC instead of rabin fingerprints.
  */
 
 #ifndef _DEDUP_H_
@@ -76,6 +79,35 @@ int rabin_segment_next(rabinpoly_t *rp,
 						unsigned int bytes,
 						int *is_new_segment);
 
+/**
+ * @brief Find all the segment boundaries in a buffer.
+ *
+ * Bulk version of rabin_segment_next(): consumes the buffer and stores
+ * the offset in buf right after the end of each segment found, in order,
+ * as rabin_segment_next() would have returned them. The rp state carries
+ * over to the next call like with rabin_segment_next(), so the bytes
+ * after the last offset belong to a segment that continues in the next
+ * buffer.
+ *
+ * It stops early once max_offsets boundaries were found; the bytes after
+ * offsets[max_offsets - 1] are not consumed then and have to be passed
+ * again.
+ *
+ * @param [in] rp Pointer to the rabinpoly_t structure returned by rabin_init
+ * @param [in] buf Pointer to a characher buffer containing data
+ * @param [in] bytes Number of bytes to read from the buf
+ * @param [out] offsets Array receiving the end offset of each segment
+ * @param [in] max_offsets Number of entries in offsets
+ *
+ * @retval int Number of boundaries stored in offsets.
+ *         -1  Error
+ */
+int rabin_segment_boundaries(rabinpoly_t *rp,
+						const char *buf,
+						unsigned int bytes,
+						unsigned int *offsets,
+						unsigned int max_offsets);
+
 /**
  * @brief Resets the Rabin Fingerprinting algorithm's datastructure
  *
@@ -101,4 +133,90 @@ void rabin_reset(rabinpoly_t *rp);
  */
 void rabin_free(rabinpoly_t **p_rp);
 
+/**
+ * Gear hash chunker structure declaration
+ */
+struct gearcdc;
+typedef struct gearcdc gearcdc_t;
+
+/**
+ * @brief Initializes the gear hash chunker.
+ *
+ * Same as rabin_init(), without a window size: the gear hash always
+ * depends on the last 64 bytes. The handle should later be free'ed by
+ * passing it to gear_free().
+ *
+ * @param [in] avg_segment_size Average desired segment size in bytes
+ * @param [in] min_segment_size Minumim size of the produced segment in bytes
+ * @param [in] max_segment_size Maximum size of the produced segment in bytes
+ *
+ * @retval gp Pointer to a allocated gearcdc_t structure
+ * @retval NULL Incase of errors during initialization
+ */
+gearcdc_t *gear_init(unsigned int avg_segment_size,
+					unsigned int min_segment_size,
+					unsigned int max_segment_size);
+
+/**
+ * @brief Find the next segment boundary.
+ *
+ * Same contract as rabin_segment_next(): returns the number of bytes
+ * consumed, up to and including the end of a segment if one was found.
+ * Segments are never shorter than min_segment_size nor longer than
+ * max_segment_size, and their sizes are normalized around
+ * avg_segment_size.
+ *
+ * @param [in] gp Pointer to the gearcdc_t structure returned by gear_init
+ * @param [in] buf Pointer to a characher buffer containing data
+ * @param [in] bytes Number of bytes to read from the buf
+ * @param [out] is_new_segment Pointer to an integer flag indicating segment
+ *                             boundary. 1: new segemnt starts here
+ *                                       0: otherwise.
+ *
+ * @retval int Number of bytes processed by the gear chunker.
+ *         -1  Error
+ */
+int gear_segment_next(gearcdc_t *gp,
+						const char *buf,
+						unsigned int bytes,
+						int *is_new_segment);
+
+/**
+ * @brief Find all the segment boundaries in a buffer.
+ *
+ * Same contract as rabin_segment_boundaries().
+ *
+ * @param [in] gp Pointer to the gearcdc_t structure returned by gear_init
+ * @param [in] buf Pointer to a characher buffer containing data
+ * @param [in] bytes Number of bytes to read from the buf
+ * @param [out] offsets Array receiving the end offset of each segment
+ * @param [in] max_offsets Number of entries in offsets
+ *
+ * @retval int Number of boundaries stored in offsets.
+ *         -1  Error
+ */
+int gear_segment_boundaries(gearcdc_t *gp,
+						const char *buf,
+						unsigned int bytes,
+						unsigned int *offsets,
+						unsigned int max_offsets);
+
+/**
+ * @brief Resets the gear chunker for a different file or stream.
+ *
+ * @param [in] gp Pointer to the gearcdc_t structure returned by gear_init
+ *
+ * @retval void None
+ */
+void gear_reset(gearcdc_t *gp);
+
+/**
+ * @brief Frees the gear chunker's datastructure
+ *
+ * @param [in] p_gp Address of the pointer returned by gear_init()
+ *
+ * @retval void None
+ */
+void gear_free(gearcdc_t **p_gp);
+
 #endif /* _DEDUP_H_ */
@@ -0,0 +1,241 @@
+/**
+ * @file gearcdc.cc
+ * @brief Gear hash content-defined chunking, an alternative to rabin
+ *
+ * Same interface pattern as the rabin functions: init, call
+ * gear_segment_next() in a loop, reset per file, free. Segment boundaries
+ * only depend on the data, not on how it is split across calls.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "gearcdc.h"
+#include "msb.h"
+
+/* Bytes of history the gear hash keeps, one bit per byte */
+#define GEAR_WINDOW 64
+
+/* Bits added to (removed from) the average's mask before (after) it */
+#define GEAR_NORMALIZATION 2
+
+/* Seed of the gear table, fixed so that boundaries are stable */
+#define GEAR_SEED 0x9e3779b97f4a7c15ULL
+
+static int dedupe_compute_cost = 0;
+
+/* Same accounting as rabin_segment_next() */
+static void log_dedupe_compute_cost()
+{
+	FILE* fp = fopen("/tmp/dedupe_compute_cost","w");
+	if (!fp) {
+		return;
+	}
+	dedupe_compute_cost++;
+	fprintf(fp, "%d\n", dedupe_compute_cost);
+	fclose(fp);
+}
+
+/**
+ * splitmix64 generator, fills the gear table
+ */
+static u_int64_t splitmix64(u_int64_t *state)
+{
+	u_int64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/**
+ * Mask of the 'bits' most significant bits, the ones that depend on the
+ * most bytes of the window
+ */
+static u_int64_t top_mask(int bits)
+{
+	if (bits <= 0) {
+		return 0;
+	}
+	if (bits >= 64) {
+		return ~0ULL;
+	}
+	return ~0ULL << (64 - bits);
+}
+
+/**
+ * Interface functions exposed by the library
+ */
+
+gearcdc_t *gear_init(unsigned int avg_segment_size,
+					unsigned int min_segment_size,
+					unsigned int max_segment_size)
+{
+	gearcdc_t *gp;
+	u_int64_t seed = GEAR_SEED;
+	unsigned int i;
+	int bits;
+
+	if (!min_segment_size || !avg_segment_size || !max_segment_size ||
+		(min_segment_size > avg_segment_size) ||
+		(max_segment_size < avg_segment_size)) {
+		return NULL;
+	}
+
+	gp = (gearcdc_t *)malloc(sizeof(gearcdc_t));
+	if (!gp) {
+		return NULL;
+	}
+
+	gp->avg_segment_size = avg_segment_size;
+	gp->min_segment_size = min_segment_size;
+	gp->max_segment_size = max_segment_size;
+	gp->skip_size = min_segment_size > GEAR_WINDOW + 1 ?
+		min_segment_size - GEAR_WINDOW - 1 : 0;
+
+	/* Same expected distance between cut points as rabin's mask */
+	bits = fls32(avg_segment_size) - 1;
+	gp->mask_small = top_mask(bits + GEAR_NORMALIZATION);
+	gp->mask_large = top_mask(bits > GEAR_NORMALIZATION ?
+		bits - GEAR_NORMALIZATION : 1);
+
+	for (i = 0; i < 256; i++) {
+		gp->G[i] = splitmix64(&seed);
+	}
+
+	gear_reset(gp);
+	return gp;
+}
+
+/**
+ * Bytes of buf from i on that fit before the segment reaches size 'limit'
+ */
+static unsigned int gear_span(unsigned int i, unsigned int bytes,
+							unsigned int seg, unsigned int limit)
+{
+	if (seg >= limit) {
+		return i;
+	}
+	return bytes - i < limit - seg ? bytes : i + (limit - seg);
+}
+
+/**
+ * Consume bytes up to and including the next segment boundary, the body
+ * of gear_segment_next() without the error checks and cost accounting
+ */
+static unsigned int gear_scan(gearcdc_t *gp,
+						const char *buf,
+						unsigned int bytes,
+						int *is_new_segment)
+{
+	const u_char *p = (const u_char *)buf;
+	const u_int64_t *G;
+	u_int64_t hash, mask;
+	unsigned int seg, i, end;
+
+	G = gp->G;
+	hash = gp->hash;
+	seg = gp->cur_seg_size;
+
+	/* Bytes too far before the first cut point to reach it */
+	i = gear_span(0, bytes, seg, gp->skip_size);
+	seg += i;
+
+	/* Up to the byte before the first position a segment can end */
+	end = gear_span(i, bytes, seg, gp->min_segment_size - 1);
+	seg += end - i;
+	for (; i < end; i++) {
+		hash = (hash << 1) + G[p[i]];
+	}
+
+	/* Each loop only checks for a cut point and the end of its range */
+	mask = gp->mask_small;
+	end = gear_span(i, bytes, seg, gp->avg_segment_size);
+	seg -= i;
+	for (; i < end; i++) {
+		hash = (hash << 1) + G[p[i]];
+		if (!(hash & mask)) {
+			i++;
+			goto boundary;
+		}
+	}
+	seg += i;
+
+	mask = gp->mask_large;
+	end = gear_span(i, bytes, seg, gp->max_segment_size);
+	seg -= i;
+	for (; i < end; i++) {
+		hash = (hash << 1) + G[p[i]];
+		if (!(hash & mask)) {
+			i++;
+			goto boundary;
+		}
+	}
+	seg += i;
+
+	if (seg < gp->max_segment_size) {
+		gp->hash = hash;
+		gp->cur_seg_size = seg;
+		return i;
+	}
+
+boundary:
+	*is_new_segment = 1;
+	gp->hash = 0;
+	gp->cur_seg_size = 0;
+	return i;
+}
+
+int gear_segment_next(gearcdc_t *gp,
+						const char *buf,
+						unsigned int bytes,
+						int *is_new_segment)
+{
+	if (!gp || !buf || !is_new_segment) {
+		return -1;
+	}
+
+	*is_new_segment = 0;
+	log_dedupe_compute_cost();
+	return gear_scan(gp, buf, bytes, is_new_segment);
+}
+
+int gear_segment_boundaries(gearcdc_t *gp,
+						const char *buf,
+						unsigned int bytes,
+						unsigned int *offsets,
+						unsigned int max_offsets)
+{
+	unsigned int pos = 0, n = 0;
+	int is_new_segment;
+
+	if (!gp || !buf || !offsets) {
+		return -1;
+	}
+
+	log_dedupe_compute_cost();
+	while (pos < bytes && n < max_offsets) {
+		is_new_segment = 0;
+		pos += gear_scan(gp, buf + pos, bytes - pos, &is_new_segment);
+		if (is_new_segment) {
+			offsets[n++] = pos;
+		}
+	}
+
+	return n;
+}
+
+void gear_reset(gearcdc_t *gp)
+{
+	gp->hash = 0;
+	gp->cur_seg_size = 0;
+}
+
+void gear_free(gearcdc_t **p_gp)
+{
+	if (!p_gp || !*p_gp) {
+		return;
+	}
+
+	free(*p_gp);
+	*p_gp = NULL;
+}
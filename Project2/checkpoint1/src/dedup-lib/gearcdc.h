@@ -0,0 +1,40 @@
+/**
+ * @file gearcdc.h
+ * @brief State of the gear hash chunker (FastCDC)
+ *
+ * The gear hash of a position is h = (h << 1) + G[byte], so only the last
+ * 64 bytes influence it and rolling it costs a shift, an add and a table
+ * lookup, with no window to keep. Cut points are found with normalized
+ * chunking: a mask with more bits (harder to match) before the average
+ * segment size and one with fewer bits after it, which narrows the spread
+ * of segment sizes around the average.
+ *
+ * See Xia et al., "FastCDC: a Fast and Efficient Content-Defined Chunking
+ * Approach for Data Deduplication", USENIX ATC 2016.
+ */
+
+#ifndef _GEARCDC_H_
+#define _GEARCDC_H_
+
+#include <sys/types.h>
+#include "dedup.h"
+
+struct gearcdc {
+	unsigned int avg_segment_size;	// in bytes
+	unsigned int min_segment_size;	// in bytes
+	unsigned int max_segment_size;	// in bytes
+
+	/* Bytes of a segment hashed before the first possible cut point
+	 * can't change it, the ones before skip_size are not hashed */
+	unsigned int skip_size;
+
+	u_int64_t mask_small;		// used below avg_segment_size
+	u_int64_t mask_large;		// used from avg_segment_size on
+
+	u_int64_t hash;			// gear hash of the current position
+	unsigned int cur_seg_size;	// tracks size of the current active segment
+
+	u_int64_t G[256];		// gear table, a random value per byte
+};
+
+#endif /* !_GEARCDC_H_ */
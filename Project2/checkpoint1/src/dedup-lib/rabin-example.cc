@@ -17,7 +17,8 @@ void usage(const char *program)
 	printf("segment lengths and their the MD5 sums.\n\n");
 	printf("Usage : %s -f <file> -a <avg-segment-size> \n", program);
 	printf("           -i <min-segment-size> -x <max-segment-size>\n");
-	printf("           -w <rabin-window-size>\n\n");
+	printf("           -w <rabin-window-size> [-g]\n\n");
+	printf("-g uses the gear hash chunker instead of rabin.\n");
 	printf("Incase no file is specified, input will be read from stdin.\n\n");
 }
 
@@ -27,10 +28,11 @@ int main(int argc, const char *argv[])
 	int avg_seg_size = 4096;
 	int min_seg_size = 3072;
 	int max_seg_size = 6144;
+	int use_gear = 0;
 	char fname[PATH_MAX] = {0};
 
 	int c;
-	while ((c = getopt(argc, (char * const*)argv, "f:w:a:i:x:")) != -1) {
+	while ((c = getopt(argc, (char * const*)argv, "f:w:a:i:x:g")) != -1) {
 		switch (c) {
 		case 'f': 
 			strncpy(fname, optarg, sizeof fname);
@@ -47,6 +49,9 @@ int main(int argc, const char *argv[])
 		case 'x':
 			max_seg_size = atoi(optarg);
 			break;
+		case 'g':
+			use_gear = 1;
+			break;
 		default:
 			usage(argv[0]);
 			exit(1);
@@ -74,12 +79,22 @@ int main(int argc, const char *argv[])
 	printf("Reading file %s\n", fname);	
 	*/
 	
-	rabinpoly_t *rp = rabin_init( window_size, avg_seg_size, 
-								  min_seg_size, max_seg_size);
+	rabinpoly_t *rp = NULL;
+	gearcdc_t *gp = NULL;
 
-	if (!rp) {
-		fprintf(stderr, "Failed to init rabinhash algorithm\n");
-		exit(1);
+	if (use_gear) {
+		gp = gear_init(avg_seg_size, min_seg_size, max_seg_size);
+		if (!gp) {
+			fprintf(stderr, "Failed to init gear chunker\n");
+			exit(1);
+		}
+	} else {
+		rp = rabin_init( window_size, avg_seg_size, 
+									  min_seg_size, max_seg_size);
+		if (!rp) {
+			fprintf(stderr, "Failed to init rabinhash algorithm\n");
+			exit(1);
+		}
 	}
 
 
@@ -93,8 +108,10 @@ int main(int argc, const char *argv[])
 	MD5_Init(&ctx);
 	while( (bytes = read(fd, buf, sizeof buf)) > 0 ) {
 		char *buftoread = (char *)&buf[0];
-		while ((len = rabin_segment_next(rp, buftoread, bytes, 
-											&new_segment)) > 0) {
+		while ((len = (gp ? gear_segment_next(gp, buftoread, bytes,
+											&new_segment) :
+						rabin_segment_next(rp, buftoread, bytes,
+											&new_segment))) > 0) {
 			MD5_Update(&ctx, buftoread, len);
 			segment_len += len;
 			
@@ -131,6 +148,7 @@ int main(int argc, const char *argv[])
 	printf("\n");
 
 	rabin_free(&rp);
+	gear_free(&gp);
 
 	return 0;
 }
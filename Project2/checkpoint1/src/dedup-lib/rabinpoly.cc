@@ -202,20 +202,30 @@ rabinpoly_t *rabin_init(unsigned int window_size,
 	return rp;
 }
 
-int rabin_segment_next(rabinpoly_t *rp, 
-						const char *buf, 
+/**
+ * Consume bytes up to and including the next segment boundary, the body
+ * of rabin_segment_next() without the error checks and cost accounting.
+ *
+ * The fingerprint only depends on the last window_size bytes, so the
+ * bytes of a segment before min_segment_size - window_size, which can't
+ * reach its first possible boundary, are skipped without hashing.
+ */
+static unsigned int rabin_scan(rabinpoly_t *rp,
+						const char *buf,
 						unsigned int bytes,
 						int *is_new_segment)
 {
-	unsigned int i;
+	unsigned int i = 0;
 
-	if (!rp || !buf || !is_new_segment) {
-		return -1;
+	if (rp->cur_seg_size + rp->window_size < rp->min_segment_size) {
+		i = rp->min_segment_size - rp->window_size - rp->cur_seg_size;
+		if (i > bytes) {
+			i = bytes;
+		}
+		rp->cur_seg_size += i;
 	}
 
-	*is_new_segment = 0;
-    log_dedupe_compute_cost();
-	for (i = 0; i < bytes; i++) {
+	for (; i < bytes; i++) {
 		slide8(rp, buf[i]);
 		rp->cur_seg_size++;
 
@@ -234,6 +244,45 @@ int rabin_segment_next(rabinpoly_t *rp,
 	return i;
 }
 
+int rabin_segment_next(rabinpoly_t *rp, 
+						const char *buf, 
+						unsigned int bytes,
+						int *is_new_segment)
+{
+	if (!rp || !buf || !is_new_segment) {
+		return -1;
+	}
+
+	*is_new_segment = 0;
+    log_dedupe_compute_cost();
+	return rabin_scan(rp, buf, bytes, is_new_segment);
+}
+
+int rabin_segment_boundaries(rabinpoly_t *rp,
+						const char *buf,
+						unsigned int bytes,
+						unsigned int *offsets,
+						unsigned int max_offsets)
+{
+	unsigned int pos = 0, n = 0;
+	int is_new_segment;
+
+	if (!rp || !buf || !offsets) {
+		return -1;
+	}
+
+    log_dedupe_compute_cost();
+	while (pos < bytes && n < max_offsets) {
+		is_new_segment = 0;
+		pos += rabin_scan(rp, buf + pos, bytes - pos, &is_new_segment);
+		if (is_new_segment) {
+			offsets[n++] = pos;
+		}
+	}
+
+	return n;
+}
+
 void rabin_reset(rabinpoly_t *rp) { 
 	rp->fingerprint = 0; 
 	rp->bufpos = -1;
@@ -20,12 +20,15 @@ import datetime
 import hashlib
 import os
 import os.path
+import re
+import shutil
 import subprocess
 import urllib
 import sys
 import getopt
 import signal
 import logging
+import uuid
 from tornado import escape
 from tornado import httpserver
 from tornado import ioloop
@@ -82,7 +85,7 @@ class S3Application(web.Application):
 
 
 class BaseRequestHandler(web.RequestHandler):
-    SUPPORTED_METHODS = ("PUT", "GET", "DELETE")
+    SUPPORTED_METHODS = ("PUT", "GET", "DELETE", "POST")
 
     def render_xml(self, value):
         assert isinstance(value, dict) and len(value) == 1
@@ -130,6 +133,14 @@ class BaseRequestHandler(web.RequestHandler):
             path = os.path.join(path, hash[:2 * (i + 1)])
         return os.path.join(path, object_name)
 
+    def _upload_path(self, upload_id):
+        # Parts of the multipart uploads in progress are kept in
+        # .multipart/<upload id>/<part number>, hidden from the bucket list
+        if not re.match(r"^[0-9a-f]+$", upload_id):
+            raise web.HTTPError(404)
+        return os.path.join(self.application.directory, ".multipart",
+                            upload_id)
+
 
 
 class RootHandler(BaseRequestHandler):
@@ -141,6 +152,8 @@ class RootHandler(BaseRequestHandler):
         names = os.listdir(self.application.directory)
         buckets = []
         for name in names:
+            if name.startswith("."):
+                continue
             path = os.path.join(self.application.directory, name)
             info = os.stat(path)
             buckets.append({
@@ -271,15 +284,41 @@ class ObjectHandler(BaseRequestHandler):
         self.set_header("Content-Type", "application/unknown")
         self.set_header("Last-Modified", datetime.datetime.utcfromtimestamp(
             info.st_mtime))
-        tmon.num_read_bytes += os.path.getsize(path)
+        size = os.path.getsize(path)
+        start, end = self._range(size)
+        if start != 0 or end != size:
+            self.set_status(206)
+            self.set_header("Content-Range", "bytes %d-%d/%d" % (start, end - 1, size))
+        tmon.num_read_bytes += end - start
         self.application.logger.debug(tmon.debug_out('GET'))
         object_file = open(path, "rb")
 
         try:
-            self.finish(object_file.read())
+            object_file.seek(start)
+            self.finish(object_file.read(end - start))
         finally:
             object_file.close()
 
+    def _range(self, size):
+        # Bytes [start, end) asked by a "Range: bytes=first-last" header,
+        # the whole object without one
+        value = self.request.headers.get("Range")
+        if not value or not value.startswith("bytes="):
+            return 0, size
+        first, sep, last = value[len("bytes="):].partition("-")
+        try:
+            if first == "":
+                start = max(size - int(last), 0)
+                end = size
+            else:
+                start = int(first)
+                end = size if last == "" else min(int(last) + 1, size)
+        except ValueError:
+            return 0, size
+        if start >= size or start >= end:
+            raise web.HTTPError(416)
+        return start, end
+
 
 
     def put(self, bucket, object_name):
@@ -291,6 +330,9 @@ class ObjectHandler(BaseRequestHandler):
         if not bucket_dir.startswith(self.application.directory) or \
            not os.path.isdir(bucket_dir):
             raise web.HTTPError(404)
+        if "uploadId" in self.request.arguments:
+            self._put_part()
+            return
         path = self._object_path(bucket, object_name)
         if not path.startswith(bucket_dir) or os.path.isdir(path):
             raise web.HTTPError(403)
@@ -311,6 +353,9 @@ class ObjectHandler(BaseRequestHandler):
         tmon.num_requests += 1
         #self.application.logger.debug('S3 Server: DELETE Object %s/%s' % (bucket, object_name))
         object_name = urllib.unquote(object_name)
+        if "uploadId" in self.request.arguments:
+            self._abort_upload()
+            return
         path = self._object_path(bucket, object_name)
         if not path.startswith(self.application.directory) or \
            not os.path.isfile(path):
@@ -322,6 +367,108 @@ class ObjectHandler(BaseRequestHandler):
         self.finish()
 
 
+    # Multipart upload: POST ?uploads starts an upload, PUT
+    # ?partNumber=&uploadId= uploads a part, POST ?uploadId= completes it by
+    # concatenating the parts listed in the body and DELETE ?uploadId=
+    # aborts it. The parts count in the usage as soon as they are uploaded.
+
+    def post(self, bucket, object_name):
+        tmon.num_requests += 1
+        object_name = urllib.unquote(object_name)
+        bucket_dir = os.path.abspath(os.path.join(
+            self.application.directory, bucket))
+        if not bucket_dir.startswith(self.application.directory) or \
+           not os.path.isdir(bucket_dir):
+            raise web.HTTPError(404)
+
+        if "uploads" in self.request.arguments:
+            upload_id = uuid.uuid4().hex
+            os.makedirs(self._upload_path(upload_id))
+            self.application.logger.debug(tmon.debug_out('INITIATE MULTIPART'))
+            self.render_xml({"InitiateMultipartUploadResult": {
+                "Bucket": bucket,
+                "Key": object_name,
+                "UploadId": upload_id,
+            }})
+            return
+
+        upload_dir = self._upload_path(self.get_argument("uploadId", u""))
+        if not os.path.isdir(upload_dir):
+            raise web.HTTPError(404)
+        numbers = [int(n) for n in re.findall(
+            r"<PartNumber>\s*(\d+)\s*</PartNumber>", self.request.body)]
+        if not numbers or numbers != sorted(set(numbers)):
+            raise web.HTTPError(400)
+        for n in numbers:
+            if not os.path.isfile(os.path.join(upload_dir, str(n))):
+                raise web.HTTPError(400)
+        path = self._object_path(bucket, object_name)
+        if not path.startswith(bucket_dir) or os.path.isdir(path):
+            raise web.HTTPError(403)
+        directory = os.path.dirname(path)
+        if not os.path.exists(directory):
+            os.makedirs(directory)
+
+        md5s = ''
+        object_file = open(path, "wb")
+        try:
+            for n in numbers:
+                part_file = open(os.path.join(upload_dir, str(n)), "rb")
+                data = part_file.read()
+                part_file.close()
+                object_file.write(data)
+                md5s += hashlib.md5(data).digest()
+        finally:
+            object_file.close()
+        # Parts uploaded but not listed are dropped
+        for name in os.listdir(upload_dir):
+            if int(name) not in numbers:
+                tmon.cur_usage -= os.path.getsize(
+                    os.path.join(upload_dir, name))
+        shutil.rmtree(upload_dir)
+        self.application.logger.debug(tmon.debug_out('COMPLETE MULTIPART'))
+        self.render_xml({"CompleteMultipartUploadResult": {
+            "Bucket": bucket,
+            "Key": object_name,
+            "ETag": '"%s-%d"' % (hashlib.md5(md5s).hexdigest(), len(numbers)),
+        }})
+
+    def _put_part(self):
+        upload_dir = self._upload_path(self.get_argument("uploadId"))
+        if not os.path.isdir(upload_dir):
+            raise web.HTTPError(404)
+        try:
+            part_number = int(self.get_argument("partNumber"))
+        except ValueError:
+            raise web.HTTPError(400)
+        if part_number < 1:
+            raise web.HTTPError(400)
+        path = os.path.join(upload_dir, str(part_number))
+        # A part uploaded again replaces the previous one
+        if os.path.isfile(path):
+            tmon.cur_usage -= os.path.getsize(path)
+        tmon.cur_usage += len(self.request.body)
+        tmon.max_usage = max(tmon.cur_usage, tmon.max_usage)
+        self.application.logger.debug(tmon.debug_out('PUT PART'))
+        part_file = open(path, "wb")
+        part_file.write(self.request.body)
+        part_file.close()
+        self.set_header("ETag",
+                        '"%s"' % hashlib.md5(self.request.body).hexdigest())
+        self.finish()
+
+    def _abort_upload(self):
+        upload_dir = self._upload_path(self.get_argument("uploadId"))
+        if not os.path.isdir(upload_dir):
+            raise web.HTTPError(404)
+        for name in os.listdir(upload_dir):
+            tmon.cur_usage -= os.path.getsize(os.path.join(upload_dir, name))
+        shutil.rmtree(upload_dir)
+        self.application.logger.debug(tmon.debug_out('ABORT MULTIPART'))
+        self.set_status(204)
+        self.finish()
+
+
 
 def exit_handler(signum, func = None):
     #print tmon.print_out()